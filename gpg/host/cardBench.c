@@ -0,0 +1,462 @@
+/*
+ * Microbenchmark of the OpenPGP card engine on the host.
+ *
+ * Drives process() directly with the APDU sequences that GnuPG sends
+ * for its common operations, and reports per-INS latency, throughput
+ * and heap allocations. The allocations are counted by interposing the
+ * allocator of the C library, so those made inside mbedtls are counted
+ * as well.
+ *
+ * Handles:
+ *    Setting up a card with an imported RSA key in every slot
+ *    The scenarios: verify, getdata, sign, decipher, import
+ *    Per-INS and per-scenario reports
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "libAPDU.h"
+#include "mbedtls/md.h"
+
+#define CARDBENCH_ITERATIONS 50     // Default iterations of each scenario
+#define CARDBENCH_CHUNK 254         // Command data sent per chained APDU
+#define CARDBENCH_RESPONSE_MAX 1024
+
+static const uint8_t PW1[] = "123456";
+static const uint8_t PW3[] = "12345678";
+
+// SHA-256 DigestInfo prefix, the digest is appended
+static const uint8_t DIGESTINFO_SHA256[19] = { 0x30, 0x31, 0x30, 0x0D, 0x06, 0x09, 0x60, 0x86, 0x48,
+        0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20 };
+
+/* Allocation counting */
+
+static int counting = 0;            // Set while process() runs
+static uint64_t allocCount = 0;     // Allocations since the last reset
+static uint64_t allocBytes = 0;     // Bytes requested by them
+
+#ifdef __GLIBC__
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+void* malloc(size_t size) {
+    if (counting) {
+        allocCount++;
+        allocBytes += size;
+    }
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    if (counting) {
+        allocCount++;
+        allocBytes += n * size;
+    }
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (counting) {
+        allocCount++;
+        allocBytes += size;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+    __libc_free(ptr);
+}
+#endif
+
+/* Statistics */
+
+typedef struct benchStats {     // Statistics of one INS or scenario
+    uint64_t count;
+    uint64_t totalNs;
+    uint64_t minNs;
+    uint64_t maxNs;
+    uint64_t allocs;
+    uint64_t bytes;
+} benchStats;
+
+static benchStats commandStats[256];
+static benchStats scenarioStats;
+
+static uint64_t nowNs() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void statsAdd(benchStats* s, uint64_t ns, uint64_t allocs, uint64_t bytes) {
+    if (s->count == 0 || ns < s->minNs) {
+        s->minNs = ns;
+    }
+    if (ns > s->maxNs) {
+        s->maxNs = ns;
+    }
+    s->count++;
+    s->totalNs += ns;
+    s->allocs += allocs;
+    s->bytes += bytes;
+}
+
+/* Exchanging APDUs */
+
+/**
+ * Send a single command APDU to process() and time it.
+ *
+ * @param cmd The command APDU
+ * @param n Length of the command APDU
+ * @param out The response APDU
+ * @return The status word
+ */
+static uint16_t transmit(const uint8_t* cmd, int n, outData* out) {
+    char recvBuf[5 + 256 + 1];
+    uint64_t start, ns;
+    apdu_t apdu;
+
+    memcpy(recvBuf, cmd, n);
+    allocCount = 0;
+    allocBytes = 0;
+
+    start = nowNs();
+    counting = 1;
+    apdu = parseAPDU(recvBuf, n);
+    process(apdu, out);
+    counting = 0;
+    ns = nowNs() - start;
+
+    statsAdd(&commandStats[cmd[1]], ns, allocCount, allocBytes);
+    statsAdd(&scenarioStats, ns, allocCount, allocBytes);
+    return (uint16_t) (out->data[out->length-2] << 8 | out->data[out->length-1]);
+}
+
+/**
+ * Send a command, chained if its data does not fit in a single APDU,
+ * and collect the whole response with GET RESPONSE.
+ *
+ * @param ins, p1, p2 The header of the command (CLA 00)
+ * @param data The command data
+ * @param len Length of the command data
+ * @param resp Where the response data is copied (may be NULL)
+ * @param respLen Length of the response data
+ * @return The final status word
+ */
+static uint16_t exchange(uint8_t ins, uint8_t p1, uint8_t p2, const uint8_t* data, int len,
+        uint8_t* resp, int* respLen) {
+    uint8_t cmd[5 + 256 + 1];
+    outData out;
+    uint16_t sw;
+    int n, pos = 0, got = 0;
+
+    do {    // Command chaining
+        int chunk = (len - pos > CARDBENCH_CHUNK) ? CARDBENCH_CHUNK : len - pos;
+        cmd[0] = (pos + chunk < len) ? 0x10 : 0x00;
+        cmd[1] = ins;
+        cmd[2] = p1;
+        cmd[3] = p2;
+        n = 4;
+        if (chunk > 0) {
+            cmd[n++] = (uint8_t) chunk;
+            memcpy(cmd + n, data + pos, chunk);
+            n += chunk;
+        }
+        cmd[n++] = 0x00;    // Le
+        pos += chunk;
+        sw = transmit(cmd, n, &out);
+    } while (pos < len && sw == SW_NO_ERROR);
+
+    for (;;) {  // GET RESPONSE
+        if (resp != NULL && got + out.length - 2 <= CARDBENCH_RESPONSE_MAX) {
+            memcpy(resp + got, out.data, out.length - 2);
+        }
+        got += out.length - 2;
+        if ((sw & 0xFF00) != SW_BYTES_REMAINING_00) {
+            break;
+        }
+        const uint8_t getResponse[5] = { 0x00, 0xC0, 0x00, 0x00, (uint8_t) sw };
+        sw = transmit(getResponse, sizeof(getResponse), &out);
+    }
+    if (respLen != NULL) {
+        (*respLen) = got;
+    }
+    return sw;
+}
+
+static void check(uint16_t sw, const char* what) {
+    if (sw != SW_NO_ERROR) {
+        fprintf(stderr, "%s failed: %04X\n", what, sw);
+        exit(1);
+    }
+}
+
+/* Card setup */
+
+static mbedtls_rsa_context hostKey;     // The key imported in every slot
+static mbedtls_ctr_drbg_context hostDrbg;
+static mbedtls_entropy_context hostEntropy;
+
+static int putLength(uint8_t* p, int len) {
+    if (len < 0x80) {
+        p[0] = (uint8_t) len;
+        return 1;
+    } else if (len <= 0xFF) {
+        p[0] = 0x81;
+        p[1] = (uint8_t) len;
+        return 2;
+    }
+    p[0] = 0x82;
+    p[1] = (uint8_t) (len >> 8);
+    p[2] = (uint8_t) len;
+    return 3;
+}
+
+/**
+ * Build the extended header list (4D) that imports hostKey in a slot.
+ *
+ * @param type B6, B8 or A4
+ * @param out Where the list is written
+ * @return Length of the list
+ */
+static int buildImport(uint8_t type, uint8_t* out) {
+    const mbedtls_mpi* comp[IMPORT_COMPONENTS] = { &hostKey.E, &hostKey.P, &hostKey.Q,
+            &hostKey.QP, &hostKey.DP, &hostKey.DQ, &hostKey.N };
+    uint8_t tmpl[32], data[1024];
+    int tmplLen = 0, dataLen = 0, bodyLen, n = 0;
+
+    for (int i = 0; i < IMPORT_COMPONENTS; i++) {
+        int len = (int) mbedtls_mpi_size(comp[i]);
+        tmpl[tmplLen++] = (uint8_t) (0x91 + i);
+        tmplLen += putLength(tmpl + tmplLen, len);
+        mbedtls_mpi_write_binary(comp[i], data + dataLen, len);
+        dataLen += len;
+    }
+
+    uint8_t hdr[16], scratch[3];
+    int hdrLen = 0;
+    hdr[hdrLen++] = type;
+    hdr[hdrLen++] = 0x00;
+    hdr[hdrLen++] = 0x7F;
+    hdr[hdrLen++] = 0x48;
+    hdrLen += putLength(hdr + hdrLen, tmplLen);
+    bodyLen = hdrLen + tmplLen + 2 + putLength(scratch, dataLen) + dataLen;
+
+    out[n++] = 0x4D;
+    n += putLength(out + n, bodyLen);
+    memcpy(out + n, hdr, hdrLen);
+    n += hdrLen;
+    memcpy(out + n, tmpl, tmplLen);
+    n += tmplLen;
+    out[n++] = 0x5F;
+    out[n++] = 0x48;
+    n += putLength(out + n, dataLen);
+    memcpy(out + n, data, dataLen);
+    return n + dataLen;
+}
+
+static void setupCard() {
+    static const uint8_t slots[3] = { 0xB6, 0xB8, 0xA4 };
+    uint8_t list[1200];
+    const char* pers = "cardBench";
+
+    if (hostStorageInit(STORAGE_PATH, 1) != 0) {
+        perror(STORAGE_PATH);
+        exit(1);
+    }
+    if (initialize() != 0) {
+        fprintf(stderr, "initialize failed\n");
+        exit(1);
+    }
+
+    mbedtls_entropy_init(&hostEntropy);
+    mbedtls_ctr_drbg_init(&hostDrbg);
+    mbedtls_rsa_init(&hostKey, MBEDTLS_RSA_PKCS_V15, 0);
+    if (mbedtls_ctr_drbg_seed(&hostDrbg, platformEntropy, &hostEntropy,
+                (const unsigned char*) pers, strlen(pers)) != 0 ||
+            mbedtls_rsa_gen_key(&hostKey, mbedtls_ctr_drbg_random, &hostDrbg, KEY_SIZE, EXPONENT) != 0) {
+        fprintf(stderr, "Failed to generate the host key\n");
+        exit(1);
+    }
+
+    check(exchange(0x20, 0x00, 0x83, PW3, sizeof(PW3) - 1, NULL, NULL), "VERIFY PW3");
+    for (int i = 0; i < 3; i++) {
+        check(exchange(0xDB, 0x3F, 0xFF, list, buildImport(slots[i], list), NULL, NULL), "Key import");
+    }
+}
+
+/* Scenarios */
+
+static void scenarioVerify(int i) {
+    check(exchange(0x20, 0x00, 0x81, PW1, sizeof(PW1) - 1, NULL, NULL), "VERIFY 81");
+    check(exchange(0x20, 0x00, 0x82, PW1, sizeof(PW1) - 1, NULL, NULL), "VERIFY 82");
+}
+
+static void scenarioGetData(int i) {    // What gpg --card-status reads
+    static const uint16_t tags[] = { 0x004F, 0x005E, 0x5F50, 0x5F52, 0x0065, 0x006E,
+            0x007A, 0x7F21, 0x00C4, 0x0101 };
+    uint8_t resp[CARDBENCH_RESPONSE_MAX];
+    int len;
+
+    for (unsigned int t = 0; t < sizeof(tags) / sizeof(tags[0]); t++) {
+        exchange(0xCA, (uint8_t) (tags[t] >> 8), (uint8_t) tags[t], NULL, 0, resp, &len);
+    }
+    check(exchange(0x47, 0x81, 0x00, (const uint8_t*) "\xB6\x00", 2, resp, &len), "Read public key");
+}
+
+static void scenarioSign(int i) {
+    uint8_t digestInfo[sizeof(DIGESTINFO_SHA256) + 32], sig[CARDBENCH_RESPONSE_MAX];
+    int len;
+
+    memcpy(digestInfo, DIGESTINFO_SHA256, sizeof(DIGESTINFO_SHA256));
+    mbedtls_sha256((const unsigned char*) &i, sizeof(i), digestInfo + sizeof(DIGESTINFO_SHA256), 0);
+
+    check(exchange(0x20, 0x00, 0x81, PW1, sizeof(PW1) - 1, NULL, NULL), "VERIFY 81");
+    check(exchange(0x2A, 0x9E, 0x9A, digestInfo, sizeof(digestInfo), sig, &len), "PSO:CDS");
+    if (i == 0 && (len != KEY_SIZE_BYTES || mbedtls_rsa_pkcs1_verify(&hostKey, NULL, NULL,
+            MBEDTLS_RSA_PUBLIC, MBEDTLS_MD_NONE, sizeof(digestInfo), digestInfo, sig) != 0)) {
+        fprintf(stderr, "PSO:CDS returned a wrong signature\n");
+        exit(1);
+    }
+}
+
+static void scenarioDecipher(int i) {
+    uint8_t msg[32], cryptogram[1 + KEY_SIZE_BYTES], plain[CARDBENCH_RESPONSE_MAX];
+    int len;
+
+    memset(msg, i, sizeof(msg));
+    cryptogram[0] = 0x00;   // Padding indicator byte
+    if (mbedtls_rsa_pkcs1_encrypt(&hostKey, mbedtls_ctr_drbg_random, &hostDrbg,
+            MBEDTLS_RSA_PUBLIC, sizeof(msg), msg, cryptogram + 1) != 0) {
+        fprintf(stderr, "Failed to encrypt\n");
+        exit(1);
+    }
+
+    check(exchange(0x20, 0x00, 0x82, PW1, sizeof(PW1) - 1, NULL, NULL), "VERIFY 82");
+    check(exchange(0x2A, 0x80, 0x86, cryptogram, sizeof(cryptogram), plain, &len), "PSO:DECIPHER");
+    if (len != sizeof(msg) || memcmp(plain, msg, sizeof(msg)) != 0) {
+        fprintf(stderr, "PSO:DECIPHER returned a wrong plaintext\n");
+        exit(1);
+    }
+}
+
+static void scenarioImport(int i) {
+    static uint8_t list[1200];
+    static int listLen = 0;
+
+    if (listLen == 0) {
+        listLen = buildImport(0xA4, list);
+    }
+    check(exchange(0x20, 0x00, 0x83, PW3, sizeof(PW3) - 1, NULL, NULL), "VERIFY PW3");
+    check(exchange(0xDB, 0x3F, 0xFF, list, listLen, NULL, NULL), "Key import");
+}
+
+typedef struct scenario {
+    const char* name;
+    void (*run)(int i);
+} scenario;
+
+static const scenario scenarios[] = {
+    { "verify", scenarioVerify },
+    { "getdata", scenarioGetData },
+    { "sign", scenarioSign },
+    { "decipher", scenarioDecipher },
+    { "import", scenarioImport },
+};
+
+#define SCENARIOS (int) (sizeof(scenarios) / sizeof(scenarios[0]))
+
+/* Reports */
+
+static void printHeader(const char* first) {
+    printf("%-10s %8s %10s %10s %10s %10s %10s %10s\n", first, "count", "mean us",
+            "min us", "max us", "ops/s", "allocs/op", "bytes/op");
+}
+
+static void printStats(const char* name, const benchStats* s) {
+    double mean = (double) s->totalNs / s->count;
+    printf("%-10s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+            (unsigned long long) s->count, mean / 1000, s->minNs / 1000.0, s->maxNs / 1000.0,
+            1e9 / mean, (double) s->allocs / s->count, (double) s->bytes / s->count);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-n iterations] [-s seed] [-v] [scenario ...]\nScenarios:", prog);
+    for (int s = 0; s < SCENARIOS; s++) {
+        fprintf(stderr, " %s", scenarios[s].name);
+    }
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = CARDBENCH_ITERATIONS;
+    int selected[SCENARIOS] = { 0 };
+    int opt, any = 0;
+
+    while ((opt = getopt(argc, argv, "n:s:v")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 's':
+            hostEntropySeed(strtoull(optarg, NULL, 0));
+            break;
+        case 'v':
+            hostLogLevel = HOST_LOG_INFO;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    for (int a = optind; a < argc; a++) {
+        int s;
+        for (s = 0; s < SCENARIOS && strcmp(argv[a], scenarios[s].name) != 0; s++);
+        if (s == SCENARIOS) {
+            usage(argv[0]);
+        }
+        selected[s] = any = 1;
+    }
+    if (iterations <= 0) {
+        usage(argv[0]);
+    }
+
+    setupCard();
+    bzero(commandStats, sizeof(commandStats));
+
+    printf("Scenarios (%d iterations, time spent in process())\n", iterations);
+    printHeader("scenario");
+    for (int s = 0; s < SCENARIOS; s++) {
+        if (any && !selected[s]) {
+            continue;
+        }
+        benchStats total = { 0 };
+        for (int i = 0; i < iterations; i++) {
+            bzero(&scenarioStats, sizeof(scenarioStats));
+            scenarios[s].run(i);
+            statsAdd(&total, scenarioStats.totalNs, scenarioStats.allocs, scenarioStats.bytes);
+        }
+        printStats(scenarios[s].name, &total);
+    }
+
+    printf("\nCommands\n");
+    printHeader("INS");
+    for (int ins = 0; ins < 256; ins++) {
+        if (commandStats[ins].count > 0) {
+            char name[8];
+            snprintf(name, sizeof(name), "%02X", ins);
+            printStats(name, &commandStats[ins]);
+        }
+    }
+
+    mbedtls_rsa_free(&hostKey);
+    mbedtls_ctr_drbg_free(&hostDrbg);
+    mbedtls_entropy_free(&hostEntropy);
+    return 0;
+}
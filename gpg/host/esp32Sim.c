@@ -0,0 +1,359 @@
+/*
+ * Network-level simulator of the ESP32 card.
+ *
+ * Runs the card engine on the host and talks to the bridge exactly like
+ * taskConnect in gpg.c: one TCP connection to port 5511 per command APDU,
+ * a single read of the command, the response, then close. The WiFi link
+ * is simulated by delaying each direction according to a latency, jitter,
+ * bandwidth and segment loss model, and by dropping whole exchanges. The
+ * proceed button is pressed after an adjustable delay, or never.
+ *
+ * All random choices come from a seeded generator, so a run can be
+ * reproduced exactly.
+ *
+ * Handles:
+ *    The port 5511 protocol of the device
+ *    Latency, jitter, bandwidth, loss and drop injection
+ *    The simulated proceed button
+ *    A summary of the injected events on exit
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "esp_log.h"
+#include "libAPDU.h"
+
+#define PORT 5511               // The default port of this protocol
+#define SIM_RETRIES 6           // Retransmissions of a segment before the exchange is dropped
+#define SIM_BUTTON_TIMEOUT 15000    // Like PROCEEDBTN in gpg.c, 30 * 500 ms
+
+static const char* TAG = "esp32Sim";
+
+typedef struct linkModel {      // Model of one direction of the WiFi link
+    double latencyMs;           // Fixed one way delay
+    double jitterMs;            // Standard deviation of the added normal delay
+    double kbps;                // Bandwidth in kbit/s, 0 for unlimited
+    double loss;                // Probability that a segment is lost
+    double rtoMs;               // Initial retransmission timeout
+    int mss;                    // Maximum segment size
+} linkModel;
+
+typedef struct simConfig {
+    const char* host;
+    const char* source;         // Local address to connect from, NULL for any
+    int port;
+    linkModel link;
+    double drop;                // Probability that an exchange is dropped
+    int buttonMs;               // Delay of the button press, -1 for never
+    int retryMs;                // Wait after a failed connection
+    long exchanges;             // Exit after this many exchanges, 0 for never
+} simConfig;
+
+typedef struct simStats {
+    long exchanges;
+    long dropped;               // Exchanges dropped by the drop model
+    long lostSegments;          // Segments retransmitted by the loss model
+    long buttonTimeouts;
+    double delayMs;             // Total delay injected by the link model
+} simStats;
+
+static simConfig config = { "127.0.0.1", NULL, PORT, { 0, 0, 0, 0, 200, 1460 }, 0, 0, 5000, 0 };
+static simStats stats;
+static volatile sig_atomic_t stop = 0;
+
+static void onSignal(int sig) {
+    stop = 1;
+}
+
+static void sleepMs(double ms) {
+    struct timespec t;
+
+    if (ms <= 0) {
+        return;
+    }
+    t.tv_sec = (time_t) (ms / 1000);
+    t.tv_nsec = (long) ((ms - t.tv_sec * 1000.0) * 1000000);
+    while (nanosleep(&t, &t) != 0 && errno == EINTR && !stop);
+}
+
+// Normally distributed random number (Box-Muller)
+static double normal() {
+    double u = drand48(), v = drand48();
+    return sqrt(-2.0 * log(u > 0 ? u : 1e-12)) * cos(2 * M_PI * v);
+}
+
+/**
+ * Compute the delay of a transfer over the simulated link.
+ *
+ * @param bytes Size of the transfer (0 for a bare handshake packet)
+ * @return The delay in ms, or a negative value if a segment was lost
+ *         more than SIM_RETRIES times
+ */
+static double linkDelay(int bytes) {
+    const linkModel* l = &config.link;
+    int segments = (bytes + l->mss - 1) / l->mss;
+    double ms = l->latencyMs + l->jitterMs * normal();
+
+    if (ms < 0) {
+        ms = 0;
+    }
+    if (l->kbps > 0) {
+        ms += bytes * 8 / l->kbps;
+    }
+    for (int s = 0; s < (segments > 0 ? segments : 1); s++) {
+        double rto = l->rtoMs;
+        int tries = 0;
+        while (drand48() < l->loss) {   // Lost, resent after the (doubling) timeout
+            if (++tries > SIM_RETRIES) {
+                return -1;
+            }
+            stats.lostSegments++;
+            ms += rto;
+            rto *= 2;
+        }
+    }
+    stats.delayMs += ms;
+    return ms;
+}
+
+/**
+ * Bind the socket to the source address, so that several simulated devices
+ * on one host reach the bridge from different addresses (e.g. 127.0.0.2).
+ */
+static int bindSource(int sockfd, int family) {
+    struct addrinfo hints, *res;
+    int r;
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config.source, NULL, &hints, &res) != 0) {
+        return -1;
+    }
+    r = bind(sockfd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    return r;
+}
+
+static int connectHost() {
+    struct addrinfo hints, *res;
+    char port[8];
+    int sockfd;
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", config.port);
+    if (getaddrinfo(config.host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sockfd >= 0 && config.source != NULL && bindSource(sockfd, res->ai_family) != 0) {
+        close(sockfd);
+        sockfd = -1;
+    }
+    if (sockfd >= 0 && connect(sockfd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(sockfd);
+        sockfd = -1;
+    }
+    freeaddrinfo(res);
+    return sockfd;
+}
+
+/**
+ * Wait for the simulated proceed button, like PROCEEDBTN in gpg.c.
+ *
+ * @return 1 if it was pressed in time, 0 if not
+ */
+static uint8_t waitButton() {
+    uint8_t phase = telemetryPhase(PHASE_BUTTON);
+    uint8_t pressed = (config.buttonMs >= 0 && config.buttonMs < SIM_BUTTON_TIMEOUT);
+
+    sleepMs(pressed ? config.buttonMs : SIM_BUTTON_TIMEOUT);
+    telemetryPhase(phase);
+    if (!pressed) {
+        stats.buttonTimeouts++;
+    }
+    return pressed;
+}
+
+// One exchange, the way taskConnect handles it
+static void exchange(int sockfd) {
+    apdu_t comAPDU;
+    outData output;
+    char recvBuf[1024];
+    double ms = 0;
+    int64_t received;
+    int r;
+
+    telemetry.connections++;
+    telemetryBegin();
+
+    bzero(recvBuf, sizeof(recvBuf));
+    r = read(sockfd, recvBuf, sizeof(recvBuf)-1);   // Receive the APDU command
+    if (r > 0 && ((ms = linkDelay(r)) < 0 || drand48() < config.drop / 2)) {
+        stats.dropped++;    // Lost on the way to the device
+        return;
+    }
+    sleepMs(ms);
+    received = esp_timer_get_time();
+    telemetryPhase(PHASE_PARSE);
+    comAPDU = parseAPDU(recvBuf, r);
+
+    if (r <= 0 || comAPDU.INS == 0x00) {    // Nothing more to receive
+        invalidate();
+        return;
+    }
+
+    if ((comAPDU.CLA != 0x10) && (comAPDU.INS == 0x88 || comAPDU.INS == 0x2A) && !waitButton()) {
+        output.data[0] = 0x69;  // SW_AUTHENTICATION_BLOCKED
+        output.data[1] = 0x83;
+        output.length = 2;
+    } else {
+        profileBusy = 1;
+        process(comAPDU, &output);
+        profileBusy = 0;
+    }
+
+    apduLogRecord(recvBuf, r, output.data, output.length, received);
+    telemetryPhase(PHASE_SEND);
+    stats.exchanges++;
+    if ((ms = linkDelay(output.length)) < 0 || drand48() < config.drop / 2) {
+        stats.dropped++;    // Processed, but the response is lost
+        return;
+    }
+    sleepMs(ms);
+    if (write(sockfd, output.data, output.length) < 0) {
+        ESP_LOGE(TAG, "... socket send failed");
+    }
+    if (!sendingTelemetry()) {
+        telemetryEnd(comAPDU.INS);
+    }
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -H host      Host running the bridge (127.0.0.1)\n"
+        "  -a address   Local address to connect from (any)\n"
+        "  -p port      Port of the bridge (%d)\n"
+        "  -l ms        One way latency (0)\n"
+        "  -j ms        Jitter, standard deviation of the latency (0)\n"
+        "  -b kbit/s    Bandwidth, 0 for unlimited (0)\n"
+        "  -L percent   Segment loss (0)\n"
+        "  -R ms        Initial retransmission timeout (200)\n"
+        "  -M bytes     Maximum segment size (1460)\n"
+        "  -d percent   Exchanges dropped, before or after processing (0)\n"
+        "  -B ms        Delay of the proceed button, -1 for never (0)\n"
+        "  -r ms        Wait after a failed connection (5000)\n"
+        "  -n count     Exit after this many exchanges\n"
+        "  -s seed      Seed of the random models (1)\n"
+        "  -w           Wipe the card first, like the reset button\n"
+        "  -i mac       MAC address returned as the device ID (02:00:00:00:00:01)\n"
+        "  -C dir       Run in this directory, which keeps its own card in %s/\n"
+        "  -v           Verbose\n", prog, PORT, STORAGE_PATH);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    struct sigaction sa;
+    long seed = 1;
+    int wipe = 0, opt, sockfd;
+    uint8_t initialized = 0;
+    nvs_handle nvsHandle;
+
+    while ((opt = getopt(argc, argv, "H:a:p:l:j:b:L:R:M:d:B:r:n:s:wi:C:v")) != -1) {
+        switch (opt) {
+        case 'H': config.host = optarg; break;
+        case 'a': config.source = optarg; break;
+        case 'p': config.port = atoi(optarg); break;
+        case 'l': config.link.latencyMs = atof(optarg); break;
+        case 'j': config.link.jitterMs = atof(optarg); break;
+        case 'b': config.link.kbps = atof(optarg); break;
+        case 'L': config.link.loss = atof(optarg) / 100; break;
+        case 'R': config.link.rtoMs = atof(optarg); break;
+        case 'M': config.link.mss = atoi(optarg); break;
+        case 'd': config.drop = atof(optarg) / 100; break;
+        case 'B': config.buttonMs = atoi(optarg); break;
+        case 'r': config.retryMs = atoi(optarg); break;
+        case 'n': config.exchanges = atol(optarg); break;
+        case 's': seed = atol(optarg); break;
+        case 'w': wipe = 1; break;
+        case 'i':
+            if (sscanf(optarg, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &hostMac[0], &hostMac[1],
+                       &hostMac[2], &hostMac[3], &hostMac[4], &hostMac[5]) != 6) {
+                usage(argv[0]);
+            }
+            break;
+        case 'C':
+            if (chdir(optarg) != 0) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 'v': hostLogLevel = HOST_LOG_INFO; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (config.link.mss <= 0 || config.link.loss >= 1) {
+        usage(argv[0]);
+    }
+    srand48(seed);
+
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = onSignal;   // No SA_RESTART, so that blocking calls return
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Initialize or restore the card, like taskConnect
+    if (hostStorageInit(STORAGE_PATH, wipe) != 0) {
+        perror(STORAGE_PATH);
+        return 1;
+    }
+    nvs_open("storage", NVS_READWRITE, &nvsHandle);
+    if (nvs_get_u8(nvsHandle, "initialized", &initialized) == ESP_OK) {
+        if (restoreState() != 0) {
+            ESP_LOGE(TAG, "Failed to restore the card, run with -w to wipe it");
+            return 1;
+        }
+    } else if (initialize() != 0) {
+        ESP_LOGE(TAG, "Failed to initialize the card");
+        return 1;
+    }
+    nvs_close(nvsHandle);
+
+    while (!stop && (config.exchanges == 0 || stats.exchanges < config.exchanges)) {
+        double ms = linkDelay(0);   // SYN
+        double back = linkDelay(0); // SYN-ACK
+        if (ms < 0 || back < 0) {
+            telemetry.connectFailures++;
+            sleepMs(config.retryMs);
+            continue;
+        }
+        sleepMs(ms + back);
+        if ((sockfd = connectHost()) < 0) {
+            ESP_LOGE(TAG, "... socket connect failed errno: %d", errno);
+            telemetry.connectFailures++;
+            invalidate();   // Invalidate / PIN Reset at a possible end of a connection
+            sleepMs(config.retryMs);
+            continue;
+        }
+        exchange(sockfd);
+        close(sockfd);
+    }
+
+    fprintf(stderr, "%ld exchanges, %ld dropped, %ld segments lost, %ld button timeouts, "
+            "%.1f ms of link delay\n", stats.exchanges, stats.dropped, stats.lostSegments,
+            stats.buttonTimeouts, stats.delayMs);
+    return 0;
+}
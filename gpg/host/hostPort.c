@@ -0,0 +1,321 @@
+/*
+ * Host port of the OpenPGP card engine (see hostPort.h).
+ */
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hostPort.h"
+#include "platform.h"
+#include "mbedtls/entropy.h"
+
+int hostLogLevel = HOST_LOG_ERROR;
+
+void hostLog(int level, char letter, const char* tag, const char* format, ...) {
+    va_list args;
+
+    if (level > hostLogLevel) {
+        return;
+    }
+    fprintf(stderr, "%c (%lld) %s: ", letter, (long long) (esp_timer_get_time() / 1000), tag);
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+}
+
+/* System */
+
+uint32_t esp_get_free_heap_size(void) {
+    return 0;   // Not tracked on the host, cardBench counts the allocations
+}
+
+uint32_t esp_get_minimum_free_heap_size(void) {
+    return 0;
+}
+
+int64_t esp_timer_get_time(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+uint8_t hostMac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };   // Locally administered
+
+esp_err_t esp_read_mac(uint8_t* mac, esp_mac_type_t type) {
+    memcpy(mac, hostMac, sizeof(hostMac));
+    return ESP_OK;
+}
+
+/*
+ * Non-Volatile Storage, kept in memory and written to STORAGE_PATH/nvs.dat
+ * on every commit once hostStorageInit has been called
+ */
+
+typedef struct nvsEntry {
+    char key[HOST_NVS_KEY_LENGTH];
+    uint16_t value;
+    uint8_t used;
+} nvsEntry;
+
+static nvsEntry nvs[HOST_NVS_KEYS];
+static char nvsPath[512] = "";  // Where the NVS is saved, empty if it is not
+
+static nvsEntry* nvsFind(const char* key, int create) {
+    nvsEntry* free = NULL;
+
+    if (strlen(key) >= HOST_NVS_KEY_LENGTH) {
+        return NULL;
+    }
+    for (int i = 0; i < HOST_NVS_KEYS; i++) {
+        if (nvs[i].used && strcmp(nvs[i].key, key) == 0) {
+            return &nvs[i];
+        }
+        if (!nvs[i].used && free == NULL) {
+            free = &nvs[i];
+        }
+    }
+    if (create && free != NULL) {
+        strcpy(free->key, key);
+        free->used = 1;
+        return free;
+    }
+    return NULL;
+}
+
+esp_err_t nvs_flash_init(void) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode mode, nvs_handle* handle) {
+    (*handle) = 1;  // A single namespace is used by the card
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle handle) {
+}
+
+esp_err_t nvs_set_u8(nvs_handle handle, const char* key, uint8_t value) {
+    return nvs_set_u16(handle, key, value);
+}
+
+esp_err_t nvs_set_u16(nvs_handle handle, const char* key, uint16_t value) {
+    nvsEntry* e = nvsFind(key, 1);
+    if (e == NULL) {
+        return ESP_FAIL;
+    }
+    e->value = value;
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_u8(nvs_handle handle, const char* key, uint8_t* value) {
+    nvsEntry* e = nvsFind(key, 0);
+    if (e == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    (*value) = (uint8_t) e->value;
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_u16(nvs_handle handle, const char* key, uint16_t* value) {
+    nvsEntry* e = nvsFind(key, 0);
+    if (e == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    (*value) = e->value;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle handle, const char* key) {
+    nvsEntry* e = nvsFind(key, 0);
+    if (e == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    bzero(e, sizeof(nvsEntry));
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_all(nvs_handle handle) {
+    bzero(nvs, sizeof(nvs));
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle handle) {
+    FILE* fp;
+
+    if (nvsPath[0] == '\0') {
+        return ESP_OK;
+    }
+    if ((fp = fopen(nvsPath, "wb")) == NULL) {
+        return ESP_FAIL;
+    }
+    fwrite(nvs, sizeof(nvs), 1, fp);
+    fclose(fp);
+    return ESP_OK;
+}
+
+/* FreeRTOS */
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec t = { ticks * portTICK_PERIOD_MS / 1000, (ticks * portTICK_PERIOD_MS % 1000) * 1000000L };
+    nanosleep(&t, NULL);
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t) (esp_timer_get_time() / (portTICK_PERIOD_MS * 1000));
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    return 0;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandleForCPU(BaseType_t cpu) {
+    return NULL;    // The profiler does not sample on the host
+}
+
+char* pcTaskGetTaskName(TaskHandle_t task) {
+    return "host";
+}
+
+BaseType_t xPortGetCoreID(void) {
+    return 0;
+}
+
+esp_err_t esp_register_freertos_tick_hook_for_cpu(esp_freertos_tick_cb_t cb, uint32_t cpu) {
+    return ESP_FAIL;
+}
+
+void esp_deregister_freertos_tick_hook_for_cpu(esp_freertos_tick_cb_t cb, uint32_t cpu) {
+}
+
+/* Platform interface of the engine (platform.h) */
+
+int platformVarWrite(const char* key, const void* value, uint8_t bits) {
+    nvs_handle handle;
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (bits == 8) {
+        err = nvs_set_u8(handle, key, *(const uint8_t*) value);
+    } else if (bits == 16) {
+        err = nvs_set_u16(handle, key, *(const uint16_t*) value);
+    } else {
+        err = ESP_FAIL;
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+int platformVarRead(const char* key, void* value, uint8_t bits) {
+    nvs_handle handle;
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (bits == 8) {
+        err = nvs_get_u8(handle, key, (uint8_t*) value);
+    } else if (bits == 16) {
+        err = nvs_get_u16(handle, key, (uint16_t*) value);
+    } else {
+        err = ESP_FAIL;
+    }
+    nvs_close(handle);
+    return err;
+}
+
+static int entropySeeded = 0;   // Set by hostEntropySeed
+static uint64_t entropyState;
+
+void hostEntropySeed(uint64_t seed) {
+    entropyState = seed;
+    entropySeeded = 1;
+}
+
+int platformEntropy(void* data, unsigned char* output, size_t len) {
+    if (!entropySeeded) {
+        return mbedtls_entropy_func(data, output, len);
+    }
+    for (size_t i = 0; i < len; i += 8) {  // SplitMix64, repeatable and not secret
+        uint64_t z = (entropyState += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+        for (size_t j = 0; j < 8 && i + j < len; j++) {
+            output[i + j] = (unsigned char) (z >> (8 * j));
+        }
+    }
+    return 0;
+}
+
+int64_t platformMicros(void) {
+    return esp_timer_get_time();
+}
+
+void platformYield(void) {
+    vTaskDelay(1);
+}
+
+uint32_t platformFreeHeap(void) {
+    return esp_get_free_heap_size();
+}
+
+uint32_t platformMinimumFreeHeap(void) {
+    return esp_get_minimum_free_heap_size();
+}
+
+int platformDeviceId(uint8_t* id) {
+    return esp_read_mac(id, ESP_MAC_WIFI_STA);
+}
+
+/* Storage directory */
+
+/**
+ * Create the directory that stands in for the FAT partition.
+ *
+ * @param path The directory (STORAGE_PATH)
+ * @param wipe If set, the files in it and the NVS are erased, like
+ *             after a hard reset of the device, otherwise the NVS that
+ *             was saved in it is loaded
+ * @return 0 on success
+ */
+int hostStorageInit(const char* path, int wipe) {
+    char file[512];
+    struct dirent* entry;
+    DIR* dir;
+    FILE* fp;
+
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    snprintf(nvsPath, sizeof(nvsPath), "%s/nvs.dat", path);
+    if (!wipe) {
+        if ((fp = fopen(nvsPath, "rb")) != NULL) {
+            if (fread(nvs, sizeof(nvs), 1, fp) != 1) {
+                bzero(nvs, sizeof(nvs));
+            }
+            fclose(fp);
+        }
+        return 0;
+    }
+    nvs_erase_all(1);
+    if ((dir = opendir(path)) == NULL) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        unlink(file);
+    }
+    closedir(dir);
+    return 0;
+}
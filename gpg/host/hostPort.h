@@ -0,0 +1,134 @@
+/*
+ * Host port of the OpenPGP card engine.
+ *
+ * Implements the platform interface of the engine (gpg/main/platform.h,
+ * built with PLATFORM_HOST) on Linux, so that the engine can be built
+ * and measured against upstream mbedtls. Also provides the parts of
+ * ESP-IDF and FreeRTOS that the rest of gpg/main and esp32Sim use; the
+ * headers in include/ stand in for the ESP-IDF ones of the same name
+ * and all of them include this file.
+ *
+ * Handles:
+ *    Logging (ESP_LOGx, to stderr, with a runtime level)
+ *    Storage (files and the NVS below STORAGE_PATH)
+ *    Clock (esp_timer_get_time, vTaskDelay)
+ *    Device identity (esp_read_mac)
+ *    Tasks, critical sections and tick hooks (single threaded, no-ops)
+ *
+ * Entropy comes from the default mbedtls sources of the host
+ * (/dev/urandom or getrandom), or once hostEntropySeed has been called
+ * from a generator seeded with it, so that runs can be repeated.
+ */
+#ifndef __HOSTPORT_H__
+#define __HOSTPORT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+/* Logging */
+
+#define HOST_LOG_NONE 0
+#define HOST_LOG_ERROR 1
+#define HOST_LOG_WARN 2
+#define HOST_LOG_INFO 3
+#define HOST_LOG_DEBUG 4
+
+extern int hostLogLevel;    // Messages above this level are dropped
+
+void hostLog(int level, char letter, const char* tag, const char* format, ...)
+        __attribute__((format(printf, 4, 5)));
+
+#define ESP_LOGE(tag, format, ...) hostLog(HOST_LOG_ERROR, 'E', tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) hostLog(HOST_LOG_WARN, 'W', tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) hostLog(HOST_LOG_INFO, 'I', tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) hostLog(HOST_LOG_DEBUG, 'D', tag, format, ##__VA_ARGS__)
+
+/* System */
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NVS_NOT_FOUND 0x1102
+#define ESP_ERR_NVS_NO_FREE_PAGES 0x110d
+
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
+int64_t esp_timer_get_time(void);
+
+typedef enum {
+    ESP_MAC_WIFI_STA,
+} esp_mac_type_t;
+
+extern uint8_t hostMac[6];  // Returned by esp_read_mac, esp32Sim -i sets it
+
+esp_err_t esp_read_mac(uint8_t* mac, esp_mac_type_t type);
+
+/* Non-Volatile Storage */
+
+#define HOST_NVS_KEYS 64        // Keys kept by the in-memory NVS
+#define HOST_NVS_KEY_LENGTH 16  // NVS_KEY_NAME_MAX_SIZE
+
+typedef uint32_t nvs_handle;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode;
+
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_open(const char* name, nvs_open_mode mode, nvs_handle* handle);
+void nvs_close(nvs_handle handle);
+esp_err_t nvs_set_u8(nvs_handle handle, const char* key, uint8_t value);
+esp_err_t nvs_set_u16(nvs_handle handle, const char* key, uint16_t value);
+esp_err_t nvs_get_u8(nvs_handle handle, const char* key, uint8_t* value);
+esp_err_t nvs_get_u16(nvs_handle handle, const char* key, uint16_t* value);
+esp_err_t nvs_erase_key(nvs_handle handle, const char* key);
+esp_err_t nvs_erase_all(nvs_handle handle);
+esp_err_t nvs_commit(nvs_handle handle);
+
+/* FreeRTOS */
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void* TaskHandle_t;
+typedef struct { int unused; } portMUX_TYPE;
+typedef void (*esp_freertos_tick_cb_t)(void);
+
+#define portNUM_PROCESSORS 1
+#define portTICK_PERIOD_MS 10
+#define portMAX_DELAY 0xFFFFFFFF
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+#define portENTER_CRITICAL(mux) (void) (mux)
+#define portEXIT_CRITICAL(mux) (void) (mux)
+#define portENTER_CRITICAL_ISR(mux) (void) (mux)
+#define portEXIT_CRITICAL_ISR(mux) (void) (mux)
+#define pdTRUE 1
+#define pdFALSE 0
+#define IRAM_ATTR
+
+typedef struct XtExcFrame {     // Only the registers read by profiler.h
+    long exit;
+    long pc;
+    long ps;
+    long a0;
+} XtExcFrame;
+
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandleForCPU(BaseType_t cpu);
+char* pcTaskGetTaskName(TaskHandle_t task);
+BaseType_t xPortGetCoreID(void);
+esp_err_t esp_register_freertos_tick_hook_for_cpu(esp_freertos_tick_cb_t cb, uint32_t cpu);
+void esp_deregister_freertos_tick_hook_for_cpu(esp_freertos_tick_cb_t cb, uint32_t cpu);
+
+/* Storage directory */
+
+int hostStorageInit(const char* path, int wipe);
+
+/* Entropy */
+
+void hostEntropySeed(uint64_t seed);   // Only for benchmarks, the keys become predictable
+
+#endif
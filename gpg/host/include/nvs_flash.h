@@ -0,0 +1,2 @@
+/* Stand-in for the ESP-IDF header of the same name, see hostPort.h */
+#include "hostPort.h"
@@ -0,0 +1,213 @@
+/*
+ * Binary log of the exchanged APDUs for the ESP32.
+ *
+ * Each exchange is stored as a fixed-size record in a ring buffer,
+ * which takes constant time and does not touch the UART, so logging
+ * can stay enabled. The records are formatted and printed by a low
+ * priority task (if PRINTAPDU is defined in gpg.c), and they can be
+ * retrieved by the host with the vendor specific command f4.
+ *
+ * Handles:
+ *    Recording the APDUs from the connection task
+ *    Printing the records outside of the APDU path
+ *    Serialization of the records (vendor specific command f4)
+ */
+#ifndef __APDULOG_H__
+#define __APDULOG_H__
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "platform.h"
+
+#include "telemetry.h"
+
+#define APDU_LOG_RECORDS 64         // Number of records kept in the ring
+//#define APDU_LOG_PAYLOAD          // If defined, the first bytes of the command data are logged as well
+#define APDU_LOG_PAYLOAD_LENGTH 16  // Bytes of the command APDU logged after the header
+
+typedef struct apduRecord {     // A logged exchange
+    uint32_t seq;               // Sequence number of the exchange
+    int64_t received;           // When the command was received (us since boot)
+    int64_t time;               // When the response was ready (us since boot)
+    uint8_t header[4];          // CLA, INS, P1, P2
+    uint16_t cmdLength;         // Length of the command APDU
+    uint16_t respLength;        // Length of the response APDU (status word included)
+    uint16_t sw;                // Status word of the response
+    uint8_t payloadLength;      // Bytes stored in payload
+    uint8_t payload[APDU_LOG_PAYLOAD_LENGTH];   // Command bytes following the header
+} apduRecord;
+
+apduRecord apduLog[APDU_LOG_RECORDS];
+uint32_t apduLogHead = 0;       // Sequence number of the next record
+portMUX_TYPE apduLogMux = portMUX_INITIALIZER_UNLOCKED;
+
+apduRecord apduLogSelected[APDU_LOG_RECORDS];  // Records of the response to f4, copied when it starts
+uint8_t apduLogSelectedCount = 0;
+uint32_t apduLogTo = 0;         // End of the records of the response to f4
+
+// Commands that carry PINs, private keys or the data to sign or decipher never have their data logged,
+// nor does a batch (f9), whose commands may be any of them
+uint8_t apduLogSensitive(uint8_t ins) {
+    return (ins == 0x20 || ins == 0x24 || ins == 0x2A || ins == 0x2C || ins == 0x88 ||
+            ins == 0xDA || ins == 0xDB || ins == 0xF2 || ins == 0xF9);
+}
+
+/**
+ * Record an exchange. Called from the connection task, once the
+ * response is ready.
+ *
+ * @param cmd The raw command APDU
+ * @param cmdLength Length of the command APDU
+ * @param resp The raw response APDU
+ * @param respLength Length of the response APDU
+ * @param received When the command was received
+ */
+void apduLogRecord(const char* cmd, int cmdLength, const uint8_t* resp, uint16_t respLength, int64_t received) {
+    int64_t now = platformMicros();
+    apduRecord* rec;
+
+    if (cmdLength < 0) {
+        cmdLength = 0;
+    }
+
+    portENTER_CRITICAL(&apduLogMux);
+    rec = &apduLog[apduLogHead % APDU_LOG_RECORDS];
+    rec->seq = apduLogHead++;
+    rec->received = received;
+    rec->time = now;
+    bzero(rec->header, sizeof(rec->header));
+    memcpy(rec->header, cmd, (cmdLength < 4) ? cmdLength : 4);
+    rec->cmdLength = (uint16_t) cmdLength;
+    rec->respLength = respLength;
+    rec->sw = (respLength >= 2) ? (uint16_t) (resp[respLength-2] << 8 | resp[respLength-1]) : 0;
+    rec->payloadLength = 0;
+#ifdef APDU_LOG_PAYLOAD
+    if (cmdLength > 4 && !apduLogSensitive(rec->header[1])) {
+        rec->payloadLength = (cmdLength - 4 > APDU_LOG_PAYLOAD_LENGTH) ? APDU_LOG_PAYLOAD_LENGTH : cmdLength - 4;
+        memcpy(rec->payload, cmd + 4, rec->payloadLength);
+    }
+#endif
+    portEXIT_CRITICAL(&apduLogMux);
+}
+
+/**
+ * Copy a record out of the ring.
+ *
+ * @param seq Sequence number of the record
+ * @param rec Where the record is copied
+ * @return 1 if the record is still in the ring, 0 if not
+ */
+uint8_t apduLogGet(uint32_t seq, apduRecord* rec) {
+    uint8_t found = 0;
+
+    portENTER_CRITICAL(&apduLogMux);
+    if (seq < apduLogHead && apduLogHead - seq <= APDU_LOG_RECORDS) {
+        memcpy(rec, &apduLog[seq % APDU_LOG_RECORDS], sizeof(apduRecord));
+        found = 1;
+    }
+    portEXIT_CRITICAL(&apduLogMux);
+    return found;
+}
+
+// Print a record to the UART
+void apduLogPrint(const apduRecord* rec) {
+    printf("#%u\t%lld us\t%lld us\tCLA: %02X\tINS: %02X\tP1: %02X\tP2: %02X\t", (unsigned int) rec->seq, (long long) rec->received, (long long) rec->time,
+            rec->header[0], rec->header[1], rec->header[2], rec->header[3]);
+    printf("Length: %d\tResponse: %d\tSW: %04X", rec->cmdLength, rec->respLength, rec->sw);
+    if (rec->payloadLength > 0) {
+        printf("\tData: ");
+        for (int i = 0; i < rec->payloadLength; i++) {
+            printf("%02X ", rec->payload[i]);
+        }
+    }
+    printf("\n");
+}
+
+/**
+ * Print the records that were added since the last call. Records that
+ * were overwritten before they could be printed are counted as dropped.
+ *
+ * @param next Sequence number of the next record to print
+ */
+void apduLogDrain(uint32_t* next) {
+    apduRecord rec;
+    uint32_t head = apduLogHead;
+
+    if (head - (*next) > APDU_LOG_RECORDS) {
+        printf("APDU log: %u records dropped\n", (unsigned int) (head - (*next) - APDU_LOG_RECORDS));
+        (*next) = head - APDU_LOG_RECORDS;
+    }
+    for (; (*next) != head; (*next)++) {
+        if (apduLogGet(*next, &rec)) {
+            apduLogPrint(&rec);
+        }
+    }
+    fflush(stdout);
+}
+
+/**
+ * Serialize the selected records and copy a window of them. The records
+ * were copied by apduLogSelect, so the GET RESPONSE exchanges that fetch
+ * the windows do not change them. Multi-byte values are big endian.
+ *
+ *    Sequence number of the next record (4)
+ *    For each record:
+ *       Sequence number (4), time received in us (8),
+ *       time the response was ready in us (8), CLA, INS, P1, P2 (4),
+ *       command length (2), response length (2), SW (2),
+ *       payload length (1), payload
+ *
+ * @param offset Offset of the window
+ * @param out Where the window is copied
+ * @param len Length of the window
+ * @return Total length of the serialized records
+ */
+uint16_t apduLogRead(uint16_t offset, uint8_t* out, uint16_t len) {
+    telemetryWriter w = { 0, offset, out, len };
+
+    telemetryPut(&w, apduLogTo, 4);
+    for (uint8_t n = 0; n < apduLogSelectedCount; n++) {
+        const apduRecord* rec = &apduLogSelected[n];
+        telemetryPut(&w, rec->seq, 4);
+        telemetryPut(&w, (uint32_t) (rec->received >> 32), 4);
+        telemetryPut(&w, (uint32_t) rec->received, 4);
+        telemetryPut(&w, (uint32_t) (rec->time >> 32), 4);
+        telemetryPut(&w, (uint32_t) rec->time, 4);
+        for (int i = 0; i < 4; i++) {
+            telemetryPut(&w, rec->header[i], 1);
+        }
+        telemetryPut(&w, rec->cmdLength, 2);
+        telemetryPut(&w, rec->respLength, 2);
+        telemetryPut(&w, rec->sw, 2);
+        telemetryPut(&w, rec->payloadLength, 1);
+        for (int i = 0; i < rec->payloadLength; i++) {
+            telemetryPut(&w, rec->payload[i], 1);
+        }
+    }
+    return w.pos;
+}
+
+/**
+ * Select the records returned by apduLogRead, from the given sequence
+ * number (or the oldest record still in the ring) to the latest one,
+ * and copy them out of the ring.
+ *
+ * @param from Sequence number of the first record
+ * @return Length of the serialized records
+ */
+uint16_t apduLogSelect(uint32_t from) {
+    portENTER_CRITICAL(&apduLogMux);
+    apduLogTo = apduLogHead;
+    if (apduLogTo - from > APDU_LOG_RECORDS || from > apduLogTo) {
+        from = (apduLogTo > APDU_LOG_RECORDS) ? apduLogTo - APDU_LOG_RECORDS : 0;
+    }
+    apduLogSelectedCount = 0;
+    for (uint32_t seq = from; seq != apduLogTo; seq++) {
+        memcpy(&apduLogSelected[apduLogSelectedCount++], &apduLog[seq % APDU_LOG_RECORDS], sizeof(apduRecord));
+    }
+    portEXIT_CRITICAL(&apduLogMux);
+    return apduLogRead(0, NULL, 0);
+}
+
+#endif
@@ -36,9 +36,7 @@
 #include "libAPDU.h"
 
 #define PORT 5511       // The default port of this protocol
-// Display the time it takes to complete an operation
-//#define TIMING        // Do not enable unless testing, or a 1 second delay will be added for each operation
-#define PRINTAPDU       // If defined, APDU info is printed, mainly used for debug reasons
+#define PRINTAPDU       // If defined, the APDU log is printed by a low priority task, mainly used for debug reasons
 #define PROCEEDBTN      // Do not perform a security operation until the button is pressed
 
 // FreeRTOS event group to signal connected & ready to make a request
@@ -51,13 +49,11 @@ const int CONNECTED_BIT = BIT0;
 static wl_handle_t s_wl_handle = WL_INVALID_HANDLE;
 
 // Mount path for the partition
-const char *base_path = "/spiflash";
+const char *base_path = STORAGE_PATH;
 
 uint8_t connected = 0;  // Status bit for the WiFi
 uint8_t proceed = 0;    // When the proceed button is pressed, proceed is set
 uint8_t hardRst = 0;    // When the hard reset button is pressed, hardRst is set
-uint16_t timeCount = 0; // How many operations were performed
-uint64_t totalTime = 0; // Total time taken for all operations in milliseconds
 
 void proceedHandle(void* arg) {     // Interrupt handler for the proceed button
     proceed = 1;
@@ -139,6 +135,7 @@ static esp_err_t event_handler(void *ctx, system_event_t *event) {
         break;
     case SYSTEM_EVENT_STA_DISCONNECTED:
         connected = 0;
+        telemetry.wifiReconnects++;
         invalidate();                   // Invalidate / PIN Reset at a WiFi disconnect
         gpio_set_level(GPIO_NUM_26, 0); // Disconnected, turn of the LED
         xEventGroupClearBits(wifiEventGroup, CONNECTED_BIT);
@@ -173,6 +170,7 @@ static void taskConnect(void *pvParameters) {
     static const char *TAG = "taskConnect";
 
     int sockfd, r;
+    int64_t received;           // When the APDU command was received
     apdu_t comAPDU;
     outData output;
     char recvBuf[1024];
@@ -224,6 +222,7 @@ begin:
         if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != 0) {
             ESP_LOGE(TAG, "... socket connect failed errno: %d", errno);
             ESP_LOGI(TAG, "Check that the server is running at the other end");
+            telemetry.connectFailures++;
             invalidate();   // Invalidate / PIN Reset at a possible end of a connection
             close(sockfd);  // The connection may have failed because there is no server running
             vTaskDelay(5000/portTICK_PERIOD_MS);    // So wait a few seconds
@@ -231,9 +230,13 @@ begin:
             goto begin;
         }
         ESP_LOGI(TAG, "... connected\n");
+        telemetry.connections++;
+        telemetryBegin();                               // Time the phases of this exchange
 
         bzero(recvBuf, sizeof(recvBuf));                // Zero the receive buffer
         r = read(sockfd, recvBuf, sizeof(recvBuf)-1);   // Receive the APDU command
+        received = esp_timer_get_time();
+        telemetryPhase(PHASE_PARSE);
         comAPDU = parseAPDU(recvBuf, r);                // Parse the APDU command
 
         if (comAPDU.INS == 0x00) {      // Nothing more to receive
@@ -242,20 +245,11 @@ begin:
             goto begin;
         }
 
-#ifdef PRINTAPDU    // Print the parsed command APDU
-        printf("CLA: %02X\tINS: %02X\tP1: %02X\t", comAPDU.CLA, comAPDU.INS, comAPDU.P1);
-        printf("P2: %02X\tP1P2: %02X\tLc: %02X\tData: ", comAPDU.P2, comAPDU.P1P2, comAPDU.Lc);
-        const uint8_t* tmp = comAPDU.data;
-        while(*tmp)
-            printf("%02X ", (unsigned int) *tmp++);
-        printf("\nLe: %02X\tTotal: %d\n", comAPDU.Le, r);
-        fflush(stdout);
-#endif
-
 #ifdef PROCEEDBTN   // The button has to be pressed before performing a security operation
         if ((comAPDU.CLA != 0x10) & (comAPDU.INS == 0x88 || comAPDU.INS == 0x2A)) { // Ignore for command chaining
             proceed = 0;    // Set the flag to 0
             int time = 0;   // Simple time counter
+            telemetryPhase(PHASE_BUTTON);
 
             while (proceed == 0 && time < 30) { // Wait until the button is pressed or time runs out
                 gpio_set_level(GPIO_NUM_25, 1);     // Flash the LEDs to notify the user
@@ -267,6 +261,7 @@ begin:
                 time++;     // 2 * 250ms * 30 = 15 seconds
             }
             gpio_set_level(GPIO_NUM_26, 1);         // Turn the WiFi status LED back on
+            telemetryPhase(PHASE_PARSE);
             if (time == 30) {           // If time == 30 it means that the time ran out
                 output.data[0] = 0x69;  // Set the output to SW_AUTHENTICATION_BLOCKED
                 output.data[1]= 0x83;   // SW_AUTHENTICATION_BLOCKED = 0x6983
@@ -278,49 +273,18 @@ begin:
 
         gpio_set_level(GPIO_NUM_25, 1);     // Start processing a command
 
-#ifdef TIMING                               // If TIMING is defined, print the duration of each operation
-        uint32_t startTime, endTime;
-        startTime = system_get_time();      // Yes, it is deprecated, but it's fine for this job
-#endif
-
+        profileBusy = 1;
         process(comAPDU, &output);          // Perform the appropriate operation
+        profileBusy = 0;
 
-#ifdef TIMING
-        endTime = system_get_time();
-        uint32_t duration = endTime - startTime;
-        uint32_t min = duration/60000000;
-        uint32_t timeTmp = duration%60000000;
-        uint32_t sec = timeTmp/1000000;
-        timeTmp = timeTmp%1000000;
-        uint32_t ms = timeTmp/1000;
-        uint32_t us = timeTmp%1000;
-        printf("\t\t(mm:ss:mls:us)    /   Duration: %d us\n", duration);
-        printf("\t\t %02d:%02d:%03d:%03d\n", min, sec, ms, us);
-        if (comAPDU.INS == 0x84 && comAPDU.CLA == 0x00) {   // Get Challenge: 0x84
-            timeCount++;            // Keep track of the number of times a specific operation has been performed
-            totalTime += duration;  // Keep the total time taken in order to calculate an average
-            printf("Number of operations: %d\t\tTotal time: %lld us\t\t", timeCount, totalTime);
-            printf("Average time: %lld\n", totalTime/timeCount);
-        }
-        fflush(stdout);
-
-        vTaskDelay(1000/portTICK_PERIOD_MS);    // To avoid watchdog starvation on repeated operations
-#endif
         gpio_set_level(GPIO_NUM_25, 0);     // End of command processing
 
-#ifdef PRINTAPDU    // Print the response APDU and it's length
-        printf("Output Data: ");
-        const uint8_t* tmp2 = output.data;
-        while(*tmp2)
-            printf("%02X ", (unsigned int) *tmp2++);
-        printf("\nLength: %d\n", output.length);
-        fflush(stdout);
-#endif
-
 #ifdef PROCEEDBTN
 writeOutput:    // Label to jump if pressing the button is required and it didn't happen
 #endif
 
+        apduLogRecord(recvBuf, r, output.data, output.length, received);  // Constant time, no printing
+        telemetryPhase(PHASE_SEND);
         if (write(sockfd, output.data, output.length) < 0) {    // Write the response
             ESP_LOGE(TAG, "... socket send failed");
             vTaskDelay(1000/portTICK_PERIOD_MS);
@@ -329,6 +293,9 @@ writeOutput:    // Label to jump if pressing the button is required and it didn'
         }
         ESP_LOGI(TAG, "... socket send success\n");
         close(sockfd);
+        if (!sendingTelemetry()) {  // Keep the telemetry unchanged while it is being read
+            telemetryEnd(comAPDU.INS);
+        }
     }
 
 exit:   // Restart the system, in a controlled manner
@@ -356,6 +323,16 @@ static void checkReset(void *pvParameters) {
     }
 }
 
+#ifdef PRINTAPDU
+static void taskLogDrain(void *pvParameters) {
+    uint32_t next = 0;      // Next APDU log record to print
+    while(1) {  // Print the logged APDUs, away from the APDU path
+        apduLogDrain(&next);
+        vTaskDelay(200/portTICK_PERIOD_MS);
+    }
+}
+#endif
+
 static void wifiStatus(void *pvParameters) {
     uint8_t toggle = 0;     // Toggle for WiFi status LED
     while(1) {  // Flash while it is still looking for a known network
@@ -377,4 +354,7 @@ void app_main() {
     xTaskCreate(&taskConnect, "taskConnect", 8192, NULL, 5, NULL);
     xTaskCreate(&checkReset, "checkReset", 2048, NULL, 5, NULL);
     xTaskCreate(&wifiStatus, "wifiStatus", 512, NULL, 5, NULL);
+#ifdef PRINTAPDU
+    xTaskCreate(&taskLogDrain, "taskLogDrain", 3072, NULL, 1, NULL);
+#endif
 }
\ No newline at end of file
@@ -29,15 +29,17 @@
 #include "mbedtls/config.h"
 #include "mbedtls/error.h"
 #include "mbedtls/rsa.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/aes.h"
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
-#include "esp_system.h"
-#include "esp_partition.h"
-#include "nvs_flash.h"
-#include "nvs.h"
 #include "errno.h"
 
+#include "platform.h"
+#include "telemetry.h"
+#include "apduLog.h"
+#include "profiler.h"
+
 #define ERRORCHK(x, y) do { \
   int ret = (x); \
   if (ret != SW_NO_ERROR) { \
@@ -61,6 +63,11 @@ static const uint8_t AID[16] = { (uint8_t) 0xD2, 0x76, 0x00, 0x01, \
 // returned by vendor specific command f1
 static const uint8_t VERSION[3] = { 0x01, 0x00, 0x12 };
 
+#ifndef STORAGE_PATH
+#define STORAGE_PATH "/spiflash"    // Where the FAT partition is mounted (overridden by the host build)
+#endif
+#define CERT_PATH STORAGE_PATH "/cert.dat"
+
 #define SW_NO_ERROR 0x9000
 #define SW_BYTES_REMAINING_00 0x6100
 #define SW_WARNING_STATE_UNCHANGED 0x6200
@@ -130,6 +137,21 @@ static uint8_t PW3_DEFAULT[8] = { 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38
 #define EXPONENT 65537          // The exponent
 #define FP_SIZE 20              // Key fingerprint size (20 bytes)
 
+#define IMPORT_COMPONENTS 7     // 91 - 97 in the Cardholder Private Key Template
+#define IMPORT_COMPONENT_MAX_LENGTH 512 // Largest E, P or Q accepted on key import
+
+// Lengths of the pre-serialized composite data objects
+#define ARD_MAX_LENGTH 222      // 6E - Application Related Data
+#define CRD_MAX_LENGTH (2 + NAME_MAX_LENGTH + 3 + LANG_MAX_LENGTH + 4)  // 65 - Cardholder Related Data
+#define PUBKEY_MAX_LENGTH (5 + 4 + KEY_SIZE_BYTES + 2 + EXPONENT_SIZE_BYTES)   // 7F49 - Public key
+
+#define CACHE_ARD 0x01          // 6E - Application Related Data
+#define CACHE_CRD 0x02          // 65 - Cardholder Related Data
+#define CACHE_SIG 0x04          // 7F49 - Signature public key
+#define CACHE_DEC 0x08          // 7F49 - Decryption public key
+#define CACHE_AUTH 0x10         // 7F49 - Authentication public key
+#define CACHE_ALL 0x1F
+
 uint8_t zero = 0;
 
 uint8_t loginData[LOGINDATA_MAX_LENGTH];
@@ -144,8 +166,7 @@ uint16_t name_length;
 uint8_t lang[LANG_MAX_LENGTH];  // Language preferences
 uint16_t lang_length;
 
-uint8_t cert[CERT_MAX_LENGTH];  // Certificate
-uint16_t cert_length;
+uint16_t cert_length;           // Certificate (kept in the flash memory only)
 
 uint8_t sex;
 
@@ -218,12 +239,62 @@ uint16_t out_left = 0;      // Counter for sending data in multiple response APD
 uint16_t out_sent = 0;      // How many data have already been sent
 uint16_t in_received = 0;   // Length of the data of command APDUs
 
+#define BATCH_APDU_MAX_LENGTH (5 + 255 + 1) // Largest command APDU in a batch (short APDU)
+uint8_t batchIn[BUFFER_MAX_LENGTH];     // Command APDUs of the batch being run
+uint8_t batchOut[BUFFER_MAX_LENGTH];    // Response APDUs of the last batch
+
+#define SOURCE_MEMORY 0     // A region of memory (buffer, a cache entry)
+#define SOURCE_FILE 1       // A file in the flash memory
+#define SOURCE_COMPUTED 2   // Generated on demand, chunk by chunk
+
+typedef struct respSource { // Where the data of the response APDUs is read from
+    uint8_t type;           // One of SOURCE_*
+    const uint8_t* data;    // SOURCE_MEMORY: the data
+    const char* path;       // SOURCE_FILE: path of the file
+    uint16_t (*read)(uint16_t offset, uint8_t* out, uint16_t len);  // SOURCE_COMPUTED
+} respSource;
+
+respSource out_source = { SOURCE_MEMORY, buffer, NULL, NULL };
+
 uint8_t chain = 0;          // Flag used for command chaining
 uint8_t chain_ins = 0;      // Command chaining INS (for checking)
 uint16_t chain_p1p2 = 0;    // Command chaining P1P2 (for checking)
 
 uint8_t terminated = 0;     // Terminated flag, if = 1 the card is locked
 
+typedef struct importState {    // State of the streaming key import parser
+    uint8_t active;             // An import is in progress
+    uint8_t element;            // Index of the next expected TLV element
+    uint8_t tagBytes;           // Tag bytes still expected
+    uint8_t lenBytes;           // Length bytes still expected (0xFF: first byte)
+    uint16_t tag;               // Tag being decoded
+    uint32_t len;               // Length being decoded
+    uint32_t skip;              // Value bytes still to skip (CRT contents)
+    uint8_t data;               // Set while receiving the 5F48 component data
+    uint8_t comp;               // Component currently being received
+    uint32_t compLen[IMPORT_COMPONENTS];    // Lengths from the 7F48 template
+    uint32_t compLeft;          // Bytes of the current component still expected
+    uint8_t type;               // Key reference from the CRT (B6, B8 or A4)
+    mbedtls_rsa_context* key;   // Key slot the components are written to
+    uint8_t modified;           // Set once the key slot has been written to
+    uint32_t outerLen;          // Length of the 4D template
+    uint32_t consumed;          // Bytes of the 4D template received so far
+    uint32_t tmplEnd;           // Value of consumed at the end of 7F48
+} importState;
+
+importState keyImport;      // Key import in progress (if keyImport.active)
+
+uint8_t cacheValid = 0;     // Bit mask of the cache entries that are up to date
+
+uint8_t ardCache[ARD_MAX_LENGTH];   // Serialized Application Related Data
+uint16_t ardCache_length;
+
+uint8_t crdCache[CRD_MAX_LENGTH];   // Serialized Cardholder Related Data
+uint16_t crdCache_length;
+
+uint8_t pubKeyCache[3][PUBKEY_MAX_LENGTH];  // Serialized public keys (sig, dec, auth)
+uint16_t pubKeyCache_length[3];
+
 
 /**
  * Parse the receive buffer to an APDU struct.
@@ -259,101 +330,137 @@ apdu_t parseAPDU(char* recvBuf, int n){
 
 // Function to store the value of a variable to the Non-Volatile Storage
 uint16_t storeVar(char* key, uint8_t val8, uint16_t val16, uint8_t mode) {
-    nvs_handle nvsHandle;
-    if (nvs_open("storage", NVS_READWRITE, &nvsHandle) != ESP_OK) {
-        return SW_UNKNOWN;
+    uint8_t phase = telemetryPhase(PHASE_FLASH);
+    uint16_t ret = SW_NO_ERROR;
+    int err;
+    if (mode == 8) {
+        err = platformVarWrite(key, &val8, 8);
+    } else if (mode == 16) {
+        err = platformVarWrite(key, &val16, 16);
     } else {
-        esp_err_t err;
-        if (mode == 8) {
-            err = nvs_set_u8(nvsHandle, key, val8);
-            if (err != ESP_OK) {
-                return err;
-            }
-        } else if (mode == 16) {
-            err = nvs_set_u16(nvsHandle, key, val16);
-            if (err != ESP_OK) {
-                return err;
-            }
-        } else {
-            return SW_UNKNOWN;
-        }
+        err = SW_UNKNOWN;
+    }
 
-        err = nvs_commit(nvsHandle);
-        if (err != ESP_OK) {
-            return err;
-        }
-        nvs_close(nvsHandle);
-        return SW_NO_ERROR;
+    if (err != 0) {
+        ret = err;
     }
+    telemetryPhase(phase);
+    return ret;
 }
 
 // Function to store a byte array to the flash memory filesystem
 uint16_t storeBuf(char* key, uint8_t* ptr, uint16_t len) {
+    uint8_t phase = telemetryPhase(PHASE_FLASH);
+    uint16_t ret = SW_NO_ERROR;
     FILE* fp = NULL;
     if ((fp = fopen(key, "wb")) == NULL) {
         ESP_LOGE("storeBuf", "I failed hard, code: %d", errno);
-        return SW_UNKNOWN;
+        ret = SW_UNKNOWN;
+    } else {
+        fwrite(ptr, sizeof(uint8_t), len, fp);
+        fclose(fp);
     }
-    fwrite(ptr, sizeof(uint8_t), len, fp);
-    fclose(fp);
-    return SW_NO_ERROR;
+    telemetryPhase(phase);
+    return ret;
 }
 
 // Function to restore the value of a variable from the Non-Volatile Storage
 uint16_t restoreVar(char* key, uint8_t* val8, uint16_t* val16, uint8_t mode) {
-    nvs_handle nvsHandle;
-    if (nvs_open("storage", NVS_READWRITE, &nvsHandle) != ESP_OK) {
-        return SW_UNKNOWN;
-    } else {
-        if (mode == 8) {
-            if (nvs_get_u8(nvsHandle, key, val8) != ESP_OK) {
-                return SW_UNKNOWN;
-            }
-        } else if (mode == 16) {
-            if (nvs_get_u16(nvsHandle, key, val16) != ESP_OK) {
-                return SW_UNKNOWN;
-            }
-        } else {
-            return SW_UNKNOWN;
+    uint8_t phase = telemetryPhase(PHASE_FLASH);
+    uint16_t ret = SW_NO_ERROR;
+    if (mode == 8) {
+        if (platformVarRead(key, val8, 8) != 0) {
+            ret = SW_UNKNOWN;
         }
-        nvs_close(nvsHandle);
-        return SW_NO_ERROR;
+    } else if (mode == 16) {
+        if (platformVarRead(key, val16, 16) != 0) {
+            ret = SW_UNKNOWN;
+        }
+    } else {
+        ret = SW_UNKNOWN;
     }
+    telemetryPhase(phase);
+    return ret;
 }
 
 // Function to restore a byte array from the flash memory filesystem
 uint16_t restoreBuf(char* key, uint8_t* ptr, uint16_t len){
+    uint8_t phase = telemetryPhase(PHASE_FLASH);
+    uint16_t ret = SW_NO_ERROR;
     FILE* fp = NULL;
     if ((fp = fopen(key, "rb")) == NULL) {
-        return SW_UNKNOWN;
+        ret = SW_UNKNOWN;
+    } else {
+        fread(ptr, sizeof(uint8_t), len, fp);
+        fclose(fp);
     }
-    fread(ptr, sizeof(uint8_t), len, fp);
-    fclose(fp);
-    return SW_NO_ERROR;
+    telemetryPhase(phase);
+    return ret;
+}
+
+/**
+ * Mark cached data objects as out of date, so that they are built
+ * again the next time they are requested.
+ *
+ * @param entries Bit mask of the entries (CACHE_*)
+ */
+void invalidateCache(uint8_t entries) {
+    cacheValid &= (uint8_t) ~entries;
+}
+
+// Return the cache entry of the public key of the given type
+uint8_t keyCacheEntry(uint8_t type) {
+    if (type == (uint8_t) 0xB6) {
+        return CACHE_SIG;
+    } else if (type == (uint8_t) 0xB8) {
+        return CACHE_DEC;
+    } else if (type == (uint8_t) 0xA4) {
+        return CACHE_AUTH;
+    }
+    return 0;
+}
+
+// Send the following responses from a region of memory
+void sourceMemory(const uint8_t* data) {
+    out_source.type = SOURCE_MEMORY;
+    out_source.data = data;
+}
+
+// Send the following responses from a file, read one chunk at a time
+void sourceFile(const char* path) {
+    out_source.type = SOURCE_FILE;
+    out_source.path = path;
+}
+
+// Send the following responses from data generated by read
+void sourceComputed(uint16_t (*read)(uint16_t offset, uint8_t* out, uint16_t len)) {
+    out_source.type = SOURCE_COMPUTED;
+    out_source.read = read;
 }
 
 // Function to read and print the keys from the flash storage
 uint16_t readKey(uint8_t type) {
     static const char *TAG = "readKey";
+    uint8_t phase = telemetryPhase(PHASE_FLASH);
     mbedtls_rsa_context* key;
     uint16_t ret;
     FILE *f;
 
     if (type == (uint8_t) 0xB6) {           // B6 = signature
         key = &sigKey;
-        if ((f = fopen("/spiflash/sigKey.dat", "rb")) == NULL) {
+        if ((f = fopen(STORAGE_PATH "/sigKey.dat", "rb")) == NULL) {
             ret = SW_UNKNOWN;
             goto exitRK;
         }
     } else if (type == (uint8_t) 0xB8) {    // B8 = decryption
         key = &decKey;
-        if ((f = fopen("/spiflash/decKey.dat", "rb")) == NULL) {
+        if ((f = fopen(STORAGE_PATH "/decKey.dat", "rb")) == NULL) {
             ret = SW_UNKNOWN;
             goto exitRK;
         }
     } else if (type == (uint8_t) 0xA4) {    // A4 = authentication
         key = &authKey;
-        if ((f = fopen("/spiflash/authKey.dat", "rb")) == NULL) {
+        if ((f = fopen(STORAGE_PATH "/authKey.dat", "rb")) == NULL) {
             ret = SW_UNKNOWN;
             goto exitRK;
         }
@@ -362,6 +469,7 @@ uint16_t readKey(uint8_t type) {
         ret = SW_UNKNOWN;
         goto exitRK;
     }
+    invalidateCache(keyCacheEntry(type));
 
     if ((mbedtls_mpi_read_file(&key->N , 16, f) != 0) ||
         (mbedtls_mpi_read_file(&key->E , 16, f) != 0) ||
@@ -387,6 +495,7 @@ uint16_t readKey(uint8_t type) {
     ret = SW_NO_ERROR;
 
 exitRK:
+    telemetryPhase(phase);
     return ret;
 }
 
@@ -405,12 +514,13 @@ uint8_t restoreState() {
     fflush(stdout);
 
     bzero(buffer, sizeof(buffer));
+    invalidateCache(CACHE_ALL);
     ERRORCHK(restoreVar("PW1_MODE_NO81", &pw1_modes[PW1_MODE_NO81], 0, 8), return 1);
     ERRORCHK(restoreVar("PW1_MODE_NO82", &pw1_modes[PW1_MODE_NO82], 0, 8), return 1);
 
     ERRORCHK(restoreVar("pw1_limit", &pw1.limit, 0, 8), return 1);
     ERRORCHK(restoreVar("pw1_length", &pw1_length, 0, 8), return 1);
-    ERRORCHK(restoreBuf("/spiflash/pw1.dat", pw1.value, pw1_length+1), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/pw1.dat", pw1.value, pw1_length+1), return 1);
     ERRORCHK(restoreVar("pw1_remaining", &pw1.remaining, 0, 8), return 1);
     ERRORCHK(restoreVar("pw1_status", &pw1_status, 0, 8), return 1);
 
@@ -420,61 +530,60 @@ uint8_t restoreState() {
 
     ERRORCHK(restoreVar("pw3_limit", &pw3.limit, 0, 8), return 1);
     ERRORCHK(restoreVar("pw3_length", &pw3_length, 0, 8), return 1);
-    ERRORCHK(restoreBuf("/spiflash/pw3.dat", pw3.value, pw3_length+1), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/pw3.dat", pw3.value, pw3_length+1), return 1);
     ERRORCHK(restoreVar("pw3_remaining", &pw3.remaining, 0, 8), return 1);
 
     ERRORCHK(restoreVar("isSigEmpty", &isSigEmpty, 0, 8), return 1);
     if (isSigEmpty == 0) {
         ERRORCHK(readKey(0xB6), return 1);
     }
-    ERRORCHK(restoreBuf("/spiflash/sigAttr.dat", sigAttributes, sizeof(sigAttributes)), return 1);
-    ERRORCHK(restoreBuf("/spiflash/sigFP.dat", sigFP, sizeof(sigFP)), return 1);
-    ERRORCHK(restoreBuf("/spiflash/sigTime.dat", sigTime, sizeof(sigTime)), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/sigAttr.dat", sigAttributes, sizeof(sigAttributes)), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/sigFP.dat", sigFP, sizeof(sigFP)), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/sigTime.dat", sigTime, sizeof(sigTime)), return 1);
 
     ERRORCHK(restoreVar("isDecEmpty", &isDecEmpty, 0, 8), return 1);
     if (isDecEmpty == 0) {
         ERRORCHK(readKey(0xB8), return 1);
     }
-    ERRORCHK(restoreBuf("/spiflash/decAttr.dat", decAttributes, sizeof(decAttributes)), return 1);
-    ERRORCHK(restoreBuf("/spiflash/decFP.dat", decFP, sizeof(decFP)), return 1);
-    ERRORCHK(restoreBuf("/spiflash/decTime.dat", decTime, sizeof(decTime)), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/decAttr.dat", decAttributes, sizeof(decAttributes)), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/decFP.dat", decFP, sizeof(decFP)), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/decTime.dat", decTime, sizeof(decTime)), return 1);
 
     ERRORCHK(restoreVar("isAuthEmpty", &isAuthEmpty, 0, 8), return 1);
     if (isAuthEmpty == 0) {
         ERRORCHK(readKey(0xA4), return 1);
     }
-    ERRORCHK(restoreBuf("/spiflash/autAttr.dat", authAttributes, sizeof(authAttributes)), return 1);
-    ERRORCHK(restoreBuf("/spiflash/authFP.dat", authFP, sizeof(authFP)), return 1);
-    ERRORCHK(restoreBuf("/spiflash/authTime.dat", authTime, sizeof(authTime)), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/autAttr.dat", authAttributes, sizeof(authAttributes)), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/authFP.dat", authFP, sizeof(authFP)), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/authTime.dat", authTime, sizeof(authTime)), return 1);
 
     ERRORCHK(restoreVar("loginData_len", 0, &loginData_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/logData.dat", loginData, loginData_length), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/logData.dat", loginData, loginData_length), return 1);
 
     ERRORCHK(restoreVar("url_length", 0, &url_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/url.dat", url, url_length), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/url.dat", url, url_length), return 1);
 
     ERRORCHK(restoreVar("name_length", 0, &name_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/name.dat", name, name_length), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/name.dat", name, name_length), return 1);
 
     ERRORCHK(restoreVar("lang_length", 0, &lang_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/lang.dat", lang, lang_length), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/lang.dat", lang, lang_length), return 1);
 
     ERRORCHK(restoreVar("cert_length", 0, &cert_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/cert.dat", cert, cert_length), return 1);
 
     ERRORCHK(restoreVar("sex", &sex, 0, 8), return 1);
 
     ERRORCHK(restoreVar("privdo1_len", 0, &private_use_do_1_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/privdo1.dat", private_use_do_1, private_use_do_1_length), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/privdo1.dat", private_use_do_1, private_use_do_1_length), return 1);
 
     ERRORCHK(restoreVar("privdo2_len", 0, &private_use_do_2_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/privdo2.dat", private_use_do_2, private_use_do_2_length), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/privdo2.dat", private_use_do_2, private_use_do_2_length), return 1);
 
     ERRORCHK(restoreVar("privdo3_len", 0, &private_use_do_3_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/privdo3.dat", private_use_do_3, private_use_do_3_length), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/privdo3.dat", private_use_do_3, private_use_do_3_length), return 1);
 
     ERRORCHK(restoreVar("privdo4_len", 0, &private_use_do_4_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/privdo4.dat", private_use_do_4, private_use_do_4_length), return 1);
+    ERRORCHK(restoreBuf(STORAGE_PATH "/privdo4.dat", private_use_do_4, private_use_do_4_length), return 1);
 
     ERRORCHK(restoreVar("terminated", &terminated, 0, 8), return 1);
 
@@ -484,17 +593,18 @@ uint8_t restoreState() {
 
 // Update all of the PIN attributes in the memory
 uint8_t updatePINattr() {
+    invalidateCache(CACHE_ARD);     // The remaining tries are part of C4
     ERRORCHK(storeVar("pw1_remaining", pw1.remaining, 0, 8), return 1);
     ERRORCHK(storeVar("pw1_length", pw1_length, 0, 8), return 1);
-    ERRORCHK(storeBuf("/spiflash/pw1.dat", pw1.value, pw1_length+1), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/pw1.dat", pw1.value, pw1_length+1), return 1);
 
     ERRORCHK(storeVar("rc_remaining", rc.remaining, 0, 8), return 1);
     ERRORCHK(storeVar("rc_length", rc_length, 0, 8), return 1);
-    ERRORCHK(storeBuf("/spiflash/rc.dat", rc.value, rc_length+1), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/rc.dat", rc.value, rc_length+1), return 1);
 
     ERRORCHK(storeVar("pw3_remaining", pw3.remaining, 0, 8), return 1);
     ERRORCHK(storeVar("pw3_length", pw3_length, 0, 8), return 1);
-    ERRORCHK(storeBuf("/spiflash/pw3.dat", pw3.value, pw3_length+1), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/pw3.dat", pw3.value, pw3_length+1), return 1);
     return 0;
 }
 
@@ -787,7 +897,7 @@ uint16_t increaseDSCounter() {
             break;
         }
     }
-    ERRORCHK(storeBuf("/spiflash/ds_count.dat", ds_counter, sizeof(ds_counter)), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/ds_count.dat", ds_counter, sizeof(ds_counter)), return 1);
 
     return SW_NO_ERROR;
 }
@@ -823,7 +933,7 @@ uint16_t computeDigitalSignature(uint16_t* length) {
     mbedtls_entropy_init(&entropy);
     const char *pers = "computeDigitalSignature";
 
-    if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+    if (mbedtls_ctr_drbg_seed(&ctr_drbg, platformEntropy, &entropy,
                         (const unsigned char *) pers, strlen(pers)) != 0) {
         return SW_UNKNOWN;  // It is not unknown though, there is a return value
     }
@@ -833,8 +943,11 @@ uint16_t computeDigitalSignature(uint16_t* length) {
     }
 
     uint8_t* outOffset = buffer + in_received;
-    if(mbedtls_rsa_pkcs1_encrypt(&sigKey, mbedtls_ctr_drbg_random, &ctr_drbg,
-            MBEDTLS_RSA_PRIVATE, in_received, buffer, outOffset) != 0) {
+    uint8_t phase = telemetryPhase(PHASE_CRYPTO);
+    int err = mbedtls_rsa_pkcs1_encrypt(&sigKey, mbedtls_ctr_drbg_random, &ctr_drbg,
+            MBEDTLS_RSA_PRIVATE, in_received, buffer, outOffset);
+    telemetryPhase(phase);
+    if (err != 0) {
         return SW_UNKNOWN;  // Again, not really unknown...
     }
 
@@ -873,7 +986,7 @@ uint16_t decipher(uint16_t* length) {
     mbedtls_entropy_init(&entropy);
     const char *pers = "decipher";
 
-    if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+    if (mbedtls_ctr_drbg_seed(&ctr_drbg, platformEntropy, &entropy,
                         (const unsigned char *) pers, strlen(pers)) != 0) {
         return SW_UNKNOWN;  // Same as above
     }
@@ -885,8 +998,11 @@ uint16_t decipher(uint16_t* length) {
         return SW_DATA_INVALID;
     }
 
-    if(mbedtls_rsa_pkcs1_decrypt(&decKey, mbedtls_ctr_drbg_random, &ctr_drbg,
-            MBEDTLS_RSA_PRIVATE, &len, inOffset, outOffset, (BUFFER_MAX_LENGTH - in_received)) != 0) {
+    uint8_t phase = telemetryPhase(PHASE_CRYPTO);
+    int err = mbedtls_rsa_pkcs1_decrypt(&decKey, mbedtls_ctr_drbg_random, &ctr_drbg,
+            MBEDTLS_RSA_PRIVATE, &len, inOffset, outOffset, (BUFFER_MAX_LENGTH - in_received));
+    telemetryPhase(phase);
+    if (err != 0) {
         return SW_UNKNOWN;  // Again, not really unknown...
     }
 
@@ -922,14 +1038,17 @@ uint16_t internalAuthenticate(uint16_t* length) {
     mbedtls_entropy_init(&entropy);
     const char *pers = "internalAuthenticate";
 
-    if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+    if (mbedtls_ctr_drbg_seed(&ctr_drbg, platformEntropy, &entropy,
                         (const unsigned char *) pers, strlen(pers)) != 0) {
         return SW_UNKNOWN;  // Same as above
     }
 
     uint8_t* outOffset = buffer + in_received;
-    if(mbedtls_rsa_pkcs1_encrypt(&authKey, mbedtls_ctr_drbg_random, &ctr_drbg,
-            MBEDTLS_RSA_PRIVATE, in_received, buffer, outOffset) != 0) {
+    uint8_t phase = telemetryPhase(PHASE_CRYPTO);
+    int err = mbedtls_rsa_pkcs1_encrypt(&authKey, mbedtls_ctr_drbg_random, &ctr_drbg,
+            MBEDTLS_RSA_PRIVATE, in_received, buffer, outOffset);
+    telemetryPhase(phase);
+    if (err != 0) {
         return SW_UNKNOWN;  // Again, not really unknown...
     }
 
@@ -943,51 +1062,74 @@ uint16_t internalAuthenticate(uint16_t* length) {
 }
 
 /**
- * Output the public key of the given key pair.
+ * Serialize the public key of the given key pair (7F49).
  *
  * @param key
  *            Key pair containing public key to be output
+ * @param out Where the template is written (PUBKEY_MAX_LENGTH bytes)
+ * @return Length of the template
  */
-uint16_t sendPublicKey(mbedtls_rsa_context* key) {
-    // Build message in buffer
+uint16_t buildPublicKey(mbedtls_rsa_context* key, uint8_t* out) {
     uint16_t offset = 0;
 
-    buffer[offset++] = 0x7F;
-    buffer[offset++] = 0x49;
-    buffer[offset++] = (uint8_t) 0x82;
+    out[offset++] = 0x7F;
+    out[offset++] = 0x49;
+    out[offset++] = (uint8_t) 0x82;
     uint16_t offsetForLength = offset;
     offset += 2;
 
     // 81 - Modulus
-    buffer[offset++] = (uint8_t) 0x81;
+    out[offset++] = (uint8_t) 0x81;
 
     // Length of modulus is always greater than 128 bytes
     if (KEY_SIZE_BYTES < 256) {
-        buffer[offset++] = (uint8_t) 0x81;
-        buffer[offset++] = (uint8_t) KEY_SIZE_BYTES;
+        out[offset++] = (uint8_t) 0x81;
+        out[offset++] = (uint8_t) KEY_SIZE_BYTES;
     } else {
-        buffer[offset++] = (uint8_t) 0x82;
-        buffer[offset++] = (uint8_t) (KEY_SIZE_BYTES >> 8);
-        buffer[offset++] = (uint8_t) (KEY_SIZE_BYTES & 0x00FF);
+        out[offset++] = (uint8_t) 0x82;
+        out[offset++] = (uint8_t) (KEY_SIZE_BYTES >> 8);
+        out[offset++] = (uint8_t) (KEY_SIZE_BYTES & 0x00FF);
     }
 
-    uint8_t* bufOffset = buffer + offset;
-    mbedtls_mpi_write_binary(&key->N, bufOffset, KEY_SIZE_BYTES);
+    uint8_t* outOffset = out + offset;
+    mbedtls_mpi_write_binary(&key->N, outOffset, KEY_SIZE_BYTES);
     offset += KEY_SIZE_BYTES;
 
     // 82 - Exponent
-    buffer[offset++] = (uint8_t) 0x82;
-    buffer[offset++] = (uint8_t) EXPONENT_SIZE_BYTES;
-    bufOffset = buffer + offset;
-    mbedtls_mpi_write_binary(&key->E, bufOffset, EXPONENT_SIZE_BYTES);
+    out[offset++] = (uint8_t) 0x82;
+    out[offset++] = (uint8_t) EXPONENT_SIZE_BYTES;
+    outOffset = out + offset;
+    mbedtls_mpi_write_binary(&key->E, outOffset, EXPONENT_SIZE_BYTES);
     offset += EXPONENT_SIZE_BYTES;
 
-    buffer[offsetForLength] = (uint8_t) ((offset - offsetForLength - 2) >> 8);
-    buffer[offsetForLength+1] = (uint8_t) ((offset - offsetForLength - 2) & 0x00FF);
+    out[offsetForLength] = (uint8_t) ((offset - offsetForLength - 2) >> 8);
+    out[offsetForLength+1] = (uint8_t) ((offset - offsetForLength - 2) & 0x00FF);
 
     return offset;
 }
 
+/**
+ * Output the public key of the given key pair. The template is only
+ * serialized again after the key has changed, and it is sent directly
+ * from the cache.
+ *
+ * @param type Type of the key (B6, B8 or A4)
+ * @param key
+ *            Key pair containing public key to be output
+ * @return Length of the template
+ */
+uint16_t sendPublicKey(uint8_t type, mbedtls_rsa_context* key) {
+    uint8_t entry = keyCacheEntry(type);
+    uint8_t idx = (entry == CACHE_SIG) ? 0 : ((entry == CACHE_DEC) ? 1 : 2);
+
+    if ((cacheValid & entry) == 0) {
+        pubKeyCache_length[idx] = buildPublicKey(key, pubKeyCache[idx]);
+        cacheValid |= entry;
+    }
+    sourceMemory(pubKeyCache[idx]);
+    return pubKeyCache_length[idx];
+}
+
 uint8_t updateKeyStatus() {
     ERRORCHK(storeVar("isSigEmpty", isSigEmpty, 0, 8), return 1);
     ERRORCHK(storeVar("isDecEmpty", isDecEmpty, 0, 8), return 1);
@@ -1008,7 +1150,7 @@ int keyGen(uint8_t type) {
 
     mbedtls_ctr_drbg_init(&ctr_drbg);
     mbedtls_entropy_init(&entropy);
-    if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+    if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, platformEntropy, &entropy,
                                (const unsigned char *) pers, strlen(pers))) != 0) {
         ESP_LOGE(TAG, "\nError:\tmbedtls_ctr_drbg_seed returned %d\n", ret);
         goto exitKG;
@@ -1017,21 +1159,21 @@ int keyGen(uint8_t type) {
     if (type == (uint8_t) 0xB6) {
         key = &sigKey;
         isEmpty = &isSigEmpty;
-        if ((fpriv = fopen("/spiflash/sigKey.dat", "wb")) == NULL) {
+        if ((fpriv = fopen(STORAGE_PATH "/sigKey.dat", "wb")) == NULL) {
             ret = 1;
             goto exitKG;
         }
     } else if (type == (uint8_t) 0xB8) {
         key = &decKey;
         isEmpty = &isDecEmpty;
-        if ((fpriv = fopen("/spiflash/decKey.dat", "wb")) == NULL) {
+        if ((fpriv = fopen(STORAGE_PATH "/decKey.dat", "wb")) == NULL) {
             ret = 1;
             goto exitKG;
         }
     } else if (type == (uint8_t) 0xA4) {
         key = &authKey;
         isEmpty = &isAuthEmpty;
-        if ((fpriv = fopen("/spiflash/authKey.dat", "wb")) == NULL) {
+        if ((fpriv = fopen(STORAGE_PATH "/authKey.dat", "wb")) == NULL) {
             ret = 1;
             goto exitKG;
         }
@@ -1039,8 +1181,12 @@ int keyGen(uint8_t type) {
         ret = 1;
         goto exitKG;
     }
+    invalidateCache(keyCacheEntry(type));
 
-    if ((ret = mbedtls_rsa_gen_key(key, mbedtls_ctr_drbg_random, &ctr_drbg, KEY_SIZE, EXPONENT)) != 0){
+    uint8_t phase = telemetryPhase(PHASE_CRYPTO);
+    ret = mbedtls_rsa_gen_key(key, mbedtls_ctr_drbg_random, &ctr_drbg, KEY_SIZE, EXPONENT);
+    telemetryPhase(phase);
+    if (ret != 0) {
         ESP_LOGE(TAG, "\nError:\tmbedtls_rsa_gen_key returned %d\n\n", ret);
         goto exitKG;
     }
@@ -1133,7 +1279,7 @@ uint16_t genAsymKey(uint8_t mode, uint16_t* ret) {
 
         if (buffer[0] == (uint8_t) 0xB6) {
             bzero(ds_counter, sizeof(ds_counter));
-            ERRORCHK(storeBuf("/spiflash/ds_count.dat", ds_counter, sizeof(ds_counter)), return 1);
+            ERRORCHK(storeBuf(STORAGE_PATH "/ds_count.dat", ds_counter, sizeof(ds_counter)), return 1);
         }
     }
 
@@ -1145,7 +1291,7 @@ uint16_t genAsymKey(uint8_t mode, uint16_t* ret) {
     }
     
     // Output requested key
-    (*ret) = sendPublicKey(key);
+    (*ret) = sendPublicKey(buffer[0], key);
     return SW_NO_ERROR;
 }
 
@@ -1171,6 +1317,155 @@ uint16_t getChallenge(uint16_t len, uint16_t* length) {
     return SW_NO_ERROR;
 }
 
+/**
+ * Serialize the Cardholder Related Data (65).
+ *
+ * @param out Where the data object is written (CRD_MAX_LENGTH bytes)
+ * @return Length of the data object
+ */
+uint16_t buildCRD(uint8_t* out) {
+    uint16_t offset = 0;
+    uint8_t* outOffset;
+
+    // 5B - Name
+    out[offset++] = 0x5B;
+    out[offset++] = (uint8_t) name_length;
+    outOffset = out + offset;
+    memcpy(outOffset, name, name_length);
+    offset += name_length;
+
+    // 5F2D - Language
+    out[offset++] = 0x5F;
+    out[offset++] = 0x2D;
+    out[offset++] = (uint8_t) lang_length;
+    outOffset = out + offset;
+    memcpy(outOffset, lang, lang_length);
+    offset += lang_length;
+
+    // 5F35 - Sex
+    out[offset++] = 0x5F;
+    out[offset++] = 0x35;
+    out[offset++] = 0x01;
+    out[offset++] = sex;
+
+    return offset;
+}
+
+/**
+ * Serialize the Application Related Data (6E).
+ *
+ * @param out Where the data object is written (ARD_MAX_LENGTH bytes)
+ * @return Length of the data object
+ */
+uint16_t buildARD(uint8_t* out) {
+    uint16_t offset = 0;
+    uint8_t* outOffset;
+
+    // 4F - AID
+    out[offset++] = 0x4F;
+    out[offset++] = sizeof(AID);
+    outOffset = out + offset;
+    memcpy(outOffset, AID, sizeof(AID));
+    offset += sizeof(AID);
+
+    // 5F52 - Historical bytes
+    out[offset++] = 0x5F;
+    out[offset++] = 0x52;
+    out[offset++] = (uint8_t) sizeof(HISTORICAL);
+    outOffset = out + offset;
+    memcpy(outOffset, HISTORICAL, sizeof(HISTORICAL));
+    offset += sizeof(HISTORICAL);
+
+    // 73 - Discretionary data objects
+    out[offset++] = 0x73;
+    out[offset++] = (uint8_t) 0x81; // This field's length will exceed 127 bytes
+    uint16_t ddoLengthOffset = offset;
+    out[offset++] = 0x00; // Placeholder for length byte
+
+    // C0 - Extended capabilities
+    out[offset++] = (uint8_t) 0xC0;
+    out[offset++] = (uint8_t) sizeof(EXTENDED_CAP);
+    outOffset = out + offset;
+    memcpy(outOffset, EXTENDED_CAP, sizeof(EXTENDED_CAP));
+    offset += sizeof(EXTENDED_CAP);
+
+    // C1 - Algorithm attributes signature
+    out[offset++] = (uint8_t) 0xC1;
+    out[offset++] = (uint8_t) 0x06;
+    outOffset = out + offset;
+    memcpy(outOffset, sigAttributes, sizeof(sigAttributes));
+    offset += sizeof(sigAttributes);
+
+    // C2 - Algorithm attributes decryption
+    out[offset++] = (uint8_t) 0xC2;
+    out[offset++] = (uint8_t) 0x06;
+    outOffset = out + offset;
+    memcpy(outOffset, decAttributes, sizeof(decAttributes));
+    offset += sizeof(decAttributes);
+
+    // C3 - Algorithm attributes authentication
+    out[offset++] = (uint8_t) 0xC3;
+    out[offset++] = (uint8_t) 0x06;
+    outOffset = out + offset;
+    memcpy(outOffset, authAttributes, sizeof(authAttributes));
+    offset += sizeof(authAttributes);
+
+    // C4 - PW1 Status bytes
+    out[offset++] = (uint8_t) 0xC4;
+    out[offset++] = 0x07;
+    out[offset++] = pw1_status;
+    out[offset++] = PW1_MAX_LENGTH;
+    out[offset++] = RC_MAX_LENGTH;
+    out[offset++] = PW3_MAX_LENGTH;
+    out[offset++] = pw1.remaining;
+    out[offset++] = rc.remaining;
+    out[offset++] = pw3.remaining;
+
+    // C5 - Fingerprints sign, dec and auth keys
+    out[offset++] = (uint8_t) 0xC5;
+    out[offset++] = (uint16_t) 60;   // * Doesn't really make sense to cast to 16-bit
+    outOffset = out + offset;
+    memcpy(outOffset, sigFP, FP_SIZE);
+    offset += FP_SIZE;
+    outOffset = out + offset;
+    memcpy(outOffset, decFP, FP_SIZE);
+    offset += FP_SIZE;
+    outOffset = out + offset;
+    memcpy(outOffset, authFP, FP_SIZE);
+    offset += FP_SIZE;
+
+    // C6 - Fingerprints CA 1, 2 and 3
+    out[offset++] = (uint8_t) 0xC6;
+    out[offset++] = (uint16_t) 60;   // * Again, 16-bit casting to an 8-bit variable...
+    outOffset = out + offset;
+    memcpy(outOffset, ca1_fp, FP_LENGTH);
+    offset += FP_LENGTH;
+    outOffset = out + offset;
+    memcpy(outOffset, ca2_fp, FP_LENGTH);
+    offset += FP_LENGTH;
+    outOffset = out + offset;
+    memcpy(outOffset, ca3_fp, FP_LENGTH);
+    offset += FP_LENGTH;
+
+    // CD - Generation times of public key pair
+    out[offset++] = (uint8_t) 0xCD;
+    out[offset++] = (uint16_t) 12;   // * Hope this is the last time of this casting
+    outOffset = out + offset;
+    memcpy(outOffset, sigTime, sizeof(sigTime));
+    offset += sizeof(sigTime);
+    outOffset = out + offset;
+    memcpy(outOffset, decTime, sizeof(decTime));
+    offset += sizeof(decTime);
+    outOffset = out + offset;
+    memcpy(outOffset, authTime, sizeof(authTime));
+    offset += sizeof(authTime);
+
+    // Set length of combined discretionary data objects
+    out[ddoLengthOffset] = (uint8_t) (offset - ddoLengthOffset - 1);
+
+    return offset;
+}
+
 /**
  * Provide the GET DATA command (INS CA)
  *
@@ -1210,137 +1505,22 @@ uint16_t getData(uint16_t tag, uint16_t* ret) {
 
     // 65 - Cardholder Related Data
     case (uint16_t) 0x0065:
-
-        // 5B - Name
-        buffer[offset++] = 0x5B;
-        buffer[offset++] = (uint8_t) name_length;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, name, name_length);
-        offset += name_length;
-
-        // 5F2D - Language
-        buffer[offset++] = 0x5F;
-        buffer[offset++] = 0x2D;
-        buffer[offset++] = (uint8_t) lang_length;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, lang, lang_length);
-        offset += lang_length;
-
-        // 5F35 - Sex
-        buffer[offset++] = 0x5F;
-        buffer[offset++] = 0x35;
-        buffer[offset++] = 0x01;
-        buffer[offset++] = sex;
-
-        (*ret) = offset;
+        if ((cacheValid & CACHE_CRD) == 0) {
+            crdCache_length = buildCRD(crdCache);
+            cacheValid |= CACHE_CRD;
+        }
+        sourceMemory(crdCache);
+        (*ret) = crdCache_length;
         return SW_NO_ERROR;
 
     // 6E - Application Related Data
     case (uint16_t) 0x006E:
-
-        // 4F - AID
-        buffer[offset++] = 0x4F;
-        buffer[offset++] = sizeof(AID);
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, AID, sizeof(AID));
-        offset += sizeof(AID);
-
-        // 5F52 - Historical bytes
-        buffer[offset++] = 0x5F;
-        buffer[offset++] = 0x52;
-        buffer[offset++] = (uint8_t) sizeof(HISTORICAL);
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, HISTORICAL, sizeof(HISTORICAL));
-        offset += sizeof(HISTORICAL);
-
-        // 73 - Discretionary data objects
-        buffer[offset++] = 0x73;
-        buffer[offset++] = (uint8_t) 0x81; // This field's length will exceed 127 bytes
-        uint16_t ddoLengthOffset = offset;
-        buffer[offset++] = 0x00; // Placeholder for length byte
-
-        // C0 - Extended capabilities
-        buffer[offset++] = (uint8_t) 0xC0;
-        buffer[offset++] = (uint8_t) sizeof(EXTENDED_CAP);
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, EXTENDED_CAP, sizeof(EXTENDED_CAP));
-        offset += sizeof(EXTENDED_CAP);
-
-        // C1 - Algorithm attributes signature
-        buffer[offset++] = (uint8_t) 0xC1;
-        buffer[offset++] = (uint8_t) 0x06;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, sigAttributes, sizeof(sigAttributes));
-        offset += sizeof(sigAttributes);
-
-        // C2 - Algorithm attributes decryption
-        buffer[offset++] = (uint8_t) 0xC2;
-        buffer[offset++] = (uint8_t) 0x06;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, decAttributes, sizeof(decAttributes));
-        offset += sizeof(decAttributes);
-
-        // C3 - Algorithm attributes authentication
-        buffer[offset++] = (uint8_t) 0xC3;
-        buffer[offset++] = (uint8_t) 0x06;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, authAttributes, sizeof(authAttributes));
-        offset += sizeof(authAttributes);
-
-        // C4 - PW1 Status bytes
-        buffer[offset++] = (uint8_t) 0xC4;
-        buffer[offset++] = 0x07;
-        buffer[offset++] = pw1_status;
-        buffer[offset++] = PW1_MAX_LENGTH;
-        buffer[offset++] = RC_MAX_LENGTH;
-        buffer[offset++] = PW3_MAX_LENGTH;
-        buffer[offset++] = pw1.remaining;
-        buffer[offset++] = rc.remaining;
-        buffer[offset++] = pw3.remaining;
-
-        // C5 - Fingerprints sign, dec and auth keys
-        buffer[offset++] = (uint8_t) 0xC5;
-        buffer[offset++] = (uint16_t) 60;   // * Doesn't really make sense to cast to 16-bit
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, sigFP, FP_SIZE);
-        offset += FP_SIZE;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, decFP, FP_SIZE);
-        offset += FP_SIZE;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, authFP, FP_SIZE);
-        offset += FP_SIZE;
-
-        // C6 - Fingerprints CA 1, 2 and 3
-        buffer[offset++] = (uint8_t) 0xC6;
-        buffer[offset++] = (uint16_t) 60;   // * Again, 16-bit casting to an 8-bit variable...
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, ca1_fp, FP_LENGTH);
-        offset += FP_LENGTH;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, ca2_fp, FP_LENGTH);
-        offset += FP_LENGTH;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, ca3_fp, FP_LENGTH);
-        offset += FP_LENGTH;
-
-        // CD - Generation times of public key pair
-        buffer[offset++] = (uint8_t) 0xCD;
-        buffer[offset++] = (uint16_t) 12;   // * Hope this is the last time of this casting
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, sigTime, sizeof(sigTime));
-        offset += sizeof(sigTime);
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, decTime, sizeof(decTime));
-        offset += sizeof(decTime);
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, authTime, sizeof(authTime));
-        offset += sizeof(authTime);
-
-        // Set length of combined discretionary data objects
-        buffer[ddoLengthOffset] = (uint8_t) (offset - ddoLengthOffset - 1);
-
-        (*ret) = offset;
+        if ((cacheValid & CACHE_ARD) == 0) {
+            ardCache_length = buildARD(ardCache);
+            cacheValid |= CACHE_ARD;
+        }
+        sourceMemory(ardCache);
+        (*ret) = ardCache_length;
         return SW_NO_ERROR;
 
     // 7A - Security support template
@@ -1358,13 +1538,9 @@ uint16_t getData(uint16_t tag, uint16_t* ret) {
 
     // 7F21 - Cardholder Certificate
     case (uint16_t) 0x7F21:
-        if (cert_length > 0) {
-            bufOffset = buffer + offset;
-            memcpy(bufOffset, cert, sizeof(cert));
-            offset += sizeof(cert);
-        }
-
-        (*ret) = offset;
+        // Served straight from the flash memory, one response at a time
+        sourceFile(CERT_PATH);
+        (*ret) = cert_length;
         return SW_NO_ERROR;
 
     // C4 - PW Status Bytes
@@ -1452,14 +1628,14 @@ uint16_t putData(uint16_t tag) {
         case (uint16_t) 0x0101:
             private_use_do_1_length = in_received;
             memcpy(private_use_do_1, buffer, in_received);
-            ERRORCHK(storeBuf("/spiflash/privdo1.dat", private_use_do_1, in_received), return SW_UNKNOWN);
+            ERRORCHK(storeBuf(STORAGE_PATH "/privdo1.dat", private_use_do_1, in_received), return SW_UNKNOWN);
             return storeVar("privdo1_len", 0, private_use_do_1_length, 16);
 
         // 0103 - Private Use DO 3
         case (uint16_t) 0x0103:
             private_use_do_3_length = in_received;
             memcpy(private_use_do_3, buffer, in_received);
-            ERRORCHK(storeBuf("/spiflash/privdo3.dat", private_use_do_3, in_received), return SW_UNKNOWN);
+            ERRORCHK(storeBuf(STORAGE_PATH "/privdo3.dat", private_use_do_3, in_received), return SW_UNKNOWN);
             return storeVar("privdo3_len", 0, private_use_do_3_length, 16);
         }
     }
@@ -1475,8 +1651,9 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_DATA;
         }
         memcpy(name, buffer, in_received);
+        invalidateCache(CACHE_CRD);
         name_length = in_received;
-        ERRORCHK(storeBuf("/spiflash/name.dat", name, in_received), return SW_UNKNOWN);
+        ERRORCHK(storeBuf(STORAGE_PATH "/name.dat", name, in_received), return SW_UNKNOWN);
         return storeVar("name_length", 0, name_length, 16);
 
     // 5E - Login data
@@ -1486,7 +1663,7 @@ uint16_t putData(uint16_t tag) {
         }
         memcpy(loginData, buffer, in_received);
         loginData_length = in_received;
-        ERRORCHK(storeBuf("/spiflash/logData.dat", loginData, in_received), return SW_UNKNOWN);
+        ERRORCHK(storeBuf(STORAGE_PATH "/logData.dat", loginData, in_received), return SW_UNKNOWN);
         return storeVar("loginData_len", 0, loginData_length, 16);
 
     // 5F2D - Language preferences
@@ -1495,8 +1672,9 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_DATA;
         }
         memcpy(lang, buffer, in_received);
+        invalidateCache(CACHE_CRD);
         lang_length = in_received;
-        ERRORCHK(storeBuf("/spiflash/lang.dat", lang, in_received), return SW_UNKNOWN);
+        ERRORCHK(storeBuf(STORAGE_PATH "/lang.dat", lang, in_received), return SW_UNKNOWN);
         return storeVar("lang_length", 0, lang_length, 16);
 
     // 5F35 - Sex
@@ -1511,6 +1689,7 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_DATA;
         }
         sex = buffer[0];
+        invalidateCache(CACHE_CRD);
         return storeVar("sex", sex, 0, 8);
 
     // 5F50 - URL
@@ -1520,7 +1699,7 @@ uint16_t putData(uint16_t tag) {
         }
         memcpy(url, buffer, in_received);
         url_length = in_received;
-        ERRORCHK(storeBuf("/spiflash/url.dat", url, in_received), return SW_UNKNOWN);
+        ERRORCHK(storeBuf(STORAGE_PATH "/url.dat", url, in_received), return SW_UNKNOWN);
         return storeVar("url_length", 0, url_length, 16);
 
     // 7F21 - Cardholder certificate
@@ -1528,9 +1707,8 @@ uint16_t putData(uint16_t tag) {
         if (in_received > CERT_MAX_LENGTH) {
             return SW_WRONG_DATA;
         }
-        memcpy(cert, buffer, in_received);
         cert_length = in_received;
-        ERRORCHK(storeBuf("/spiflash/cert.dat", cert, in_received), return SW_UNKNOWN);
+        ERRORCHK(storeBuf(CERT_PATH, buffer, in_received), return SW_UNKNOWN);
         return storeVar("cert_length", 0, cert_length, 16);
 
     // C4 - PW Status Bytes
@@ -1543,6 +1721,7 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_DATA;
         }
         pw1_status = buffer[0];
+        invalidateCache(CACHE_ARD);
         return storeVar("pw1_status", pw1_status, 0, 8);
 
     // C7 - Fingerprint signature key
@@ -1551,7 +1730,8 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_DATA;       // Method setFingerprint performs limit checking
         }
         memcpy(sigFP, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/sigFP.dat", sigFP, in_received), return SW_UNKNOWN);
+        invalidateCache(CACHE_ARD);
+        ERRORCHK(storeBuf(STORAGE_PATH "/sigFP.dat", sigFP, in_received), return SW_UNKNOWN);
         return SW_NO_ERROR;
 
     // C8 - Fingerprint decryption key
@@ -1560,7 +1740,8 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_DATA;       // Method setFingerprint performs limit checking
         }
         memcpy(decFP, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/decFP.dat", decFP, in_received), return SW_UNKNOWN);
+        invalidateCache(CACHE_ARD);
+        ERRORCHK(storeBuf(STORAGE_PATH "/decFP.dat", decFP, in_received), return SW_UNKNOWN);
         return SW_NO_ERROR;
 
     // C9 - Fingerprint authentication key
@@ -1569,7 +1750,8 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_DATA;       // Method setFingerprint performs limit checking
         }
         memcpy(authFP, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/authFP.dat", authFP, in_received), return SW_UNKNOWN);
+        invalidateCache(CACHE_ARD);
+        ERRORCHK(storeBuf(STORAGE_PATH "/authFP.dat", authFP, in_received), return SW_UNKNOWN);
         return SW_NO_ERROR;
 
     // CA - Fingerprint Certification Authority 1
@@ -1578,7 +1760,8 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_DATA;
         }
         memcpy(ca1_fp, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/ca1_fp.dat", ca1_fp, in_received), return SW_UNKNOWN);
+        invalidateCache(CACHE_ARD);
+        ERRORCHK(storeBuf(STORAGE_PATH "/ca1_fp.dat", ca1_fp, in_received), return SW_UNKNOWN);
         return SW_NO_ERROR;
 
     // CB - Fingerprint Certification Authority 2
@@ -1587,7 +1770,8 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_DATA;
         }
         memcpy(ca2_fp, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/ca2_fp.dat", ca2_fp, in_received), return SW_UNKNOWN);
+        invalidateCache(CACHE_ARD);
+        ERRORCHK(storeBuf(STORAGE_PATH "/ca2_fp.dat", ca2_fp, in_received), return SW_UNKNOWN);
         return SW_NO_ERROR;
 
     // CC - Fingerprint Certification Authority 3
@@ -1596,7 +1780,8 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_DATA;
         }
         memcpy(ca3_fp, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/ca3_fp.dat", ca3_fp, in_received), return SW_UNKNOWN);
+        invalidateCache(CACHE_ARD);
+        ERRORCHK(storeBuf(STORAGE_PATH "/ca3_fp.dat", ca3_fp, in_received), return SW_UNKNOWN);
         return SW_NO_ERROR;
 
     // CE - Signature key generation date/time
@@ -1605,7 +1790,8 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_DATA;   // Method setTime performs limit checking
         }
         memcpy(sigTime, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/sigTime.dat", sigTime, in_received), return SW_UNKNOWN);
+        invalidateCache(CACHE_ARD);
+        ERRORCHK(storeBuf(STORAGE_PATH "/sigTime.dat", sigTime, in_received), return SW_UNKNOWN);
         return SW_NO_ERROR;
 
     // CF - Decryption key generation date/time
@@ -1614,7 +1800,8 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_DATA;   // Method setTime performs limit checking
         }
         memcpy(decTime, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/decTime.dat", decTime, in_received), return SW_UNKNOWN);
+        invalidateCache(CACHE_ARD);
+        ERRORCHK(storeBuf(STORAGE_PATH "/decTime.dat", decTime, in_received), return SW_UNKNOWN);
         return SW_NO_ERROR;
 
     // D0 - Authentication key generation date/time
@@ -1623,7 +1810,8 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_DATA;   // Method setTime performs limit checking
         }
         memcpy(authTime, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/authTime.dat", authTime, in_received), return SW_UNKNOWN);
+        invalidateCache(CACHE_ARD);
+        ERRORCHK(storeBuf(STORAGE_PATH "/authTime.dat", authTime, in_received), return SW_UNKNOWN);
         return SW_NO_ERROR;
 
     // D3 - Resetting Code
@@ -1648,7 +1836,7 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_LENGTH;
         }
         memcpy(private_use_do_2, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/private_use_do_2.dat", private_use_do_2, in_received), return SW_UNKNOWN);
+        ERRORCHK(storeBuf(STORAGE_PATH "/private_use_do_2.dat", private_use_do_2, in_received), return SW_UNKNOWN);
         private_use_do_2_length = in_received;
         return storeVar("private_use_do_2_length", 0, private_use_do_2_length, 16);
 
@@ -1658,7 +1846,7 @@ uint16_t putData(uint16_t tag) {
             return SW_WRONG_LENGTH;
         }
         memcpy(private_use_do_4, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/private_use_do_4.dat", private_use_do_4, in_received), return SW_UNKNOWN);
+        ERRORCHK(storeBuf(STORAGE_PATH "/private_use_do_4.dat", private_use_do_4, in_received), return SW_UNKNOWN);
         private_use_do_4_length = in_received;
         return storeVar("private_use_do_4_length", 0, private_use_do_4_length, 16);
 
@@ -1685,250 +1873,306 @@ uint16_t getLengthBytes(uint16_t length) {
 }
 
 /**
- * Get length of TLV element.
- *
- * @param data
- *            Byte array
- * @param offset
- *            Offset within byte array containing first byte
- * @return Length of value
+ * Abort a key import in progress. If the key slot has already been
+ * overwritten with some of the received components, the stored key
+ * is restored from the flash memory, or the slot is cleared if it was
+ * empty, so that no partial key is left in RAM.
  */
-uint16_t getLength(uint8_t* data, uint16_t offset, uint16_t* status) {
-    uint16_t len = 0;
-
-    if ((data[offset] & (uint8_t) 0x80) == (uint8_t) 0x00) {
-        len = data[offset];
-        (*status) = SW_NO_ERROR;
-    } else if ((data[offset] & (uint8_t) 0x7F) == (uint8_t) 0x01) {
-        len = data[(uint16_t) (offset + 1)];
-        len &= 0x00FF;
-        (*status) = SW_NO_ERROR;
-    } else if ((data[offset] & (uint8_t) 0x7F) == (uint8_t) 0x02) {
-        len = (uint16_t) (data[(uint16_t) (offset + 1)] << 8) | data[(uint16_t) (offset + 2)];
-        (*status) = SW_NO_ERROR;
-    } else {
-        (*status) = SW_UNKNOWN;
-    }
-
-    return len;
+void importAbort() {
+    if (keyImport.active && keyImport.modified) {
+        uint8_t isEmpty = 1;
+        if (keyImport.type == (uint8_t) 0xB6) {
+            isEmpty = isSigEmpty;
+        } else if (keyImport.type == (uint8_t) 0xB8) {
+            isEmpty = isDecEmpty;
+        } else if (keyImport.type == (uint8_t) 0xA4) {
+            isEmpty = isAuthEmpty;
+        }
+        if (isEmpty == 0 && readKey(keyImport.type) != SW_NO_ERROR) {
+            ESP_LOGE("importAbort", "Failed to restore key %02X", keyImport.type);
+            isEmpty = 1;
+        }
+        if (isEmpty != 0) {
+            mbedtls_rsa_free(keyImport.key);
+            mbedtls_rsa_init(keyImport.key, MBEDTLS_RSA_PKCS_V15, 0);
+        }
+        invalidateCache(keyCacheEntry(keyImport.type));
+    }
+    bzero(&keyImport, sizeof(keyImport));
 }
 
 /**
- * Provide functionality for importing keys.
- *
- * @param apdu
+ * Compute the remaining CRT parameters of the imported key from P, Q
+ * and E. This runs as soon as Q has been received, so the work is done
+ * while the rest of the (unused) template data is still being sent.
  */
-uint16_t importKey() {
-    uint16_t status;
-    uint8_t* bufOffset;
-    uint16_t offset = 0;
-    FILE* fpriv = NULL;
-    uint8_t* isEmpty;
-
-    if (pw3.validated == 0) {
-        return SW_SECURITY_STATUS_NOT_SATISFIED;
-    }
+uint16_t importDerive() {
+    uint16_t status = SW_NO_ERROR;
+    mbedtls_rsa_context* key = keyImport.key;
+    mbedtls_mpi P1, Q1, H;
+    mbedtls_mpi_init(&P1);
+    mbedtls_mpi_init(&Q1);
+    mbedtls_mpi_init(&H);
 
-    // Check for tag 4D
-    if (buffer[offset++] != 0x4D) {
-        return SW_DATA_INVALID;
+    if ((mbedtls_mpi_mul_mpi(&key->N, &key->P, &key->Q) != 0) ||
+        (mbedtls_mpi_sub_int(&P1, &key->P, 1) != 0) ||
+        (mbedtls_mpi_sub_int(&Q1, &key->Q, 1) != 0) ||
+        (mbedtls_mpi_mul_mpi(&H, &P1, &Q1) != 0) ||
+        (mbedtls_mpi_inv_mod(&key->D , &key->E, &H) != 0) ||
+        (mbedtls_mpi_mod_mpi(&key->DP, &key->D, &P1) != 0) ||
+        (mbedtls_mpi_mod_mpi(&key->DQ, &key->D, &Q1) != 0) ||
+        (mbedtls_mpi_inv_mod(&key->QP, &key->Q, &key->P) != 0)) {
+        status = SW_UNKNOWN;
     }
+    key->len = (mbedtls_mpi_bitlen(&key->N) + 7) >> 3;
 
-    // Length of 4D
-    uint16_t len = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len);
-    } else {
-        return status;
-    }
+    mbedtls_mpi_free(&P1);
+    mbedtls_mpi_free(&Q1);
+    mbedtls_mpi_free(&H);
+    return status;
+}
 
-    // Get key for Control Reference Template
-    uint8_t type = buffer[offset++];
+/**
+ * Handle a complete TLV header (tag and length) of the extended header
+ * list. The expected elements are, in order:
+ *    4D (Extended header list)
+ *    B6, B8 or A4 (Control Reference Template)
+ *    7F48 (Cardholder private key template)
+ *    91 - 97 (Lengths of E, P, Q, PQ, DP1, DQ1 and the modulus)
+ *    5F48 (Cardholder private key data)
+ */
+uint16_t importElement() {
     uint8_t err;
-    mbedtls_rsa_context* key = getKey(type, &err);
-    if (err != 0) {
-        return SW_UNKNOWN;
-    }
-
-    // Skip empty length of CRT
-    offset++;
-
-    // Check for tag 7F48
-    if (buffer[offset++] != 0x7F || buffer[offset++] != 0x48) {
-        return SW_DATA_INVALID;
-    }
-    uint16_t len_template = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_template);
-    } else {
-        return status;
-    }
-
-    uint16_t offset_data = (uint16_t) (offset + len_template);
+    uint32_t total = 0;
 
-    if (buffer[offset++] != (uint8_t) 0x91) {
-        return SW_DATA_INVALID;
-    }
-    uint16_t len_e = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_e);
-    } else {
-        return status;
-    }
+    switch (keyImport.element) {
+    case 0:
+        if (keyImport.tag != (uint16_t) 0x004D) {
+            return SW_DATA_INVALID;
+        }
+        keyImport.outerLen = keyImport.len;
+        break;
 
-    if (buffer[offset++] != (uint8_t) 0x92) {
-        return SW_DATA_INVALID;
-    }
-    uint16_t len_p = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_p);
-    } else {
-        return status;
-    }
+    case 1:
+        keyImport.type = (uint8_t) keyImport.tag;
+        keyImport.key = getKey(keyImport.type, &err);
+        if (err != 0 || keyImport.tag > 0xFF) {
+            return SW_DATA_INVALID;
+        }
+        keyImport.skip = keyImport.len;  // The CRT contents are not needed
+        break;
 
-    if (buffer[offset++] != (uint8_t) 0x93) {
-        return SW_DATA_INVALID;
-    }
-    uint16_t len_q = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_q);
-    } else {
-        return status;
-    }
+    case 2:
+        if (keyImport.tag != (uint16_t) 0x7F48) {
+            return SW_DATA_INVALID;
+        }
+        keyImport.tmplEnd = keyImport.consumed + keyImport.len;
+        break;
 
-    if (buffer[offset++] != (uint8_t) 0x94) {
-        return SW_DATA_INVALID;
-    }
-    uint16_t len_pq = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_pq);
-    } else {
-        return status;
-    }
+    case 10:
+        if (keyImport.tag != (uint16_t) 0x5F48) {
+            return SW_DATA_INVALID;
+        }
+        for (int i = 0; i < IMPORT_COMPONENTS; i++) {
+            total += keyImport.compLen[i];
+        }
+        if (total != keyImport.len) {
+            return SW_WRONG_LENGTH;
+        }
+        keyImport.data = 1;
+        keyImport.comp = 0;
+        keyImport.compLeft = keyImport.compLen[0];
+        break;
 
-    if (buffer[offset++] != (uint8_t) 0x95) {
-        return SW_DATA_INVALID;
-    }
-    uint16_t len_dp1 = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_dp1);
-    } else {
-        return status;
+    default:    // 91 - 97, only the lengths are given in the template
+        if (keyImport.tag != (uint16_t) (0x91 + keyImport.element - 3)) {
+            return SW_DATA_INVALID;
+        }
+        // E, P and Q are staged in buffer while they are being received
+        if (keyImport.element < 6 && (keyImport.len == 0 ||
+                keyImport.len > IMPORT_COMPONENT_MAX_LENGTH)) {
+            return SW_WRONG_LENGTH;
+        }
+        keyImport.compLen[keyImport.element - 3] = keyImport.len;
+        // 97 is the last element, 7F48 has to end with it
+        if (keyImport.element == 9 && keyImport.consumed != keyImport.tmplEnd) {
+            return SW_WRONG_LENGTH;
+        }
+        break;
     }
 
-    if (buffer[offset++] != (uint8_t) 0x96) {
-        return SW_DATA_INVALID;
-    }
-    uint16_t len_dq1 = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_dq1);
-    } else {
-        return status;
+    // The CRT, 7F48 and 5F48 may not extend past the end of 4D (91 - 97
+    // give the lengths of the components of 5F48)
+    if ((keyImport.element <= 2 || keyImport.element == 10) &&
+            keyImport.element > 0 &&
+            keyImport.len > keyImport.outerLen - keyImport.consumed) {
+        return SW_WRONG_LENGTH;
     }
 
-    if (buffer[offset++] != (uint8_t) 0x97) {
-        return SW_DATA_INVALID;
-    }
-    uint16_t len_modulus = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_modulus);
-    } else {
-        return status;
-    }
+    keyImport.element++;
+    return SW_NO_ERROR;
+}
 
-    if (buffer[offset_data++] != 0x5F || buffer[offset_data++] != 0x48) {
-        return SW_DATA_INVALID;
+/**
+ * Consume the next part of a component of 5F48. E, P and Q are collected
+ * in buffer and written to the key slot when complete, while PQ, DP1, DQ1
+ * and the modulus are skipped since they are derived from P and Q.
+ *
+ * @param data The received data
+ * @param len Length of the data
+ * @return Number of bytes consumed
+ */
+uint16_t importComponent(uint8_t* data, uint16_t len, uint16_t* status) {
+    mbedtls_mpi* target[3] = { &keyImport.key->E, &keyImport.key->P, &keyImport.key->Q };
+    uint8_t comp = keyImport.comp;
+    uint16_t n = len;
+
+    if (n > keyImport.compLeft) {
+        n = (uint16_t) keyImport.compLeft;
+    }
+    if (comp < 3) {
+        memcpy(buffer + (keyImport.compLen[comp] - keyImport.compLeft), data, n);
+    }
+    keyImport.compLeft -= n;
+    (*status) = SW_NO_ERROR;
+
+    while (keyImport.compLeft == 0 && keyImport.comp < IMPORT_COMPONENTS) {
+        comp = keyImport.comp;
+        if (comp < 3) {
+            keyImport.modified = 1;
+            invalidateCache(keyCacheEntry(keyImport.type));
+            if (mbedtls_mpi_read_binary(target[comp], buffer, keyImport.compLen[comp]) != 0) {
+                (*status) = SW_UNKNOWN;
+                return n;
+            }
+            if (comp == 2 && (((*status) = importDerive()) != SW_NO_ERROR)) {
+                return n;
+            }
+        }
+        keyImport.comp++;
+        if (keyImport.comp < IMPORT_COMPONENTS) {
+            keyImport.compLeft = keyImport.compLen[keyImport.comp];
+        }
     }
-    len = getLength(buffer, offset_data, &status);
-    offset_data += getLengthBytes(len);
-
-    mbedtls_mpi P1, Q1, H;
-    mbedtls_mpi_init(&P1);
-    mbedtls_mpi_init(&Q1);
-    mbedtls_mpi_init(&H);
+    return n;
+}
 
-    bufOffset = buffer + offset_data;
-    if((mbedtls_mpi_read_binary(&key->E, bufOffset, len_e) != 0)) {
-        status = SW_UNKNOWN;
-        goto cleanup;
-    }
-    offset_data += len_e;
+/**
+ * Feed a chunk of the extended header list to the import parser.
+ *
+ * @param data The chunk
+ * @param len Length of the chunk
+ */
+uint16_t importFeed(uint8_t* data, uint16_t len) {
+    uint16_t status = SW_NO_ERROR;
+    uint16_t n;
+
+    while (len > 0) {
+        // Everything after the header of 4D belongs to it
+        if (keyImport.element > 0) {
+            n = len;
+            if (keyImport.data) {
+                n = (keyImport.compLeft < n) ? (uint16_t) keyImport.compLeft : n;
+            } else if (keyImport.skip > 0) {
+                n = (keyImport.skip < n) ? (uint16_t) keyImport.skip : n;
+            } else {
+                n = 1;
+            }
+            if (n > keyImport.outerLen - keyImport.consumed) {
+                return SW_WRONG_LENGTH;
+            }
+            keyImport.consumed += n;
+        }
 
-    bufOffset = buffer + offset_data;
-    if((mbedtls_mpi_read_binary(&key->P, bufOffset, len_p) != 0)) {
-        status = SW_UNKNOWN;
-        goto cleanup;
+        if (keyImport.data) {       // 5F48 - Component data
+            if (keyImport.comp >= IMPORT_COMPONENTS) {
+                return SW_WRONG_LENGTH;  // More data than announced
+            }
+            n = importComponent(data, len, &status);
+            if (status != SW_NO_ERROR) {
+                return status;
+            }
+            data += n;
+            len -= n;
+        } else if (keyImport.skip > 0) {    // Contents of the CRT
+            n = (keyImport.skip > len) ? len : (uint16_t) keyImport.skip;
+            keyImport.skip -= n;
+            data += n;
+            len -= n;
+        } else if (keyImport.tagBytes > 0) {    // Tag
+            if (keyImport.tagBytes == 2) {
+                keyImport.tag = *data;
+                // A tag number of 1F indicates that a second tag byte follows
+                keyImport.tagBytes = ((*data & 0x1F) == 0x1F) ? 1 : 0;
+            } else {
+                keyImport.tag = (uint16_t) (keyImport.tag << 8) | *data;
+                keyImport.tagBytes = 0;
+            }
+            keyImport.lenBytes = 0xFF;
+            data++;
+            len--;
+        } else {                            // Length, up to 3 bytes
+            if (keyImport.lenBytes == 0xFF) {
+                if ((*data & 0x80) == 0x00) {
+                    keyImport.len = *data;
+                    keyImport.lenBytes = 0;
+                } else if ((*data & 0x7F) >= 1 && (*data & 0x7F) <= 3) {
+                    keyImport.len = 0;
+                    keyImport.lenBytes = *data & 0x7F;
+                } else {
+                    return SW_WRONG_DATA;
+                }
+            } else {
+                keyImport.len = (keyImport.len << 8) | *data;
+                keyImport.lenBytes--;
+            }
+            data++;
+            len--;
+
+            if (keyImport.lenBytes == 0) {  // Header complete
+                if ((status = importElement()) != SW_NO_ERROR) {
+                    return status;
+                }
+                keyImport.tagBytes = 2;
+            }
+        }
     }
-    offset_data += len_p;
+    return SW_NO_ERROR;
+}
 
-    bufOffset = buffer + offset_data;
-    if((mbedtls_mpi_read_binary(&key->Q, bufOffset, len_q) != 0)) {
-        status = SW_UNKNOWN;
-        goto cleanup;
-    }
+/**
+ * Validate the imported key and store it to the flash memory, once the
+ * last chunk has been received.
+ */
+uint16_t importFinish() {
+    FILE* fpriv = NULL;
+    uint8_t* isEmpty;
+    mbedtls_rsa_context* key = keyImport.key;
 
-    if (mbedtls_mpi_mul_mpi(&key->N, &key->P, &key->Q) != 0) {
-        status = SW_UNKNOWN;
-        goto cleanup;
-    }
-    if (mbedtls_mpi_sub_int(&P1, &key->P, 1) != 0) {
-        status = SW_UNKNOWN;
-        goto cleanup;
-    }
-    if (mbedtls_mpi_sub_int(&Q1, &key->Q, 1) != 0) {
-        status = SW_UNKNOWN;
-        goto cleanup;
-    }
-    if (mbedtls_mpi_mul_mpi(&H, &P1, &Q1) != 0) {
-        status = SW_UNKNOWN;
-        goto cleanup;
-    }
-    if (mbedtls_mpi_inv_mod(&key->D , &key->E, &H) != 0) {
-        status = SW_UNKNOWN;
-        goto cleanup;
-    }
-    if (mbedtls_mpi_mod_mpi(&key->DP, &key->D, &P1) != 0) {
-        status = SW_UNKNOWN;
-        goto cleanup;
-    }
-    if (mbedtls_mpi_mod_mpi(&key->DQ, &key->D, &Q1) != 0) {
-        status = SW_UNKNOWN;
-        goto cleanup;
-    }
-    if (mbedtls_mpi_inv_mod(&key->QP, &key->Q, &key->P) != 0) {
-        status = SW_UNKNOWN;
-        goto cleanup;
+    if (!keyImport.data || keyImport.comp < IMPORT_COMPONENTS ||
+            keyImport.consumed != keyImport.outerLen) {
+        return SW_WRONG_LENGTH;     // The data ended prematurely
     }
 
     // Check the key
     if (mbedtls_rsa_check_privkey(key) != 0) {
         ESP_LOGE("importKey", "Failed hard");
-        status = SW_UNKNOWN;
-        goto cleanup;
+        return SW_UNKNOWN;
     }
 
     // Store the key to the flash memory
-    if (type == (uint8_t) 0xB6) {
+    if (keyImport.type == (uint8_t) 0xB6) {
         isEmpty = &isSigEmpty;
-        if ((fpriv = fopen("/spiflash/sigKey.dat", "wb")) == NULL) {
-            status = SW_UNKNOWN;
-            goto cleanup;
-        }
-    } else if (type == (uint8_t) 0xB8) {
+        fpriv = fopen(STORAGE_PATH "/sigKey.dat", "wb");
+    } else if (keyImport.type == (uint8_t) 0xB8) {
         isEmpty = &isDecEmpty;
-        if ((fpriv = fopen("/spiflash/decKey.dat", "wb")) == NULL) {
-            status = SW_UNKNOWN;
-            goto cleanup;
-        }
-    } else if (type == (uint8_t) 0xA4) {
-        isEmpty = &isAuthEmpty;
-        if ((fpriv = fopen("/spiflash/authKey.dat", "wb")) == NULL) {
-            status = SW_UNKNOWN;
-            goto cleanup;
-        }
+        fpriv = fopen(STORAGE_PATH "/decKey.dat", "wb");
     } else {
-        status = SW_UNKNOWN;
-        goto cleanup;
+        isEmpty = &isAuthEmpty;
+        fpriv = fopen(STORAGE_PATH "/authKey.dat", "wb");
+    }
+    if (fpriv == NULL) {
+        return SW_UNKNOWN;
     }
 
     int ret;    // Write the key to a file in the flash memory
@@ -1942,23 +2186,49 @@ uint16_t importKey() {
         (ret = mbedtls_mpi_write_file("QP = ", &key->QP, 16, fpriv)) != 0) {
         ESP_LOGE("importKey", "\nError:\tmbedtls_mpi_write_file returned %d\n\n", ret);
         fclose(fpriv);
-        status = SW_UNKNOWN;
-        goto cleanup;
+        return SW_UNKNOWN;
     }
     fclose(fpriv);
 
-    key->len = (mbedtls_mpi_bitlen(&key->N) + 7) >> 3;
     (*isEmpty) = 0;
     if (updateKeyStatus() != 0) {
         return SW_UNKNOWN;
     }
+    return SW_NO_ERROR;
+}
+
+/**
+ * Provide functionality for importing keys.
+ *
+ * The extended header list is parsed incrementally as each chained
+ * command APDU arrives, instead of collecting it in buffer first, so
+ * its total length is not limited by BUFFER_MAX_LENGTH.
+ *
+ * @param apdu The current chunk
+ */
+uint16_t importKey(apdu_t apdu) {
+    uint16_t status;
+    uint8_t last = ((apdu.CLA & (uint8_t) 0x10) == 0);
+
+    if (!keyImport.active) {
+        if (pw3.validated == 0) {
+            return SW_SECURITY_STATUS_NOT_SATISFIED;
+        }
+        bzero(&keyImport, sizeof(keyImport));
+        keyImport.active = 1;
+        keyImport.tagBytes = 2;
+    }
 
-    status = SW_NO_ERROR;
+    status = importFeed(apdu.data, apdu.Lc);
+    if (status == SW_NO_ERROR && last) {
+        status = importFinish();
+    }
 
-cleanup:
-    mbedtls_mpi_free(&P1);
-    mbedtls_mpi_free(&Q1);
-    mbedtls_mpi_free(&H);
+    if (status != SW_NO_ERROR) {
+        importAbort();
+    } else if (last) {
+        bzero(&keyImport, sizeof(keyImport));
+    }
     return status;
 }
 
@@ -1974,6 +2244,7 @@ uint16_t setPinRetries(uint8_t pin_retries, uint8_t reset_retries, uint8_t admin
             return SW_UNKNOWN;
         }
         pw1_status = 0x00;
+        invalidateCache(CACHE_ARD);
         ERRORCHK(storeVar("pw1_status", pw1_status, 0, 8), return SW_UNKNOWN);
     }
     if (reset_retries != 0) {
@@ -1995,16 +2266,216 @@ uint16_t setPinRetries(uint8_t pin_retries, uint8_t reset_retries, uint8_t admin
     return SW_NO_ERROR;
 }
 
+#define BENCH_RSA_SIG 0         // RSA private operation, signature key
+#define BENCH_RSA_DEC 1         // RSA private operation, decryption key
+#define BENCH_RSA_AUTH 2        // RSA private operation, authentication key
+#define BENCH_DRBG 3            // CTR_DRBG, 1 KB of output
+#define BENCH_SHA256 4          // SHA-256 of 1 KB
+#define BENCH_AES 5             // AES-256-CBC encryption of 1 KB
+#define BENCH_STOREVAR 6        // storeVar of an 8-bit variable (BENCH_FLASH only)
+#define BENCH_STOREBUF 7        // storeBuf of 256 bytes (BENCH_FLASH only)
+#define BENCH_TLV 8             // Serialization of 6E and of a public key template
+#define BENCH_PRIMITIVES 9
+
+//#define BENCH_FLASH               // If defined, f5 also times the flash writes, to the NVS key benchVar and to bench.dat
+#ifdef BENCH_FLASH
+#define BENCH_DISABLED 0
+#else
+#define BENCH_DISABLED ((1 << BENCH_STOREVAR) | (1 << BENCH_STOREBUF))  // Primitives left out of the firmware
+#endif
+#define BENCH_ITERATIONS 8          // Default number of iterations per primitive
+#define BENCH_MAX_ITERATIONS 64
+#define BENCH_DATA_LENGTH 1024      // Data processed per iteration by the throughput primitives
+
+/**
+ * Run one iteration of a benchmarked primitive. buffer is used as
+ * scratch space.
+ *
+ * @return 0 on success
+ */
+int benchRun(uint8_t prim, mbedtls_ctr_drbg_context* ctr_drbg, mbedtls_aes_context* aes) {
+    uint8_t iv[16] = { 0 };
+    mbedtls_rsa_context* key;
+    uint8_t err;
+
+    switch (prim) {
+    case BENCH_RSA_SIG:
+    case BENCH_RSA_DEC:
+    case BENCH_RSA_AUTH:
+        key = getKey((prim == BENCH_RSA_SIG) ? 0xB6 : ((prim == BENCH_RSA_DEC) ? 0xB8 : 0xA4), &err);
+        if (err != 0) {
+            return 1;
+        }
+        buffer[0] = 0x00;   // Keep the input smaller than the modulus
+        return mbedtls_rsa_private(key, mbedtls_ctr_drbg_random, ctr_drbg, buffer, buffer + KEY_SIZE_BYTES);
+    case BENCH_DRBG:
+        return mbedtls_ctr_drbg_random(ctr_drbg, buffer, BENCH_DATA_LENGTH);
+    case BENCH_SHA256:
+        mbedtls_sha256(buffer, BENCH_DATA_LENGTH, buffer + BENCH_DATA_LENGTH, 0);
+        return 0;
+    case BENCH_AES:
+        return mbedtls_aes_crypt_cbc(aes, MBEDTLS_AES_ENCRYPT, BENCH_DATA_LENGTH, iv, buffer, buffer);
+#ifdef BENCH_FLASH
+    case BENCH_STOREVAR:
+        return (storeVar("benchVar", buffer[0], 0, 8) != SW_NO_ERROR);
+    case BENCH_STOREBUF:
+        return (storeBuf(STORAGE_PATH "/bench.dat", buffer, 256) != SW_NO_ERROR);
+#endif
+    case BENCH_TLV:
+        buildARD(buffer);
+        buildPublicKey(&sigKey, buffer + ARD_MAX_LENGTH);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Provide the SELF BENCHMARK command (vendor specific f5)
+ *
+ * Time the primitives selected in mask (bit n selects BENCH_n) on the
+ * device itself, so the results are free of network effects. For each
+ * primitive that was run, the output holds its id (1), the number of
+ * iterations (1), and the minimum, median and 99th percentile in us
+ * (4 each, big endian). RSA primitives of empty key slots are skipped,
+ * and so are the flash writes unless the firmware is built with
+ * BENCH_FLASH.
+ *
+ * Before using this method PW3 has to be verified.
+ *
+ * @param mask Primitives to run (0 for all of them)
+ * @param iterations Iterations per primitive (0 for the default)
+ * @param ret Length of data written in buffer
+ */
+uint16_t selfBenchmark(uint16_t mask, uint8_t iterations, uint16_t* ret) {
+    uint32_t samples[BENCH_MAX_ITERATIONS];
+    uint8_t results[BENCH_PRIMITIVES * 14];
+    uint16_t offset = 0;
+    uint16_t status = SW_NO_ERROR;
+    const char* pers = "selfBenchmark";
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_entropy_context entropy;
+    mbedtls_aes_context aes;
+
+    if (pw3.validated == 0) {
+        return SW_SECURITY_STATUS_NOT_SATISFIED;
+    }
+    if (mask == 0) {
+        mask = (1 << BENCH_PRIMITIVES) - 1;
+    }
+    mask &= ~BENCH_DISABLED;
+    if (iterations == 0) {
+        iterations = BENCH_ITERATIONS;
+    } else if (iterations > BENCH_MAX_ITERATIONS) {
+        return SW_WRONG_DATA;
+    }
+
+    mbedtls_ctr_drbg_init(&ctr_drbg);
+    mbedtls_entropy_init(&entropy);
+    mbedtls_aes_init(&aes);
+    if (mbedtls_ctr_drbg_seed(&ctr_drbg, platformEntropy, &entropy,
+                        (const unsigned char *) pers, strlen(pers)) != 0 ||
+        mbedtls_ctr_drbg_random(&ctr_drbg, buffer, BENCH_DATA_LENGTH) != 0 ||
+        mbedtls_aes_setkey_enc(&aes, buffer, 256) != 0) {
+        status = SW_UNKNOWN;
+        goto exitSB;
+    }
+
+    for (uint8_t prim = 0; prim < BENCH_PRIMITIVES; prim++) {
+        if ((mask & (1 << prim)) == 0 ||
+            (prim == BENCH_RSA_SIG && isSigEmpty) ||
+            (prim == BENCH_RSA_DEC && isDecEmpty) ||
+            (prim == BENCH_RSA_AUTH && isAuthEmpty)) {
+            continue;
+        }
+
+        for (uint8_t i = 0; i < iterations; i++) {
+            int64_t start = platformMicros();
+            if (benchRun(prim, &ctr_drbg, &aes) != 0) {
+                status = SW_UNKNOWN;
+                goto exitSB;
+            }
+            uint32_t sample = (uint32_t) (platformMicros() - start);
+
+            // Insertion sort, the number of samples is small
+            uint8_t j = i;
+            for (; j > 0 && samples[j-1] > sample; j--) {
+                samples[j] = samples[j-1];
+            }
+            samples[j] = sample;
+            platformYield();  // Let the idle task run, long runs would trigger the watchdog
+        }
+
+        uint32_t stats[3] = { samples[0], samples[(iterations - 1) / 2],
+                              samples[(iterations * 99 + 99) / 100 - 1] };
+        results[offset++] = prim;
+        results[offset++] = iterations;
+        for (int s = 0; s < 3; s++) {
+            results[offset++] = (uint8_t) (stats[s] >> 24);
+            results[offset++] = (uint8_t) (stats[s] >> 16);
+            results[offset++] = (uint8_t) (stats[s] >> 8);
+            results[offset++] = (uint8_t) stats[s];
+        }
+    }
+    memcpy(buffer, results, offset);
+    (*ret) = offset;
+
+exitSB:
+#ifdef BENCH_FLASH
+    remove(STORAGE_PATH "/bench.dat");
+#endif
+    mbedtls_aes_free(&aes);
+    mbedtls_ctr_drbg_free(&ctr_drbg);
+    mbedtls_entropy_free(&entropy);
+    return status;
+}
+
+/**
+ * Copy a chunk of the response data from the current source.
+ *
+ * @param offset Offset of the chunk in the response data
+ * @param out Where the chunk is copied
+ * @param len Length of the chunk
+ * @return Number of bytes copied
+ */
+uint16_t readSource(uint16_t offset, uint8_t* out, uint16_t len) {
+    uint16_t n = 0;
+    FILE* fp = NULL;
+
+    switch (out_source.type) {
+    case SOURCE_MEMORY:
+        memcpy(out, out_source.data + offset, len);
+        n = len;
+        break;
+
+    case SOURCE_FILE: {
+        uint8_t phase = telemetryPhase(PHASE_FLASH);
+        if ((fp = fopen(out_source.path, "rb")) != NULL) {
+            if (fseek(fp, offset, SEEK_SET) == 0) {
+                n = fread(out, sizeof(uint8_t), len, fp);
+            }
+            fclose(fp);
+        }
+        telemetryPhase(phase);
+        break;
+    }
+
+    case SOURCE_COMPUTED:
+        if (out_source.read(offset, out, len) >= offset + len) {
+            n = len;
+        }
+        break;
+    }
+    return n;
+}
+
 /**
- * Send next block of data in buffer. Used for sending data in <buffer>
+ * Send next block of data from the current source (see respSource).
  *
  * @param apdu
  * @param status Status to send
  * @param output The struct that will hold the output
  */
 uint16_t sendNext(apdu_t apdu, uint16_t status, outData* output) {
-    uint8_t* bufOffset;
-
     // Determine maximum size of the messages
     uint16_t max_length;
     max_length = RESPONSE_MAX_LENGTH;
@@ -2013,10 +2484,15 @@ uint16_t sendNext(apdu_t apdu, uint16_t status, outData* output) {
         max_length = out_left;
     }
 
-    bufOffset = buffer + out_sent;
-    memcpy(output->data, bufOffset, max_length);
-
     uint16_t statusNew = status;
+    if (readSource(out_sent, output->data, max_length) != max_length) {
+        // The source could not provide the data, e.g. the file is gone
+        out_sent = 0;
+        out_left = 0;
+        max_length = 0;
+        statusNew = SW_UNKNOWN;
+    }
+
     if (out_left > max_length) {
         output->length = max_length;
 
@@ -2045,8 +2521,8 @@ uint16_t sendNext(apdu_t apdu, uint16_t status, outData* output) {
 }
 
 /**
- * Send len bytes from buffer. If len is greater than RESPONSE_MAX_LENGTH,
- * remaining data can be retrieved using GET RESPONSE.
+ * Send len bytes from the current source. If len is greater than
+ * RESPONSE_MAX_LENGTH, remaining data can be retrieved using GET RESPONSE.
  *
  * @param apdu
  * @param len The byte length of the data to send
@@ -2071,9 +2547,104 @@ void sendError(apdu_t apdu, uint16_t status, outData* output) {
     sendNext(apdu, status, output);
 }
 
+void process(apdu_t apdu, outData* output);
+
+// Commands a batch may not hold: those needing the proceed button, those
+// running for seconds, those with responses that may not fit and those
+// that would end the batch state (reset, GET RESPONSE, another batch)
+uint8_t batchRefused(uint8_t ins, uint8_t p1) {
+    switch (ins) {
+    case 0x00: case 0x2A: case 0x55: case 0x88: case 0xC0:
+    case 0xF3: case 0xF4: case 0xF5: case 0xF6: case (uint8_t) 0xF9:
+        return 1;
+    case 0x47:
+        return (p1 == (uint8_t) 0x80);     // Key generation
+    }
+    return 0;
+}
+
+/**
+ * Run the command APDUs of a batch (buffer) in order, stopping after the
+ * first one that does not end in 9000. Each command and each response is
+ * preceded by its length (2 bytes, big endian); a response holds all of
+ * its data, GET RESPONSE is done here. The commands are checked before any
+ * of them is run. When the responses left no room for the next one, the
+ * batch ends early and the host sends the remaining commands again; a read
+ * whose response did not fit is not counted as run.
+ *
+ * @param ret Length of the responses written in batchOut
+ */
+uint16_t batch(uint16_t* ret) {
+    outData response;
+    apdu_t inner;
+    uint16_t in = 0, out = 0, start, n, sw;
+    uint16_t total = in_received;
+
+    if (total == 0) {
+        return SW_WRONG_LENGTH;
+    }
+    while (in < total) {
+        if (total - in < 2) {
+            return SW_WRONG_DATA;
+        }
+        n = (uint16_t) buffer[in] << 8 | buffer[in+1];
+        if (n < 4 || n > BATCH_APDU_MAX_LENGTH || n > total - in - 2) {
+            return SW_WRONG_DATA;
+        }
+        if ((buffer[in+2] & 0x10) || batchRefused(buffer[in+3], buffer[in+4])) {
+            return SW_CONDITIONS_NOT_SATISFIED;
+        }
+        in += 2 + n;
+    }
+
+    memcpy(batchIn, buffer, total);     // The commands overwrite buffer
+    in = 0;
+    while (in < total && out + 2 + RESPONSE_MAX_LENGTH + 2 <= sizeof(batchOut)) {
+        n = (uint16_t) batchIn[in] << 8 | batchIn[in+1];
+        inner = parseAPDU((char*) batchIn + in + 2, n);
+        response.length = 0;
+        process(inner, &response);
+        if (response.length < 2) {
+            response.data[0] = (uint8_t) (SW_UNKNOWN >> 8);
+            response.data[1] = (uint8_t) SW_UNKNOWN;
+            response.length = 2;
+        }
+
+        start = out;
+        out += 2;
+        memcpy(batchOut + out, response.data, response.length);
+        out += response.length;
+        sw = (uint16_t) response.data[response.length-2] << 8 | response.data[response.length-1];
+        while ((sw & 0xFF00) == SW_BYTES_REMAINING_00) {
+            out -= 2;
+            n = (out_left > RESPONSE_MAX_LENGTH) ? RESPONSE_MAX_LENGTH : out_left;
+            if (out + n + 2 > sizeof(batchOut)) {
+                out = start;    // Read again in the next batch
+                goto done;
+            }
+            sw = sendNext(inner, SW_NO_ERROR, &response);
+            memcpy(batchOut + out, response.data, response.length);
+            out += response.length;
+        }
+        batchOut[start] = (uint8_t) ((out - start - 2) >> 8);
+        batchOut[start+1] = (uint8_t) (out - start - 2);
+        in += 2 + ((uint16_t) batchIn[in] << 8 | batchIn[in+1]);
+        if (sw != SW_NO_ERROR) {
+            break;
+        }
+    }
+done:
+    out_sent = 0;
+    out_left = 0;
+    sourceMemory(batchOut);
+    *ret = out;
+    return SW_NO_ERROR;
+}
+
 uint8_t initialize() {
     static const char* TAG = "initialize";
     bzero(buffer, sizeof(buffer));
+    invalidateCache(CACHE_ALL);
     pw1_modes[PW1_MODE_NO81] = 0;
     ERRORCHK(storeVar("PW1_MODE_NO81", pw1_modes[PW1_MODE_NO81], 0, 8), return 1);
     pw1_modes[PW1_MODE_NO82] = 0;
@@ -2108,11 +2679,11 @@ uint8_t initialize() {
     sigAttributes[2] = (uint8_t) (KEY_SIZE & 0x00FF);
     sigAttributes[3] = (uint8_t) (EXPONENT_SIZE >> 8);
     sigAttributes[4] = (uint8_t) (EXPONENT_SIZE & 0x00FF);
-    ERRORCHK(storeBuf("/spiflash/sigAttr.dat", sigAttributes, sizeof(sigAttributes)), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/sigAttr.dat", sigAttributes, sizeof(sigAttributes)), return 1);
     bzero(sigFP, sizeof(sigFP));
-    ERRORCHK(storeBuf("/spiflash/sigFP.dat", sigFP, sizeof(sigFP)), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/sigFP.dat", sigFP, sizeof(sigFP)), return 1);
     bzero(sigTime, sizeof(sigTime));
-    ERRORCHK(storeBuf("/spiflash/sigTime.dat", sigTime, sizeof(sigTime)), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/sigTime.dat", sigTime, sizeof(sigTime)), return 1);
 
     mbedtls_rsa_init(&decKey, MBEDTLS_RSA_PKCS_V15, 0);
     isDecEmpty = 1;
@@ -2120,11 +2691,11 @@ uint8_t initialize() {
     decAttributes[2] = (uint8_t) (KEY_SIZE & 0x00FF);
     decAttributes[3] = (uint8_t) (EXPONENT_SIZE >> 8);
     decAttributes[4] = (uint8_t) (EXPONENT_SIZE & 0x00FF);
-    ERRORCHK(storeBuf("/spiflash/decAttr.dat", decAttributes, sizeof(decAttributes)), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/decAttr.dat", decAttributes, sizeof(decAttributes)), return 1);
     bzero(decFP, sizeof(decFP));
-    ERRORCHK(storeBuf("/spiflash/decFP.dat", decFP, sizeof(decFP)), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/decFP.dat", decFP, sizeof(decFP)), return 1);
     bzero(decTime, sizeof(decTime));
-    ERRORCHK(storeBuf("/spiflash/decTime.dat", decTime, sizeof(decTime)), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/decTime.dat", decTime, sizeof(decTime)), return 1);
 
     mbedtls_rsa_init(&authKey, MBEDTLS_RSA_PKCS_V15, 0);
     isAuthEmpty = 1;
@@ -2132,11 +2703,11 @@ uint8_t initialize() {
     authAttributes[2] = (uint8_t) (KEY_SIZE & 0x00FF);
     authAttributes[3] = (uint8_t) (EXPONENT_SIZE >> 8);
     authAttributes[4] = (uint8_t) (EXPONENT_SIZE & 0x00FF);
-    ERRORCHK(storeBuf("/spiflash/autAttr.dat", authAttributes, sizeof(authAttributes)), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/autAttr.dat", authAttributes, sizeof(authAttributes)), return 1);
     bzero(authFP, sizeof(authFP));
-    ERRORCHK(storeBuf("/spiflash/authFP.dat", authFP, sizeof(authFP)), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/authFP.dat", authFP, sizeof(authFP)), return 1);
     bzero(authTime, sizeof(authTime));
-    ERRORCHK(storeBuf("/spiflash/authTime.dat", authTime, sizeof(authTime)), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/authTime.dat", authTime, sizeof(authTime)), return 1);
 
     if (updateKeyStatus() != 0) {
         return 1;
@@ -2145,27 +2716,26 @@ uint8_t initialize() {
     loginData_length = 0;
     ERRORCHK(storeVar("loginData_len", 0, loginData_length, 16), return 1);
     bzero(loginData, LOGINDATA_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/logData.dat", loginData, loginData_length), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/logData.dat", loginData, loginData_length), return 1);
 
     url_length = 0;
     ERRORCHK(storeVar("url_length", 0, url_length, 16), return 1);
     bzero(url, URL_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/url.dat", url, url_length), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/url.dat", url, url_length), return 1);
 
     name_length = 0;
     ERRORCHK(storeVar("name_length", 0, name_length, 16), return 1);
     bzero(name, NAME_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/name.dat", name, name_length), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/name.dat", name, name_length), return 1);
 
     lang_length = 0;
     ERRORCHK(storeVar("lang_length", 0, lang_length, 16), return 1);
     bzero(lang, LANG_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/lang.dat", lang, lang_length), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/lang.dat", lang, lang_length), return 1);
 
     cert_length = 0;
     ERRORCHK(storeVar("cert_length", 0, cert_length, 16), return 1);
-    bzero(cert, CERT_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/cert.dat", cert, cert_length), return 1);
+    ERRORCHK(storeBuf(CERT_PATH, buffer, cert_length), return 1);
 
     sex = 0x39;
     ERRORCHK(storeVar("sex", sex, 0, 8), return 1);
@@ -2173,22 +2743,22 @@ uint8_t initialize() {
     private_use_do_1_length = 0;
     ERRORCHK(storeVar("privdo1_len", 0, private_use_do_1_length, 16), return 1);
     bzero(private_use_do_1, PRIVATE_DO_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/privdo1.dat", private_use_do_1, private_use_do_1_length), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/privdo1.dat", private_use_do_1, private_use_do_1_length), return 1);
 
     private_use_do_2_length = 0;
     ERRORCHK(storeVar("privdo2_len", 0, private_use_do_2_length, 16), return 1);
     bzero(private_use_do_2, PRIVATE_DO_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/privdo2.dat", private_use_do_2, private_use_do_2_length), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/privdo2.dat", private_use_do_2, private_use_do_2_length), return 1);
 
     private_use_do_3_length = 0;
     ERRORCHK(storeVar("privdo3_len", 0, private_use_do_3_length, 16), return 1);
     bzero(private_use_do_3, PRIVATE_DO_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/privdo3.dat", private_use_do_3, private_use_do_3_length), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/privdo3.dat", private_use_do_3, private_use_do_3_length), return 1);
 
     private_use_do_4_length = 0;
     ERRORCHK(storeVar("privdo4_len", 0, private_use_do_4_length, 16), return 1);
     bzero(private_use_do_4, PRIVATE_DO_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/privdo4.dat", private_use_do_4, private_use_do_4_length), return 1);
+    ERRORCHK(storeBuf(STORAGE_PATH "/privdo4.dat", private_use_do_4, private_use_do_4_length), return 1);
 
     terminated = 0;
     ERRORCHK(storeVar("terminated", terminated, 0, 8), return 1);
@@ -2199,6 +2769,11 @@ uint8_t initialize() {
     return 0;
 }
 
+// Check whether the current response is the telemetry, which is not recorded
+uint8_t sendingTelemetry() {
+    return (out_source.type == SOURCE_COMPUTED && out_source.read == telemetryRead);
+}
+
 void invalidate() {     // Invalidate the PINs
     pw1.validated = 0;
     rc.validated = 0;
@@ -2225,6 +2800,48 @@ void process(apdu_t apdu, outData* output) {
         return;
     }
 
+    // GET DEVICE ID (vendor specific)
+    // Returns the MAC address of the WiFi station (6 bytes), which the bridge
+    // uses to tell the devices apart. Answered here, so that it can be sent at
+    // any time without disturbing chaining, GET RESPONSE or a key import
+    if (apdu.INS == (uint8_t) 0xF8) {
+        if (platformDeviceId(output->data) == 0) {
+            output->data[6] = (uint8_t) (SW_NO_ERROR >> 8);
+            output->data[7] = (uint8_t) SW_NO_ERROR;
+            output->length = 8;
+        } else {
+            output->data[0] = (uint8_t) (SW_UNKNOWN >> 8);
+            output->data[1] = (uint8_t) SW_UNKNOWN;
+            output->length = 2;
+        }
+        return;
+    }
+
+    if (keyImport.active && apdu.INS != (uint8_t) 0xDB) {
+        importAbort();      // A key import was interrupted by another command
+    }
+
+    // DB - PUT DATA (Odd)
+    // The key import parses each chunk as it arrives, so it bypasses buffer
+    if (apdu.INS == (uint8_t) 0xDB) {
+        out_sent = 0;
+        out_left = 0;
+        sourceMemory(buffer);
+        if (chain == 1) {
+            resetChaining();
+            status = SW_CONDITIONS_NOT_SATISFIED;
+        } else if (terminated == 1) {
+            status = SW_CONDITIONS_NOT_SATISFIED;
+        } else if (apdu.P1P2 == (uint16_t) 0x3FFF) {
+            // Odd PUT DATA only supported for importing keys
+            // 4D - Extended Header list
+            status = importKey(apdu);
+        } else {
+            status = SW_RECORD_NOT_FOUND;
+        }
+        goto exit;
+    }
+
     // Support for command chaining
     if ((status = commandChaining(apdu)) != 0){
         goto exit;
@@ -2234,6 +2851,7 @@ void process(apdu_t apdu, outData* output) {
     if (apdu.INS != (uint8_t) 0xC0) {
         out_sent = 0;
         out_left = 0;
+        sourceMemory(buffer);
     }
 
     if (terminated == 1 && apdu.INS != 0x44) {
@@ -2309,17 +2927,6 @@ void process(apdu_t apdu, outData* output) {
             status = putData(apdu.P1P2);
             break;
 
-        // DB - PUT DATA (Odd)
-        case (uint8_t) 0xDB:
-            // Odd PUT DATA only supported for importing keys
-            // 4D - Extended Header list
-            if (apdu.P1P2 == (uint16_t) 0x3FFF) {
-                status = importKey();
-            } else {
-                status = SW_RECORD_NOT_FOUND;
-            }
-            break;
-
         // E6 - TERMINATE DF
         case (uint8_t) 0xE6:
             if ((pw1.remaining == 0) && (pw3.remaining == 0)) {
@@ -2357,6 +2964,101 @@ void process(apdu_t apdu, outData* output) {
             }
             break;
 
+        // GET TELEMETRY (vendor specific)
+        // P1P2 0000 reads the telemetry, 0001 clears it (requires PW3)
+        case (uint8_t) 0xF3:
+            if (apdu.P1P2 == (uint16_t) 0x0000) {
+                telemetry.freeHeap = platformFreeHeap();  // Same value in every chunk
+                len = telemetryRead(0, NULL, 0);
+                sourceComputed(telemetryRead);
+                status = SW_NO_ERROR;
+            } else if (apdu.P1P2 == (uint16_t) 0x0001) {
+                if (pw3.validated == 0) {
+                    status = SW_SECURITY_STATUS_NOT_SATISFIED;
+                } else {
+                    telemetryReset();
+                    status = SW_NO_ERROR;
+                }
+            } else {
+                status = SW_INCORRECT_P1P2;
+            }
+            break;
+
+        // GET APDU LOG (vendor specific, requires PW3)
+        // Returns the logged APDUs from the sequence number in the data (4 bytes)
+        // or, without data, all of the logged APDUs
+        case (uint8_t) 0xF4:
+            if (pw3.validated == 0) {
+                status = SW_SECURITY_STATUS_NOT_SATISFIED;  // The log shows when the keys were used
+                break;
+            }
+            if (in_received == 4) {
+                len = apduLogSelect((uint32_t) buffer[0] << 24 | (uint32_t) buffer[1] << 16 |
+                                    (uint32_t) buffer[2] << 8 | buffer[3]);
+            } else if (in_received == 0) {
+                len = apduLogSelect(0);
+            } else {
+                status = SW_WRONG_LENGTH;
+                break;
+            }
+            sourceComputed(apduLogRead);
+            status = SW_NO_ERROR;
+            break;
+
+        // SELF BENCHMARK (vendor specific)
+        // P1P2 selects the primitives, the optional data byte the iterations
+        case (uint8_t) 0xF5:
+            if (in_received > 1) {
+                status = SW_WRONG_LENGTH;
+            } else {
+                status = selfBenchmark(apdu.P1P2, (in_received == 1) ? buffer[0] : 0, &len);
+            }
+            break;
+
+        // PROFILER (vendor specific)
+        // P1 00 reads the samples, 01 starts sampling (P2 00 always, 01 only
+        // during APDUs), 02 stops, 03 prints the samples; all require PW3
+        case (uint8_t) 0xF6:
+            status = SW_NO_ERROR;
+            if (apdu.P1 > (uint8_t) 0x03 || (apdu.P1 == (uint8_t) 0x01 && apdu.P2 > PROFILE_APDU)) {
+                status = SW_INCORRECT_P1P2;
+            } else if (pw3.validated == 0) {
+                status = SW_SECURITY_STATUS_NOT_SATISFIED;
+            } else if (apdu.P1 == (uint8_t) 0x00) {
+                len = profileSelect();
+                sourceComputed(profileRead);
+            } else if (apdu.P1 == (uint8_t) 0x01) {
+                profileStart(apdu.P2);
+            } else if (apdu.P1 == (uint8_t) 0x02) {
+                profileStop();
+            } else if (apdu.P1 == (uint8_t) 0x03) {
+                profileStop();
+                profilePrint();
+            }
+            break;
+
+        // GET CLOCK (vendor specific)
+        // Returns the time since boot in us (8 bytes) and the sequence number
+        // this exchange gets in the APDU log (4 bytes), for clock correlation
+        case (uint8_t) 0xF7: {
+            int64_t now = platformMicros();
+            for (int i = 0; i < 8; i++) {
+                buffer[i] = (uint8_t) (now >> (56 - 8*i));
+            }
+            for (int i = 0; i < 4; i++) {
+                buffer[8+i] = (uint8_t) (apduLogHead >> (24 - 8*i));
+            }
+            len = 12;
+            status = SW_NO_ERROR;
+            break;
+        }
+
+        // BATCH (vendor specific)
+        // Runs the command APDUs in the data, see batch()
+        case (uint8_t) 0xF9:
+            status = batch(&len);
+            break;
+
         default :
             ESP_LOGE(TAG, "Failed to process APDU");
     }
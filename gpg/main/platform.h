@@ -0,0 +1,143 @@
+/*
+ * Platform interface of the OpenPGP card engine.
+ *
+ * libAPDU.h, telemetry.h and apduLog.h reach the device only through
+ * the functions declared here. They are implemented below with ESP-IDF;
+ * the host port (gpg/host) defines PLATFORM_HOST and implements them in
+ * hostPort.c instead.
+ *
+ * Handles:
+ *    Storage of the state variables (NVS)
+ *    Entropy, which seeds every CTR_DRBG of the engine
+ *    Clock and yielding to the other tasks
+ *    Free heap and device identity
+ *
+ * The files of the state (keys, certificates, PINs) are accessed with
+ * stdio below STORAGE_PATH, and messages are logged with the ESP_LOGx
+ * macros, which every platform provides.
+ */
+#ifndef __PLATFORM_H__
+#define __PLATFORM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Stores a variable in the non-volatile storage and commits it.
+ * @param key Name of the variable
+ * @param value Points to its value, a uint8_t or a uint16_t
+ * @param bits Width of the value, 8 or 16
+ * @return 0 on success, else the error of the platform
+ */
+int platformVarWrite(const char* key, const void* value, uint8_t bits);
+
+/**
+ * Reads a variable from the non-volatile storage.
+ * @param key Name of the variable
+ * @param value Where the value is written, a uint8_t or a uint16_t
+ * @param bits Width of the value, 8 or 16
+ * @return 0 on success, else the error of the platform
+ */
+int platformVarRead(const char* key, void* value, uint8_t bits);
+
+/**
+ * Entropy source in the form of mbedtls_entropy_func, passed to
+ * mbedtls_ctr_drbg_seed.
+ * @param data A mbedtls_entropy_context
+ * @param output Where the entropy is written
+ * @param len Bytes to write
+ * @return 0 on success
+ */
+int platformEntropy(void* data, unsigned char* output, size_t len);
+
+// Time since boot in us
+int64_t platformMicros(void);
+
+// Lets the other tasks run (and the watchdog be fed) during long loops
+void platformYield(void);
+
+// Free heap now and the lowest it has been since boot, in bytes
+uint32_t platformFreeHeap(void);
+uint32_t platformMinimumFreeHeap(void);
+
+/**
+ * Reads the identity of the device, the MAC address of the WiFi station.
+ * @param id Where the 6 bytes are written
+ * @return 0 on success
+ */
+int platformDeviceId(uint8_t* id);
+
+#ifndef PLATFORM_HOST
+
+#include "mbedtls/entropy.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+#include "nvs.h"
+
+int platformVarWrite(const char* key, const void* value, uint8_t bits) {
+    nvs_handle nvsHandle;
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &nvsHandle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (bits == 8) {
+        err = nvs_set_u8(nvsHandle, key, *(const uint8_t*) value);
+    } else if (bits == 16) {
+        err = nvs_set_u16(nvsHandle, key, *(const uint16_t*) value);
+    } else {
+        err = ESP_ERR_INVALID_ARG;
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvsHandle);
+    }
+    nvs_close(nvsHandle);
+    return err;
+}
+
+int platformVarRead(const char* key, void* value, uint8_t bits) {
+    nvs_handle nvsHandle;
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &nvsHandle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (bits == 8) {
+        err = nvs_get_u8(nvsHandle, key, (uint8_t*) value);
+    } else if (bits == 16) {
+        err = nvs_get_u16(nvsHandle, key, (uint16_t*) value);
+    } else {
+        err = ESP_ERR_INVALID_ARG;
+    }
+    nvs_close(nvsHandle);
+    return err;
+}
+
+int platformEntropy(void* data, unsigned char* output, size_t len) {
+    return mbedtls_entropy_func(data, output, len);     // Fed by the hardware RNG
+}
+
+int64_t platformMicros(void) {
+    return esp_timer_get_time();
+}
+
+void platformYield(void) {
+    vTaskDelay(1);
+}
+
+uint32_t platformFreeHeap(void) {
+    return esp_get_free_heap_size();
+}
+
+uint32_t platformMinimumFreeHeap(void) {
+    return esp_get_minimum_free_heap_size();
+}
+
+int platformDeviceId(uint8_t* id) {
+    return esp_read_mac(id, ESP_MAC_WIFI_STA);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * Sampling CPU profiler for the ESP32.
+ *
+ * While a profiling window is open, the FreeRTOS tick hook of each
+ * core records the program counter and the return address of the
+ * task that the tick interrupted, which are found in the exception
+ * frame saved at the top of the task's stack. The samples are kept
+ * in RAM, and they are read with the vendor specific command f6 or
+ * printed to the console. testing/profileFold.py symbolizes them
+ * against the firmware ELF and outputs folded stacks.
+ *
+ * Handles:
+ *    Starting and stopping the sampling (both cores)
+ *    Serialization of the samples (vendor specific command f6)
+ *    Printing the samples to the console
+ */
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/xtensa_context.h"
+#include "esp_freertos_hooks.h"
+
+#include "telemetry.h"
+
+#define PROFILE_SAMPLES 1024        // Samples kept, for both cores together
+#define PROFILE_TASKS 16            // Tasks that are told apart
+#define PROFILE_TASK_NAME 16        // configMAX_TASK_NAME_LEN
+
+#define PROFILE_ALWAYS 0            // Sample everything while the window is open
+#define PROFILE_APDU 1              // Sample only while an APDU is being processed
+
+typedef struct profileSample {
+    uint32_t pc;                // Interrupted program counter
+    uint32_t ret;               // Return address of the interrupted function (a0)
+    uint8_t core;               // Core that was sampled
+    uint8_t task;               // Index of the task in profileTaskHandles
+} profileSample;
+
+profileSample profileSamples[PROFILE_SAMPLES];
+uint16_t profileCount = 0;      // Samples taken
+uint32_t profileDropped = 0;    // Samples lost because profileSamples was full
+TaskHandle_t profileTaskHandles[PROFILE_TASKS];
+char profileTaskNames[PROFILE_TASKS][PROFILE_TASK_NAME];
+uint8_t profileTaskCount = 0;
+uint8_t profiling = 0;          // Set while the profiling window is open
+uint8_t profileMode = PROFILE_ALWAYS;
+volatile uint8_t profileBusy = 0;   // Set by the connection task around process()
+portMUX_TYPE profileMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Tick hook, called on each core from the tick interrupt
+void IRAM_ATTR profileTick() {
+    uint8_t core = xPortGetCoreID();
+    TaskHandle_t task = xTaskGetCurrentTaskHandleForCPU(core);
+    uint8_t t;
+
+    if (!profiling || task == NULL || (profileMode == PROFILE_APDU && !profileBusy)) {
+        return;
+    }
+    // The first member of the TCB is pxTopOfStack, which points to the
+    // frame saved when the task was interrupted
+    XtExcFrame* frame = *(XtExcFrame**) task;
+
+    portENTER_CRITICAL_ISR(&profileMux);
+    if (profileCount >= PROFILE_SAMPLES) {
+        profileDropped++;
+    } else {
+        for (t = 0; t < profileTaskCount && profileTaskHandles[t] != task; t++);
+        if (t == profileTaskCount && t < PROFILE_TASKS) {
+            profileTaskHandles[t] = task;
+            strncpy(profileTaskNames[t], pcTaskGetTaskName(task), PROFILE_TASK_NAME - 1);
+            profileTaskCount++;
+        }
+        profileSample* s = &profileSamples[profileCount++];
+        s->pc = (uint32_t) frame->pc;
+        s->ret = (uint32_t) frame->a0;
+        s->core = core;
+        s->task = t;    // PROFILE_TASKS if there are too many tasks
+    }
+    portEXIT_CRITICAL_ISR(&profileMux);
+}
+
+/**
+ * Discard the previous samples and open the profiling window.
+ *
+ * @param mode PROFILE_ALWAYS or PROFILE_APDU
+ */
+void profileStart(uint8_t mode) {
+    if (profiling) {
+        return;
+    }
+    profileMode = mode;
+    profileCount = 0;
+    profileDropped = 0;
+    profileTaskCount = 0;
+    bzero(profileTaskNames, sizeof(profileTaskNames));
+    profiling = 1;
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        esp_register_freertos_tick_hook_for_cpu(profileTick, core);
+    }
+}
+
+// Close the profiling window, the samples are kept
+void profileStop() {
+    if (!profiling) {
+        return;
+    }
+    profiling = 0;
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        esp_deregister_freertos_tick_hook_for_cpu(profileTick, core);
+    }
+}
+
+/**
+ * Serialize the samples and copy a window of them. Multi-byte values
+ * are big endian.
+ *
+ *    Sampling rate in Hz (2), samples (2), dropped samples (4), tasks (1)
+ *    For each task: name length (1), name
+ *    For each sample: core (1), task (1), PC (4), return address (4)
+ *
+ * @param offset Offset of the window
+ * @param out Where the window is copied
+ * @param len Length of the window
+ * @return Total length of the serialized samples
+ */
+uint16_t profileRead(uint16_t offset, uint8_t* out, uint16_t len) {
+    telemetryWriter w = { 0, offset, out, len };
+
+    telemetryPut(&w, 1000 / portTICK_PERIOD_MS, 2);
+    telemetryPut(&w, profileCount, 2);
+    telemetryPut(&w, profileDropped, 4);
+    telemetryPut(&w, profileTaskCount, 1);
+    for (uint8_t t = 0; t < profileTaskCount; t++) {
+        uint8_t n = strlen(profileTaskNames[t]);
+        telemetryPut(&w, n, 1);
+        for (uint8_t i = 0; i < n; i++) {
+            telemetryPut(&w, (uint8_t) profileTaskNames[t][i], 1);
+        }
+    }
+    for (uint16_t i = 0; i < profileCount; i++) {
+        telemetryPut(&w, profileSamples[i].core, 1);
+        telemetryPut(&w, profileSamples[i].task, 1);
+        telemetryPut(&w, profileSamples[i].pc, 4);
+        telemetryPut(&w, profileSamples[i].ret, 4);
+    }
+    return w.pos;
+}
+
+/**
+ * Close the profiling window, so that the samples do not change while
+ * they are being read, and return the length of the serialized samples.
+ */
+uint16_t profileSelect() {
+    profileStop();
+    return profileRead(0, NULL, 0);
+}
+
+// Print the samples to the console, in the format read by profileFold.py
+void profilePrint() {
+    for (uint16_t i = 0; i < profileCount; i++) {
+        profileSample* s = &profileSamples[i];
+        printf("PROFILE %d %s 0x%08x 0x%08x\n", s->core,
+                (s->task < profileTaskCount) ? profileTaskNames[s->task] : "?",
+                (unsigned int) s->pc, (unsigned int) s->ret);
+    }
+    printf("PROFILE END %u dropped\n", (unsigned int) profileDropped);
+    fflush(stdout);
+}
+
+#endif
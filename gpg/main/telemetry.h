@@ -0,0 +1,218 @@
+/*
+ * Always-on latency and resource telemetry for the ESP32.
+ *
+ * Every exchanged APDU is split into phases, and the time spent in
+ * each phase is added to a log2-bucketed histogram (in microseconds)
+ * of the slot of its INS. The cost per APDU is a few timer reads and
+ * counter increments, so the instrumentation can stay enabled.
+ *
+ * Handles:
+ *    Per-INS latency histograms of each phase
+ *    Heap and stack high-water marks
+ *    Connection and WiFi reconnect counters
+ *    Serialization of all of the above (vendor specific command f3)
+ */
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "platform.h"
+
+#define TELEMETRY_VERSION 1
+
+#define PHASE_RECEIVE 0         // Waiting for and reading the command APDU
+#define PHASE_PARSE 1           // Parsing and processing (everything not below)
+#define PHASE_BUTTON 2          // Waiting for the proceed button
+#define PHASE_CRYPTO 3          // RSA operations
+#define PHASE_FLASH 4           // NVS and filesystem accesses
+#define PHASE_SEND 5            // Writing the response APDU
+#define PHASES 6
+
+#define TELEMETRY_BUCKETS 24    // Bucket b counts durations in [2^(b-1), 2^b) us, the last one is open
+#define TELEMETRY_SLOTS 16      // INS tracked separately, the last slot collects all others
+
+typedef struct insStats {       // Statistics of one INS
+    uint8_t ins;                // The INS (0x00 for the shared last slot)
+    uint32_t count;             // Number of APDUs recorded
+    uint16_t hist[PHASES][TELEMETRY_BUCKETS];   // Saturating bucket counters
+} insStats;
+
+typedef struct telemetry_t {
+    insStats slots[TELEMETRY_SLOTS];
+    uint8_t slotsUsed;
+    int64_t phaseTime[PHASES];  // Time spent in each phase by the current APDU
+    int64_t phaseStart;         // When the current phase was entered
+    uint8_t phase;              // The current phase
+    uint32_t freeHeap;          // Free heap when the telemetry read started
+    uint32_t minFreeHeap;       // Lowest free heap seen after an APDU
+    uint32_t minFreeStack;      // Lowest unused stack of the APDU task
+    uint32_t connections;       // Connections made to the host
+    uint32_t connectFailures;   // Connections to the host that failed
+    uint32_t wifiReconnects;    // Times the WiFi connection was lost
+} telemetry_t;
+
+telemetry_t telemetry = { .minFreeHeap = UINT32_MAX, .minFreeStack = UINT32_MAX };
+
+// Return the histogram bucket of a duration in microseconds
+uint8_t telemetryBucket(int64_t us) {
+    uint8_t b = 0;
+    while (us > 0 && b < TELEMETRY_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/**
+ * Charge the time since the last switch to the current phase and enter
+ * the given one.
+ *
+ * @param phase The phase entered (PHASE_*)
+ * @return The phase that was left, to be restored by the caller
+ */
+uint8_t telemetryPhase(uint8_t phase) {
+    int64_t now = platformMicros();
+    uint8_t prev = telemetry.phase;
+
+    telemetry.phaseTime[prev] += now - telemetry.phaseStart;
+    telemetry.phaseStart = now;
+    telemetry.phase = phase;
+    return prev;
+}
+
+// Start timing a new APDU exchange, in the receive phase
+void telemetryBegin() {
+    bzero(telemetry.phaseTime, sizeof(telemetry.phaseTime));
+    telemetry.phaseStart = platformMicros();
+    telemetry.phase = PHASE_RECEIVE;
+}
+
+/**
+ * Finish timing the current APDU exchange and add its phases to the
+ * histograms of its INS.
+ *
+ * @param ins The INS of the command APDU
+ */
+void telemetryEnd(uint8_t ins) {
+    insStats* s = NULL;
+    uint32_t heap, stack;
+
+    telemetryPhase(PHASE_RECEIVE);
+
+    for (uint8_t i = 0; i < telemetry.slotsUsed; i++) {
+        if (telemetry.slots[i].ins == ins) {
+            s = &telemetry.slots[i];
+            break;
+        }
+    }
+    if (s == NULL) {
+        if (telemetry.slotsUsed < TELEMETRY_SLOTS - 1) {
+            s = &telemetry.slots[telemetry.slotsUsed++];
+            s->ins = ins;
+        } else {
+            s = &telemetry.slots[TELEMETRY_SLOTS - 1];
+            telemetry.slotsUsed = TELEMETRY_SLOTS;
+        }
+    }
+
+    s->count++;
+    for (uint8_t p = 0; p < PHASES; p++) {
+        uint16_t* c = &s->hist[p][telemetryBucket(telemetry.phaseTime[p])];
+        if (*c < UINT16_MAX) {
+            (*c)++;
+        }
+    }
+
+    heap = platformMinimumFreeHeap();
+    if (heap < telemetry.minFreeHeap) {
+        telemetry.minFreeHeap = heap;
+    }
+    stack = uxTaskGetStackHighWaterMark(NULL);
+    if (stack < telemetry.minFreeStack) {
+        telemetry.minFreeStack = stack;
+    }
+}
+
+// Clear the histograms and the counters
+void telemetryReset() {
+    bzero(telemetry.slots, sizeof(telemetry.slots));
+    telemetry.slotsUsed = 0;
+    telemetry.minFreeHeap = UINT32_MAX;
+    telemetry.minFreeStack = UINT32_MAX;
+    telemetry.connections = 0;
+    telemetry.connectFailures = 0;
+    telemetry.wifiReconnects = 0;
+}
+
+typedef struct telemetryWriter {    // Window of the serialized telemetry to copy
+    uint16_t pos;       // Position in the serialized data
+    uint16_t offset;    // Start of the window
+    uint8_t* out;       // Where the window is copied
+    uint16_t len;       // Length of the window
+} telemetryWriter;
+
+void telemetryPut(telemetryWriter* w, uint32_t val, uint8_t bytes) {
+    while (bytes-- > 0) {
+        if (w->pos >= w->offset && w->pos < w->offset + w->len) {
+            w->out[w->pos - w->offset] = (uint8_t) (val >> (8 * bytes));
+        }
+        w->pos++;
+    }
+}
+
+/**
+ * Serialize the telemetry and copy a window of it. Multi-byte values
+ * are big endian.
+ *
+ *    Version (1), phases (1), buckets (1), slots (1)
+ *    Current free heap, lowest free heap, lowest free stack (4 each)
+ *    Connections, failed connections, WiFi reconnects (4 each)
+ *    For each slot:
+ *       INS (1), count (4), number of non-empty buckets (1)
+ *       For each non-empty bucket: phase << 5 | bucket (1), count (2)
+ *
+ * @param offset Offset of the window
+ * @param out Where the window is copied
+ * @param len Length of the window
+ * @return Total length of the serialized telemetry
+ */
+uint16_t telemetryRead(uint16_t offset, uint8_t* out, uint16_t len) {
+    telemetryWriter w = { 0, offset, out, len };
+
+    telemetryPut(&w, TELEMETRY_VERSION, 1);
+    telemetryPut(&w, PHASES, 1);
+    telemetryPut(&w, TELEMETRY_BUCKETS, 1);
+    telemetryPut(&w, telemetry.slotsUsed, 1);
+    telemetryPut(&w, telemetry.freeHeap, 4);
+    telemetryPut(&w, telemetry.minFreeHeap, 4);
+    telemetryPut(&w, telemetry.minFreeStack, 4);
+    telemetryPut(&w, telemetry.connections, 4);
+    telemetryPut(&w, telemetry.connectFailures, 4);
+    telemetryPut(&w, telemetry.wifiReconnects, 4);
+
+    for (uint8_t i = 0; i < telemetry.slotsUsed; i++) {
+        insStats* s = &telemetry.slots[i];
+        uint8_t used = 0;
+        for (uint8_t p = 0; p < PHASES; p++) {
+            for (uint8_t b = 0; b < TELEMETRY_BUCKETS; b++) {
+                used += (s->hist[p][b] != 0);
+            }
+        }
+        telemetryPut(&w, s->ins, 1);
+        telemetryPut(&w, s->count, 4);
+        telemetryPut(&w, used, 1);
+        for (uint8_t p = 0; p < PHASES; p++) {
+            for (uint8_t b = 0; b < TELEMETRY_BUCKETS; b++) {
+                if (s->hist[p][b] != 0) {
+                    telemetryPut(&w, (uint8_t) (p << 5 | b), 1);
+                    telemetryPut(&w, s->hist[p][b], 2);
+                }
+            }
+        }
+    }
+    return w.pos;
+}
+
+#endif
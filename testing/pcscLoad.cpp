@@ -0,0 +1,663 @@
+/*
+ * pcscLoad.cpp
+ *
+ * PC/SC load generator and latency benchmark for the whole host stack
+ * (application - pcscd - vpcd - vicc - ESP32 or esp32Sim). It links
+ * against libpcsclite, either the one of pcsc-lite or the replacement
+ * in virtualsmartcard-0.8/src/pcsclite-vpcd.
+ *
+ * A weighted mix of operations (each a short sequence of APDUs, like
+ * GnuPG sends them) is replayed by a number of threads, spread across
+ * the selected readers. The threads run as fast as they can, at a fixed
+ * rate (closed loop), or open loop, where the latency is measured from
+ * the time an operation was due, so queueing behind slow operations is
+ * not hidden (coordinated omission).
+ *
+ * The latencies of each operation and each APDU type are recorded in
+ * log-linear (HDR style) histograms, and the results are written as
+ * JSON for regression gates.
+ *
+ * Handles:
+ *    Operation mixes and the APDU sequences of each operation
+ *    Thread, reader and rate management
+ *    Histograms, the summary table and the JSON report
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <winscard.h>
+
+#define RECONNECT_DELAY_MS 100   // Wait after a failed SCardConnect
+#define CARD_WAIT_MS 10000       // Wait for a card in one of the readers
+#define IOCTL_VPCD_BATCH (0x42000000 + 3500)    // SCARD_CTL_CODE(3500), see ifd-vpcd.h
+
+typedef std::chrono::steady_clock Clock;
+typedef std::vector<uint8_t> Bytes;
+
+/*
+ * Histogram
+ */
+
+// Log-linear histogram of latencies in microseconds. Values below
+// 2^SUB_BITS are exact, larger ones keep SUB_BITS - 1 significant bits
+// (relative error below 0.2%). Values up to 2^36 us (19 hours).
+class Histogram {
+public:
+    static const int SUB_BITS = 10;
+    static const int MAX_BITS = 36;
+
+    Histogram() : counts((MAX_BITS - SUB_BITS + 2) << (SUB_BITS - 1), 0),
+            total(0), minValue(UINT64_MAX), maxValue(0), sum(0) {}
+
+    void record(uint64_t us) {
+        if (us >= (1ULL << MAX_BITS)) {
+            us = (1ULL << MAX_BITS) - 1;
+        }
+        counts[index(us)]++;
+        total++;
+        sum += us;
+        minValue = std::min(minValue, us);
+        maxValue = std::max(maxValue, us);
+    }
+
+    void merge(const Histogram& h) {
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] += h.counts[i];
+        }
+        total += h.total;
+        sum += h.sum;
+        minValue = std::min(minValue, h.minValue);
+        maxValue = std::max(maxValue, h.maxValue);
+    }
+
+    // Highest value equivalent to the one at the given percentile
+    uint64_t percentile(double p) const {
+        uint64_t rank = (uint64_t) std::ceil(p / 100.0 * total), seen = 0;
+        if (rank == 0) {
+            rank = 1;
+        }
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(highest(i), maxValue);
+            }
+        }
+        return maxValue;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total ? minValue : 0; }
+    uint64_t max() const { return maxValue; }
+    double mean() const { return total ? sum / total : 0; }
+
+private:
+    std::vector<uint64_t> counts;
+    uint64_t total, minValue, maxValue;
+    double sum;
+
+    static size_t index(uint64_t v) {
+        if (v < (1ULL << SUB_BITS)) {
+            return (size_t) v;
+        }
+        int b = 63 - __builtin_clzll(v) - SUB_BITS + 1;     // Bits dropped
+        return ((size_t) b << (SUB_BITS - 1)) + (size_t) (v >> b);
+    }
+
+    static uint64_t highest(size_t i) {
+        if (i < (1U << SUB_BITS)) {
+            return i;
+        }
+        int b = (int) (i >> (SUB_BITS - 1)) - 1;
+        uint64_t sub = i - ((size_t) b << (SUB_BITS - 1));
+        return (sub << b) + (1ULL << b) - 1;
+    }
+};
+
+/*
+ * Operations
+ */
+
+struct Step {                   // One command APDU of an operation
+    std::string name;           // APDU type, for the per-APDU histograms
+    Bytes apdu;
+};
+
+struct Operation {
+    std::string name;
+    double weight;
+    std::vector<Step> steps;
+    bool batched;               // Steps sent at once with SCardControl (IOCTL_VPCD_BATCH)
+};
+
+struct Config {
+    std::vector<std::string> readerFilters;
+    int threads = 1;
+    double duration = 10;       // Seconds
+    double warmup = 1;          // Seconds not recorded
+    double rate = 0;            // Operations per second (all threads), 0 for unlimited
+    bool openLoop = false;
+    bool poisson = false;
+    unsigned seed = 1;
+    std::string pin = "123456";
+    std::string mix = "getdata=60,pubkey=10,challenge=10,verify=10,sign=10";
+    std::string cryptogramFile;
+    std::string jsonFile;
+};
+
+static Config config;
+
+static Bytes hexBytes(const char* hex) {
+    Bytes b;
+    for (const char* p = hex; p[0] && p[1]; p += 2) {
+        while (*p == ' ') {
+            p++;
+        }
+        b.push_back((uint8_t) strtoul(std::string(p, 2).c_str(), NULL, 16));
+    }
+    return b;
+}
+
+static Bytes command(const char* header, const Bytes& data, bool le) {
+    Bytes apdu = hexBytes(header);
+    if (!data.empty()) {
+        apdu.push_back((uint8_t) data.size());
+        apdu.insert(apdu.end(), data.begin(), data.end());
+    }
+    if (le) {
+        apdu.push_back(0x00);
+    }
+    return apdu;
+}
+
+static Step verifyStep(const char* p2) {
+    Bytes pin(config.pin.begin(), config.pin.end());
+    return Step { std::string("VERIFY ") + p2, command((std::string("00 20 00 ") + p2).c_str(), pin, false) };
+}
+
+// Chain data that does not fit a short APDU, as serverPGP.py does
+static void chain(std::vector<Step>& steps, const std::string& name, const char* insP1P2, const Bytes& data) {
+    for (size_t pos = 0; pos < data.size(); pos += 254) {
+        size_t n = std::min((size_t) 254, data.size() - pos);
+        bool last = (pos + n == data.size());
+        Bytes part(data.begin() + pos, data.begin() + pos + n);
+        steps.push_back(Step { name, command(((last ? "00 " : "10 ") + std::string(insP1P2)).c_str(), part, last) });
+    }
+}
+
+static std::vector<Operation> buildOperations() {
+    std::map<std::string, std::vector<Step>> known;
+    known["getdata"] = { { "GET DATA 6E", command("00 CA 00 6E", Bytes(), true) } };
+    known["crd"] = { { "GET DATA 65", command("00 CA 00 65", Bytes(), true) } };
+    known["pubkey"] = { { "READ PUBLIC KEY", command("00 47 81 00", hexBytes("B600"), true) } };
+    known["challenge"] = { { "GET CHALLENGE", hexBytes("0084000008") } };
+    known["verify"] = { verifyStep("82") };
+    known["telemetry"] = { { "TELEMETRY", command("00 F3 00 00", Bytes(), true) } };
+    // The data objects gpg --card-status reads, one by one or in a batch
+    known["status"] = {
+        { "GET DATA 6E", command("00 CA 00 6E", Bytes(), true) },
+        { "GET DATA 65", command("00 CA 00 65", Bytes(), true) },
+        { "GET DATA 5F50", command("00 CA 5F 50", Bytes(), true) },
+        { "GET DATA 5F52", command("00 CA 5F 52", Bytes(), true) },
+        { "GET DATA 7A", command("00 CA 00 7A", Bytes(), true) },
+        { "GET DATA C4", command("00 CA 00 C4", Bytes(), true) },
+    };
+    known["status-batch"] = known["status"];
+
+    // SHA-256 DigestInfo of an all zero digest
+    Bytes digestInfo = hexBytes("3031300D060960864801650304020105000420");
+    digestInfo.resize(digestInfo.size() + 32, 0x00);
+    known["sign"] = { verifyStep("81"), { "PSO:CDS", command("00 2A 9E 9A", digestInfo, true) } };
+
+    if (!config.cryptogramFile.empty()) {
+        std::ifstream f(config.cryptogramFile, std::ios::binary);
+        Bytes cryptogram(1, 0x00);  // Padding indicator byte
+        cryptogram.insert(cryptogram.end(), std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        std::vector<Step> steps = { verifyStep("82") };
+        chain(steps, "PSO:DECIPHER", "2A 80 86", cryptogram);
+        known["decipher"] = steps;
+    }
+
+    std::vector<Operation> ops;
+    size_t pos = 0;
+    while (pos < config.mix.size()) {
+        size_t end = config.mix.find(',', pos);
+        std::string item = config.mix.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        size_t eq = item.find('=');
+        std::string name = item.substr(0, eq);
+        double weight = (eq == std::string::npos) ? 1 : atof(item.c_str() + eq + 1);
+        if (known.find(name) == known.end() || weight <= 0) {
+            fprintf(stderr, "Unknown operation in the mix: %s%s\n", name.c_str(),
+                    name == "decipher" ? " (needs -c)" : "");
+            exit(1);
+        }
+        ops.push_back(Operation { name, weight, known[name], name == "status-batch" });
+        pos = (end == std::string::npos) ? config.mix.size() : end + 1;
+    }
+    return ops;
+}
+
+/*
+ * Workers
+ */
+
+struct Results {                // Results of a worker, merged at the end
+    std::map<std::string, Histogram> ops;
+    std::map<std::string, Histogram> apdus;
+    std::map<std::string, uint64_t> errors;     // Per operation
+    std::map<std::string, std::map<std::string, uint64_t>> statusWords;     // Per APDU type
+};
+
+static std::atomic<bool> stopping(false);
+static std::mutex resultsMutex;
+static Results total;
+
+static uint64_t micros(Clock::duration d) {
+    return (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+class Worker {
+public:
+    Worker(int id, const std::string& reader, const std::vector<Operation>& ops)
+        : id(id), reader(reader), ops(ops), rng(config.seed + id), context(0), card(0), connected(false) {
+        std::vector<double> weights;
+        for (const Operation& op : ops) {
+            weights.push_back(op.weight);
+        }
+        pick = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+    }
+
+    void run() {
+        Clock::time_point start = Clock::now();
+        Clock::time_point warm = start + std::chrono::microseconds((int64_t) (config.warmup * 1e6));
+        Clock::time_point due = start;
+        double interval = (config.rate > 0) ? config.threads / config.rate : 0;  // Seconds
+        std::exponential_distribution<double> arrivals(interval > 0 ? 1 / interval : 1);
+
+        if (SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &context) != SCARD_S_SUCCESS) {
+            fprintf(stderr, "[%d] SCardEstablishContext failed\n", id);
+            return;
+        }
+        while (!stopping) {
+            if (interval > 0) {
+                double wait = config.poisson ? arrivals(rng) : interval;
+                due += std::chrono::microseconds((int64_t) (wait * 1e6));
+                std::this_thread::sleep_until(due);
+            } else {
+                due = Clock::now();
+            }
+            if (stopping) {
+                break;
+            }
+            const Operation& op = ops[pick(rng)];
+            Clock::time_point sent = Clock::now();
+            bool ok = perform(op, sent >= warm);
+            Clock::time_point done = Clock::now();
+            if (sent < warm) {
+                continue;
+            }
+            // Open loop: measured from when the operation was due
+            results.ops[op.name].record(micros(done - ((config.openLoop && interval > 0) ? due : sent)));
+            if (!ok) {
+                results.errors[op.name]++;
+            }
+        }
+        disconnect();
+        SCardReleaseContext(context);
+
+        std::lock_guard<std::mutex> lock(resultsMutex);
+        for (auto& h : results.ops) {
+            total.ops[h.first].merge(h.second);
+        }
+        for (auto& h : results.apdus) {
+            total.apdus[h.first].merge(h.second);
+        }
+        for (auto& e : results.errors) {
+            total.errors[e.first] += e.second;
+        }
+        for (auto& s : results.statusWords) {
+            for (auto& sw : s.second) {
+                total.statusWords[s.first][sw.first] += sw.second;
+            }
+        }
+    }
+
+private:
+    int id;
+    std::string reader;
+    const std::vector<Operation>& ops;
+    std::mt19937 rng;
+    std::discrete_distribution<size_t> pick;
+    SCARDCONTEXT context;
+    SCARDHANDLE card;
+    bool connected;             // Handles can be 0 (pcsclite-vpcd uses the slot)
+    DWORD protocol = 0;
+    Results results;
+
+    bool connect() {
+        if (!connected) {
+            connected = (SCardConnect(context, reader.c_str(), SCARD_SHARE_SHARED,
+                    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card, &protocol) == SCARD_S_SUCCESS);
+        }
+        return connected;
+    }
+
+    void disconnect() {
+        if (connected) {
+            SCardDisconnect(card, SCARD_LEAVE_CARD);
+            connected = false;
+        }
+    }
+
+    // Send an APDU and record it, returning the status word or 0 on a PC/SC error
+    uint16_t transmit(const std::string& name, const Bytes& apdu, Bytes& resp, bool record) {
+        uint8_t buf[258 + 2];
+        DWORD len = sizeof(buf);
+        const SCARD_IO_REQUEST* pci = (protocol == SCARD_PROTOCOL_T0) ? SCARD_PCI_T0 : SCARD_PCI_T1;
+
+        Clock::time_point start = Clock::now();
+        LONG rv = SCardTransmit(card, pci, apdu.data(), (DWORD) apdu.size(), NULL, buf, &len);
+        uint64_t us = micros(Clock::now() - start);
+        if (rv != SCARD_S_SUCCESS || len < 2) {
+            if (record) {
+                results.statusWords[name]["pcsc"]++;
+            }
+            disconnect();   // Reconnect on the next operation
+            return 0;
+        }
+        uint16_t sw = (uint16_t) (buf[len-2] << 8 | buf[len-1]);
+        if (record) {
+            char s[8];
+            snprintf(s, sizeof(s), "%04X", sw);
+            results.apdus[name].record(us);
+            results.statusWords[name][s]++;
+        }
+        resp.insert(resp.end(), buf, buf + len - 2);
+        return sw;
+    }
+
+    // Send the steps in one SCardControl, recorded as one BATCH APDU type
+    bool batch(const std::vector<Step>& steps, bool record) {
+        Bytes commands;
+        uint8_t buf[4096];
+        DWORD len = 0;
+
+        for (const Step& step : steps) {
+            commands.push_back((uint8_t) (step.apdu.size() >> 8));
+            commands.push_back((uint8_t) step.apdu.size());
+            commands.insert(commands.end(), step.apdu.begin(), step.apdu.end());
+        }
+        Clock::time_point start = Clock::now();
+        LONG rv = SCardControl(card, IOCTL_VPCD_BATCH, commands.data(), (DWORD) commands.size(),
+                buf, sizeof(buf), &len);
+        uint64_t us = micros(Clock::now() - start);
+        if (rv != SCARD_S_SUCCESS) {
+            if (record) {
+                results.statusWords["BATCH"]["pcsc"]++;
+            }
+            disconnect();
+            return false;
+        }
+        // One response for each step run, the last one is the first error
+        size_t responses = 0;
+        uint16_t sw = 0;
+        for (DWORD pos = 0; pos + 2 <= len; responses++) {
+            DWORD n = (DWORD) (buf[pos] << 8 | buf[pos+1]);
+            if (n < 2 || pos + 2 + n > len) {
+                sw = 0;
+                break;
+            }
+            sw = (uint16_t) (buf[pos+n] << 8 | buf[pos+n+1]);
+            pos += 2 + n;
+        }
+        if (record) {
+            char s[8];
+            snprintf(s, sizeof(s), "%04X", sw);
+            results.apdus["BATCH"].record(us);
+            results.statusWords["BATCH"][s]++;
+        }
+        return sw == 0x9000 && responses == steps.size();
+    }
+
+    bool perform(const Operation& op, bool record) {
+        bool ok = true;
+
+        if (!connect()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(RECONNECT_DELAY_MS));
+            return false;
+        }
+        SCardBeginTransaction(card);
+        if (op.batched) {
+            ok = batch(op.steps, record);
+        } else {
+            for (const Step& step : op.steps) {
+                Bytes resp;
+                uint16_t sw = transmit(step.name, step.apdu, resp, record);
+                while ((sw & 0xFF00) == 0x6100) {   // GET RESPONSE
+                    Bytes getResponse = { 0x00, 0xC0, 0x00, 0x00, (uint8_t) sw };
+                    sw = transmit("GET RESPONSE", getResponse, resp, record);
+                }
+                if (sw != 0x9000) {
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        if (connected) {
+            SCardEndTransaction(card, SCARD_LEAVE_CARD);
+        }
+        return ok;
+    }
+};
+
+static std::vector<std::string> listReaders(SCARDCONTEXT context) {
+    DWORD len = 0;
+    std::vector<std::string> readers;
+
+    if (SCardListReaders(context, NULL, NULL, &len) == SCARD_S_SUCCESS && len > 0) {
+        std::vector<char> buf(len);
+        if (SCardListReaders(context, NULL, buf.data(), &len) == SCARD_S_SUCCESS) {
+            for (const char* p = buf.data(); *p != '\0'; p += strlen(p) + 1) {
+                bool match = config.readerFilters.empty();
+                for (const std::string& f : config.readerFilters) {
+                    match |= (strstr(p, f.c_str()) != NULL);
+                }
+                if (match) {
+                    readers.push_back(p);
+                }
+            }
+        }
+    }
+    // Keep the readers with a card in them, waiting a little for the
+    // first card (the vicc connects once the reader has started)
+    std::vector<SCARD_READERSTATE> states(readers.size());
+    for (size_t i = 0; i < readers.size(); i++) {
+        memset(&states[i], 0, sizeof(SCARD_READERSTATE));
+        states[i].szReader = readers[i].c_str();
+        states[i].dwCurrentState = SCARD_STATE_UNAWARE;
+    }
+    std::vector<std::string> present;
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(CARD_WAIT_MS);
+    while (!states.empty() && present.empty() && Clock::now() < deadline) {
+        if (SCardGetStatusChange(context, 1000, states.data(), (DWORD) states.size()) == SCARD_S_SUCCESS) {
+            for (size_t i = 0; i < readers.size(); i++) {
+                if (states[i].dwEventState & SCARD_STATE_PRESENT) {
+                    present.push_back(readers[i]);
+                }
+                states[i].dwCurrentState = states[i].dwEventState & ~SCARD_STATE_CHANGED;
+            }
+        }
+    }
+    readers.swap(present);
+    return readers;
+}
+
+/*
+ * Reports
+ */
+
+static void printTable(const char* title, const std::map<std::string, Histogram>& hists, double seconds) {
+    printf("\n%-18s %8s %9s %9s %9s %9s %9s %9s %9s\n", title, "count", "ops/s",
+            "mean ms", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+    for (const auto& h : hists) {
+        const Histogram& s = h.second;
+        printf("%-18s %8llu %9.1f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", h.first.c_str(),
+                (unsigned long long) s.count(), s.count() / seconds, s.mean() / 1000,
+                s.percentile(50) / 1000.0, s.percentile(90) / 1000.0, s.percentile(99) / 1000.0,
+                s.percentile(99.9) / 1000.0, s.max() / 1000.0);
+    }
+}
+
+static void jsonHistograms(FILE* f, const char* key, const std::map<std::string, Histogram>& hists,
+        double seconds, bool operations) {
+    bool first = true;
+    fprintf(f, "  \"%s\": {", key);
+    for (const auto& h : hists) {
+        const Histogram& s = h.second;
+        fprintf(f, "%s\n    \"%s\": {\"count\": %llu, \"throughput\": %.3f, ", first ? "" : ",",
+                h.first.c_str(), (unsigned long long) s.count(), s.count() / seconds);
+        if (operations) {
+            fprintf(f, "\"errors\": %llu, ", (unsigned long long) total.errors[h.first]);
+        } else {
+            bool firstSw = true;
+            fprintf(f, "\"status\": {");
+            for (const auto& sw : total.statusWords[h.first]) {
+                fprintf(f, "%s\"%s\": %llu", firstSw ? "" : ", ", sw.first.c_str(), (unsigned long long) sw.second);
+                firstSw = false;
+            }
+            fprintf(f, "}, ");
+        }
+        fprintf(f, "\"latency_us\": {\"min\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, "
+                "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}}",
+                (unsigned long long) s.min(), s.mean(), (unsigned long long) s.percentile(50),
+                (unsigned long long) s.percentile(90), (unsigned long long) s.percentile(99),
+                (unsigned long long) s.percentile(99.9), (unsigned long long) s.max());
+        first = false;
+    }
+    fprintf(f, "\n  }");
+}
+
+static void writeJson(const std::vector<std::string>& readers, double seconds) {
+    FILE* f = (config.jsonFile == "-") ? stdout : fopen(config.jsonFile.c_str(), "w");
+    if (f == NULL) {
+        perror(config.jsonFile.c_str());
+        return;
+    }
+    fprintf(f, "{\n  \"config\": {\"threads\": %d, \"readers\": %zu, \"duration_s\": %.3f, "
+            "\"warmup_s\": %.3f, \"rate\": %.3f, \"open_loop\": %s, \"poisson\": %s, \"mix\": \"%s\"},\n",
+            config.threads, readers.size(), seconds, config.warmup, config.rate,
+            config.openLoop ? "true" : "false", config.poisson ? "true" : "false", config.mix.c_str());
+    jsonHistograms(f, "operations", total.ops, seconds, true);
+    fprintf(f, ",\n");
+    jsonHistograms(f, "apdus", total.apdus, seconds, false);
+    fprintf(f, "\n}\n");
+    if (f != stdout) {
+        fclose(f);
+    }
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -r name      Use the readers whose name contains this (repeatable, default all)\n"
+        "  -t threads   Threads, spread across the readers (1)\n"
+        "  -d seconds   Duration of the measurement (10)\n"
+        "  -w seconds   Warm-up, not recorded (1)\n"
+        "  -R rate      Operations per second of all threads, 0 for as fast as possible (0)\n"
+        "  -O           Open loop: latency from when each operation was due\n"
+        "  -P           Poisson arrivals instead of a fixed interval\n"
+        "  -m mix       Operations and weights (%s)\n"
+        "               getdata crd pubkey challenge verify sign decipher telemetry\n"
+        "               status status-batch\n"
+        "  -c file      Cryptogram for decipher (e.g. cipherTest0)\n"
+        "  -p pin       PW1 (123456)\n"
+        "  -s seed      Seed of the operation choice (1)\n"
+        "  -j file      Write the results as JSON (- for stdout)\n", prog, config.mix.c_str());
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:t:d:w:R:OPm:c:p:s:j:")) != -1) {
+        switch (opt) {
+        case 'r': config.readerFilters.push_back(optarg); break;
+        case 't': config.threads = atoi(optarg); break;
+        case 'd': config.duration = atof(optarg); break;
+        case 'w': config.warmup = atof(optarg); break;
+        case 'R': config.rate = atof(optarg); break;
+        case 'O': config.openLoop = true; break;
+        case 'P': config.poisson = true; break;
+        case 'm': config.mix = optarg; break;
+        case 'c': config.cryptogramFile = optarg; break;
+        case 'p': config.pin = optarg; break;
+        case 's': config.seed = (unsigned) atoi(optarg); break;
+        case 'j': config.jsonFile = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (config.threads <= 0 || config.duration <= 0 || config.warmup < 0 || config.rate < 0) {
+        usage(argv[0]);
+    }
+
+    // Held for the whole run: pcsclite-vpcd closes its readers, and so
+    // disconnects the vicc, when the last context is released
+    SCARDCONTEXT context;
+    if (SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &context) != SCARD_S_SUCCESS) {
+        fprintf(stderr, "SCardEstablishContext failed\n");
+        return 1;
+    }
+    std::vector<Operation> ops = buildOperations();
+    std::vector<std::string> readers = listReaders(context);
+    if (readers.empty()) {
+        fprintf(stderr, "No matching reader with a card\n");
+        return 1;
+    }
+
+    std::vector<Worker*> workers;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < config.threads; i++) {
+        workers.push_back(new Worker(i, readers[i % readers.size()], ops));
+    }
+    for (Worker* w : workers) {
+        threads.push_back(std::thread(&Worker::run, w));
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds((int64_t) ((config.warmup + config.duration) * 1e6)));
+    stopping = true;
+    for (std::thread& t : threads) {
+        t.join();
+    }
+    for (Worker* w : workers) {
+        delete w;
+    }
+    SCardReleaseContext(context);
+
+    uint64_t errors = 0;
+    for (const auto& e : total.errors) {
+        errors += e.second;
+    }
+    printf("%d threads on %zu readers, %.1f s%s\n", config.threads, readers.size(), config.duration,
+            config.openLoop ? ", open loop" : "");
+    printTable("operation", total.ops, config.duration);
+    printTable("APDU", total.apdus, config.duration);
+    if (errors > 0) {
+        printf("\n%llu operations failed\n", (unsigned long long) errors);
+    }
+    if (!config.jsonFile.empty()) {
+        writeJson(readers, config.duration);
+    }
+    return errors > 0;
+}
@@ -0,0 +1,177 @@
+"""
+profileFold.py    19/10/2026
+
+SYNOPSIS
+
+    profileFold.py -e ELF [-c CONSOLE_LOG] [-r READER] [-a] [-t SECONDS]
+
+DESCRIPTION
+
+    This program collects the samples of the sampling
+    profiler of the ESP32 (vendor specific command f6)
+    and prints them as folded stacks, one line per
+    distinct stack followed by its sample count, the
+    input format of flamegraph.pl:
+
+        task;caller;function count
+
+    The samples are either read from the card through
+    PC/SC (the profiler is started, left running for
+    the given time while the card is being used, and
+    stopped), or parsed from a console log that holds
+    the output of f6 with P1 03. Addresses are resolved
+    with xtensa-esp32-elf-addr2line against the ELF of
+    the firmware that was sampled.
+
+    Example:
+
+        profileFold.py -e ../gpg/build/gpg.elf -t 30 | \\
+            flamegraph.pl > profile.svg
+"""
+from __future__ import print_function
+import sys
+import time
+import argparse
+import subprocess
+from getpass import getpass
+from collections import Counter
+
+ADDR2LINE = "xtensa-esp32-elf-addr2line"
+
+
+def transmit(conn, apdu):
+    """Send an APDU and collect the whole response (GET RESPONSE)"""
+    data, sw1, sw2 = conn.transmit(apdu)
+    while sw1 == 0x61:
+        more, sw1, sw2 = conn.transmit([0x00, 0xC0, 0x00, 0x00, sw2])
+        data += more
+    return data, (sw1 << 8) | sw2
+
+
+def readCard(reader, seconds, apduOnly):
+    """Run the profiler on the card and return its samples"""
+    from smartcard.System import readers
+
+    conn = readers()[reader].createConnection()
+    conn.connect()
+    # SELECT the OpenPGP application
+    transmit(conn, [0x00, 0xA4, 0x04, 0x00, 0x06, 0xD2, 0x76, 0x00, 0x01, 0x24, 0x01])
+
+    pin = [ord(c) for c in getpass("Admin PIN: ")]
+    data, sw = transmit(conn, [0x00, 0x20, 0x00, 0x83, len(pin)] + pin)
+    if sw != 0x9000:
+        sys.exit("VERIFY failed: %04X" % sw)
+
+    data, sw = transmit(conn, [0x00, 0xF6, 0x01, 0x01 if apduOnly else 0x00])
+    if sw != 0x9000:
+        sys.exit("Failed to start the profiler: %04X" % sw)
+    print("Profiling for %d seconds" % seconds, file=sys.stderr)
+    time.sleep(seconds)
+
+    data, sw = transmit(conn, [0x00, 0xF6, 0x00, 0x00, 0x00])
+    if sw != 0x9000:
+        sys.exit("Failed to read the samples: %04X" % sw)
+    return parseSamples(bytearray(data))
+
+
+def parseSamples(data):
+    """Parse the response to f6 with P1 00 into (core, task, pc, ret) tuples"""
+    def u(pos, n):
+        return sum(data[pos + i] << (8 * (n - 1 - i)) for i in range(n))
+
+    rate, count, dropped, tasks = u(0, 2), u(2, 2), u(4, 4), u(8, 1)
+    pos = 9
+    names = []
+    for i in range(tasks):
+        n = data[pos]
+        names.append(bytes(data[pos + 1:pos + 1 + n]).decode("ascii", "replace"))
+        pos += 1 + n
+
+    samples = []
+    for i in range(count):
+        task = data[pos + 1]
+        samples.append((data[pos], names[task] if task < len(names) else "?",
+                        u(pos + 2, 4), u(pos + 6, 4)))
+        pos += 10
+
+    print("%d samples at %d Hz, %d dropped" % (count, rate, dropped), file=sys.stderr)
+    return samples
+
+
+def readConsole(path):
+    """Parse the lines printed by f6 with P1 03 from a console log"""
+    samples = []
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) == 5 and fields[0] == "PROFILE":
+                samples.append((int(fields[1]), fields[2],
+                                int(fields[3], 16), int(fields[4], 16)))
+    return samples
+
+
+def callSite(ret):
+    """
+    Turn a windowed return address into the address of the call.
+    The top two bits of a0 hold the window increment of the call
+    instead of the top bits of the address, and the call
+    instruction is 3 bytes long.
+    """
+    if ret == 0:
+        return None
+    return ((ret & 0x3FFFFFFF) | 0x40000000) - 3
+
+
+def symbolize(elf, addrs):
+    """Resolve addresses to function names with addr2line"""
+    addrs = sorted(addrs)
+    if not addrs:
+        return {}
+    out = subprocess.check_output([ADDR2LINE, "-f", "-C", "-e", elf] +
+                                  ["0x%08x" % a for a in addrs])
+    lines = out.decode("ascii", "replace").splitlines()
+    names = {}
+    for i, a in enumerate(addrs):
+        name = lines[2 * i] if 2 * i < len(lines) else "??"
+        names[a] = name if name != "??" else "0x%08x" % a
+    return names
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Fold the ESP32 profiler samples")
+    parser.add_argument("-e", "--elf", required=True, help="ELF of the sampled firmware")
+    parser.add_argument("-c", "--console", help="console log to parse instead of the card")
+    parser.add_argument("-r", "--reader", type=int, default=0, help="PC/SC reader index")
+    parser.add_argument("-t", "--time", type=int, default=10, help="seconds to profile")
+    parser.add_argument("-a", "--apdu", action="store_true",
+                        help="sample only while APDUs are being processed")
+    parser.add_argument("--per-core", action="store_true", help="split the stacks by core")
+    args = parser.parse_args()
+
+    if args.console:
+        samples = readConsole(args.console)
+    else:
+        samples = readCard(args.reader, args.time, args.apdu)
+
+    addrs = set()
+    for core, task, pc, ret in samples:
+        addrs.add(pc)
+        if callSite(ret) is not None:
+            addrs.add(callSite(ret))
+    names = symbolize(args.elf, addrs)
+
+    stacks = Counter()
+    for core, task, pc, ret in samples:
+        frames = ["cpu%d" % core] if args.per_core else []
+        frames.append(task)
+        if callSite(ret) is not None:
+            frames.append(names[callSite(ret)])
+        frames.append(names[pc])
+        stacks[";".join(frames)] += 1
+
+    for stack, count in stacks.most_common():
+        print("%s %d" % (stack, count))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,226 @@
+"""
+replayTrace.py    19/10/2026
+
+SYNOPSIS
+
+    replayTrace.py TRACE [-d] [-p PORT] [-s SPEED] [-t pcsc|esp]
+                   [-r READER] [-H HOST] [-P PORT] [-n COUNT]
+
+DESCRIPTION
+
+    This program reads an APDU trace captured by libvpcd
+    (set VPCD_TRACE=/path/to/file in the environment of
+    pcscd, see src/vpcd/trace.h) and either prints it, or
+    re-issues the recorded command APDUs against a card
+    and compares the latencies and status words with the
+    recorded ones.
+
+    The commands are sent through PC/SC (-t pcsc, a real
+    card or vpcd and vicc), or directly to an ESP32 or
+    to gpg/host/esp32Sim by acting as the bridge on port
+    5511 (-t esp). The control messages of vpcd (power,
+    reset and the ATR polls) are not replayed.
+
+    By default the recorded pacing is kept: the time
+    between a response and the next command of the trace
+    is waited before sending that command. -s scales it
+    (2 is twice as fast), -s 0 replays flat out.
+
+    Example:
+
+        replayTrace.py /tmp/gpg.trc -t esp -s 0
+"""
+from __future__ import print_function
+import sys
+import time
+import socket
+import struct
+import argparse
+
+HEADER = struct.Struct("=8sIIQQQQQQQ")
+RECORD = struct.Struct("=IHBBQII")
+
+PAD, SEND, RECV, ERROR, CONNECT, EJECT = range(6)
+TYPES = ["pad", "send", "recv", "error", "connect", "eject"]
+
+INS_NAMES = {
+    0xA4: "SELECT", 0xCA: "GET DATA", 0x20: "VERIFY", 0x2A: "PSO",
+    0x88: "INTERNAL AUTHENTICATE", 0x47: "GENERATE KEY", 0x84: "GET CHALLENGE",
+    0xC0: "GET RESPONSE", 0xDA: "PUT DATA", 0xDB: "PUT DATA", 0x24: "CHANGE REFERENCE DATA",
+    0x2C: "RESET RETRY COUNTER", 0xE6: "TERMINATE", 0x44: "ACTIVATE",
+}
+
+
+def readTrace(path):
+    """
+    Return the records of a trace as (port, seq, type, flags, time, payload)
+    tuples, oldest first, and the CLOCK_MONOTONIC time (ns) tracing started
+    """
+    with open(path, "rb") as f:
+        data = f.read()
+    (magic, version, headerSize, capacity, head, tail,
+     records, overwritten, startMono, startReal) = HEADER.unpack_from(data, 0)
+    if magic.rstrip(b"\0") != b"VPCDTRC" or version != 1:
+        sys.exit("%s is not a vpcd trace" % path)
+    if overwritten:
+        print("%d records were overwritten, the ring was full" % overwritten, file=sys.stderr)
+
+    ring = data[headerSize:headerSize + capacity]
+    out = []
+    pos = tail
+    while pos < head:
+        offset = pos % capacity
+        if capacity - offset < RECORD.size:
+            pos += capacity - offset
+            continue
+        size, port, kind, flags, t, length, seq = RECORD.unpack_from(ring, offset)
+        if size == 0:
+            break   # Torn record of a live trace
+        if kind != PAD:
+            start = offset + RECORD.size
+            out.append((port, seq, kind, flags, t, bytearray(ring[start:start + length])))
+        pos += size
+    return out, startMono
+
+
+def exchanges(records, port):
+    """Pair the commands with their responses, returning (port, seq, sent, received, command, response)"""
+    pending = {}
+    out = []
+    for p, seq, kind, flags, t, payload in records:
+        if port is not None and p != port:
+            continue
+        if kind == SEND:
+            pending[p] = (t, payload)
+        elif kind == RECV and p in pending:
+            sent, command = pending.pop(p)
+            if len(command) > 1:    # Not a control message
+                out.append((p, seq, sent, t, command, payload))
+        elif kind in (ERROR, EJECT):
+            pending.pop(p, None)
+    return out
+
+
+def dump(records, start):
+    for port, seq, kind, flags, t, payload in records:
+        text = " ".join("%02X" % b for b in payload)
+        if kind == ERROR and len(payload) == 4:
+            text = "errno %d" % struct.unpack("=i", bytes(payload))[0]
+        print("%12.3f ms  %5d  %6d  %-7s %s%s" % ((t - start) / 1e6, port, seq,
+                                                   TYPES[kind] if kind < len(TYPES) else kind,
+                                                   text, " (truncated)" if flags & 1 else ""))
+
+
+class PcscTarget(object):
+    def __init__(self, reader):
+        from smartcard.System import readers
+        self.conn = readers()[reader].createConnection()
+        self.conn.connect()
+
+    def transmit(self, apdu):
+        data, sw1, sw2 = self.conn.transmit(list(apdu))
+        return bytearray(data + [sw1, sw2])
+
+
+class EspTarget(object):
+    """Acts as the bridge: one connection of the device per command APDU"""
+    def __init__(self, host, port):
+        self.server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.server.bind((host, port))
+        self.server.listen(1)
+
+    def transmit(self, apdu):
+        conn, address = self.server.accept()
+        try:
+            conn.sendall(bytes(apdu))
+            response = b""
+            while True:     # The device closes the connection after the response
+                chunk = conn.recv(4096)
+                if not chunk:
+                    break
+                response += chunk
+        finally:
+            conn.close()
+        return bytearray(response)
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p * len(values)))] if values else 0
+
+
+def replay(pairs, target, speed):
+    results = []
+    previous = None
+    for port, seq, sent, received, command, response in pairs:
+        if speed > 0 and previous is not None:
+            time.sleep(max(0, (sent - previous) / 1e9 / speed))
+        previous = received
+        start = time.time()
+        try:
+            answer = target.transmit(command)
+        except Exception as e:
+            print("%s: %s" % (" ".join("%02X" % b for b in command[:5]), e), file=sys.stderr)
+            answer = bytearray()
+        results.append((command, (received - sent) / 1e6, (time.time() - start) * 1e3,
+                        response[-2:], answer[-2:]))
+    return results
+
+
+def report(results, elapsed):
+    byIns = {}
+    mismatches = 0
+    for command, recorded, replayed, sw, newSw in results:
+        name = INS_NAMES.get(command[1], "INS %02X" % command[1])
+        byIns.setdefault(name, []).append((recorded, replayed))
+        if sw != newSw:
+            mismatches += 1
+
+    print("%-22s %6s  %21s  %21s" % ("", "", "recorded ms", "replayed ms"))
+    print("%-22s %6s  %10s %10s  %10s %10s" % ("command", "count", "p50", "p95", "p50", "p95"))
+    for name in sorted(byIns):
+        rec = [r for r, n in byIns[name]]
+        new = [n for r, n in byIns[name]]
+        print("%-22s %6d  %10.2f %10.2f  %10.2f %10.2f" % (name, len(rec),
+              percentile(rec, 0.5), percentile(rec, 0.95), percentile(new, 0.5), percentile(new, 0.95)))
+    print("\n%d commands in %.2f s, %d status words differ from the trace" %
+          (len(results), elapsed, mismatches))
+    return mismatches
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Print or replay a vpcd APDU trace")
+    parser.add_argument("trace", help="trace file written by libvpcd")
+    parser.add_argument("-d", "--dump", action="store_true", help="print the records and exit")
+    parser.add_argument("-p", "--port", type=int, help="only the vicc on this port (VPCDPORT + slot)")
+    parser.add_argument("-s", "--speed", type=float, default=1.0,
+                        help="pacing factor, 0 for flat out (1)")
+    parser.add_argument("-t", "--target", choices=["pcsc", "esp"], default="pcsc")
+    parser.add_argument("-r", "--reader", type=int, default=0, help="PC/SC reader index")
+    parser.add_argument("-H", "--host", default="0.0.0.0", help="address to listen on for the device")
+    parser.add_argument("-P", "--esp-port", type=int, default=5511, help="port to listen on for the device")
+    parser.add_argument("-n", "--count", type=int, help="replay only the first COUNT commands")
+    args = parser.parse_args()
+
+    records, start = readTrace(args.trace)
+    if args.dump:
+        dump([r for r in records if args.port is None or r[0] == args.port], start)
+        return
+
+    pairs = exchanges(records, args.port)[:args.count]
+    if not pairs:
+        sys.exit("No command APDUs in the trace")
+    if args.target == "pcsc":
+        target = PcscTarget(args.reader)
+    else:
+        target = EspTarget(args.host, args.esp_port)
+
+    start = time.time()
+    results = replay(pairs, target, args.speed)
+    if report(results, time.time() - start):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,245 @@
+"""
+traceCollect.py    19/10/2026
+
+SYNOPSIS
+
+    traceCollect.py -v VPCD_TRACE -b BRIDGE_TRACE [-r READER]
+                    [-w COUNT] [-i] [-j JSON]
+
+DESCRIPTION
+
+    This program merges the traces of one APDU as it
+    passes through the host and the ESP32, and reports
+    where the time goes:
+
+        vpcd           the binary trace of libvpcd
+                       (VPCD_TRACE in the environment of
+                       pcscd)
+        vicc bridge    the JSON lines written by
+                       vicc --trace
+        ESP32          the APDU log of the device
+                       (vendor specific command f4),
+                       read through PC/SC with -r
+                       (asks for the Admin PIN)
+
+    An APDU is identified by the port of the vicc and
+    its sequence number on the connection to vpcd, which
+    both sides count. vpcd and the vicc have to run on
+    the same host, as their timestamps are compared
+    directly. The time of the ESP32 is converted with
+    the offset the bridge measured with f7 at the start
+    of the session. The APDU log of the device holds the
+    last 64 exchanges only, older ones are reported
+    without the split between WiFi and processing.
+
+    The hops of an APDU are:
+
+        vpcd->vicc     vpcd sent it, the vicc received it
+        bridge         waiting for the ESP32 to connect
+        uplink         WiFi, until the ESP32 read it
+        device         processing on the ESP32
+        downlink       WiFi, until the bridge read the
+                       response
+        device+wifi    the last three, without the log
+        bridge reply   handing the response back
+        vicc->vpcd     until vpcd received it
+
+    Example:
+
+        traceCollect.py -v /tmp/gpg.trc -b /tmp/bridge.jsonl -r 0 -w 5
+"""
+from __future__ import print_function
+import sys
+import json
+import argparse
+from getpass import getpass
+
+from replayTrace import readTrace, SEND, RECV, INS_NAMES
+
+HOPS = ["vpcd->vicc", "bridge", "uplink", "device", "downlink", "device+wifi",
+        "bridge reply", "vicc->vpcd", "total"]
+
+
+def vpcdExchanges(records):
+    """The exchanges of the vpcd trace by (port, seq), as lists of (sent, received, INS)"""
+    pending = {}
+    out = {}
+    for port, seq, kind, flags, t, payload in records:
+        if kind == SEND:
+            pending[port] = (seq, t, payload)
+        elif kind == RECV and port in pending:
+            s, sent, command = pending.pop(port)
+            if s == seq and len(command) > 1:
+                out.setdefault((port, seq), []).append((sent, t, command[1]))
+    return out
+
+
+def readBridge(path):
+    apdus, clocks = [], []
+    with open(path) as f:
+        for line in f:
+            try:
+                event = json.loads(line)
+            except ValueError:
+                continue
+            if event.get("event") == "apdu":
+                apdus.append(event)
+            elif event.get("event") == "clock":
+                clocks.append(event)
+    return apdus, clocks
+
+
+def transmit(conn, apdu):
+    data, sw1, sw2 = conn.transmit(apdu)
+    while sw1 == 0x61:
+        more, sw1, sw2 = conn.transmit([0x00, 0xC0, 0x00, 0x00, sw2])
+        data += more
+    return data, (sw1 << 8) | sw2
+
+
+def readDeviceLog(reader):
+    """Read the APDU log of the ESP32 (f4) into {seq: (received us, ready us, INS)}"""
+    from smartcard.System import readers
+
+    conn = readers()[reader].createConnection()
+    conn.connect()
+    transmit(conn, [0x00, 0xA4, 0x04, 0x00, 0x06, 0xD2, 0x76, 0x00, 0x01, 0x24, 0x01])
+
+    pin = [ord(c) for c in getpass("Admin PIN: ")]
+    data, sw = transmit(conn, [0x00, 0x20, 0x00, 0x83, len(pin)] + pin)
+    if sw != 0x9000:
+        sys.exit("VERIFY failed: %04X" % sw)
+
+    data, sw = transmit(conn, [0x00, 0xF4, 0x00, 0x00, 0x00])
+    if sw != 0x9000:
+        sys.exit("Failed to read the APDU log: %04X" % sw)
+
+    data = bytearray(data)
+
+    def u(pos, n):
+        return sum(data[pos + i] << (8 * (n - 1 - i)) for i in range(n))
+
+    log = {}
+    pos = 4
+    while pos + 31 <= len(data):
+        seq, received, ready, ins = u(pos, 4), u(pos + 4, 8), u(pos + 12, 8), data[pos + 21]
+        if ready:
+            log[seq] = (received, ready, ins)
+        pos += 31 + data[pos + 30]
+    return log
+
+
+def clockOffset(clocks, port, t):
+    """Offset (device us - host us) measured last before host time t (ns)"""
+    offset = None
+    for clock in clocks:
+        if clock["port"] == port and clock["t"] <= t:
+            offset = clock["offset_us"]
+    return offset
+
+
+def merge(vpcd, apdus, clocks, device):
+    requests = []
+    for event in apdus:
+        t = event["t"]
+        hops = {}
+        # The vpcd exchange with the same number, sent just before the vicc got it
+        candidates = [c for c in vpcd.get((event["port"], event["seq"]), [])
+                      if c[0] <= t["recv"] and c[2] == event["ins"]]
+        if candidates:
+            sent, received, ins = max(candidates)
+            hops["vpcd->vicc"] = t["recv"] - sent
+            hops["vicc->vpcd"] = received - t["reply"]
+            hops["total"] = received - sent
+        if "device_send" in t and "device_recv" in t:
+            hops["bridge"] = t["device_send"] - t["recv"]
+            hops["bridge reply"] = t["reply"] - t["device_recv"]
+            record = device.get(event.get("device_seq"))
+            offset = clockOffset(clocks, event["port"], t["recv"])
+            if record is not None and record[2] == event["ins"] and offset is not None:
+                devReceived = (record[0] - offset) * 1000
+                devReady = (record[1] - offset) * 1000
+                hops["uplink"] = devReceived - t["device_send"]
+                hops["device"] = devReady - devReceived
+                hops["downlink"] = t["device_recv"] - devReady
+            else:
+                hops["device+wifi"] = t["device_recv"] - t["device_send"]
+        else:
+            hops["device"] = t["reply"] - t["recv"]     # Emulated card
+        requests.append({"port": event["port"], "seq": event["seq"], "ins": event["ins"],
+                         "sw": event.get("sw"), "start": t["recv"], "hops": hops})
+    return requests
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p * len(values)))] if values else 0
+
+
+def summary(requests):
+    out = {}
+    for hop in HOPS:
+        values = [r["hops"][hop] / 1e6 for r in requests if hop in r["hops"]]
+        if values:
+            out[hop] = {"count": len(values), "p50": percentile(values, 0.5),
+                        "p90": percentile(values, 0.9), "p99": percentile(values, 0.99),
+                        "max": max(values)}
+    return out
+
+
+def printSummary(title, stats):
+    print("%-14s %7s %10s %10s %10s %10s" % (title, "count", "p50 ms", "p90 ms", "p99 ms", "max ms"))
+    for hop in HOPS:
+        if hop in stats:
+            s = stats[hop]
+            print("%-14s %7d %10.2f %10.2f %10.2f %10.2f" %
+                  (hop, s["count"], s["p50"], s["p90"], s["p99"], s["max"]))
+    print()
+
+
+def printWaterfall(request, width=60):
+    hops = [(h, request["hops"][h]) for h in HOPS[:-1] if h in request["hops"]]
+    total = float(request["hops"].get("total", sum(max(0, v) for h, v in hops))) or 1.0
+    print("port %d #%d %s, SW %s, %.2f ms" % (request["port"], request["seq"],
+          INS_NAMES.get(request["ins"], "INS %02X" % request["ins"]), request["sw"], total / 1e6))
+    pos = 0
+    for hop, value in hops:
+        n = int(round(max(0, value) / total * width))
+        print("  %-14s %s%s %8.2f ms" % (hop, " " * pos, "#" * max(n, 1), value / 1e6))
+        pos = min(width, pos + n)
+    print()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Merge the traces of vpcd, the vicc bridge and the ESP32")
+    parser.add_argument("-v", "--vpcd", required=True, help="trace written by libvpcd (VPCD_TRACE)")
+    parser.add_argument("-b", "--bridge", required=True, help="trace written by vicc --trace")
+    parser.add_argument("-r", "--reader", type=int, help="read the APDU log of the ESP32 from this PC/SC reader")
+    parser.add_argument("-w", "--waterfall", type=int, default=0, help="print the slowest COUNT APDUs")
+    parser.add_argument("-i", "--by-ins", action="store_true", help="percentiles for each instruction")
+    parser.add_argument("-j", "--json", help="write the merged APDUs and percentiles to this file")
+    args = parser.parse_args()
+
+    records, start = readTrace(args.vpcd)
+    apdus, clocks = readBridge(args.bridge)
+    device = readDeviceLog(args.reader) if args.reader is not None else {}
+
+    requests = merge(vpcdExchanges(records), apdus, clocks, device)
+    if not requests:
+        sys.exit("No APDUs in the bridge trace")
+
+    stats = summary(requests)
+    printSummary("hop", stats)
+    if args.by_ins:
+        for ins in sorted(set(r["ins"] for r in requests)):
+            printSummary(INS_NAMES.get(ins, "INS %02X" % ins), summary([r for r in requests if r["ins"] == ins]))
+    for request in sorted(requests, key=lambda r: -r["hops"].get("total", 0))[:args.waterfall]:
+        printWaterfall(request)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"hops": stats, "apdus": requests}, f, indent=1, sort_keys=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,484 @@
+/*
+ * Microbenchmark of the transmit path of vpcd (libvpcd).
+ *
+ * Runs libvpcd in server mode, as pcscd does, against a minimal vicc in
+ * a thread of the same process that answers every command APDU right
+ * away with a response of a fixed size. So the numbers are the cost of
+ * vpcd and of the loopback socket only, without Python or the ESP32,
+ * and reports per-exchange latency, throughput and heap allocations.
+ * The allocations are counted by interposing the allocator of the C
+ * library, like gpg/host/cardBench does.
+ *
+ * With -r, every iteration sends one command APDU to each of several
+ * readers, which is what a test farm of virtual readers does to vpcd.
+ *
+ * With -t, the vicc connects to a Unix domain socket instead of the
+ * loopback (unix), or exchanges the messages through shared memory (shm),
+ * so that the transports can be compared with the same exchanges.
+ *
+ * Handles:
+ *    The paths: legacy (the framing of vpcd before vicc_transmit_into:
+ *    the length and the message written separately with Nagle on, read
+ *    with two calls into a reallocated buffer, copied and freed, as
+ *    IFDHTransmitToICC did), split (the same with Nagle off), transmit
+ *    (vicc_transmit), into (vicc_transmit_into, what IFDHTransmitToICC
+ *    uses), submit (vicc_submit and vicc_complete, reader after reader)
+ *    and wait (vicc_submit to every reader, then the responses in the order
+ *    vicc_wait reports them)
+ *    The vicc threads
+ *    Per-path reports
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "shm.h"
+#include "vpcd.h"
+
+#define VPCDBENCH_ITERATIONS 200    // Default exchanges of each path (legacy waits ~40 ms each)
+#define VPCDBENCH_WARMUP 20         // Exchanges not recorded
+#define VPCDBENCH_PORT 35999        // Default port of the benchmark's vpcd
+#define VPCDBENCH_RESPONSE 64       // Default response data, without the status word
+#define VPCDBENCH_READERS 1         // Default readers, on consecutive ports
+#define VPCDBENCH_SOCKET "/tmp/vpcdBench" // Unix domain sockets, PATH.PID.READER
+#define VPCDBENCH_MAX (0xFFFF + 2)
+
+/* Allocation counting */
+
+static int counting = 0;            // Set while an exchange runs
+static uint64_t allocCount = 0;     // Allocations since the last reset
+
+#ifdef __GLIBC__
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+void* malloc(size_t size) {
+    if (counting) {
+        __atomic_add_fetch(&allocCount, 1, __ATOMIC_RELAXED);
+    }
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    if (counting) {
+        __atomic_add_fetch(&allocCount, 1, __ATOMIC_RELAXED);
+    }
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (counting) {
+        __atomic_add_fetch(&allocCount, 1, __ATOMIC_RELAXED);
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+    __libc_free(ptr);
+}
+#endif
+
+/* The vicc */
+
+static unsigned short port = VPCDBENCH_PORT;
+static size_t responseLength = VPCDBENCH_RESPONSE;
+static int readers = VPCDBENCH_READERS;
+
+typedef enum benchTransport {
+    TRANSPORT_TCP,
+    TRANSPORT_UNIX,
+    TRANSPORT_SHM,
+} benchTransport;
+
+static const char* const transportNames[] = { "tcp", "unix", "shm" };
+static const char* const transportDescriptions[] = { "over loopback", "over a Unix domain socket", "through shared memory" };
+static benchTransport transport = TRANSPORT_TCP;
+
+static void socketPath(int reader, char* path, size_t len) {
+    snprintf(path, len, "%s.%d.%d", VPCDBENCH_SOCKET, (int) getpid(), reader);
+}
+
+static int recvExactly(int sock, uint8_t* buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = recv(sock, buf + got, len - got, 0);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        got += r;
+    }
+    return 1;
+}
+
+static int connectReader(int reader) {
+    struct sockaddr_in addr;
+    struct sockaddr_un unixAddr;
+    int sock;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port + reader);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    memset(&unixAddr, 0, sizeof(unixAddr));
+    unixAddr.sun_family = AF_UNIX;
+    socketPath(reader, unixAddr.sun_path, sizeof(unixAddr.sun_path));
+    for (;;) {
+        if (transport == TRANSPORT_TCP) {
+            sock = socket(AF_INET, SOCK_STREAM, 0);
+            if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+                return sock;
+            }
+        } else {
+            sock = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (connect(sock, (struct sockaddr*) &unixAddr, sizeof(unixAddr)) == 0) {
+                return sock;
+            }
+        }
+        close(sock);
+        usleep(10000);
+    }
+}
+
+// Answers like vicc, on the connection of every reader: reads the length
+// and then the message, and writes the length and the response with one
+// call
+static void* viccThread(void* arg) {
+    static uint8_t msg[VPCDBENCH_MAX], resp[2 + VPCDBENCH_MAX];
+    struct pollfd* fds = calloc(readers, sizeof(struct pollfd));
+    int open = readers;
+    uint16_t size;
+
+    for (int i = 0; i < readers; i++) {
+        fds[i].fd = connectReader(i);
+        fds[i].events = POLLIN;
+    }
+
+    memset(resp, 0xA5, sizeof(resp));
+    while (open > 0 && poll(fds, readers, -1) > 0) {
+        for (int i = 0; i < readers; i++) {
+            size_t n = responseLength + 2;
+            if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            if (!recvExactly(fds[i].fd, (uint8_t*) &size, sizeof(size)) || !recvExactly(fds[i].fd, msg, ntohs(size))) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open--;
+                continue;
+            }
+            if (ntohs(size) == VPCD_CTRL_LEN && msg[0] != VPCD_CTRL_ATR) {
+                continue;       // Power and reset, not answered
+            }
+            resp[0] = (uint8_t) (n >> 8);
+            resp[1] = (uint8_t) n;
+            resp[n] = 0x90;
+            resp[n + 1] = 0x00;
+            if (send(fds[i].fd, resp, 2 + n, MSG_NOSIGNAL) != (ssize_t) (2 + n)) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open--;
+            }
+        }
+    }
+    free(fds);
+    return NULL;
+}
+
+// Answers like viccThread, through the rings of one reader: a thread per
+// reader, since a ring has no descriptor to poll
+static void* shmThread(void* arg) {
+    static uint8_t resp[VPCDBENCH_MAX];
+    uint8_t msg[VPCDBENCH_MAX];
+    int sock = connectReader((int) (intptr_t) arg);
+    struct vpcd_shm* shm = vpcd_shm_accept(sock);
+    ssize_t r;
+
+    memset(resp, 0xA5, sizeof(resp));
+    resp[responseLength] = 0x90;
+    resp[responseLength + 1] = 0x00;
+    while (shm != NULL && (r = vpcd_shm_recv(shm, VPCD_SHM_TO_VICC, msg, sizeof(msg), sock)) >= 0) {
+        if (r == VPCD_CTRL_LEN && msg[0] != VPCD_CTRL_ATR) {
+            continue;
+        }
+        if (vpcd_shm_send(shm, VPCD_SHM_TO_VPCD, resp, responseLength + 2, sock) < 0) {
+            break;
+        }
+    }
+    vpcd_shm_free(shm);
+    close(sock);
+    return NULL;
+}
+
+/* The paths */
+
+// The exchange of vpcd before the frame was written at once: length and
+// message in two writes, with Nagle on, and the response read into a
+// buffer reallocated for each response, then copied like
+// IFDHTransmitToICC did
+static ssize_t legacyTransmit(struct vicc_ctx* ctx, const uint8_t* apdu, size_t len, uint8_t* out, size_t outLen) {
+    uint16_t size = htons((uint16_t) len);
+    uint8_t* p = NULL;
+    ssize_t r = -1;
+
+    if (send(ctx->client_sock, &size, sizeof(size), MSG_NOSIGNAL) != sizeof(size)
+            || send(ctx->client_sock, apdu, len, MSG_NOSIGNAL) != (ssize_t) len) {
+        return -1;
+    }
+    if (recv(ctx->client_sock, &size, sizeof(size), MSG_WAITALL) != sizeof(size)) {
+        return -1;
+    }
+    size = ntohs(size);
+    if ((p = realloc(p, size)) != NULL
+            && recv(ctx->client_sock, p, size, MSG_WAITALL) == size && size <= outLen) {
+        memcpy(out, p, size);
+        r = size;
+    }
+    free(p);
+    return r;
+}
+
+static ssize_t transmitTransmit(struct vicc_ctx* ctx, const uint8_t* apdu, size_t len, uint8_t* out, size_t outLen) {
+    uint8_t* p = NULL;
+    ssize_t r = vicc_transmit(ctx, len, apdu, &p);
+    if (r > 0 && (size_t) r <= outLen) {
+        memcpy(out, p, r);
+    }
+    free(p);
+    return r;
+}
+
+static ssize_t intoTransmit(struct vicc_ctx* ctx, const uint8_t* apdu, size_t len, uint8_t* out, size_t outLen) {
+    return vicc_transmit_into(ctx, len, apdu, out, outLen);
+}
+
+static ssize_t submitTransmit(struct vicc_ctx* ctx, const uint8_t* apdu, size_t len, uint8_t* out, size_t outLen) {
+    if (vicc_submit(ctx, len, apdu) < 0) {
+        return -1;
+    }
+    return vicc_complete(ctx, out, outLen, 5, 0);
+}
+
+// All readers at once: the responses are received as vicc_wait reports
+// them. Returns the length of the last response
+static ssize_t waitRound(struct vicc_ctx** ctx, const uint8_t* apdu, size_t len, uint8_t* out, size_t outLen) {
+    ssize_t r = -1;
+    int done = 0;
+
+    for (int i = 0; i < readers; i++) {
+        if (vicc_submit(ctx[i], len, apdu) < 0) {
+            return -1;
+        }
+    }
+    while (done < readers) {
+        struct vicc_ctx* ready = vicc_wait(5, 0);
+        if (ready == NULL) {
+            return -1;
+        }
+        r = vicc_complete(ready, out, outLen, 0, 0);
+        if (r < 0 && errno == EAGAIN) {
+            continue;       // An older event, e.g. the connection of the reader
+        }
+        if (r < 0) {
+            return -1;
+        }
+        done++;
+    }
+    return r;
+}
+
+typedef struct benchPath {
+    const char* name;
+    ssize_t (*transmit)(struct vicc_ctx* ctx, const uint8_t* apdu, size_t len, uint8_t* out, size_t outLen);
+    ssize_t (*round)(struct vicc_ctx** ctx, const uint8_t* apdu, size_t len, uint8_t* out, size_t outLen);
+    int nagle;          // Leave Nagle on for the path
+    int shm;            // The path works with the shm transport
+} benchPath;
+
+static const benchPath paths[] = {
+    { "legacy", legacyTransmit, NULL, 1, 0 },
+    { "split", legacyTransmit, NULL, 0, 0 },
+    { "transmit", transmitTransmit, NULL, 0, 1 },
+    { "into", intoTransmit, NULL, 0, 1 },
+    { "submit", submitTransmit, NULL, 0, 1 },
+    { "wait", NULL, waitRound, 0, 0 },
+};
+
+#define PATHS (int) (sizeof(paths) / sizeof(paths[0]))
+
+/* Reports */
+
+static int compareNs(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-n iterations] [-s response bytes] [-p port] [-r readers] [-t tcp|unix|shm] [path ...]\nPaths:", prog);
+    for (int p = 0; p < PATHS; p++) {
+        fprintf(stderr, " %s", paths[p].name);
+    }
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    // GET DATA 6E, as GnuPG sends it most
+    static const uint8_t apdu[] = { 0x00, 0xCA, 0x00, 0x6E, 0x00 };
+    static uint8_t out[VPCDBENCH_MAX];
+    int iterations = VPCDBENCH_ITERATIONS;
+    int selected[PATHS] = { 0 };
+    int opt, any = 0;
+    pthread_t* vicc;
+    int viccThreads;
+    struct vicc_ctx** ctx;
+
+    while ((opt = getopt(argc, argv, "n:s:p:r:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 's':
+            responseLength = (size_t) atoi(optarg);
+            break;
+        case 'p':
+            port = (unsigned short) atoi(optarg);
+            break;
+        case 'r':
+            readers = atoi(optarg);
+            break;
+        case 't':
+            for (transport = TRANSPORT_TCP; transport <= TRANSPORT_SHM && strcmp(optarg, transportNames[transport]) != 0; transport++);
+            if (transport > TRANSPORT_SHM) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    for (int a = optind; a < argc; a++) {
+        int p;
+        for (p = 0; p < PATHS && strcmp(argv[a], paths[p].name) != 0; p++);
+        if (p == PATHS) {
+            usage(argv[0]);
+        }
+        selected[p] = any = 1;
+    }
+    if (iterations <= 0 || responseLength > 0xFFFF - 2 || readers <= 0 || port + readers > 0x10000) {
+        usage(argv[0]);
+    }
+
+    ctx = calloc(readers, sizeof(struct vicc_ctx*));
+    for (int i = 0; i < readers; i++) {
+        char name[128];
+        if (transport == TRANSPORT_TCP) {
+            ctx[i] = vicc_init(NULL, port + i);
+        } else {
+            size_t prefix = strlen(transport == TRANSPORT_SHM ? VPCD_SHM_PREFIX : VPCD_UNIX_PREFIX);
+            memcpy(name, transport == TRANSPORT_SHM ? VPCD_SHM_PREFIX : VPCD_UNIX_PREFIX, prefix);
+            socketPath(i, name + prefix, sizeof(name) - prefix);
+            ctx[i] = vicc_init(name, port + i);
+        }
+        if (ctx[i] == NULL) {
+            fprintf(stderr, "Could not listen on %s %d\n", transportNames[transport], port + i);
+            return 1;
+        }
+    }
+    viccThreads = transport == TRANSPORT_SHM ? readers : 1;
+    vicc = calloc(viccThreads, sizeof(pthread_t));
+    for (int i = 0; i < viccThreads; i++) {
+        pthread_create(&vicc[i], NULL, transport == TRANSPORT_SHM ? shmThread : viccThread, (void*) (intptr_t) i);
+    }
+    for (int i = 0; i < readers; i++) {
+        while (!vicc_connect(ctx[i], 1, 0));
+    }
+
+    uint64_t* samples = malloc(iterations * sizeof(uint64_t));
+    if (readers == 1) {
+        printf("%d exchanges of %zu + 2 response bytes per path, %s\n", iterations, responseLength,
+                transportDescriptions[transport]);
+    } else {
+        printf("%d rounds of one exchange of %zu + 2 response bytes with each of %d readers per path, %s (times per round)\n",
+                iterations, responseLength, readers, transportDescriptions[transport]);
+    }
+    printf("%-10s %8s %10s %10s %10s %10s %10s %10s\n", "path", "count", "mean us",
+            "p50 us", "p99 us", "max us", "ops/s", "allocs/op");
+    for (int p = 0; p < PATHS; p++) {
+        int nodelay = !paths[p].nagle;
+        uint64_t total = 0;
+        if (any && !selected[p]) {
+            continue;
+        }
+        if (transport == TRANSPORT_SHM && !paths[p].shm) {
+            if (any) {
+                printf("%-10s (not with shm: it uses the socket, or vicc_wait, which does not report the rings)\n", paths[p].name);
+            }
+            continue;
+        }
+        for (int i = 0; i < readers; i++) {
+            setsockopt(ctx[i]->client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        }
+        allocCount = 0;
+        for (int i = -VPCDBENCH_WARMUP; i < iterations; i++) {
+            ssize_t r = -1;
+            counting = (i >= 0);
+            uint64_t start = nowNs();
+            if (paths[p].round != NULL) {
+                r = paths[p].round(ctx, apdu, sizeof(apdu), out, sizeof(out));
+            } else {
+                for (int c = 0; c < readers && (c == 0 || r == (ssize_t) responseLength + 2); c++) {
+                    r = paths[p].transmit(ctx[c], apdu, sizeof(apdu), out, sizeof(out));
+                }
+            }
+            uint64_t ns = nowNs() - start;
+            counting = 0;
+            if (r != (ssize_t) responseLength + 2) {
+                fprintf(stderr, "%s: exchange failed (%zd)\n", paths[p].name, r);
+                return 1;
+            }
+            if (i >= 0) {
+                samples[i] = ns;
+                total += ns;
+            }
+        }
+        qsort(samples, iterations, sizeof(uint64_t), compareNs);
+        double mean = (double) total / iterations;
+        printf("%-10s %8d %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", paths[p].name, iterations,
+                mean / 1000, samples[iterations / 2] / 1000.0, samples[(int) (iterations * 0.99)] / 1000.0,
+                samples[iterations - 1] / 1000.0, readers * 1e9 / mean, (double) allocCount / iterations / readers);
+    }
+    free(samples);
+
+    for (int i = 0; i < readers; i++) {
+        vicc_exit(ctx[i]);
+    }
+    free(ctx);
+    for (int i = 0; i < viccThreads; i++) {
+        pthread_join(vicc[i], NULL);
+    }
+    free(vicc);
+    return 0;
+}
@@ -32,9 +32,10 @@
 #include <string.h>
 
 /* pcscd allows at most 16 readers. Apple's SmartCardServices on OS X 10.10
- * freaks out if more than 8 slots are registered. We want only two slots... */
-//#define VICC_MAX_SLOTS (VPCDSLOTS <= PCSCLITE_MAX_READERS_CONTEXTS ? VPCDSLOTS : PCSCLITE_MAX_READERS_CONTEXTS)
-#define VICC_MAX_SLOTS 1    // MODIFIED CODE: We don't really need more than 1
+ * freaks out if more than 8 slots are registered. We want only two slots...
+ * A bridge serving several ESP32 devices needs one slot per device
+ * (vicc --slots), so the count is set with --enable-vpcdslots again */
+#define VICC_MAX_SLOTS (VPCDSLOTS <= PCSCLITE_MAX_READERS_CONTEXTS ? VPCDSLOTS : PCSCLITE_MAX_READERS_CONTEXTS)
 
 const unsigned char vicc_max_slots = VICC_MAX_SLOTS;
 
@@ -103,43 +104,118 @@ void log_msg(const int priority, const char *fmt, ...)
 #endif
 #endif
 
-static struct vicc_ctx *ctx[VICC_MAX_SLOTS];
-const char *hostname = NULL;
+/* The contexts of the slots pcscd opened, one per Lun (the reader in the
+ * upper 16 bits, the slot in the lower 16 bits). pcscd counts every slot as
+ * a reader, so there are at most PCSCLITE_MAX_READERS_CONTEXTS. A context is
+ * allocated when pcscd creates the channel of its slot and has a lock of its
+ * own, so that the slots of all readers can be used at once. pcscd creates
+ * and closes the channels from one thread, before it starts and after it
+ * stops using the slot, so the table itself is not locked. */
+static struct channel {
+    DWORD Lun;
+    struct vicc_ctx *ctx;
+} channels[PCSCLITE_MAX_READERS_CONTEXTS];
+
 static const char openport[] = "/dev/null";
 
-RESPONSECODE
-IFDHCreateChannel (DWORD Lun, DWORD Channel)
+static struct vicc_ctx *
+lun2ctx (DWORD Lun)
 {
-    size_t slot = Lun & 0xffff;
-    if (slot >= vicc_max_slots) {
+    size_t i;
+    for (i = 0; i < sizeof channels / sizeof *channels; i++) {
+        if (channels[i].ctx && channels[i].Lun == Lun)
+            return channels[i].ctx;
+    }
+    return NULL;
+}
+
+/* Whether the device name selects a Unix domain socket (unix:PATH, or
+ * shm:PATH for the shared memory transport) */
+static int
+is_unix (const char *name)
+{
+    return name && (strncmp(name, VPCD_UNIX_PREFIX, strlen(VPCD_UNIX_PREFIX)) == 0
+            || strncmp(name, VPCD_SHM_PREFIX, strlen(VPCD_SHM_PREFIX)) == 0);
+}
+
+/* Open the slot of Lun: connect to hostname, or wait for the vicc if it is
+ * NULL */
+static RESPONSECODE
+create_channel (DWORD Lun, const char *hostname, DWORD Channel)
+{
+    size_t slot = Lun & 0xffff, i, unused = sizeof channels / sizeof *channels;
+    char _path[MAX_READERNAME + 8];
+    const char *name = hostname;
+    struct vicc_ctx *ctx;
+    if (slot >= vicc_max_slots || lun2ctx(Lun)) {
+        return IFD_COMMUNICATION_ERROR;
+    }
+    for (i = 0; i < sizeof channels / sizeof *channels; i++) {
+        if (!channels[i].ctx) {
+            unused = i;
+            break;
+        }
+    }
+    if (unused == sizeof channels / sizeof *channels) {
+        Log1(PCSC_LOG_ERROR, "Too many slots");
         return IFD_COMMUNICATION_ERROR;
     }
     if (!hostname)
         Log2(PCSC_LOG_INFO, "Waiting for virtual ICC on port %hu",
                 (unsigned short) (Channel+slot));
-    ctx[slot] = vicc_init(hostname, Channel+slot);
-    if (!ctx[slot]) {
+    if (is_unix(hostname) && slot) {
+        /* every reader has its own socket, PATH, PATH.1, PATH.2, ... */
+        snprintf(_path, sizeof _path, "%s.%zu", hostname, slot);
+        name = _path;
+    }
+    ctx = vicc_init(name, Channel+slot);
+    if (!ctx) {
         Log1(PCSC_LOG_ERROR, "Could not initialize connection to virtual ICC");
         return IFD_COMMUNICATION_ERROR;
     }
-    if (hostname)
+    if (ctx->path)
+        Log2(PCSC_LOG_INFO, "Waiting for virtual ICC on %s", name);
+    else if (ctx->esp)
+        Log2(PCSC_LOG_INFO, "Waiting for ESP32 on port %hu",
+                (unsigned short) (Channel+slot));
+    else if (hostname)
         Log3(PCSC_LOG_INFO, "Connected to virtual ICC on %s port %hu",
                 hostname, (unsigned short) (Channel+slot));
 
+    channels[unused].Lun = Lun;
+    channels[unused].ctx = ctx;
+
     return IFD_SUCCESS;
 }
 
+RESPONSECODE
+IFDHCreateChannel (DWORD Lun, DWORD Channel)
+{
+    /* the address configured with --enable-vpcdhost */
+    return create_channel (Lun, VPCDHOST, Channel);
+}
+
 RESPONSECODE
 IFDHCreateChannelByName (DWORD Lun, LPSTR DeviceName)
 {
     RESPONSECODE r = IFD_NOT_SUPPORTED;
     char *dots;
     char _hostname[MAX_READERNAME];
+    const char *hostname = NULL;
     size_t hostname_len;
     unsigned long int port = VPCDPORT;
 
     dots = strchr(DeviceName, ':');
-    if (dots) {
+    if (is_unix(DeviceName)) {
+        /* the path of a Unix domain socket, which may contain ':' */
+        if (strlen(DeviceName) < sizeof _hostname)
+            strcpy(_hostname, DeviceName);
+        else {
+            Log3(PCSC_LOG_ERROR, "Not enough memory to hold hostname (have %zu, need %zu)", sizeof _hostname, strlen(DeviceName));
+            goto err;
+        }
+        hostname = _hostname;
+    } else if (dots) {
         /* a port has been specified behind the device name */
 
         hostname_len = dots - DeviceName;
@@ -170,12 +246,9 @@ IFDHCreateChannelByName (DWORD Lun, LPSTR DeviceName)
         Log1(PCSC_LOG_INFO, "Using default port.");
     }
 
-    r = IFDHCreateChannel (Lun, port);
+    r = create_channel (Lun, hostname, port);
 
 err:
-    /* set hostname back to default in case it has been changed */
-    hostname = NULL;
-
     return r;
 }
 
@@ -183,28 +256,89 @@ RESPONSECODE
 IFDHControl (DWORD Lun, DWORD dwControlCode, PUCHAR TxBuffer, DWORD TxLength,
         PUCHAR RxBuffer, DWORD RxLength, LPDWORD pdwBytesReturned)
 {
-    Log9(PCSC_LOG_DEBUG, "IFDHControl not supported (Lun=%u ControlCode=%u TxBuffer=%p TxLength=%u RxBuffer=%p RxLength=%u pBytesReturned=%p)%s",
-            (unsigned int) Lun, (unsigned int) dwControlCode,
-            (unsigned char *) TxBuffer, (unsigned int) TxLength,
-            (unsigned char *) RxBuffer, (unsigned int) RxLength,
-            (unsigned int *) pdwBytesReturned, "");
-    if (pdwBytesReturned)
+    unsigned char *responses = NULL;
+    ssize_t size;
+    RESPONSECODE r = IFD_COMMUNICATION_ERROR;
+    size_t slot = Lun & 0xffff;
+
+    if (dwControlCode == IOCTL_VPCD_CANCEL && slot < vicc_max_slots) {
+        /* without the lock, the exchange holds it */
+        vicc_cancel(lun2ctx(Lun));
+        if (pdwBytesReturned)
+            *pdwBytesReturned = 0;
+        return IFD_SUCCESS;
+    }
+
+    if (dwControlCode != IOCTL_VPCD_BATCH) {
+        Log9(PCSC_LOG_DEBUG, "IFDHControl not supported (Lun=%u ControlCode=%u TxBuffer=%p TxLength=%u RxBuffer=%p RxLength=%u pBytesReturned=%p)%s",
+                (unsigned int) Lun, (unsigned int) dwControlCode,
+                (unsigned char *) TxBuffer, (unsigned int) TxLength,
+                (unsigned char *) RxBuffer, (unsigned int) RxLength,
+                (unsigned int *) pdwBytesReturned, "");
+        if (pdwBytesReturned)
+            *pdwBytesReturned = 0;
+        return IFD_ERROR_NOT_SUPPORTED;
+    }
+
+    if (slot >= vicc_max_slots) {
+        goto err;
+    }
+
+    if (!pdwBytesReturned) {
+        Log1(PCSC_LOG_ERROR, "Invalid input data");
+        goto err;
+    }
+
+    size = vicc_batch(lun2ctx(Lun), TxLength, TxBuffer, &responses);
+
+    if (size < 0 && (errno == ETIMEDOUT || errno == ECANCELED)) {
+        Log1(PCSC_LOG_ERROR, "no rapdus in time");
+        r = IFD_RESPONSE_TIMEOUT;
+        goto err;
+    }
+
+    if (size < 0) {
+        Log1(PCSC_LOG_ERROR, "could not send apdus or receive rapdus");
+        goto err;
+    }
+
+    if (RxLength < size) {
+        Log1(PCSC_LOG_ERROR, "Not enough memory for rapdus");
+        r = IFD_ERROR_INSUFFICIENT_BUFFER;
+        goto err;
+    }
+
+    *pdwBytesReturned = size;
+    memcpy(RxBuffer, responses, size);
+
+    r = IFD_SUCCESS;
+
+err:
+    if (r != IFD_SUCCESS && pdwBytesReturned)
         *pdwBytesReturned = 0;
-    return IFD_ERROR_NOT_SUPPORTED;
+
+    free(responses);
+
+    return r;
 }
 
 RESPONSECODE
 IFDHCloseChannel (DWORD Lun)
 {
-    size_t slot = Lun & 0xffff;
-    if (slot >= vicc_max_slots) {
+    size_t i;
+    for (i = 0; i < sizeof channels / sizeof *channels; i++) {
+        if (channels[i].ctx && channels[i].Lun == Lun)
+            break;
+    }
+    if (i == sizeof channels / sizeof *channels) {
         return IFD_COMMUNICATION_ERROR;
     }
-    if (vicc_exit(ctx[slot]) < 0) {
+    if (vicc_exit(channels[i].ctx) < 0) {
         Log1(PCSC_LOG_ERROR, "Could not close connection to virtual ICC");
+        channels[i].ctx = NULL;
         return IFD_COMMUNICATION_ERROR;
     }
-    ctx[slot] = NULL;
+    channels[i].ctx = NULL;
 
     return IFD_SUCCESS;
 }
@@ -212,7 +346,6 @@ IFDHCloseChannel (DWORD Lun)
 RESPONSECODE
 IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
 {
-    unsigned char *atr = NULL;
     ssize_t size;
     size_t slot = Lun & 0xffff;
     RESPONSECODE r = IFD_COMMUNICATION_ERROR;
@@ -226,7 +359,17 @@ IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
     switch (Tag) {
         case TAG_IFD_ATR:
 
-            size = vicc_getatr(ctx[slot], &atr);
+#ifndef __APPLE__
+            size = vicc_getatr_into(lun2ctx(Lun), Value, *Length);
+#else
+            /* Apple's new SmartCardServices on OS X 10.10 doesn't set the
+             * length correctly so we only check for the maximum  */
+            size = vicc_getatr_into(lun2ctx(Lun), Value, MAX_ATR_SIZE);
+#endif
+            if (size < 0 && errno == ENOBUFS) {
+                Log1(PCSC_LOG_ERROR, "Not enough memory for ATR");
+                goto err;
+            }
             if (size < 0) {
                 Log1(PCSC_LOG_ERROR, "could not get ATR");
                 goto err;
@@ -237,21 +380,7 @@ IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
             }
             Log2(PCSC_LOG_DEBUG, "Got ATR (%zd bytes)", size);
 
-#ifndef __APPLE__
-            if (*Length < size) {
-#else
-            /* Apple's new SmartCardServices on OS X 10.10 doesn't set the
-             * length correctly so we only check for the maximum  */
-            if (MAX_ATR_SIZE < size) {
-#endif
-                free(atr);
-                Log1(PCSC_LOG_ERROR, "Not enough memory for ATR");
-                goto err;
-            }
-
-            memcpy(Value, atr, size);
             *Length = size;
-            free(atr);
             break;
 
         case TAG_IFD_SLOTS_NUMBER:
@@ -270,9 +399,13 @@ IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
                 goto err;
             }
 
-            /* We are not thread safe due to
-             * the global hostname and ctx */
+#if defined(_WIN32) || defined(HAVE_PTHREAD)
+            /* every slot has a context and a lock of its own */
+            *Value  = 1;
+#else
+            /* without threads lock() does nothing, pcscd has to serialize */
             *Value  = 0;
+#endif
             *Length = 1;
             break;
 
@@ -334,7 +467,7 @@ IFDHPowerICC (DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
 
     switch (Action) {
         case IFD_POWER_DOWN:
-            if (vicc_poweroff(ctx[slot]) < 0) {
+            if (vicc_poweroff(lun2ctx(Lun)) < 0) {
                 Log1(PCSC_LOG_ERROR, "could not powerdown");
                 goto err;
             }
@@ -346,13 +479,13 @@ IFDHPowerICC (DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
 #endif
             return IFD_SUCCESS;
         case IFD_POWER_UP:
-            if (vicc_poweron(ctx[slot]) < 0) {
+            if (vicc_poweron(lun2ctx(Lun)) < 0) {
                 Log1(PCSC_LOG_ERROR, "could not powerup");
                 goto err;
             }
             break;
         case IFD_RESET:
-            if (vicc_reset(ctx[slot]) < 0) {
+            if (vicc_reset(lun2ctx(Lun)) < 0) {
                 Log1(PCSC_LOG_ERROR, "could not reset");
                 goto err;
             }
@@ -379,7 +512,6 @@ IFDHTransmitToICC (DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer,
         DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength,
         PSCARD_IO_HEADER RecvPci)
 {
-    unsigned char *rapdu = NULL;
     ssize_t size;
     RESPONSECODE r = IFD_COMMUNICATION_ERROR;
     size_t slot = Lun & 0xffff;
@@ -393,20 +525,27 @@ IFDHTransmitToICC (DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer,
         goto err;
     }
 
-    size = vicc_transmit(ctx[slot], TxLength, TxBuffer, &rapdu);
+    /* received right into pcscd's buffer */
+    size = vicc_transmit_into(lun2ctx(Lun), TxLength, TxBuffer, RxBuffer, *RxLength);
 
-    if (size < 0) {
-        Log1(PCSC_LOG_ERROR, "could not send apdu or receive rapdu");
+    if (size < 0 && errno == ENOBUFS) {
+        Log1(PCSC_LOG_ERROR, "Not enough memory for rapdu");
         goto err;
     }
 
-    if (*RxLength < size) {
-        Log1(PCSC_LOG_ERROR, "Not enough memory for rapdu");
+    if (size < 0 && (errno == ETIMEDOUT || errno == ECANCELED)) {
+        /* the card stays connected, its late rapdu is discarded */
+        Log1(PCSC_LOG_ERROR, "no rapdu in time");
+        r = IFD_RESPONSE_TIMEOUT;
+        goto err;
+    }
+
+    if (size < 0) {
+        Log1(PCSC_LOG_ERROR, "could not send apdu or receive rapdu");
         goto err;
     }
 
     *RxLength = size;
-    memcpy(RxBuffer, rapdu, size);
     RecvPci->Protocol = 1;
 
     r = IFD_SUCCESS;
@@ -415,8 +554,6 @@ err:
     if (r != IFD_SUCCESS && RxLength)
         *RxLength = 0;
 
-    free(rapdu);
-
     return r;
 }
 
@@ -427,7 +564,7 @@ IFDHICCPresence (DWORD Lun)
     if (slot >= vicc_max_slots) {
         return IFD_COMMUNICATION_ERROR;
     }
-    switch (vicc_present(ctx[slot])) {
+    switch (vicc_present(lun2ctx(Lun))) {
         case 0:
             return IFD_ICC_NOT_PRESENT;
         case 1:
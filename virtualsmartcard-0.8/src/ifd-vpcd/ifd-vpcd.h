@@ -24,7 +24,18 @@ extern "C" {
 #endif
 
 extern const unsigned char vicc_max_slots;
-extern const char *hostname;
+
+/** Control code of SCardControl for sending several APDUs at once (see
+ * vicc_batch), SCARD_CTL_CODE(3500) of pcsc-lite. The input and the output
+ * hold the APDUs and their responses, each preceded by its length (2 bytes,
+ * big endian); the responses end with the first one that is not 90 00. */
+#define IOCTL_VPCD_BATCH (0x42000000 + 3500)
+
+/** Control code of SCardControl aborting the exchange that waits for its
+ * response on the reader (see vicc_cancel), SCARD_CTL_CODE(3501). pcscd runs
+ * the control of a reader only after its exchange, so it takes effect with
+ * the libpcsclite of virtualsmartcard, whose SCardCancel sends it. */
+#define IOCTL_VPCD_CANCEL (0x42000000 + 3501)
 
 #ifdef  __cplusplus
 }
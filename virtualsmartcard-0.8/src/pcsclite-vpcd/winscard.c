@@ -41,7 +41,11 @@ struct card {
 #define SET_R_TEST(value) { r = value; if (r != SCARD_S_SUCCESS) { goto err; } }
 
 static struct card cards[PCSCLITE_MAX_READERS_CONTEXTS];
+/* readers whose vicc connected since the first context was established */
+static int seen[PCSCLITE_MAX_READERS_CONTEXTS];
 static int cancel_status = 0;
+/* calls of SCardCancel, which also aborts the running transmits */
+static volatile unsigned int cancel_count = 0;
 static size_t context_count = 0;
 
 static const char reader_format_str[] = "Virtual PCD %02"SCNu32;
@@ -52,7 +56,6 @@ const SCARD_IO_REQUEST g_rgSCardT0Pci, g_rgSCardT1Pci, g_rgSCardRawPci;
 
 /* part of libvpcd, but not exported */
 extern const unsigned char vicc_max_slots;
-extern const char *hostname;
 
 static LONG autoallocate(void *buf, LPDWORD len, DWORD max, void **rbuf)
 {
@@ -84,15 +87,13 @@ static void initialize_globals(void)
 {
     uint32_t index;
     DWORD Channel = VPCDPORT;
-    const char *hostname_old = hostname;
 
-    hostname = VPCDHOST;
+    /* connects to VPCDHOST */
     for (index = 0;
             index < PCSCLITE_MAX_READERS_CONTEXTS && index < vicc_max_slots;
             index++) {
         IFDHCreateChannel ((DWORD) index, Channel);
     }
-    hostname = hostname_old;
 }
 
 static void release_globals(void)
@@ -104,6 +105,30 @@ static void release_globals(void)
         IFDHCloseChannel ((DWORD) index);
     }
     memset(cards, 0, sizeof cards);
+    memset(seen, 0, sizeof seen);
+}
+
+/* The first reader is always listed, the others appear when their vicc
+ * connects for the first time and stay */
+static int reader_listed(uint32_t index)
+{
+    if (index >= PCSCLITE_MAX_READERS_CONTEXTS || index >= vicc_max_slots)
+        return 0;
+    if (!seen[index] && (index == 0
+                || IFDHICCPresence((DWORD) index) == IFD_ICC_PRESENT))
+        seen[index] = 1;
+    return seen[index];
+}
+
+static DWORD readers_listed(void)
+{
+    uint32_t index;
+    DWORD count = 0;
+    for (index = 0; index < PCSCLITE_MAX_READERS_CONTEXTS; index++) {
+        if (reader_listed(index))
+            count++;
+    }
+    return count;
 }
 
 static LONG handle2card(SCARDHANDLE hCard, struct card **card)
@@ -435,9 +460,17 @@ PCSC_API LONG SCardGetStatusChange(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCA
                 /* this reader should be ignored */
                 continue;
 
-            if (strcmp(rgReaderStates[i].szReader, "\\\\?PnP?\\Notification") == 0)
-                /* we don't allow readers to be added or removed */
+            if (strcmp(rgReaderStates[i].szReader, "\\\\?PnP?\\Notification") == 0) {
+                /* like pcsc-lite, the number of readers in the upper 16 bits
+                 * changes when a reader was added */
+                rgReaderStates[i].dwEventState = readers_listed() << 16;
+                if ((rgReaderStates[i].dwCurrentState >> 16)
+                        != (rgReaderStates[i].dwEventState >> 16)) {
+                    rgReaderStates[i].dwEventState |= SCARD_STATE_CHANGED;
+                    event_count++;
+                }
                 continue;
+            }
 
             rgReaderStates[i].dwEventState = 0;
 
@@ -495,7 +528,13 @@ PCSC_API LONG SCardGetStatusChange(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCA
 
 PCSC_API LONG SCardCancel(SCARDHANDLE hCard)
 {
+    DWORD index;
+
     cancel_status = 1;
+    cancel_count++;
+    for (index = 0; index < vicc_max_slots; index++)
+        IFDHControl(index, IOCTL_VPCD_CANCEL, NULL, 0, NULL, 0, NULL);
+
     return SCARD_S_SUCCESS;
 }
 
@@ -510,15 +549,19 @@ PCSC_API LONG SCardTransmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci, L
 {
     DWORD Lun = hCard;
     LONG r;
+    unsigned int cancels = cancel_count;
     /* ignored */
     SCARD_IO_HEADER SendPci, RecvPci;
 
     /* transceive data */
-    SET_R_TEST( responsecode2long(
+    r = responsecode2long(
                 IFDHTransmitToICC (Lun, SendPci, (PUCHAR) pbSendBuffer,
-                    cbSendLength, pbRecvBuffer, pcbRecvLength, &RecvPci)));
+                    cbSendLength, pbRecvBuffer, pcbRecvLength, &RecvPci));
+
+    /* the exchange was aborted by SCardCancel */
+    if (r == SCARD_E_TIMEOUT && cancels != cancel_count)
+        r = SCARD_E_CANCELLED;
 
-err:
     return r;
 }
 
@@ -552,6 +595,9 @@ PCSC_API LONG SCardListReaders(SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR ms
 
     /* write reader names */
     for (index = 0; index < PCSCLITE_MAX_READERS_CONTEXTS; index++) {
+        if (!reader_listed(index))
+            continue;
+
         /* what memory we have left */
         readerlen = *pcchReaders - readerslen;
 
@@ -17,6 +17,10 @@
  * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 
 #ifdef _WIN32
@@ -28,6 +32,11 @@ int lock(void *io_lock)
     return 1;
 }
 
+int trylock(void *io_lock)
+{
+    return TryEnterCriticalSection(io_lock) ? 1 : 0;
+}
+
 int unlock(void *io_lock)
 {
 	LeaveCriticalSection(io_lock);
@@ -37,15 +46,17 @@ int unlock(void *io_lock)
 void *create_lock(void)
 {
     CRITICAL_SECTION *io_lock = malloc(sizeof *io_lock);
-    InitializeCriticalSection(io_lock);
-    /* FIXME error handling */
+    if (io_lock)
+        InitializeCriticalSection(io_lock);
     return io_lock;
 }
 
 void free_lock(void *io_lock)
 {
-    DeleteCriticalSection(io_lock);
-    free(io_lock);
+    if (io_lock) {
+        DeleteCriticalSection(io_lock);
+        free(io_lock);
+    }
 }
 
 #else
@@ -55,15 +66,23 @@ void free_lock(void *io_lock)
 
 int lock(void *io_lock)
 {
-    r = 0;
+    int r = 0;
     if (0 == pthread_mutex_lock(io_lock))
         r = 1;
     return r;
 }
 
+int trylock(void *io_lock)
+{
+    int r = 0;
+    if (0 == pthread_mutex_trylock(io_lock))
+        r = 1;
+    return r;
+}
+
 int unlock(void *io_lock)
 {
-    r = 0;
+    int r = 0;
     if (0 == pthread_mutex_unlock(io_lock))
         r = 1;
     return r;
@@ -72,16 +91,19 @@ int unlock(void *io_lock)
 void *create_lock(void)
 {
     pthread_mutex_t *io_lock = malloc(sizeof *io_lock);
-    if (io_lock) {
-        *io_lock = PTHREAD_MUTEX_INITIALIZER;
+    if (io_lock && 0 != pthread_mutex_init(io_lock, NULL)) {
+        free(io_lock);
+        io_lock = NULL;
     }
     return io_lock;
 }
 
 void free_lock(void *io_lock)
 {
-    pthread_mutex_destroy(io_lock);
-    free(io_lock);
+    if (io_lock) {
+        pthread_mutex_destroy(io_lock);
+        free(io_lock);
+    }
 }
 
 #else
@@ -91,6 +113,11 @@ int lock(void *io_lock)
     return 1;
 }
 
+int trylock(void *io_lock)
+{
+    return 1;
+}
+
 int unlock(void *io_lock)
 {
     return 1;
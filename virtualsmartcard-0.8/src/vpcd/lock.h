@@ -24,6 +24,8 @@ extern "C" {
 #endif
 
 int lock(void *io_lock);
+/* Take the lock if it is free, 0 if another thread holds it */
+int trylock(void *io_lock);
 int unlock(void *io_lock);
 void *create_lock(void);
 void free_lock(void *io_lock);
@@ -0,0 +1,549 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "manager.h"
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+
+#ifndef __linux__
+
+int vpcd_manager_add(struct vicc_ctx *ctx)
+{
+    return 0;
+}
+
+void vpcd_manager_remove(struct vicc_ctx *ctx)
+{
+}
+
+SOCKET vpcd_manager_accept(struct vicc_ctx *ctx, long secs, long usecs)
+{
+    return (SOCKET) -1;
+}
+
+void vpcd_manager_attach(struct vicc_ctx *ctx)
+{
+}
+
+void vpcd_manager_detach(struct vicc_ctx *ctx)
+{
+}
+
+int vpcd_manager_arm(struct vicc_ctx *ctx)
+{
+    return 0;
+}
+
+void vpcd_manager_done(struct vicc_ctx *ctx)
+{
+}
+
+struct vicc_ctx *vpcd_manager_next(long secs, long usecs)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+#else
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INVALID_SOCKET -1
+
+/* Events taken with one epoll_wait */
+#define MANAGER_EVENTS 64
+
+/* Data of the event of the eventfd stopping the thread */
+#define MANAGER_WAKE UINT64_MAX
+
+struct vpcd_slot {
+    struct vicc_ctx *ctx;
+    /* entry in manager_slots, and the generation of the entry, so that
+     * events still pending for a removed context are told apart from those
+     * of the next context in the same entry */
+    uint32_t index;
+    uint32_t generation;
+    /* connection accepted by the thread and not yet taken by the context */
+    SOCKET accepted;
+    pthread_cond_t accepted_cond;
+    /* the listening socket is armed */
+    int listening;
+    /* an event happened that vicc_wait has not reported yet */
+    int ready;
+    /* on the queue of vicc_wait */
+    int queued;
+    struct vpcd_slot *next;
+};
+
+/* Serializes vpcd_manager_add and vpcd_manager_remove, which start and
+ * stop the thread */
+static pthread_mutex_t manager_users_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int manager_users = 0;
+
+/* Everything below is shared with the thread */
+static pthread_mutex_t manager_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t manager_queue_cond;
+static pthread_t manager_thread;
+static int manager_epoll = -1;
+static int manager_wake = -1;
+static struct vpcd_slot **manager_slots = NULL;
+static uint32_t manager_capacity = 0;
+static uint32_t manager_generation = 0;
+static struct vpcd_slot *queue_head = NULL, *queue_tail = NULL;
+
+static uint64_t key(struct vpcd_slot *slot, int listening)
+{
+    return (uint64_t) slot->generation << 32 | slot->index << 1 | (listening ? 1 : 0);
+}
+
+static struct vpcd_slot *lookup(uint64_t data, int *listening)
+{
+    uint32_t index = (uint32_t) data >> 1;
+    struct vpcd_slot *slot;
+
+    if (index >= manager_capacity)
+        return NULL;
+    slot = manager_slots[index];
+    if (!slot || slot->generation != (uint32_t) (data >> 32))
+        return NULL;
+    *listening = data & 1;
+
+    return slot;
+}
+
+static void deadline(struct timespec *t, long secs, long usecs)
+{
+    clock_gettime(CLOCK_MONOTONIC, t);
+    t->tv_sec += secs + usecs / 1000000;
+    t->tv_nsec += (usecs % 1000000) * 1000;
+    if (t->tv_nsec >= 1000000000) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000;
+    }
+}
+
+static int cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    int r;
+
+    if (pthread_condattr_init(&attr) != 0)
+        return 0;
+    r = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0
+        && pthread_cond_init(cond, &attr) == 0;
+    pthread_condattr_destroy(&attr);
+
+    return r;
+}
+
+/* The following functions are called with manager_mutex held */
+
+static void queue(struct vpcd_slot *slot)
+{
+    slot->ready = 1;
+    if (!slot->queued) {
+        slot->queued = 1;
+        slot->next = NULL;
+        if (queue_tail)
+            queue_tail->next = slot;
+        else
+            queue_head = slot;
+        queue_tail = slot;
+    }
+    pthread_cond_signal(&manager_queue_cond);
+}
+
+static void unqueue(struct vpcd_slot *slot)
+{
+    struct vpcd_slot *prev = NULL, *cur;
+
+    if (!slot->queued)
+        return;
+    for (cur = queue_head; cur != slot; prev = cur, cur = cur->next);
+    if (prev)
+        prev->next = slot->next;
+    else
+        queue_head = slot->next;
+    if (queue_tail == slot)
+        queue_tail = prev;
+    slot->queued = 0;
+}
+
+static void listen_again(struct vpcd_slot *slot)
+{
+    struct epoll_event ev;
+
+    if (slot->listening || slot->accepted != INVALID_SOCKET
+            || slot->ctx->server_sock == INVALID_SOCKET)
+        return;
+
+    ev.events = EPOLLIN|EPOLLONESHOT;
+    ev.data.u64 = key(slot, 1);
+    if (epoll_ctl(manager_epoll, EPOLL_CTL_MOD, slot->ctx->server_sock, &ev) == 0)
+        slot->listening = 1;
+}
+
+static void accept_client(struct vpcd_slot *slot)
+{
+    SOCKET client;
+
+    slot->listening = 0;
+    client = accept(slot->ctx->server_sock, NULL, NULL);
+    if (client == INVALID_SOCKET) {
+        /* The client gave up before it was accepted. On other errors (e.g.
+         * out of descriptors) the next vpcd_manager_accept tries again */
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED
+                || errno == EINTR)
+            listen_again(slot);
+        return;
+    }
+
+    slot->accepted = client;
+    pthread_cond_signal(&slot->accepted_cond);
+    queue(slot);
+}
+
+static void *manager_loop(void *arg)
+{
+    struct epoll_event events[MANAGER_EVENTS];
+    struct vpcd_slot *slot;
+    int i, n, listening;
+
+    for (;;) {
+        n = epoll_wait(manager_epoll, events, MANAGER_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        pthread_mutex_lock(&manager_mutex);
+        for (i = 0; i < n; i++) {
+            if (events[i].data.u64 == MANAGER_WAKE) {
+                pthread_mutex_unlock(&manager_mutex);
+                return NULL;
+            }
+            slot = lookup(events[i].data.u64, &listening);
+            if (!slot)
+                /* the context was removed */
+                continue;
+            if (listening)
+                accept_client(slot);
+            else
+                /* a response, or the connection was closed */
+                queue(slot);
+        }
+        pthread_mutex_unlock(&manager_mutex);
+    }
+
+    return NULL;
+}
+
+static int manager_start(void)
+{
+    struct epoll_event ev;
+
+    manager_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (manager_epoll < 0)
+        goto err;
+    manager_wake = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if (manager_wake < 0)
+        goto err;
+    ev.events = EPOLLIN;
+    ev.data.u64 = MANAGER_WAKE;
+    if (epoll_ctl(manager_epoll, EPOLL_CTL_ADD, manager_wake, &ev) != 0)
+        goto err;
+    if (!cond_init(&manager_queue_cond))
+        goto err;
+    if (pthread_create(&manager_thread, NULL, manager_loop, NULL) != 0) {
+        pthread_cond_destroy(&manager_queue_cond);
+        goto err;
+    }
+
+    return 1;
+
+err:
+    if (manager_wake >= 0)
+        close(manager_wake);
+    if (manager_epoll >= 0)
+        close(manager_epoll);
+    manager_wake = -1;
+    manager_epoll = -1;
+
+    return 0;
+}
+
+static void manager_stop(void)
+{
+    uint64_t one = 1;
+
+    if (write(manager_wake, &one, sizeof one) == sizeof one)
+        pthread_join(manager_thread, NULL);
+    else
+        pthread_detach(manager_thread);
+    close(manager_wake);
+    close(manager_epoll);
+    manager_wake = -1;
+    manager_epoll = -1;
+    pthread_cond_destroy(&manager_queue_cond);
+
+    free(manager_slots);
+    manager_slots = NULL;
+    manager_capacity = 0;
+    queue_head = queue_tail = NULL;
+}
+
+int vpcd_manager_add(struct vicc_ctx *ctx)
+{
+    struct vpcd_slot *slot, **slots;
+    struct epoll_event ev;
+    uint32_t i, capacity;
+    int flags, r = 0;
+
+    if (!ctx)
+        return 0;
+
+    slot = calloc(1, sizeof *slot);
+    if (!slot)
+        return 0;
+    slot->ctx = ctx;
+    slot->accepted = INVALID_SOCKET;
+    if (!cond_init(&slot->accepted_cond)) {
+        free(slot);
+        return 0;
+    }
+
+    pthread_mutex_lock(&manager_users_mutex);
+    if (!manager_users && !manager_start())
+        goto err;
+
+    pthread_mutex_lock(&manager_mutex);
+    for (i = 0; i < manager_capacity && manager_slots[i]; i++);
+    if (i == manager_capacity) {
+        capacity = manager_capacity ? 2*manager_capacity : 16;
+        slots = realloc(manager_slots, capacity * sizeof *slots);
+        if (slots) {
+            for (i = manager_capacity; i < capacity; i++)
+                slots[i] = NULL;
+            i = manager_capacity;
+            manager_slots = slots;
+            manager_capacity = capacity;
+        }
+    }
+    if (i < manager_capacity) {
+        slot->index = i;
+        slot->generation = ++manager_generation;
+        manager_slots[i] = slot;
+        r = 1;
+    }
+    pthread_mutex_unlock(&manager_mutex);
+
+    if (r && ctx->server_sock != INVALID_SOCKET) {
+        /* the thread accepts only when a client is waiting, but it may have
+         * given up in the meantime */
+        flags = fcntl(ctx->server_sock, F_GETFL);
+        ev.events = EPOLLIN|EPOLLONESHOT;
+        ev.data.u64 = key(slot, 1);
+        slot->listening = 1;
+        if (flags < 0 || fcntl(ctx->server_sock, F_SETFL, flags|O_NONBLOCK) < 0
+                || epoll_ctl(manager_epoll, EPOLL_CTL_ADD, ctx->server_sock, &ev) != 0) {
+            pthread_mutex_lock(&manager_mutex);
+            manager_slots[slot->index] = NULL;
+            pthread_mutex_unlock(&manager_mutex);
+            r = 0;
+        }
+    }
+
+    if (r) {
+        ctx->slot = slot;
+        manager_users++;
+    } else if (!manager_users) {
+        manager_stop();
+    }
+
+err:
+    pthread_mutex_unlock(&manager_users_mutex);
+    if (!r) {
+        pthread_cond_destroy(&slot->accepted_cond);
+        free(slot);
+    }
+
+    return r;
+}
+
+void vpcd_manager_remove(struct vicc_ctx *ctx)
+{
+    struct vpcd_slot *slot;
+
+    if (!ctx || !ctx->slot)
+        return;
+    slot = ctx->slot;
+
+    pthread_mutex_lock(&manager_users_mutex);
+
+    if (ctx->server_sock != INVALID_SOCKET)
+        epoll_ctl(manager_epoll, EPOLL_CTL_DEL, ctx->server_sock, NULL);
+    if (ctx->client_sock != INVALID_SOCKET)
+        epoll_ctl(manager_epoll, EPOLL_CTL_DEL, ctx->client_sock, NULL);
+
+    pthread_mutex_lock(&manager_mutex);
+    manager_slots[slot->index] = NULL;
+    unqueue(slot);
+    if (slot->accepted != INVALID_SOCKET)
+        close(slot->accepted);
+    pthread_mutex_unlock(&manager_mutex);
+
+    pthread_cond_destroy(&slot->accepted_cond);
+    free(slot);
+    ctx->slot = NULL;
+
+    if (!--manager_users)
+        manager_stop();
+
+    pthread_mutex_unlock(&manager_users_mutex);
+}
+
+SOCKET vpcd_manager_accept(struct vicc_ctx *ctx, long secs, long usecs)
+{
+    struct vpcd_slot *slot = ctx->slot;
+    struct timespec until;
+    SOCKET client;
+
+    deadline(&until, secs, usecs);
+
+    pthread_mutex_lock(&manager_mutex);
+    /* after a failed accept */
+    listen_again(slot);
+    while (slot->accepted == INVALID_SOCKET && (secs > 0 || usecs > 0)
+            && pthread_cond_timedwait(&slot->accepted_cond, &manager_mutex,
+                &until) != ETIMEDOUT);
+    client = slot->accepted;
+    slot->accepted = INVALID_SOCKET;
+    pthread_mutex_unlock(&manager_mutex);
+
+    return client;
+}
+
+void vpcd_manager_attach(struct vicc_ctx *ctx)
+{
+    struct vpcd_slot *slot = ctx->slot;
+    struct epoll_event ev;
+
+    if (!slot || ctx->client_sock == INVALID_SOCKET)
+        return;
+
+    /* report only that the client closed the connection until a command
+     * is submitted */
+    ev.events = EPOLLRDHUP|EPOLLONESHOT;
+    ev.data.u64 = key(slot, 0);
+    epoll_ctl(manager_epoll, EPOLL_CTL_ADD, ctx->client_sock, &ev);
+}
+
+void vpcd_manager_detach(struct vicc_ctx *ctx)
+{
+    struct vpcd_slot *slot = ctx->slot;
+
+    if (!slot || ctx->client_sock == INVALID_SOCKET)
+        return;
+
+    epoll_ctl(manager_epoll, EPOLL_CTL_DEL, ctx->client_sock, NULL);
+
+    pthread_mutex_lock(&manager_mutex);
+    listen_again(slot);
+    pthread_mutex_unlock(&manager_mutex);
+}
+
+int vpcd_manager_arm(struct vicc_ctx *ctx)
+{
+    struct vpcd_slot *slot = ctx->slot;
+    struct epoll_event ev;
+
+    if (!slot || ctx->client_sock == INVALID_SOCKET)
+        return 0;
+
+    ev.events = EPOLLIN|EPOLLRDHUP|EPOLLONESHOT;
+    ev.data.u64 = key(slot, 0);
+
+    return epoll_ctl(manager_epoll, EPOLL_CTL_MOD, ctx->client_sock, &ev) == 0;
+}
+
+void vpcd_manager_done(struct vicc_ctx *ctx)
+{
+    struct vpcd_slot *slot = ctx->slot;
+
+    if (!slot)
+        return;
+
+    pthread_mutex_lock(&manager_mutex);
+    slot->ready = 0;
+    pthread_mutex_unlock(&manager_mutex);
+}
+
+struct vicc_ctx *vpcd_manager_next(long secs, long usecs)
+{
+    struct vpcd_slot *slot;
+    struct vicc_ctx *ctx = NULL;
+    struct timespec until;
+
+    deadline(&until, secs, usecs);
+
+    pthread_mutex_lock(&manager_users_mutex);
+    if (!manager_users) {
+        pthread_mutex_unlock(&manager_users_mutex);
+        errno = ENOSYS;
+        return NULL;
+    }
+    pthread_mutex_unlock(&manager_users_mutex);
+
+    pthread_mutex_lock(&manager_mutex);
+    for (;;) {
+        /* skip the contexts whose event was taken by vicc_complete */
+        while (queue_head && !queue_head->ready) {
+            slot = queue_head;
+            unqueue(slot);
+        }
+        if (queue_head) {
+            slot = queue_head;
+            unqueue(slot);
+            slot->ready = 0;
+            ctx = slot->ctx;
+            break;
+        }
+        if ((secs <= 0 && usecs <= 0)
+                || pthread_cond_timedwait(&manager_queue_cond, &manager_mutex,
+                    &until) == ETIMEDOUT) {
+            errno = ETIMEDOUT;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&manager_mutex);
+
+    return ctx;
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _VPCD_MANAGER_H_
+#define _VPCD_MANAGER_H_
+
+#include "vpcd.h"
+
+/**
+ * Connection manager of the contexts of a process.
+ *
+ * One thread waits with epoll on the listening sockets of all contexts and
+ * on their connections. It accepts the connection of a vicc (or an ESP32) as
+ * soon as it arrives and hands it to the context, which takes it with \a
+ * vpcd_manager_accept, instead of every reader polling its own socket with
+ * select. It also queues the contexts whose connection got a response (\a
+ * vpcd_manager_arm) or was closed, for \a vicc_wait.
+ *
+ * The manager needs epoll (Linux). Elsewhere \a vpcd_manager_add leaves the
+ * context unmanaged and libvpcd accepts with select.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Manage the sockets of a context, starting the thread for the first.
+ *
+ * @return 1 if the context is managed, 0 if not (no epoll or an error)
+ */
+int vpcd_manager_add(struct vicc_ctx *ctx);
+
+/** @brief Stop managing the context; the thread ends with the last one. */
+void vpcd_manager_remove(struct vicc_ctx *ctx);
+
+/**
+ * @brief Take the connection accepted on the listening socket of the
+ * context, waiting for one at most \a secs seconds and \a usecs microseconds.
+ *
+ * @return The connection or INVALID_SOCKET
+ */
+SOCKET vpcd_manager_accept(struct vicc_ctx *ctx, long secs, long usecs);
+
+/** @brief Watch the new connection of the context (ctx->client_sock). */
+void vpcd_manager_attach(struct vicc_ctx *ctx);
+
+/**
+ * @brief Forget the connection of the context before it is closed, and
+ * accept the next one.
+ */
+void vpcd_manager_detach(struct vicc_ctx *ctx);
+
+/** @brief Queue the context once its connection gets a response. */
+int vpcd_manager_arm(struct vicc_ctx *ctx);
+
+/** @brief Take the context off the queue, its response was received. */
+void vpcd_manager_done(struct vicc_ctx *ctx);
+
+/**
+ * @brief Wait for the next queued context.
+ *
+ * @return The context, or NULL with errno set to ETIMEDOUT, or to ENOSYS
+ *         without the manager.
+ */
+struct vicc_ctx *vpcd_manager_next(long secs, long usecs);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
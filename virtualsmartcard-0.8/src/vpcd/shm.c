@@ -0,0 +1,468 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+/* memfd_create */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include "shm.h"
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+
+#ifndef __linux__
+
+struct vpcd_shm *vpcd_shm_offer(SOCKET sock)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+struct vpcd_shm *vpcd_shm_accept(SOCKET sock)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void vpcd_shm_free(struct vpcd_shm *shm)
+{
+}
+
+ssize_t vpcd_shm_send(struct vpcd_shm *shm, int ring,
+        const unsigned char *buffer, size_t length, SOCKET sock)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+ssize_t vpcd_shm_recv(struct vpcd_shm *shm, int ring,
+        unsigned char *buffer, size_t length, SOCKET sock)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int vpcd_shm_wait(struct vpcd_shm *shm, int ring, SOCKET sock,
+        long secs, long usecs)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#else
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Bytes of a ring, a power of two holding at least one message of the
+ * largest size (2 + 0xFFFF) */
+#define SHM_RING_SIZE (1 << 17)
+
+/* Tells a region of this version from anything else passed on the socket */
+#define SHM_MAGIC 0x76706331
+
+/* Nanoseconds a side checks its ring before it sleeps, if another CPU can
+ * run the other side meanwhile */
+#define SHM_SPIN_NS 20000
+
+#define SHM_CACHE_LINE 64
+
+/* A ring of bytes with one sender and one receiver. head and tail count the
+ * bytes written and read (modulo 2^32), each is advanced by one side only.
+ * Whoever sleeps on a counter until the other side advances it says so in
+ * its sleepers, so that the other side makes the futex call only then. */
+struct shm_ring {
+    uint32_t head;
+    uint32_t head_sleepers;
+    unsigned char pad0[SHM_CACHE_LINE - 2*sizeof(uint32_t)];
+    uint32_t tail;
+    uint32_t tail_sleepers;
+    unsigned char pad1[SHM_CACHE_LINE - 2*sizeof(uint32_t)];
+    unsigned char data[SHM_RING_SIZE];
+};
+
+struct shm_region {
+    uint32_t magic;
+    uint32_t ring_size;
+    unsigned char pad[SHM_CACHE_LINE - 2*sizeof(uint32_t)];
+    struct shm_ring ring[2];
+};
+
+struct vpcd_shm {
+    struct shm_region *region;
+};
+
+static void relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Whether spinning can pay off: on a single CPU it only delays the side
+ * that would advance the ring */
+static int spin(void)
+{
+    static int cpus = 0;
+    if (!cpus)
+        cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 1;
+}
+
+/* Whether the other side still holds the socket open */
+static int alive(SOCKET sock)
+{
+    unsigned char c;
+    int e = errno;
+    ssize_t r = recv(sock, (void *) &c, 1, MSG_PEEK|MSG_DONTWAIT);
+    int open = r > 0 || (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+                || errno == EINTR));
+    errno = e;
+    return open;
+}
+
+/* Wait until *word is no longer seen, at most timeout nanoseconds (forever
+ * if negative). Returns 1 if it changed, 0 on timeout, -1 if the socket was
+ * closed */
+static int await(uint32_t *word, uint32_t *sleepers, uint32_t seen,
+        SOCKET sock, int64_t timeout)
+{
+    struct timespec slice;
+    int64_t start, left;
+    int i;
+
+    start = now_ns();
+    if (timeout != 0 && spin()) {
+        for (i = 1; ; i++) {
+            if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen)
+                return 1;
+            relax();
+            if (i % 64 == 0 && now_ns() - start >= SHM_SPIN_NS)
+                break;
+        }
+    }
+
+    for (;;) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen)
+            return 1;
+
+        left = (int64_t) VPCD_SHM_CHECK_MS * 1000000;
+        if (timeout >= 0) {
+            if (now_ns() - start >= timeout)
+                return 0;
+            if (timeout - (now_ns() - start) < left)
+                left = timeout - (now_ns() - start);
+        }
+        slice.tv_sec = left / 1000000000;
+        slice.tv_nsec = left % 1000000000;
+
+        /* the sender advances the counter before it reads sleepers, the
+         * futex only sleeps if the counter was not advanced yet */
+        __atomic_add_fetch(sleepers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == seen)
+            syscall(SYS_futex, word, FUTEX_WAIT, seen, &slice, NULL, 0);
+        __atomic_sub_fetch(sleepers, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen)
+            return 1;
+        if (!alive(sock)) {
+            errno = ECONNRESET;
+            return -1;
+        }
+    }
+}
+
+static void advance(uint32_t *word, uint32_t *sleepers, uint32_t value)
+{
+    __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(sleepers, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void copy_in(struct shm_ring *r, uint32_t pos,
+        const unsigned char *buffer, size_t length)
+{
+    size_t offset = pos & (SHM_RING_SIZE - 1);
+    size_t first = length < SHM_RING_SIZE - offset ?
+        length : SHM_RING_SIZE - offset;
+
+    memcpy(r->data + offset, buffer, first);
+    memcpy(r->data, buffer + first, length - first);
+}
+
+static void copy_out(struct shm_ring *r, uint32_t pos,
+        unsigned char *buffer, size_t length)
+{
+    size_t offset = pos & (SHM_RING_SIZE - 1);
+    size_t first = length < SHM_RING_SIZE - offset ?
+        length : SHM_RING_SIZE - offset;
+
+    memcpy(buffer, r->data + offset, first);
+    memcpy(buffer + first, r->data, length - first);
+}
+
+static struct vpcd_shm *map(int fd)
+{
+    struct vpcd_shm *shm = malloc(sizeof *shm);
+    void *p;
+
+    if (!shm)
+        return NULL;
+
+    p = mmap(NULL, sizeof *shm->region, PROT_READ|PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    if (p == MAP_FAILED) {
+        free(shm);
+        return NULL;
+    }
+    shm->region = p;
+
+    return shm;
+}
+
+struct vpcd_shm *vpcd_shm_offer(SOCKET sock)
+{
+    struct vpcd_shm *shm = NULL;
+    union {
+        struct cmsghdr header;
+        unsigned char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    unsigned char c = 'S';
+    int fd;
+
+    fd = memfd_create("vpcd", MFD_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, sizeof *shm->region) != 0)
+        goto err;
+
+    shm = map(fd);
+    if (!shm)
+        goto err;
+    shm->region->magic = SHM_MAGIC;
+    shm->region->ring_size = SHM_RING_SIZE;
+
+    iov.iov_base = &c;
+    iov.iov_len = sizeof c;
+    memset(&msg, 0, sizeof msg);
+    memset(&control, 0, sizeof control);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof control.buffer;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof c) {
+        vpcd_shm_free(shm);
+        shm = NULL;
+    }
+
+err:
+    close(fd);
+
+    return shm;
+}
+
+struct vpcd_shm *vpcd_shm_accept(SOCKET sock)
+{
+    struct vpcd_shm *shm = NULL;
+    union {
+        struct cmsghdr header;
+        unsigned char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    struct stat st;
+    unsigned char c;
+    ssize_t r;
+    int fd = -1;
+
+    iov.iov_base = &c;
+    iov.iov_len = sizeof c;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof control.buffer;
+
+    do {
+        r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0)
+        return NULL;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET
+            && cmsg->cmsg_type == SCM_RIGHTS
+            && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+
+    if (r != sizeof c || c != 'S' || fd < 0
+            || fstat(fd, &st) != 0
+            || (size_t) st.st_size < sizeof *shm->region) {
+        errno = EPROTO;
+        goto err;
+    }
+
+    shm = map(fd);
+    if (shm && (shm->region->magic != SHM_MAGIC
+                || shm->region->ring_size != SHM_RING_SIZE)) {
+        vpcd_shm_free(shm);
+        shm = NULL;
+        errno = EPROTO;
+    }
+
+err:
+    if (fd >= 0)
+        close(fd);
+
+    return shm;
+}
+
+void vpcd_shm_free(struct vpcd_shm *shm)
+{
+    if (shm) {
+        munmap(shm->region, sizeof *shm->region);
+        free(shm);
+    }
+}
+
+ssize_t vpcd_shm_send(struct vpcd_shm *shm, int ring,
+        const unsigned char *buffer, size_t length, SOCKET sock)
+{
+    struct shm_ring *r;
+    unsigned char size[2];
+    uint32_t head, tail;
+
+    if (!shm || (ring != VPCD_SHM_TO_VICC && ring != VPCD_SHM_TO_VPCD)
+            || length > 0xFFFF || (!buffer && length)) {
+        errno = EINVAL;
+        return -1;
+    }
+    r = &shm->region->ring[ring];
+
+    /* only the sender writes head */
+    head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    for (;;) {
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (SHM_RING_SIZE - (head - tail) >= sizeof size + length)
+            break;
+        if (await(&r->tail, &r->tail_sleepers, tail, sock, -1) < 0)
+            return -1;
+    }
+
+    size[0] = (unsigned char) (length >> 8);
+    size[1] = (unsigned char) length;
+    copy_in(r, head, size, sizeof size);
+    copy_in(r, head + sizeof size, buffer, length);
+    advance(&r->head, &r->head_sleepers, head + sizeof size + length);
+
+    return (ssize_t) length;
+}
+
+ssize_t vpcd_shm_recv(struct vpcd_shm *shm, int ring,
+        unsigned char *buffer, size_t length, SOCKET sock)
+{
+    struct shm_ring *r;
+    unsigned char size[2];
+    uint32_t head, tail;
+    size_t n;
+
+    if (!shm || (ring != VPCD_SHM_TO_VICC && ring != VPCD_SHM_TO_VPCD)
+            || !buffer) {
+        errno = EINVAL;
+        return -1;
+    }
+    r = &shm->region->ring[ring];
+
+    /* the sender publishes a message with its length at once */
+    tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head - tail >= sizeof size)
+            break;
+        if (await(&r->head, &r->head_sleepers, head, sock, -1) < 0)
+            return -1;
+    }
+
+    copy_out(r, tail, size, sizeof size);
+    n = size[0] << 8 | size[1];
+    if (head - tail < sizeof size + n) {
+        errno = EPROTO;
+        return -1;
+    }
+    copy_out(r, tail + sizeof size, buffer, n < length ? n : length);
+    advance(&r->tail, &r->tail_sleepers, tail + sizeof size + n);
+
+    if (n > length) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    return (ssize_t) n;
+}
+
+int vpcd_shm_wait(struct vpcd_shm *shm, int ring, SOCKET sock,
+        long secs, long usecs)
+{
+    struct shm_ring *r;
+    uint32_t head;
+
+    if (!shm || (ring != VPCD_SHM_TO_VICC && ring != VPCD_SHM_TO_VPCD)) {
+        errno = EINVAL;
+        return -1;
+    }
+    r = &shm->region->ring[ring];
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (head != __atomic_load_n(&r->tail, __ATOMIC_RELAXED))
+        return 1;
+
+    return await(&r->head, &r->head_sleepers, head, sock,
+            (int64_t) secs * 1000000000 + (int64_t) usecs * 1000);
+}
+
+#endif
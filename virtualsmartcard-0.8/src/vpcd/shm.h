@@ -0,0 +1,103 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _VPCD_SHM_H_
+#define _VPCD_SHM_H_
+
+#include "vpcd.h"
+
+/**
+ * Shared memory transport between vpcd and a vicc on the same host.
+ *
+ * The vicc connects to the Unix domain socket of the reader as usual. vpcd
+ * then creates a region of shared memory and passes it over the socket
+ * (SCM_RIGHTS). The region holds a ring of bytes for each direction, which
+ * carries the messages framed like on the socket (the length on 2 bytes, big
+ * endian, followed by the message). The receiver of a ring spins for a moment
+ * and then sleeps on a futex, which the sender wakes only if somebody sleeps.
+ *
+ * The socket stays open and idle: the connection ends when either side
+ * closes it, which a waiting side notices within \a VPCD_SHM_CHECK_MS.
+ *
+ * The transport needs futexes and memfd (Linux). Elsewhere \a vpcd_shm_offer
+ * and \a vpcd_shm_accept fail with ENOSYS.
+ */
+
+/** Ring of the messages from vpcd to the vicc */
+#define VPCD_SHM_TO_VICC 0
+/** Ring of the messages from the vicc to vpcd */
+#define VPCD_SHM_TO_VPCD 1
+
+/** Milliseconds a waiting side sleeps before it checks the socket again */
+#define VPCD_SHM_CHECK_MS 100
+
+struct vpcd_shm;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Create the region for a new connection and pass it to the vicc
+ * (vpcd side).
+ *
+ * @return The region, or NULL with errno set
+ */
+struct vpcd_shm *vpcd_shm_offer(SOCKET sock);
+
+/**
+ * @brief Receive the region vpcd passes on a new connection (vicc side).
+ *
+ * @return The region, or NULL with errno set
+ */
+struct vpcd_shm *vpcd_shm_accept(SOCKET sock);
+
+/** @brief Unmap the region. */
+void vpcd_shm_free(struct vpcd_shm *shm);
+
+/**
+ * @brief Send a message into \a ring, waiting while the ring is full.
+ *
+ * @return \a length, or -1 with errno set to EINVAL for a message longer
+ *         than 0xFFFF, or to ECONNRESET if \a sock was closed
+ */
+ssize_t vpcd_shm_send(struct vpcd_shm *shm, int ring,
+        const unsigned char *buffer, size_t length, SOCKET sock);
+
+/**
+ * @brief Receive the next message of \a ring into \a buffer, waiting for it.
+ *
+ * A message longer than \a length is consumed and fails with ENOBUFS.
+ *
+ * @return The length of the message, or -1 with errno set (ECONNRESET if
+ *         \a sock was closed)
+ */
+ssize_t vpcd_shm_recv(struct vpcd_shm *shm, int ring,
+        unsigned char *buffer, size_t length, SOCKET sock);
+
+/**
+ * @brief Wait at most \a secs seconds and \a usecs microseconds for a message
+ * in \a ring.
+ *
+ * @return 1 if a message is there, 0 on timeout, -1 if \a sock was closed
+ */
+int vpcd_shm_wait(struct vpcd_shm *shm, int ring, SOCKET sock,
+        long secs, long usecs);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,233 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "trace.h"
+#include "lock.h"
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef _WIN32
+
+void vpcd_trace_open(void)
+{
+}
+
+void vpcd_trace_close(void)
+{
+}
+
+void vpcd_trace(unsigned short port, unsigned int seq, uint8_t type,
+        const unsigned char *data, size_t length)
+{
+}
+
+#else
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ALIGN8(n) (((n) + 7) & ~((uint64_t) 7))
+
+/* Smallest ring accepted, so that any APDU fits */
+#define VPCD_TRACE_MIN_SIZE (64*1024)
+
+static struct vpcd_trace_header *trace_header = NULL;
+static unsigned char *trace_ring = NULL;
+static size_t trace_mapped = 0;
+static unsigned int trace_users = 0;
+static void *trace_lock = NULL;
+
+static uint64_t now(clockid_t clock)
+{
+    struct timespec t;
+    clock_gettime(clock, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + (uint64_t) t.tv_nsec;
+}
+
+static size_t trace_size(void)
+{
+    const char *s = getenv("VPCD_TRACE_SIZE");
+    char *end;
+    unsigned long size;
+
+    if (!s)
+        return VPCD_TRACE_SIZE;
+
+    size = strtoul(s, &end, 10);
+    if (*end == 'k' || *end == 'K')
+        size *= 1024;
+    else if (*end == 'm' || *end == 'M')
+        size *= 1024*1024;
+
+    if (size < VPCD_TRACE_MIN_SIZE)
+        size = VPCD_TRACE_MIN_SIZE;
+
+    return (size_t) ALIGN8(size);
+}
+
+void vpcd_trace_open(void)
+{
+    const char *path;
+    size_t capacity;
+    void *p;
+    int fd;
+
+    if (trace_users++)
+        return;
+
+    path = getenv("VPCD_TRACE");
+    if (!path || !*path)
+        return;
+
+    capacity = trace_size();
+    trace_mapped = sizeof *trace_header + capacity;
+
+    fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+    if (ftruncate(fd, (off_t) trace_mapped) != 0) {
+        perror(path);
+        close(fd);
+        return;
+    }
+    p = mmap(NULL, trace_mapped, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror(path);
+        return;
+    }
+
+    trace_lock = create_lock();
+    if (!trace_lock) {
+        munmap(p, trace_mapped);
+        return;
+    }
+
+    trace_header = p;
+    trace_ring = (unsigned char *) p + sizeof *trace_header;
+    memset(trace_header, 0, sizeof *trace_header);
+    memcpy(trace_header->magic, VPCD_TRACE_MAGIC, sizeof VPCD_TRACE_MAGIC);
+    trace_header->version = VPCD_TRACE_VERSION;
+    trace_header->header_size = sizeof *trace_header;
+    trace_header->capacity = capacity;
+    trace_header->start_mono = now(CLOCK_MONOTONIC);
+    trace_header->start_real = now(CLOCK_REALTIME);
+}
+
+void vpcd_trace_close(void)
+{
+    if (!trace_users || --trace_users)
+        return;
+
+    if (trace_header) {
+        msync(trace_header, trace_mapped, MS_ASYNC);
+        munmap(trace_header, trace_mapped);
+        trace_header = NULL;
+        trace_ring = NULL;
+        free_lock(trace_lock);
+        trace_lock = NULL;
+    }
+}
+
+/* Drop the oldest records until there are \a needed free bytes */
+static void make_room(uint64_t needed)
+{
+    struct vpcd_trace_record *record;
+    uint64_t capacity = trace_header->capacity;
+    uint64_t offset, left;
+
+    while (capacity - (trace_header->head - trace_header->tail) < needed) {
+        offset = trace_header->tail % capacity;
+        left = capacity - offset;
+        if (left < sizeof *record) {
+            trace_header->tail += left;
+            continue;
+        }
+        record = (struct vpcd_trace_record *) (trace_ring + offset);
+        if (record->type != VPCD_TRACE_PAD)
+            trace_header->overwritten++;
+        trace_header->tail += record->size;
+    }
+}
+
+void vpcd_trace(unsigned short port, unsigned int seq, uint8_t type,
+        const unsigned char *data, size_t length)
+{
+    struct vpcd_trace_record *record;
+    uint64_t capacity, offset, left, size;
+    uint64_t time;
+    uint8_t flags = 0;
+
+    if (!trace_header)
+        return;
+
+    time = now(CLOCK_MONOTONIC);
+    capacity = trace_header->capacity;
+    if (length > capacity/2 - sizeof *record) {
+        length = capacity/2 - sizeof *record;
+        flags |= VPCD_TRACE_TRUNCATED;
+    }
+    size = ALIGN8(sizeof *record + length);
+
+    if (!lock(trace_lock))
+        return;
+
+    offset = trace_header->head % capacity;
+    left = capacity - offset;
+    if (left < size) {
+        /* skip to the start of the ring */
+        make_room(left + size);
+        if (left >= sizeof *record) {
+            record = (struct vpcd_trace_record *) (trace_ring + offset);
+            memset(record, 0, sizeof *record);
+            record->size = (uint32_t) left;
+            record->type = VPCD_TRACE_PAD;
+        }
+        trace_header->head += left;
+        offset = 0;
+    } else {
+        make_room(size);
+    }
+
+    record = (struct vpcd_trace_record *) (trace_ring + offset);
+    record->size = (uint32_t) size;
+    record->port = port;
+    record->type = type;
+    record->flags = flags;
+    record->time = time;
+    record->length = (uint32_t) length;
+    record->seq = seq;
+    if (length)
+        memcpy(record + 1, data, length);
+
+    /* publish the record for readers of the live file */
+    __sync_synchronize();
+    trace_header->head += size;
+    trace_header->records++;
+
+    unlock(trace_lock);
+}
+
+#endif
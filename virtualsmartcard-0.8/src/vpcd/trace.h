@@ -0,0 +1,107 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _VPCD_TRACE_H_
+#define _VPCD_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Trace capture of the messages exchanged with the vicc.
+ *
+ * Tracing is enabled by setting VPCD_TRACE to the name of a file in the
+ * environment of the process that loads the driver (pcscd). The file is
+ * mapped into memory and used as a ring buffer: the oldest records are
+ * overwritten once it is full. Its size is set with VPCD_TRACE_SIZE (in
+ * bytes, with an optional K or M suffix).
+ *
+ * The file starts with a \a vpcd_trace_header followed by the ring of
+ * records. Each record is a \a vpcd_trace_record followed by the payload
+ * and padded to a multiple of 8 bytes. A record never wraps around the
+ * end of the ring; the space left at the end is skipped, either by a
+ * record of type \a VPCD_TRACE_PAD or, if it is smaller than a record
+ * header, implicitly. All fields are in host byte order.
+ */
+
+#define VPCD_TRACE_MAGIC   "VPCDTRC"
+#define VPCD_TRACE_VERSION 1
+
+/** Default size of the ring */
+#define VPCD_TRACE_SIZE    (16*1024*1024)
+
+#define VPCD_TRACE_PAD     0 /**< Skipped space at the end of the ring */
+#define VPCD_TRACE_SEND    1 /**< Message sent to the vicc */
+#define VPCD_TRACE_RECV    2 /**< Message received from the vicc */
+#define VPCD_TRACE_ERROR   3 /**< Failed send or receive, payload is errno */
+#define VPCD_TRACE_CONNECT 4 /**< The vicc connected */
+#define VPCD_TRACE_EJECT   5 /**< The connection to the vicc was closed */
+
+#define VPCD_TRACE_TRUNCATED 0x01 /**< Flag: the payload was cut short */
+
+struct vpcd_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t capacity;      /**< Size of the ring following the header */
+    uint64_t head;          /**< Position of the next record, never wraps */
+    uint64_t tail;          /**< Position of the oldest record */
+    uint64_t records;       /**< Records written */
+    uint64_t overwritten;   /**< Records lost when the ring was full */
+    uint64_t start_mono;    /**< CLOCK_MONOTONIC when tracing started (ns) */
+    uint64_t start_real;    /**< CLOCK_REALTIME at the same time (ns) */
+};
+
+struct vpcd_trace_record {
+    uint32_t size;          /**< Size of the record including padding */
+    uint16_t port;          /**< Port of the vicc (VPCDPORT + slot) */
+    uint8_t type;
+    uint8_t flags;
+    uint64_t time;          /**< CLOCK_MONOTONIC (ns) */
+    uint32_t length;        /**< Length of the payload */
+    uint32_t seq;           /**< Number of the message on the connection to
+                              the vicc, counted from 1 by both sides */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Start tracing if it is enabled in the environment.
+ *
+ * Calls are counted, the trace is closed by the last \a vpcd_trace_close.
+ */
+void vpcd_trace_open(void);
+
+void vpcd_trace_close(void);
+
+/**
+ * @brief Append a record to the trace. Does nothing if tracing is disabled.
+ *
+ * @param[in] port   Port of the vicc
+ * @param[in] seq    Number of the message sent last on the connection
+ * @param[in] type   One of VPCD_TRACE_*
+ * @param[in] data   Payload
+ * @param[in] length Length of the payload
+ */
+void vpcd_trace(unsigned short port, unsigned int seq, uint8_t type,
+        const unsigned char *data, size_t length);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
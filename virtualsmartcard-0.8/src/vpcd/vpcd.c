@@ -18,6 +18,9 @@
  */
 #include "vpcd.h"
 #include "lock.h"
+#include "manager.h"
+#include "shm.h"
+#include "trace.h"
 
 #if HAVE_CONFIG_H
 #include "config.h"
@@ -37,10 +40,17 @@
 typedef WORD uint16_t;
 #else
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 #define INVALID_SOCKET -1
 #endif
@@ -51,14 +61,70 @@ typedef WORD uint16_t;
 #include <string.h>
 #include <sys/types.h>
 
+/* ESP32 backend. The firmware connects, reads one command APDU, sends the
+ * response and closes the connection, then connects again right away. */
+#define ESP_CONNECT_TIMEOUT  10 /* seconds to wait for the device to connect */
+#define ESP_RESPONSE_TIMEOUT 30 /* seconds to wait for a response unless
+                                   VPCD_TIMEOUT or vicc_settimeout set
+                                   another time, the proceed button waits
+                                   15 */
+#define ESP_PRESENT_GRACE    2  /* seconds the device counts as present while
+                                   it reconnects after an exchange */
+#define ESP_MAX_RESPONSE     (0x10000+2)
+
+/* TCP keepalive of the connection to the vicc or the ESP32, so that a peer
+ * that vanished without closing it (power, network) is noticed as removed:
+ * probes after this many idle seconds, every interval, this many times */
+#define VPCD_KEEPALIVE_IDLE     10
+#define VPCD_KEEPALIVE_INTERVAL 2
+#define VPCD_KEEPALIVE_COUNT    3
+
+/* Client mode: milliseconds a connection attempt to the vicc may take, and
+ * the range of the pause after a failed one, which doubles with every
+ * failure, so that presence polls against a vicc that is down return at
+ * once */
+#define VPCD_CONNECT_TIMEOUT 1000
+#define VPCD_BACKOFF_MIN     100
+#define VPCD_BACKOFF_MAX     5000
+
+/* Size of the response buffer of a context, enough for both backends */
+#define RESPONSE_BUFFER_SIZE ESP_MAX_RESPONSE
+
+/* Command invalidating the session of the device (PIN verification) on reset */
+static const unsigned char esp_invalidate[] = {0x00, 0x55, 0x00, 0x00, 0x00};
+
+/* The ATR vicc gives for its default ISO 7816 card, which it used to report
+ * for the ESP32 */
+static const unsigned char esp_atr[] = {
+    0x3B, 0x95, 0x13, 0x81, 0x01, 0x80, 0x73, 0xFF, 0x01, 0x00, 0x0B};
+
 static ssize_t sendToVICC(struct vicc_ctx *ctx, size_t size, const unsigned char *buffer);
-static ssize_t recvFromVICC(struct vicc_ctx *ctx, unsigned char **buffer);
+static ssize_t recvFromVICC(struct vicc_ctx *ctx, unsigned char *buffer, size_t length);
 
 static ssize_t sendall(SOCKET sock, const void *buffer, size_t size);
+#ifdef _WIN32
 static ssize_t recvall(SOCKET sock, void *buffer, size_t size);
+#endif
+
+static void trace_error(struct vicc_ctx *ctx, ssize_t r);
+
+static ssize_t esp_send(struct vicc_ctx *ctx, size_t length,
+        const unsigned char *apdu, long secs);
+static ssize_t esp_recv(struct vicc_ctx *ctx, unsigned char *rapdu,
+        size_t rapdu_len);
+static ssize_t esp_transmit(struct vicc_ctx *ctx, size_t length,
+        const unsigned char *apdu, unsigned char *rapdu, size_t rapdu_len);
+static int esp_present(struct vicc_ctx *ctx);
+static ssize_t transceive(struct vicc_ctx *ctx, unsigned int cancels,
+        size_t apdu_len, const unsigned char *apdu, unsigned char *rapdu,
+        size_t rapdu_len);
 
 static SOCKET opensock(unsigned short port);
-static SOCKET connectsock(const char *hostname, unsigned short port);
+static SOCKET openunixsock(const char *path);
+static SOCKET connectsock(struct vicc_ctx *ctx);
+static void setclientopts(SOCKET sock);
+static long long now_ms(void);
+static int readable(SOCKET sock, long secs, long usecs);
 
 ssize_t sendall(SOCKET sock, const void *buffer, size_t size)
 {
@@ -81,12 +147,68 @@ ssize_t sendall(SOCKET sock, const void *buffer, size_t size)
     return (ssize_t) sent;
 }
 
-ssize_t recvall(SOCKET sock, void *buffer, size_t size) {
-    return recv(sock, buffer,
 #ifdef _WIN32
-            (int)
+ssize_t recvall(SOCKET sock, void *buffer, size_t size) {
+    return recv(sock, buffer, (int) size, MSG_WAITALL|MSG_NOSIGNAL);
+}
+#endif
+
+#ifndef _WIN32
+/* Like sendall, but gathering the parts of iov in one call */
+static ssize_t sendallv(SOCKET sock, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    size_t sent = 0;
+    ssize_t r;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (msg.msg_iovlen > 0) {
+        r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return r;
+        }
+        sent += r;
+
+        /* skip what was sent */
+        while (msg.msg_iovlen > 0 && (size_t) r >= msg.msg_iov->iov_len) {
+            r -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (unsigned char *) msg.msg_iov->iov_base + r;
+            msg.msg_iov->iov_len -= r;
+        }
+    }
+
+    return (ssize_t) sent;
+}
+#endif
+
+/* Send the small messages of an exchange right away instead of waiting
+ * for the acknowledgement of the previous one (Nagle), and probe an idle
+ * connection */
+static void setclientopts(SOCKET sock)
+{
+    int yes = 1;
+#ifdef TCP_KEEPIDLE
+    int idle = VPCD_KEEPALIVE_IDLE;
+    int interval = VPCD_KEEPALIVE_INTERVAL;
+    int count = VPCD_KEEPALIVE_COUNT;
+#endif
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *) &yes, sizeof yes);
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &yes, sizeof yes);
+#ifdef TCP_KEEPIDLE
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, (void *) &idle, sizeof idle);
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, (void *) &interval, sizeof interval);
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, (void *) &count, sizeof count);
 #endif
-            size, MSG_WAITALL|MSG_NOSIGNAL);
 }
 
 static SOCKET opensock(unsigned short port)
@@ -131,13 +253,118 @@ err:
     return INVALID_SOCKET;
 }
 
-static SOCKET connectsock(const char *hostname, unsigned short port)
+/* Listen on a Unix domain socket, replacing the one a previous vpcd left */
+static SOCKET openunixsock(const char *path)
+{
+#ifdef _WIN32
+    errno = ENOSYS;
+    return INVALID_SOCKET;
+#else
+    SOCKET sock;
+    struct sockaddr_un server_sockaddr;
+    struct stat st;
+
+    memset(&server_sockaddr, 0, sizeof server_sockaddr);
+    server_sockaddr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof server_sockaddr.sun_path) {
+        errno = ENAMETOOLONG;
+        return INVALID_SOCKET;
+    }
+    strcpy(server_sockaddr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    if (bind(sock, (struct sockaddr *) &server_sockaddr,
+                sizeof server_sockaddr) != 0)  {
+        perror(path);
+        goto err;
+    }
+
+    if (listen(sock, 0) != 0) {
+        perror(NULL);
+        goto err;
+    }
+
+    return sock;
+
+err:
+    close(sock);
+
+    return INVALID_SOCKET;
+#endif
+}
+
+/* Connect within VPCD_CONNECT_TIMEOUT instead of the minutes a blocking
+ * connect takes with a host that does not answer */
+static int connectwithin(SOCKET sock, const struct sockaddr *addr,
+        socklen_t addr_len)
+{
+#ifdef _WIN32
+    return connect(sock, addr, (int) addr_len);
+#else
+    struct pollfd pfd;
+    socklen_t e_len = sizeof(int);
+    int flags, r, e;
+
+    flags = fcntl(sock, F_GETFL);
+    if (flags < 0 || fcntl(sock, F_SETFL, flags|O_NONBLOCK) < 0)
+        return -1;
+
+    r = connect(sock, addr, addr_len);
+    if (r < 0 && errno == EINPROGRESS) {
+        pfd.fd = sock;
+        pfd.events = POLLOUT;
+        do {
+            r = poll(&pfd, 1, VPCD_CONNECT_TIMEOUT);
+        } while (r < 0 && errno == EINTR);
+        if (r == 0) {
+            errno = ETIMEDOUT;
+            r = -1;
+        } else if (r > 0) {
+            r = getsockopt(sock, SOL_SOCKET, SO_ERROR, (void *) &e, &e_len);
+            if (r == 0 && e) {
+                errno = e;
+                r = -1;
+            }
+        }
+    }
+
+    if (fcntl(sock, F_SETFL, flags) < 0)
+        return -1;
+
+    return r;
+#endif
+}
+
+/* Connect to the vicc. The address hostname resolves to is kept for the next
+ * connection, and resolved again after a connection to it failed */
+static SOCKET connectsock(struct vicc_ctx *ctx)
 {
 	struct addrinfo hints, *res = NULL, *cur;
 	SOCKET sock = INVALID_SOCKET;
     char _port[10];
 
-    if (snprintf(_port, sizeof _port, "%hu", port) < 0)
+    if (ctx->addr) {
+        sock = socket(((struct sockaddr *) ctx->addr)->sa_family,
+                SOCK_STREAM, 0);
+        if (sock != INVALID_SOCKET && connectwithin(sock, ctx->addr,
+                    (socklen_t) ctx->addr_len) == 0) {
+            setclientopts(sock);
+            return sock;
+        }
+        if (sock != INVALID_SOCKET)
+            close(sock);
+        free(ctx->addr);
+        ctx->addr = NULL;
+        return INVALID_SOCKET;
+    }
+
+    if (snprintf(_port, sizeof _port, "%hu", ctx->port) < 0)
         goto err;
     _port[(sizeof _port) -1] = '\0';
 
@@ -146,7 +373,7 @@ static SOCKET connectsock(const char *hostname, unsigned short port)
 	hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_NUMERICSERV;
 
-	if (getaddrinfo(hostname, _port, &hints, &res) != 0)
+	if (getaddrinfo(ctx->hostname, _port, &hints, &res) != 0)
 		goto err;
 
 	for (cur = res; cur; cur = cur->ai_next) {
@@ -154,14 +381,18 @@ static SOCKET connectsock(const char *hostname, unsigned short port)
 		if (sock == INVALID_SOCKET)
 			continue;
 
-		if (connect(sock, cur->ai_addr,
-#ifdef _WIN32
-                    (int)
-#endif
-                    cur->ai_addrlen) != -1)
+		if (connectwithin(sock, cur->ai_addr, cur->ai_addrlen) != -1) {
+            setclientopts(sock);
+            ctx->addr = malloc(cur->ai_addrlen);
+            if (ctx->addr) {
+                memcpy(ctx->addr, cur->ai_addr, cur->ai_addrlen);
+                ctx->addr_len = cur->ai_addrlen;
+            }
 			break;
+        }
 
 		close(sock);
+		sock = INVALID_SOCKET;
 	}
 
 err:
@@ -169,6 +400,27 @@ err:
 	return sock;
 }
 
+/* Connect to the vicc unless the pause after the last failed attempt lasts */
+static SOCKET reconnect(struct vicc_ctx *ctx)
+{
+    SOCKET sock;
+
+    if (now_ms() < ctx->retry_at)
+        return INVALID_SOCKET;
+
+    sock = connectsock(ctx);
+    if (sock == INVALID_SOCKET) {
+        ctx->backoff = ctx->backoff ? 2*ctx->backoff : VPCD_BACKOFF_MIN;
+        if (ctx->backoff > VPCD_BACKOFF_MAX)
+            ctx->backoff = VPCD_BACKOFF_MAX;
+        ctx->retry_at = now_ms() + ctx->backoff;
+    } else {
+        ctx->backoff = 0;
+    }
+
+    return sock;
+}
+
 SOCKET waitforclient(SOCKET server, long secs, long usecs)
 {
     fd_set rfds;
@@ -192,9 +444,13 @@ SOCKET waitforclient(SOCKET server, long secs, long usecs)
     if (select((int) server+1, &rfds, NULL, NULL, &tv) == -1)
         return INVALID_SOCKET;
 
-    if (FD_ISSET(server, &rfds))
-        return accept(server, (struct sockaddr *) &client_sockaddr,
+    if (FD_ISSET(server, &rfds)) {
+        SOCKET client = accept(server, (struct sockaddr *) &client_sockaddr,
                 &client_socklen);
+        if (client != INVALID_SOCKET)
+            setclientopts(client);
+        return client;
+    }
 
     return INVALID_SOCKET;
 }
@@ -203,62 +459,492 @@ static ssize_t sendToVICC(struct vicc_ctx *ctx, size_t length, const unsigned ch
 {
     ssize_t r;
     uint16_t size;
+#ifndef _WIN32
+    struct iovec iov[2];
+#endif
 
     if (!ctx || length > 0xFFFF) {
         errno = EINVAL;
         return -1;
     }
 
-    /* send size of message on 2 bytes */
+    ctx->seq++;
+    vpcd_trace(ctx->port, ctx->seq, VPCD_TRACE_SEND, buffer, length);
+
+    if (ctx->shm) {
+        r = vpcd_shm_send(ctx->shm, VPCD_SHM_TO_VICC, buffer, length,
+                ctx->client_sock);
+        if (r < 0) {
+            trace_error(ctx, r);
+            vicc_eject(ctx);
+        }
+        return r;
+    }
+
+    /* send size of message on 2 bytes, followed by the message */
     size = htons((uint16_t) length);
+#ifdef _WIN32
     r = sendall(ctx->client_sock, (void *) &size, sizeof size);
     if (r == sizeof size)
-        /* send message */
         r = sendall(ctx->client_sock, buffer, length);
+#else
+    iov[0].iov_base = &size;
+    iov[0].iov_len = sizeof size;
+    iov[1].iov_base = (void *) buffer;
+    iov[1].iov_len = length;
+    r = sendallv(ctx->client_sock, iov, 2);
+    if (r >= 0)
+        r -= sizeof size;
+#endif
 
-    if (r < 0)
+    if (r < 0) {
+        trace_error(ctx, r);
         vicc_eject(ctx);
+    }
 
     return r;
 }
 
-static ssize_t recvFromVICC(struct vicc_ctx *ctx, unsigned char **buffer)
+/* Milliseconds of the monotonic clock */
+static long long now_ms(void)
 {
-    ssize_t r;
+#ifdef _WIN32
+    return (long long) GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/* Whether an exchange gives up waiting for its response, with errno set to
+ * ETIMEDOUT at deadline (now_ms) or to ECANCELED after vicc_cancel */
+static int expired(struct vicc_ctx *ctx, long long deadline)
+{
+    if (ctx->cancels != ctx->cancels_before) {
+        errno = ECANCELED;
+        return 1;
+    }
+    if (deadline - now_ms() <= 0) {
+        errno = ETIMEDOUT;
+        return 1;
+    }
+    return 0;
+}
+
+/* Wait until the connection has something to receive. Returns 1 if it has,
+ * or 0 with errno set like expired, or to ECONNRESET if the vicc closed the
+ * connection of the shared memory */
+static int waitfor(struct vicc_ctx *ctx, long long deadline)
+{
+    long long left;
+    long slice;
+    int r;
+
+    while (!expired(ctx, deadline)) {
+        left = deadline - now_ms();
+        slice = left < VPCD_CANCEL_CHECK_MS ? (long) left : VPCD_CANCEL_CHECK_MS;
+
+        if (ctx->shm) {
+            r = vpcd_shm_wait(ctx->shm, VPCD_SHM_TO_VPCD, ctx->client_sock,
+                    0, slice * 1000);
+            if (r < 0) {
+                errno = ECONNRESET;
+                return 0;
+            }
+        } else {
+            r = readable(ctx->client_sock, 0, slice * 1000);
+        }
+        if (r > 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Give up the response of the current exchange: the vicc still sends it,
+ * the next exchange discards it */
+static ssize_t abandon(struct vicc_ctx *ctx)
+{
+    int e = errno;
+
+    if (e == ETIMEDOUT || e == ECANCELED) {
+        ctx->stale++;
+    } else {
+        vicc_eject(ctx);
+    }
+    trace_error(ctx, -1);
+    errno = e;
+
+    return -1;
+}
+
+/* Lose the connection during a message, its framing is gone */
+static ssize_t broken(struct vicc_ctx *ctx, ssize_t r)
+{
+    int e = r < 0 ? errno : 0;
+
+    trace_error(ctx, r);
+    vicc_eject(ctx);
+    errno = e;
+
+    return r < 0 ? -1 : 0;
+}
+
+/* Receive a message into buffer, or discard it if buffer is NULL. A message
+ * longer than length is read to its end, so that the connection stays
+ * usable, and fails with ENOBUFS. Waiting for the message ends at deadline;
+ * the connection stays usable then, too. A receive on the socket returns
+ * every VPCD_CANCEL_CHECK_MS (setcheckinterval) to check that */
+static ssize_t recvframe(struct vicc_ctx *ctx, unsigned char *buffer,
+        size_t length, long long deadline)
+{
+    unsigned char discard[64], *p;
     uint16_t size;
-    unsigned char *p = NULL;
+    size_t got = 0, want, n;
+    ssize_t r;
+#ifndef _WIN32
+    struct iovec iov[2];
+    struct msghdr msg;
+#endif
+
+    if (!buffer)
+        length = 0;
+
+    if (ctx->shm) {
+        if (!waitfor(ctx, deadline))
+            return abandon(ctx);
+        r = vpcd_shm_recv(ctx->shm, VPCD_SHM_TO_VPCD,
+                buffer ? buffer : discard, length, ctx->client_sock);
+        if (r < 0 && errno == ENOBUFS && !buffer)
+            return 0;
+        if (r < 0 && errno != ENOBUFS)
+            return broken(ctx, r);
+        if (r < 0)
+            trace_error(ctx, r);
+        else if (buffer)
+            vpcd_trace(ctx->port, ctx->seq, VPCD_TRACE_RECV, buffer, r);
+        return buffer ? r : 0;
+    }
+
+#ifdef _WIN32
+    if (!waitfor(ctx, deadline))
+        return abandon(ctx);
+
+    /* receive size of message on 2 bytes */
+    r = recvall(ctx->client_sock, &size, sizeof size);
+    if (r < (ssize_t) sizeof size)
+        return broken(ctx, r < 0 ? r : 0);
+    got = sizeof size;
+#else
+    /* receive size of message on 2 bytes together with as much of the
+     * message as has arrived */
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    while (got < sizeof size) {
+        iov[0].iov_base = (unsigned char *) &size + got;
+        iov[0].iov_len = sizeof size - got;
+        iov[1].iov_base = buffer;
+        iov[1].iov_len = length;
+        msg.msg_iovlen = 2;
+        r = recvmsg(ctx->client_sock, &msg, MSG_NOSIGNAL);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (!expired(ctx, deadline))
+                    continue;
+                if (!got)
+                    return abandon(ctx);
+            }
+            return broken(ctx, r);
+        }
+        got += r;
+    }
+#endif
+    want = sizeof size + ntohs(size);
+    if (got > want) {
+        /* the vicc answers one message at a time */
+        errno = EMSGSIZE;
+        return broken(ctx, -1);
+    }
+
+    /* receive the rest of the message */
+    while (got < want) {
+        if (got - sizeof size < length) {
+            p = buffer + got - sizeof size;
+            n = (want - sizeof size < length ? want - sizeof size : length)
+                - (got - sizeof size);
+        } else {
+            p = discard;
+            n = want - got < sizeof discard ? want - got : sizeof discard;
+        }
+#ifdef _WIN32
+        r = recvall(ctx->client_sock, p, n);
+#else
+        r = recv(ctx->client_sock, p, n, MSG_NOSIGNAL);
+#endif
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)
+                    && !expired(ctx, deadline))
+                continue;
+            return broken(ctx, r);
+        }
+        got += r;
+    }
+
+    if (!buffer)
+        return 0;
+    if (want - sizeof size > length) {
+        errno = ENOBUFS;
+        trace_error(ctx, -1);
+        return -1;
+    }
+    vpcd_trace(ctx->port, ctx->seq, VPCD_TRACE_RECV, buffer, want - sizeof size);
+
+    return (ssize_t) (want - sizeof size);
+}
+
+/* Receive the response of the current exchange, after the late responses of
+ * the exchanges that gave up on theirs */
+static ssize_t recvFromVICC(struct vicc_ctx *ctx, unsigned char *buffer, size_t length)
+{
+    long long deadline;
+    ssize_t r;
 
     if (!buffer || !ctx) {
         errno = EINVAL;
         return -1;
     }
 
-    /* receive size of message on 2 bytes */
-    r = recvall(ctx->client_sock, &size, sizeof size);
-    if (r < sizeof size)
+    deadline = now_ms() + ctx->timeout;
+    while (ctx->stale) {
+        r = recvframe(ctx, NULL, 0, deadline);
+        if (r < 0)
+            return r;
+        /* a closed connection owes nothing */
+        if (ctx->client_sock == INVALID_SOCKET)
+            return 0;
+        ctx->stale--;
+    }
+
+    return recvframe(ctx, buffer, length, deadline);
+}
+
+static void trace_error(struct vicc_ctx *ctx, ssize_t r)
+{
+    /* 0 if the vicc closed the connection */
+    int e = r < 0 ? errno : 0;
+    vpcd_trace(ctx->port, ctx->seq, VPCD_TRACE_ERROR, (unsigned char *) &e, sizeof e);
+}
+
+/* Let the receives on the connection to the vicc return every
+ * VPCD_CANCEL_CHECK_MS, so that recvframe checks its deadline and
+ * vicc_cancel without a poll before every receive */
+static void setcheckinterval(SOCKET sock)
+{
+#ifndef _WIN32
+    struct timeval tv;
+
+    tv.tv_sec = 0;
+    tv.tv_usec = VPCD_CANCEL_CHECK_MS * 1000L;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *) &tv, sizeof tv);
+#endif
+}
+
+/* Receive until the device closes the connection. Every part is waited for
+ * with waitfor, so a device that goes quiet within its response fails the
+ * exchange at deadline or on vicc_cancel, like recvframe. A response longer
+ * than length fails with ENOBUFS */
+static ssize_t recvuntilclose(struct vicc_ctx *ctx, unsigned char *buffer,
+        size_t length, long long deadline)
+{
+    unsigned char discard[64];
+    SOCKET sock = ctx->client_sock;
+    size_t size = 0;
+    int overflow = 0;
+    ssize_t r;
+
+    do {
+        if (!waitfor(ctx, deadline))
+            return -1;
+        if (size < length)
+            r = recv(sock, (void *) (buffer + size),
+#ifdef _WIN32
+                    (int)
+#endif
+                    (length - size), MSG_NOSIGNAL);
+        else
+            r = recv(sock, (void *) discard, sizeof discard, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR) {
+                r = 1;
+                continue;
+            }
+            return r;
+        }
+        if (size < length)
+            size += r;
+        else if (r > 0)
+            overflow = 1;
+    } while (r > 0);
+
+    if (overflow) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    return (ssize_t) size;
+}
+
+/* Whether the connection is still open, without waiting: a peer that closed
+ * it has the socket readable at its end, one that vanished is found out by
+ * TCP keepalive */
+static int alive(SOCKET sock)
+{
+#ifdef MSG_DONTWAIT
+    unsigned char c;
+    ssize_t r = recv(sock, (void *) &c, 1, MSG_PEEK|MSG_DONTWAIT);
+    return r > 0 || (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+#else
+    return 1;
+#endif
+}
+
+static void esp_close(struct vicc_ctx *ctx)
+{
+    /* keep the error of the exchange */
+    int e = errno;
+    vpcd_manager_detach(ctx);
+    close(ctx->client_sock);
+    ctx->client_sock = INVALID_SOCKET;
+    errno = e;
+}
+
+/* Send a command APDU on the connection the device parked, waiting at most
+ * secs for the device to connect. A connection the device closed while it
+ * was parked (reboot, lost network) is skipped before anything is written
+ * to it */
+static ssize_t esp_send(struct vicc_ctx *ctx, size_t length,
+        const unsigned char *apdu, long secs)
+{
+    ssize_t r;
+
+    while (ctx->client_sock == INVALID_SOCKET || !alive(ctx->client_sock)) {
+        if (ctx->client_sock != INVALID_SOCKET)
+            esp_close(ctx);
+        if (!vicc_connect(ctx, secs, 0)) {
+            errno = secs ? ETIMEDOUT : EAGAIN;
+            trace_error(ctx, -1);
+            return -1;
+        }
+    }
+
+    ctx->seq++;
+    vpcd_trace(ctx->port, ctx->seq, VPCD_TRACE_SEND, apdu, length);
+
+    /* The device reads the command with a single read, so no framing */
+    r = sendall(ctx->client_sock, apdu, length);
+    if (r < 0) {
+        trace_error(ctx, -1);
+        esp_close(ctx);
+    }
+
+    return r;
+}
+
+/* Receive the response, the device closes the connection after it. A
+ * cancelled exchange closes the connection right away */
+static ssize_t esp_recv(struct vicc_ctx *ctx, unsigned char *rapdu,
+        size_t rapdu_len)
+{
+    ssize_t r;
+
+    r = recvuntilclose(ctx, rapdu, rapdu_len, now_ms() + ctx->timeout);
+    esp_close(ctx);
+
+    if (r > 0) {
+        vpcd_trace(ctx->port, ctx->seq, VPCD_TRACE_RECV, rapdu, r);
+        ctx->esp_seen = time(NULL);
         return r;
+    }
+    if (r == 0)
+        /* closed without a response */
+        errno = ECONNRESET;
+    trace_error(ctx, -1);
 
-    size = ntohs(size);
+    return -1;
+}
 
-    p = realloc(*buffer, size);
-    if (p == NULL) {
-        errno = ENOMEM;
+static ssize_t esp_transmit(struct vicc_ctx *ctx, size_t length,
+        const unsigned char *apdu, unsigned char *rapdu, size_t rapdu_len)
+{
+    ssize_t r;
+
+    if (!rapdu) {
+        errno = EINVAL;
         return -1;
     }
-    *buffer = p;
 
-    /* receive message */
-    return recvall(ctx->client_sock, *buffer, size);
+    r = esp_send(ctx, length, apdu, ESP_CONNECT_TIMEOUT);
+    if (r < 0 && (errno == ECONNRESET || errno == EPIPE))
+        /* The device dropped the connection before the command was written
+         * (e.g. it rebooted just after the check of esp_send); retry once on
+         * a new one */
+        r = esp_send(ctx, length, apdu, ESP_CONNECT_TIMEOUT);
+    if (r < 0)
+        return -1;
+
+    /* The command was sent and may have been run (a signature counter, a PIN
+     * retry), so a failure from here on is reported, never sent again */
+    return esp_recv(ctx, rapdu, rapdu_len);
+}
+
+/* Checked without waiting for an exchange, like vicc_present: the device is
+ * present while its connection is open, for ESP_PRESENT_GRACE after its last
+ * response, or once it parked a new connection. Only the latter needs the
+ * lock, and an exchange holding it has a connection unless it waits for
+ * the device to connect */
+static int esp_present(struct vicc_ctx *ctx)
+{
+    SOCKET sock;
+    int r;
+
+    if (!ctx)
+        return 0;
+
+    sock = ctx->client_sock;
+    if ((sock != INVALID_SOCKET && alive(sock))
+            || time(NULL) - ctx->esp_seen <= ESP_PRESENT_GRACE)
+        return 1;
+
+    if (!trylock(ctx->io_lock))
+        return sock != INVALID_SOCKET;
+    if (ctx->client_sock != INVALID_SOCKET && !alive(ctx->client_sock))
+        esp_close(ctx);
+    r = vicc_connect(ctx, 0, 0);
+    unlock(ctx->io_lock);
+
+    return r;
 }
 
 int vicc_eject(struct vicc_ctx *ctx)
 {
     int r = 0;
     if (ctx && ctx->client_sock > 0) {
+        vpcd_manager_detach(ctx);
         if (close(ctx->client_sock) < 0) {
             r -= 1;
         }
         ctx->client_sock = INVALID_SOCKET;
+        vpcd_shm_free(ctx->shm);
+        ctx->shm = NULL;
+        ctx->pending = 0;
+        ctx->atr_len = 0;
+        ctx->stale = 0;
+        vpcd_trace(ctx->port, ctx->seq, VPCD_TRACE_EJECT, NULL, 0);
     }
     return r;
 }
@@ -266,17 +952,42 @@ int vicc_eject(struct vicc_ctx *ctx)
 struct vicc_ctx * vicc_init(const char *hostname, unsigned short port)
 {
     struct vicc_ctx *r = NULL;
+    const char *timeout;
 
     struct vicc_ctx *ctx = malloc(sizeof *ctx);
     if (!ctx) {
         goto err;
     }
 
+    vpcd_trace_open();
+
     ctx->hostname = NULL;
     ctx->io_lock = NULL;
     ctx->server_sock = INVALID_SOCKET;
     ctx->client_sock = INVALID_SOCKET;
     ctx->port = port;
+    ctx->seq = 0;
+    ctx->esp = hostname && strcmp(hostname, VPCD_ESP_HOSTNAME) == 0;
+    ctx->esp_seen = 0;
+    ctx->buffer = NULL;
+    ctx->slot = NULL;
+    ctx->pending = 0;
+    ctx->atr_len = 0;
+    ctx->path = NULL;
+    ctx->use_shm = 0;
+    ctx->shm = NULL;
+    ctx->timeout = (ctx->esp ? ESP_RESPONSE_TIMEOUT : VPCD_RESPONSE_TIMEOUT) * 1000L;
+    ctx->stale = 0;
+    ctx->cancels = 0;
+    ctx->cancels_before = 0;
+    ctx->addr = NULL;
+    ctx->addr_len = 0;
+    ctx->retry_at = 0;
+    ctx->backoff = 0;
+
+    timeout = getenv("VPCD_TIMEOUT");
+    if (timeout && atol(timeout) > 0)
+        ctx->timeout = atol(timeout) * 1000L;
 
 #ifdef _WIN32
     WSADATA wsaData;
@@ -288,18 +999,43 @@ struct vicc_ctx * vicc_init(const char *hostname, unsigned short port)
         goto err;
     }
 
-    if (hostname) {
+    if (hostname && strncmp(hostname, VPCD_SHM_PREFIX,
+                strlen(VPCD_SHM_PREFIX)) == 0) {
+        ctx->use_shm = 1;
+        ctx->path = strdup(hostname + strlen(VPCD_SHM_PREFIX));
+    } else if (hostname && strncmp(hostname, VPCD_UNIX_PREFIX,
+                strlen(VPCD_UNIX_PREFIX)) == 0) {
+        ctx->path = strdup(hostname + strlen(VPCD_UNIX_PREFIX));
+    }
+
+    if (ctx->use_shm || ctx->path) {
+        if (!ctx->path) {
+            goto err;
+        }
+        ctx->server_sock = openunixsock(ctx->path);
+        if (ctx->server_sock == INVALID_SOCKET) {
+            goto err;
+        }
+    } else if (hostname && !ctx->esp) {
         ctx->hostname = strdup(hostname);
         if (!ctx->hostname) {
             goto err;
         }
-        ctx->client_sock = connectsock(hostname, port);
+        ctx->client_sock = reconnect(ctx);
+        if (ctx->client_sock != INVALID_SOCKET) {
+            setcheckinterval(ctx->client_sock);
+            vpcd_trace(ctx->port, ctx->seq, VPCD_TRACE_CONNECT, NULL, 0);
+        }
     } else {
         ctx->server_sock = opensock(port);
         if (ctx->server_sock == INVALID_SOCKET) {
             goto err;
         }
     }
+
+    /* without the manager, vicc_connect accepts with select */
+    if (vpcd_manager_add(ctx))
+        vpcd_manager_attach(ctx);
     r = ctx;
 
 err:
@@ -314,15 +1050,22 @@ int vicc_exit(struct vicc_ctx *ctx)
 {
     int r = vicc_eject(ctx);
     if (ctx) {
+        vpcd_manager_remove(ctx);
         free_lock(ctx->io_lock);
         free(ctx->hostname);
+        free(ctx->addr);
+        free(ctx->buffer);
         if (ctx->server_sock > 0) {
             ctx->server_sock = close(ctx->server_sock);
             if (ctx->server_sock == INVALID_SOCKET) {
                 r -= 1;
             }
+            if (ctx->path)
+                unlink(ctx->path);
         }
+        free(ctx->path);
         free(ctx);
+        vpcd_trace_close();
 #ifdef _WIN32
         WSACleanup();
 #endif
@@ -331,30 +1074,414 @@ int vicc_exit(struct vicc_ctx *ctx)
     return r;
 }
 
+int vicc_settimeout(struct vicc_ctx *ctx, long secs, long usecs)
+{
+    long timeout = secs * 1000 + usecs / 1000;
+
+    if (!ctx || timeout <= 0)
+        return 0;
+
+    ctx->timeout = timeout;
+
+    return 1;
+}
+
+void vicc_cancel(struct vicc_ctx *ctx)
+{
+    if (ctx)
+        ctx->cancels++;
+}
+
+/* Whether a failed exchange lost the connection: a response too long for the
+ * buffer was read to its end, and a late one is discarded when it arrives */
+static int lost(ssize_t r)
+{
+    return r == 0 || (r < 0 && errno != ENOBUFS && errno != ETIMEDOUT
+            && errno != ECANCELED);
+}
+
+/* Send an APDU and receive the response into rapdu, holding the lock;
+ * cancels is ctx->cancels from before the caller took the lock */
+static ssize_t transceive(struct vicc_ctx *ctx, unsigned int cancels,
+        size_t apdu_len, const unsigned char *apdu, unsigned char *rapdu,
+        size_t rapdu_len)
+{
+    ssize_t r;
+
+    if (ctx->pending) {
+        /* the response of vicc_submit would be taken for this one */
+        errno = EBUSY;
+        return -1;
+    }
+    /* a cancel before the exchange was called is not for it, one while it
+     * waited for the lock behind another exchange is */
+    ctx->cancels_before = cancels;
+    if (ctx->cancels != cancels) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    if (ctx->esp) {
+        if (!rapdu) {
+            errno = EINVAL;
+            return -1;
+        }
+        return esp_transmit(ctx, apdu_len, apdu, rapdu, rapdu_len);
+    }
+
+    if (apdu_len && apdu)
+        r = sendToVICC(ctx, apdu_len, apdu);
+    else
+        r = 1;
+
+    if (r > 0 && rapdu)
+        r = recvFromVICC(ctx, rapdu, rapdu_len);
+
+    return r;
+}
+
 ssize_t vicc_transmit(struct vicc_ctx *ctx,
         size_t apdu_len, const unsigned char *apdu,
         unsigned char **rapdu)
 {
     ssize_t r = -1;
+    unsigned char *p;
+    unsigned int cancels = ctx ? ctx->cancels : 0;
 
     if (ctx && lock(ctx->io_lock)) {
-        if (apdu_len && apdu)
-            r = sendToVICC(ctx, apdu_len, apdu);
-        else
-            r = 1;
+        if (rapdu && !ctx->buffer)
+            ctx->buffer = malloc(RESPONSE_BUFFER_SIZE);
+        if (rapdu && !ctx->buffer) {
+            errno = ENOMEM;
+        } else {
+            r = transceive(ctx, cancels, apdu_len, apdu,
+                    rapdu ? ctx->buffer : NULL, RESPONSE_BUFFER_SIZE);
+        }
 
-        if (r > 0 && rapdu)
-            r = recvFromVICC(ctx, rapdu);
+        if (r > 0 && rapdu) {
+            p = realloc(*rapdu, r);
+            if (p) {
+                memcpy(p, ctx->buffer, r);
+                *rapdu = p;
+            } else {
+                errno = ENOMEM;
+                r = -1;
+            }
+        }
 
+        /* under the lock, vicc_present may connect again meanwhile */
+        if (lost(r) && !ctx->esp)
+            vicc_eject(ctx);
         unlock(ctx->io_lock);
     }
 
-    if (r <= 0)
-        vicc_eject(ctx);
+    return r;
+}
+
+ssize_t vicc_transmit_into(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char *rapdu, size_t rapdu_len)
+{
+    ssize_t r = -1;
+    unsigned int cancels = ctx ? ctx->cancels : 0;
+
+    if (ctx && lock(ctx->io_lock)) {
+        r = transceive(ctx, cancels, apdu_len, apdu, rapdu, rapdu_len);
+        if (lost(r) && !ctx->esp)
+            vicc_eject(ctx);
+        unlock(ctx->io_lock);
+    }
+
+    return r;
+}
+
+ssize_t vicc_submit(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu)
+{
+    ssize_t r = -1;
+    unsigned int cancels;
+
+    if (!ctx || !apdu_len || !apdu) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    cancels = ctx->cancels;
+    if (lock(ctx->io_lock)) {
+        ctx->cancels_before = cancels;
+        if (ctx->pending)
+            errno = EBUSY;
+        else if (ctx->esp)
+            /* only on the connection the device parked */
+            r = esp_send(ctx, apdu_len, apdu, 0);
+        else if (ctx->client_sock == INVALID_SOCKET)
+            errno = ENOTCONN;
+        else
+            r = sendToVICC(ctx, apdu_len, apdu);
+
+        if (r >= 0) {
+            ctx->pending = 1;
+            vpcd_manager_arm(ctx);
+        }
+        unlock(ctx->io_lock);
+    }
 
     return r;
 }
 
+static int readable(SOCKET sock, long secs, long usecs)
+{
+#ifdef _WIN32
+    fd_set rfds;
+    struct timeval tv;
+
+    FD_ZERO(&rfds);
+#pragma warning(disable:4127)
+    FD_SET(sock, &rfds);
+#pragma warning(default:4127)
+    tv.tv_sec = secs;
+    tv.tv_usec = usecs;
+
+    return select((int) sock+1, &rfds, NULL, NULL, &tv) > 0;
+#else
+    /* poll, unlike select, takes the descriptors of hundreds of readers */
+    struct pollfd pfd;
+    int r;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    do {
+        r = poll(&pfd, 1, (int) (secs*1000 + usecs/1000));
+    } while (r < 0 && errno == EINTR);
+
+    return r > 0;
+#endif
+}
+
+ssize_t vicc_complete(struct vicc_ctx *ctx,
+        unsigned char *rapdu, size_t rapdu_len, long secs, long usecs)
+{
+    ssize_t r = -1;
+
+    if (!ctx || !rapdu) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (lock(ctx->io_lock)) {
+        if (!ctx->pending) {
+            errno = EINVAL;
+        } else if (ctx->client_sock == INVALID_SOCKET) {
+            /* the parked connection of the device was found closed */
+            ctx->pending = 0;
+            errno = ECONNRESET;
+        } else if (ctx->shm
+                ? !vpcd_shm_wait(ctx->shm, VPCD_SHM_TO_VPCD, ctx->client_sock,
+                    secs, usecs)
+                : !readable(ctx->client_sock, secs, usecs)) {
+            errno = EAGAIN;
+        } else {
+            ctx->pending = 0;
+            vpcd_manager_done(ctx);
+            if (ctx->esp) {
+                r = esp_recv(ctx, rapdu, rapdu_len);
+            } else {
+                r = recvFromVICC(ctx, rapdu, rapdu_len);
+                if (lost(r))
+                    vicc_eject(ctx);
+            }
+        }
+        unlock(ctx->io_lock);
+    }
+
+    return r;
+}
+
+struct vicc_ctx *vicc_wait(long secs, long usecs)
+{
+    return vpcd_manager_next(secs, usecs);
+}
+
+/* Largest data of a short command APDU, and so of a batch envelope */
+#define BATCH_MAX_DATA 0xFF
+
+static int batch_append(unsigned char **responses, size_t *length,
+        const unsigned char *response, size_t response_len)
+{
+    unsigned char *p = realloc(*responses, *length + 2 + response_len);
+    if (!p)
+        return 0;
+    *responses = p;
+    p[*length] = (unsigned char) (response_len >> 8);
+    p[*length + 1] = (unsigned char) response_len;
+    memcpy(p + *length + 2, response, response_len);
+    *length += 2 + response_len;
+    return 1;
+}
+
+static int batch_ok(const unsigned char *response, size_t response_len)
+{
+    return response_len >= 2
+        && response[response_len - 2] == 0x90
+        && response[response_len - 1] == 0x00;
+}
+
+/* Send an APDU, following 61 XX with GET RESPONSE. Returns the length of
+ * the complete response (data and the last status word), or -1 on error */
+static ssize_t batch_transmit(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char **rapdu)
+{
+    unsigned char get_response[5] = {0x00, 0xC0, 0x00, 0x00, 0x00};
+    unsigned char *part = NULL, *p;
+    size_t length = 0;
+    ssize_t r;
+
+    r = vicc_transmit(ctx, apdu_len, apdu, &part);
+    while (r >= 2) {
+        p = realloc(*rapdu, length + r);
+        if (!p)
+            break;
+        *rapdu = p;
+        memcpy(p + length, part, r);
+        length += r;
+        if (part[r - 2] != 0x61) {
+            free(part);
+            return length;
+        }
+        length -= 2;
+        get_response[4] = part[r - 1];
+        r = vicc_transmit(ctx, sizeof get_response, get_response, &part);
+    }
+    free(part);
+
+    return -1;
+}
+
+/* Send the APDUs one by one. Returns the number of bytes of commands that
+ * were sent, or -1 on error; *stop is set if a response was not 90 00 */
+static ssize_t batch_single(struct vicc_ctx *ctx,
+        size_t commands_len, const unsigned char *commands,
+        unsigned char **responses, size_t *length, int *stop)
+{
+    unsigned char *rapdu = NULL;
+    size_t in = 0, n;
+    ssize_t r;
+
+    while (in < commands_len && !*stop) {
+        n = commands[in] << 8 | commands[in + 1];
+        r = batch_transmit(ctx, n, commands + in + 2, &rapdu);
+        if (r < 0 || !batch_append(responses, length, rapdu, r)) {
+            free(rapdu);
+            return -1;
+        }
+        *stop = !batch_ok(rapdu, r);
+        in += 2 + n;
+    }
+    free(rapdu);
+
+    return in;
+}
+
+/* Send the APDUs in one envelope. Returns the number of bytes of commands
+ * that were run, 0 if the card refused the envelope, or -1 on error; *stop
+ * is set if a response was not 90 00 */
+static ssize_t batch_envelope(struct vicc_ctx *ctx,
+        size_t commands_len, const unsigned char *commands,
+        unsigned char **responses, size_t *length, int *stop)
+{
+    unsigned char envelope[5 + BATCH_MAX_DATA];
+    unsigned char *data = NULL;
+    size_t in = 0, out = 0, n;
+    ssize_t r, ran = -1;
+
+    envelope[0] = 0x00;
+    envelope[1] = VPCD_BATCH_INS;
+    envelope[2] = 0x00;
+    envelope[3] = 0x00;
+    envelope[4] = (unsigned char) commands_len;
+    memcpy(envelope + 5, commands, commands_len);
+
+    r = batch_transmit(ctx, 5 + commands_len, envelope, &data);
+    if (r < 0)
+        goto err;
+
+    ran = 0;
+    if (!batch_ok(data, r))
+        goto err;           /* refused, e.g. an APDU the firmware won't batch */
+
+    /* one response per APDU that was run, in order */
+    while (out + 2 <= (size_t) r - 2 && in < commands_len) {
+        n = data[out] << 8 | data[out + 1];
+        if (n < 2 || out + 2 + n > (size_t) r - 2) {
+            errno = EMSGSIZE;
+            ran = -1;
+            goto err;
+        }
+        if (!batch_append(responses, length, data + out + 2, n)) {
+            ran = -1;
+            goto err;
+        }
+        *stop = !batch_ok(data + out + 2, n);
+        out += 2 + n;
+        in += 2 + (commands[in] << 8 | commands[in + 1]);
+    }
+    ran = in;
+
+err:
+    free(data);
+
+    return ran;
+}
+
+ssize_t vicc_batch(struct vicc_ctx *ctx,
+        size_t commands_len, const unsigned char *commands,
+        unsigned char **responses)
+{
+    size_t in = 0, end, n, length = 0;
+    ssize_t r;
+    int stop = 0;
+
+    if (!commands || !responses) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (end = 0; end < commands_len; end += 2 + n) {
+        if (commands_len - end < 2) {
+            errno = EINVAL;
+            return -1;
+        }
+        n = commands[end] << 8 | commands[end + 1];
+        if (n < 4 || n > commands_len - end - 2) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    while (in < commands_len && !stop) {
+        /* as many APDUs as fit into the envelope */
+        for (end = in; end < commands_len; end += 2 + n) {
+            n = commands[end] << 8 | commands[end + 1];
+            if (end + 2 + n - in > BATCH_MAX_DATA)
+                break;
+        }
+
+        if (end == in) {
+            /* too large for an envelope */
+            n = commands[in] << 8 | commands[in + 1];
+            r = batch_single(ctx, 2 + n, commands + in, responses, &length, &stop);
+        } else {
+            r = batch_envelope(ctx, end - in, commands + in, responses, &length, &stop);
+            if (r == 0)
+                r = batch_single(ctx, end - in, commands + in, responses, &length, &stop);
+        }
+        if (r < 0)
+            return -1;
+        in += r;
+    }
+
+    return length;
+}
 
 int vicc_connect(struct vicc_ctx *ctx, long secs, long usecs)
 {
@@ -362,15 +1489,40 @@ int vicc_connect(struct vicc_ctx *ctx, long secs, long usecs)
         return 0;
 
     if (ctx->client_sock == INVALID_SOCKET) {
-        if (ctx->server_sock) {
+        if (ctx->server_sock != INVALID_SOCKET) {
             /* server mode, try to accept a client */
-            ctx->client_sock = waitforclient(ctx->server_sock, secs, usecs);
+            if (ctx->slot) {
+                /* take the connection the manager accepted */
+                ctx->client_sock = vpcd_manager_accept(ctx, secs, usecs);
+                if (ctx->client_sock != INVALID_SOCKET && !ctx->path)
+                    setclientopts(ctx->client_sock);
+            } else
+                ctx->client_sock = waitforclient(ctx->server_sock, secs, usecs);
             if (!ctx->client_sock) {
                 ctx->client_sock = INVALID_SOCKET;
             }
         } else {
             /* client mode, try to connect (again) */
-            ctx->client_sock = connectsock(ctx->hostname, ctx->port);
+            ctx->client_sock = reconnect(ctx);
+        }
+        if (ctx->client_sock != INVALID_SOCKET && ctx->use_shm) {
+            /* the messages go through shared memory from now on */
+            ctx->shm = vpcd_shm_offer(ctx->client_sock);
+            if (!ctx->shm) {
+                close(ctx->client_sock);
+                ctx->client_sock = INVALID_SOCKET;
+            }
+        }
+        if (ctx->client_sock != INVALID_SOCKET) {
+            /* the ESP32 connects for every exchange, its messages are
+             * numbered for the whole session */
+            if (!ctx->esp) {
+                ctx->seq = 0;
+                setcheckinterval(ctx->client_sock);
+            }
+            ctx->atr_len = 0;
+            vpcd_trace(ctx->port, ctx->seq, VPCD_TRACE_CONNECT, NULL, 0);
+            vpcd_manager_attach(ctx);
         }
     }
 
@@ -382,27 +1534,117 @@ int vicc_connect(struct vicc_ctx *ctx, long secs, long usecs)
 }
 
 int vicc_present(struct vicc_ctx *ctx) {
-    unsigned char *atr = NULL;
+    unsigned char atr[VPCD_MAX_ATR_SIZE];
+    SOCKET sock;
+
+    if (ctx && ctx->esp)
+        return esp_present(ctx);
+
+    if (!vicc_connect(ctx, 0, 0))
+        return 0;
 
-    /* get the atr to check if the card is still alive */
-    if (!vicc_connect(ctx, 0, 0) || vicc_getatr(ctx, &atr) <= 0)
+    /* Checked without the lock, so that polling does not wait for an
+     * exchange (the peek leaves a response that is arriving alone) */
+    sock = ctx->client_sock;
+    if (!alive(sock)) {
+        if (lock(ctx->io_lock)) {
+            if (ctx->client_sock == sock)
+                vicc_eject(ctx);
+            unlock(ctx->io_lock);
+        }
         return 0;
+    }
 
-    free(atr);
+    /* get the atr once to check that the card answers */
+    if (ctx->atr_len)
+        return 1;
 
-    return 1;
+    return vicc_getatr_into(ctx, atr, sizeof atr) > 0;
 }
 
 ssize_t vicc_getatr(struct vicc_ctx *ctx, unsigned char **atr) {
+    unsigned char buffer[VPCD_MAX_ATR_SIZE];
+    unsigned char *p;
+    ssize_t r;
+
+    if (!atr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    r = vicc_getatr_into(ctx, buffer, sizeof buffer);
+    if (r > 0) {
+        p = realloc(*atr, r);
+        if (!p) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(p, buffer, r);
+        *atr = p;
+    }
+
+    return r;
+}
+
+ssize_t vicc_getatr_into(struct vicc_ctx *ctx, unsigned char *atr, size_t atr_len) {
     unsigned char i = VPCD_CTRL_ATR;
-    return vicc_transmit(ctx, VPCD_CTRL_LEN, &i, atr);
+    ssize_t r = -1;
+    unsigned int cancels = ctx ? ctx->cancels : 0;
+
+    if (ctx && ctx->esp) {
+        /* the firmware has no ATR */
+        if (!atr) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (!esp_present(ctx))
+            return 0;
+        if (atr_len < sizeof esp_atr) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        memcpy(atr, esp_atr, sizeof esp_atr);
+        return sizeof esp_atr;
+    }
+
+    if (!atr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx && lock(ctx->io_lock)) {
+        if (ctx->atr_len) {
+            if (atr_len < ctx->atr_len) {
+                errno = ENOBUFS;
+            } else {
+                memcpy(atr, ctx->atr, ctx->atr_len);
+                r = ctx->atr_len;
+            }
+        } else {
+            r = transceive(ctx, cancels, VPCD_CTRL_LEN, &i, atr, atr_len);
+            if (r > 0 && (size_t) r <= sizeof ctx->atr) {
+                memcpy(ctx->atr, atr, r);
+                ctx->atr_len = r;
+            }
+        }
+        if (lost(r))
+            vicc_eject(ctx);
+        unlock(ctx->io_lock);
+    }
+
+    return r;
 }
 
 int vicc_poweron(struct vicc_ctx *ctx) {
     unsigned char i = VPCD_CTRL_ON;
     int r = 0;
 
+    if (ctx && ctx->esp)
+        /* the device is always powered */
+        return 1;
+
     if (ctx && lock(ctx->io_lock)) {
+        ctx->atr_len = 0;
         r = sendToVICC(ctx, VPCD_CTRL_LEN, &i);
         unlock(ctx->io_lock);
     }
@@ -414,6 +1656,9 @@ int vicc_poweroff(struct vicc_ctx *ctx) {
     unsigned char i = VPCD_CTRL_OFF;
     int r = 0;
 
+    if (ctx && ctx->esp)
+        return 1;
+
     if (ctx && lock(ctx->io_lock)) {
         r = sendToVICC(ctx, VPCD_CTRL_LEN, &i);
         unlock(ctx->io_lock);
@@ -424,9 +1669,19 @@ int vicc_poweroff(struct vicc_ctx *ctx) {
 
 int vicc_reset(struct vicc_ctx *ctx) {
     unsigned char i = VPCD_CTRL_RESET;
+    unsigned char *rapdu = NULL;
     int r = 0;
 
+    if (ctx && ctx->esp) {
+        /* like vicc in ESP32 mode, forget the verified PINs */
+        if (vicc_transmit(ctx, sizeof esp_invalidate, esp_invalidate, &rapdu) > 0)
+            r = 1;
+        free(rapdu);
+        return r;
+    }
+
     if (ctx && lock(ctx->io_lock)) {
+        ctx->atr_len = 0;
         r = sendToVICC(ctx, VPCD_CTRL_LEN, &i);
         unlock(ctx->io_lock);
     }
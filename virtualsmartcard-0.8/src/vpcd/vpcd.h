@@ -35,6 +35,8 @@ typedef int ssize_t;
 #include <unistd.h>
 #endif
 
+#include <time.h>
+
 #define VPCD_CTRL_LEN 	1
 
 #define VPCD_CTRL_OFF   0
@@ -42,12 +44,77 @@ typedef int ssize_t;
 #define VPCD_CTRL_RESET 2
 #define VPCD_CTRL_ATR	4
 
+/** Host name selecting the ESP32 backend: instead of talking to vicc, vpcd
+ * listens on the port for the connections of an ESP32 running the GnuPG
+ * firmware (e.g. DEVICENAME esp:5511 in reader.conf) */
+#define VPCD_ESP_HOSTNAME "esp"
+
+/** Prefix of a host name selecting a Unix domain socket: vpcd listens on the
+ * path following it instead of a TCP port (e.g. DEVICENAME
+ * unix:/run/vpcd/vicc in reader.conf) */
+#define VPCD_UNIX_PREFIX "unix:"
+
+/** Prefix of a host name selecting the shared memory transport (shm.h): vpcd
+ * listens on a Unix domain socket like with \a VPCD_UNIX_PREFIX, and
+ * exchanges the messages with the vicc through rings in shared memory */
+#define VPCD_SHM_PREFIX "shm:"
+
+/** Longest ATR kept by a context (ISO 7816-3) */
+#define VPCD_MAX_ATR_SIZE 33
+
 struct vicc_ctx {
         SOCKET server_sock;
         SOCKET client_sock;
         char *hostname;
         unsigned short port;
         void *io_lock;
+        /* messages sent to the vicc on the current connection, used to
+         * correlate the trace records of vpcd and vicc */
+        unsigned int seq;
+        /* ESP32 backend: client_sock is the connection the device opened
+         * and keeps waiting for the next command APDU */
+        int esp;
+        time_t esp_seen;
+        /* responses for vicc_transmit and vicc_getatr, allocated once and
+         * reused for every exchange */
+        unsigned char *buffer;
+        /* state of the connection manager (manager.h), NULL if the
+         * sockets of the context are not managed */
+        void *slot;
+        /* a command was submitted and its response not yet received */
+        int pending;
+        /* ATR of the card on the current connection, fetched once after
+         * it connected, was powered up or reset; 0 if not known */
+        unsigned char atr[VPCD_MAX_ATR_SIZE];
+        size_t atr_len;
+        /* Unix domain socket vpcd listens on, removed by vicc_exit; NULL
+         * for TCP */
+        char *path;
+        /* shared memory transport: the region of the current connection
+         * (shm.h), NULL until the vicc connected */
+        int use_shm;
+        void *shm;
+        /* milliseconds an exchange waits for its response (\a
+         * vicc_settimeout) */
+        long timeout;
+        /* responses owed by the vicc for exchanges that timed out or were
+         * cancelled, discarded when they arrive */
+        unsigned int stale;
+        /* counted up by \a vicc_cancel, without the lock; an exchange is
+         * aborted once it differs from \a cancels_before */
+        volatile unsigned int cancels;
+        /* \a cancels when the current exchange was called, before it waited
+         * for the lock */
+        unsigned int cancels_before;
+        /* client mode: the address hostname resolved to, kept while
+         * connecting to it works; NULL if not resolved yet */
+        void *addr;
+        size_t addr_len;
+        /* client mode: no new connection is attempted before retry_at
+         * (milliseconds of the monotonic clock), backoff doubles with every
+         * failed attempt */
+        long long retry_at;
+        long backoff;
 };
 
 #ifdef __cplusplus
@@ -58,14 +125,23 @@ extern "C" {
 /** Standard port of the virtual smart card reader */
 #define VPCDPORT 35963
 
+/** Seconds an exchange waits for the response of the vicc by default, more
+ * than the vicc waits for an ESP32 (30, the proceed button waits 15). The
+ * environment variable VPCD_TIMEOUT of pcscd overrides it. */
+#define VPCD_RESPONSE_TIMEOUT 40
+
 /**
  * @brief Initialize the module
  *
  * @param[in] hostname Set hostname to something different to NULL if you want
  *                     to connect the vpcd to a socket opened by vicc.
  *                     Otherwise (default behavior) the vpcd will open a port
- *                     for vicc
- * @param[in] port     Port to connect to or to open (see \a hostname)
+ *                     for vicc. \a VPCD_ESP_HOSTNAME opens the port for an
+ *                     ESP32 instead, a name starting with \a
+ *                     VPCD_UNIX_PREFIX or \a VPCD_SHM_PREFIX a Unix domain
+ *                     socket for vicc
+ * @param[in] port     Port to connect to or to open (see \a hostname); only
+ *                     names the reader in the trace for a Unix domain socket
  *
  * @return On success, the call returns the initialized context
  *         On error, NULL is returned.
@@ -75,15 +151,56 @@ struct vicc_ctx * vicc_init(const char *hostname, unsigned short port);
 int vicc_exit(struct vicc_ctx *ctx);
 int vicc_eject(struct vicc_ctx *ctx);
 
+/**
+ * @brief Set how long an exchange waits for its response, \a secs seconds
+ * and \a usecs microseconds (\a VPCD_RESPONSE_TIMEOUT by default, 30 s for
+ * an ESP32).
+ *
+ * An exchange without a response in time fails with ETIMEDOUT and the card
+ * stays connected: the late response is discarded when it arrives.
+ *
+ * @return 1 on success, 0 if \a ctx is NULL or the time not positive
+ */
+int vicc_settimeout(struct vicc_ctx *ctx, long secs, long usecs);
+
+/**
+ * @brief Abort the exchange that waits for its response on \a ctx, and
+ * those called before that still wait for the lock.
+ *
+ * Called from another thread, without waiting for the exchange. It fails
+ * with ECANCELED within \a VPCD_CANCEL_CHECK_MS, the card stays connected
+ * like after a timeout; an exchange still waiting for the lock fails as
+ * soon as it gets it, without sending anything. Does nothing if no
+ * exchange is waiting.
+ */
+void vicc_cancel(struct vicc_ctx *ctx);
+
+/** Milliseconds an exchange waits at most before it checks whether it was
+ * cancelled */
+#define VPCD_CANCEL_CHECK_MS 50
+
 int vicc_connect(struct vicc_ctx *ctx, long secs, long usecs);
-int vicc_present(struct vicc_ctx *ctx);
 int vicc_poweron(struct vicc_ctx *ctx);
 int vicc_poweroff(struct vicc_ctx *ctx);
 int vicc_reset(struct vicc_ctx *ctx);
 
+/**
+ * @brief Whether a card is connected.
+ *
+ * The connection is checked without an exchange, a closed one is noticed
+ * from the socket (and with TCP keepalive if the vicc vanished without
+ * closing it). The ATR is requested only if it is not known yet.
+ *
+ * @return 1 if a card is present, 0 if not
+ */
+int vicc_present(struct vicc_ctx *ctx);
+
 /**
  * @brief Receive ATR from the virtual smart card.
  *
+ * The ATR is requested once per connection, and again after \a
+ * vicc_poweron or \a vicc_reset.
+ *
  * @param[in,out] atr ATR received. Memory will be reused (via \a realloc) and
  *                    should be freed by the caller if no longer needed.
  *
@@ -92,6 +209,18 @@ int vicc_reset(struct vicc_ctx *ctx);
  */
 ssize_t vicc_getatr(struct vicc_ctx *ctx, unsigned char** atr);
 
+/**
+ * @brief Receive ATR from the virtual smart card into a buffer of the caller.
+ *
+ * @param[out] atr     ATR received
+ * @param[in]  atr_len Size of \a atr
+ *
+ * @return On success, the call returns the number of bytes received.
+ *         On error, -1 is returned, and errno is set appropriately (ENOBUFS
+ *         if the ATR is longer than \a atr_len).
+ */
+ssize_t vicc_getatr_into(struct vicc_ctx *ctx, unsigned char *atr, size_t atr_len);
+
 /**
  * @brief Send an APDU to the virtual smart card.
  *
@@ -108,6 +237,101 @@ ssize_t vicc_transmit(struct vicc_ctx *ctx,
         size_t apdu_len, const unsigned char *apdu,
         unsigned char **rapdu);
 
+/**
+ * @brief Send an APDU to the virtual smart card and receive the response
+ * into a buffer of the caller, without allocating memory.
+ *
+ * @param[in]  apdu_len  Number of bytes to send
+ * @param[in]  apdu      Data to be sent
+ * @param[out] rapdu     Data received
+ * @param[in]  rapdu_len Size of \a rapdu
+ *
+ * @return On success, the call returns the number of bytes received.
+ *         On error, -1 is returned, and errno is set appropriately (ENOBUFS
+ *         if the response is longer than \a rapdu_len, the card stays
+ *         connected).
+ */
+ssize_t vicc_transmit_into(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        unsigned char *rapdu, size_t rapdu_len);
+
+/**
+ * @brief Send an APDU to the virtual smart card without waiting for the
+ * response, which is received with \a vicc_complete.
+ *
+ * No other exchange may use the context until then. With the connection
+ * manager the context is reported by \a vicc_wait once the response
+ * arrives, so that one thread can keep a command going on many readers.
+ *
+ * @param[in] apdu_len Number of bytes to send
+ * @param[in] apdu     Data to be sent
+ *
+ * @return On success, the call returns the number of bytes sent.
+ *         On error, -1 is returned, and errno is set appropriately (EBUSY if
+ *         a response is pending, ENOTCONN if no card is connected; with the
+ *         ESP32 backend EAGAIN if the device has not connected yet).
+ */
+ssize_t vicc_submit(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu);
+
+/**
+ * @brief Receive the response of the APDU sent with \a vicc_submit into a
+ * buffer of the caller, waiting for it at most \a secs seconds and \a usecs
+ * microseconds.
+ *
+ * @param[out] rapdu     Data received
+ * @param[in]  rapdu_len Size of \a rapdu
+ *
+ * @return On success, the call returns the number of bytes received.
+ *         On error, -1 is returned, and errno is set appropriately (EAGAIN
+ *         if the response has not arrived yet, it stays pending; EINVAL if
+ *         nothing was submitted).
+ */
+ssize_t vicc_complete(struct vicc_ctx *ctx,
+        unsigned char *rapdu, size_t rapdu_len, long secs, long usecs);
+
+/**
+ * @brief Wait at most \a secs seconds and \a usecs microseconds for the next
+ * context with an event: a response to \a vicc_submit, a card that
+ * connected (see \a vicc_connect) or a connection that was closed.
+ *
+ * The event may already have been handled, e.g. \a vicc_complete then fails
+ * with EAGAIN. The responses that arrive through shared memory (\a
+ * VPCD_SHM_PREFIX) are not reported, only the connections of that transport;
+ * poll them with \a vicc_complete.
+ *
+ * @return On success, the context. On error, NULL is returned and errno is
+ *         set appropriately (ETIMEDOUT, or ENOSYS without the connection
+ *         manager, which needs epoll).
+ */
+struct vicc_ctx *vicc_wait(long secs, long usecs);
+
+/** INS of the batch envelope of the ESP32 firmware (vendor specific) */
+#define VPCD_BATCH_INS 0xF9
+
+/**
+ * @brief Send several APDUs to the virtual smart card, stopping after the
+ * first response that does not end in 90 00.
+ *
+ * The APDUs are packed into as few batch envelopes (\a VPCD_BATCH_INS) as
+ * their size allows and the ESP32 runs each envelope in one exchange. A card
+ * that does not know the envelope gets the APDUs one by one.
+ *
+ * @param[in]     commands_len Number of bytes in \a commands
+ * @param[in]     commands     The APDUs, each preceded by its length (2
+ *                             bytes, big endian)
+ * @param[in,out] responses    The responses in the same format, one for each
+ *                             APDU sent. Memory will be reused (via \a
+ *                             realloc) and should be freed by the caller if no
+ *                             longer needed.
+ *
+ * @return On success, the call returns the number of bytes received.
+ *         On error, -1 is returned, and errno is set appropriately.
+ */
+ssize_t vicc_batch(struct vicc_ctx *ctx,
+        size_t commands_len, const unsigned char *commands,
+        unsigned char **responses);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,293 @@
+#
+# This file is part of virtualsmartcard.
+#
+# virtualsmartcard is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option) any
+# later version.
+#
+# virtualsmartcard is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Counters and latency histograms of the vicc bridge, served over HTTP in the
+Prometheus text format (version 0.0.4) for scraping by a monitoring system.
+
+The endpoint is given as PORT or HOST:PORT (HTTP on TCP, 127.0.0.1 unless
+a host is given) or as unix:/path (HTTP on a Unix socket, e.g. for
+curl --unix-socket /path http://localhost/metrics). ESP32 devices are
+labelled with their MAC address (see DeviceBridge).
+"""
+
+import logging
+import os
+import socket
+import threading
+import time
+
+try:
+    from BaseHTTPServer import BaseHTTPRequestHandler
+    from SocketServer import TCPServer, UnixStreamServer, ThreadingMixIn
+except ImportError:
+    from http.server import BaseHTTPRequestHandler
+    from socketserver import TCPServer, UnixStreamServer, ThreadingMixIn
+
+# Upper bounds of the latency buckets (s); the ESP32 takes seconds to sign
+# and waits for the proceed button
+BUCKETS = (0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0,
+           30.0, 60.0)
+
+LOCAL_DEVICE = "emulated"   # Device label of the APDUs answered by the vicc
+NO_DEVICE = "none"          # Device label of the commands no device took
+CACHE_DEVICE = "cache"      # Device label of the reads answered from the cache (see DeviceCache)
+MIRROR_DEVICE = "mirror"    # Device label of the commands refused by the mirror (see DeviceMirror)
+
+# Name, type and help of the metrics, in the order they are rendered
+FAMILIES = (
+    ("vicc_start_time_seconds", "gauge", "Start time of the vicc since the epoch"),
+    ("vicc_vpcd_connections_total", "counter", "Connections to vpcd, including reconnects"),
+    ("vicc_vpcd_connection_uptime_seconds", "gauge", "Age of the current connection to vpcd"),
+    ("vicc_queue_depth", "gauge", "Commands waiting for a device to connect"),
+    ("vicc_in_flight", "gauge", "Commands sent to a device and not answered yet"),
+    ("vicc_apdu_duration_seconds", "histogram",
+     "Time from receiving a command from vpcd to sending the response"),
+    ("vicc_device_exchange_seconds", "histogram", "Time from sending a command to a device to its response"),
+    ("vicc_apdu_errors_total", "counter", "Responses with an error status word"),
+    ("vicc_device_errors_total", "counter", "Failed exchanges with a device"),
+    ("vicc_device_last_seen_seconds", "gauge", "Time of the last exchange with a device since the epoch"),
+    ("vicc_pool_device_load", "gauge", "Commands routed to a device of the pool and not answered yet"),
+    ("vicc_pool_device_healthy", "gauge", "Whether a device of the pool is connected and takes commands"),
+    ("vicc_pool_device_busy_seconds_total", "counter", "Time a device of the pool spent in exchanges"),
+    ("vicc_pool_failovers_total", "counter", "Commands sent to another device after a device failed"),
+    ("vicc_pool_pin_replays_total", "counter", "VERIFY commands replayed to a device of the pool"),
+)
+
+
+class Histogram(object):
+
+    def __init__(self):
+        self.counts = [0] * (len(BUCKETS) + 1)
+        self.sum = 0.0
+
+    def observe(self, value):
+        i = 0
+        while i < len(BUCKETS) and value > BUCKETS[i]:
+            i += 1
+        self.counts[i] += 1
+        self.sum += value
+
+    def lines(self, name, labels):
+        out = []
+        total = 0
+        for bound, count in zip(BUCKETS + ("+Inf",), self.counts):
+            total += count
+            le = bound if isinstance(bound, str) else repr(bound)
+            out.append("%s_bucket%s %d" % (name, _labels(labels + (("le", le),)), total))
+        out.append("%s_sum%s %.6f" % (name, _labels(labels), self.sum))
+        out.append("%s_count%s %d" % (name, _labels(labels), total))
+        return out
+
+
+def _labels(pairs):
+    if not pairs:
+        return ""
+    return "{%s}" % ",".join('%s="%s"' % (k, str(v).replace("\\", "\\\\").replace('"', '\\"'))
+                             for k, v in pairs)
+
+
+class BridgeMetrics(object):
+
+    def __init__(self, port):
+        self.lock = threading.Lock()
+        self.port = port
+        self.start = time.time()
+        self.vpcdConnections = 0
+        self.vpcdConnectedSince = None
+        self.apdus = {}         # (INS, device): Histogram from vpcd to vpcd
+        self.exchanges = {}     # device: Histogram of the exchanges with the ESP32
+        self.statusWords = {}   # (INS, SW): Count of the error status words
+        self.deviceErrors = {}  # (device, reason): Count
+        self.lastSeen = {}      # device: Time of the last exchange
+        self.queued = 0         # Commands waiting for a device to connect
+        self.inFlight = 0       # Commands sent to a device, not answered yet
+        self.current = None     # (INS, received) of the APDU being handled
+        self.device = LOCAL_DEVICE  # Device that answered the APDU being handled
+
+    def connected(self):
+        """A new connection to vpcd"""
+        with self.lock:
+            self.vpcdConnections += 1
+            self.vpcdConnectedSince = time.time()
+            self.current = None
+
+    def received(self, msg):
+        """A message was received from vpcd"""
+        with self.lock:
+            if msg is not None and len(msg) > 1:
+                self.current = (bytearray(msg)[1], time.time())
+            else:
+                self.current = None
+            self.device = LOCAL_DEVICE
+
+    def local(self, device):
+        """The command was answered for the device by the vicc (CACHE_DEVICE or MIRROR_DEVICE)"""
+        with self.lock:
+            self.device = device
+
+    def waiting(self):
+        """The command was handed over to the device thread"""
+        with self.lock:
+            self.queued += 1
+
+    def forwarded(self, device):
+        """The command is being sent to the device, returns the time for answered()"""
+        now = time.time()
+        with self.lock:
+            self.queued = max(0, self.queued - 1)
+            self.inFlight += 1
+            self.device = device
+        return now
+
+    def answered(self, device, forwarded):
+        """The device sent its response"""
+        now = time.time()
+        with self.lock:
+            self.inFlight = max(0, self.inFlight - 1)
+            self.exchanges.setdefault(device, Histogram()).observe(now - forwarded)
+            self.lastSeen[device] = now
+
+    def failed(self, device, error):
+        """The exchange with the device failed"""
+        reason = "timeout" if isinstance(error, socket.timeout) else "disconnect"
+        with self.lock:
+            self.inFlight = max(0, self.inFlight - 1)
+            key = (device, reason)
+            self.deviceErrors[key] = self.deviceErrors.get(key, 0) + 1
+
+    def abandoned(self):
+        """No device took the command before its deadline"""
+        with self.lock:
+            self.queued = max(0, self.queued - 1)
+            key = (NO_DEVICE, "timeout")
+            self.deviceErrors[key] = self.deviceErrors.get(key, 0) + 1
+
+    def replied(self, response):
+        """The response is being sent to vpcd"""
+        with self.lock:
+            if self.current is None:
+                return
+            ins, received = self.current
+            self.current = None
+            self.apdus.setdefault((ins, self.device), Histogram()).observe(time.time() - received)
+            if response is not None and len(response) >= 2:
+                sw = bytearray(response)[-2:]
+                if sw != b'\x90\x00' and sw[0] != 0x61:
+                    key = (ins, "%02X%02X" % (sw[0], sw[1]))
+                    self.statusWords[key] = self.statusWords.get(key, 0) + 1
+
+    def samples(self):
+        """The sample lines of each metric, by name (see FAMILIES)"""
+        out = {}
+
+        def metric(name, samples):
+            out[name] = ["%s%s %s" % (name, _labels(labels), value) for labels, value in samples]
+
+        now = time.time()
+        with self.lock:
+            port = (("port", self.port),)
+            metric("vicc_start_time_seconds", [(port, "%.3f" % self.start)])
+            metric("vicc_vpcd_connections_total", [(port, self.vpcdConnections)])
+            metric("vicc_vpcd_connection_uptime_seconds",
+                   [(port, "%.3f" % (now - self.vpcdConnectedSince if self.vpcdConnectedSince else 0))])
+            metric("vicc_queue_depth", [(port, self.queued)])
+            metric("vicc_in_flight", [(port, self.inFlight)])
+
+            name = "vicc_apdu_duration_seconds"
+            out[name] = []
+            for (ins, device), histogram in sorted(self.apdus.items()):
+                out[name].extend(histogram.lines(name, port + (("ins", "%02X" % ins), ("device", device))))
+
+            name = "vicc_device_exchange_seconds"
+            out[name] = []
+            for device, histogram in sorted(self.exchanges.items()):
+                out[name].extend(histogram.lines(name, port + (("device", device),)))
+
+            metric("vicc_apdu_errors_total",
+                   [(port + (("ins", "%02X" % ins), ("sw", sw)), n)
+                    for (ins, sw), n in sorted(self.statusWords.items())])
+            metric("vicc_device_errors_total",
+                   [(port + (("device", device), ("reason", reason)), n)
+                    for (device, reason), n in sorted(self.deviceErrors.items())])
+            metric("vicc_device_last_seen_seconds",
+                   [(port + (("device", device),), "%.3f" % t) for device, t in sorted(self.lastSeen.items())])
+        return out
+
+
+
+class MetricsServer(object):
+    """The endpoint serving the metrics of all vpcd connections (slots) of the vicc"""
+
+    def __init__(self, address):
+        self.lock = threading.Lock()
+        self.metrics = []
+        self.serve(address)
+
+    def add(self, metrics):
+        with self.lock:
+            self.metrics.append(metrics)
+        return metrics
+
+    def render(self):
+        """The metrics in the Prometheus text format"""
+        with self.lock:
+            samples = [metrics.samples() for metrics in self.metrics]
+        out = []
+        for name, kind, text in FAMILIES:
+            out.append("# HELP %s %s" % (name, text))
+            out.append("# TYPE %s %s" % (name, kind))
+            for lines in samples:
+                out.extend(lines.get(name, []))
+        return "\n".join(out) + "\n"
+
+    def serve(self, address):
+        """Serve the metrics on address (PORT, HOST:PORT or unix:/path) from a daemon thread"""
+        metrics = self
+
+        class Handler(BaseHTTPRequestHandler):
+            def do_GET(self):
+                body = metrics.render().encode("ascii")
+                self.send_response(200)
+                self.send_header("Content-Type", "text/plain; version=0.0.4")
+                self.send_header("Content-Length", str(len(body)))
+                self.end_headers()
+                self.wfile.write(body)
+
+            def log_message(self, format, *args):
+                pass
+
+        if address.startswith("unix:"):
+            path = address[5:]
+            if os.path.exists(path):
+                os.unlink(path)
+
+            class Server(ThreadingMixIn, UnixStreamServer):
+                daemon_threads = True
+            server = Server(path, Handler)
+        else:
+            host, _, port = address.rpartition(":")
+
+            class Server(ThreadingMixIn, TCPServer):
+                daemon_threads = True
+                allow_reuse_address = True
+            server = Server((host or "127.0.0.1", int(port)), Handler)
+
+        thread = threading.Thread(target=server.serve_forever)
+        thread.daemon = True
+        thread.start()
+        logging.info("Serving metrics on %s", address)
+        return server
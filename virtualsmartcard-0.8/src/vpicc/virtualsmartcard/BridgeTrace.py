@@ -0,0 +1,148 @@
+#
+# This file is part of virtualsmartcard.
+#
+# virtualsmartcard is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option) any
+# later version.
+#
+# virtualsmartcard is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Trace of the exchanges handled by the vicc, written as one JSON object per
+line, for correlation with the trace of vpcd (VPCD_TRACE) and the APDU log
+of the ESP32.
+
+The messages of a connection to vpcd are numbered from 1 on both sides, so
+an exchange is identified by the port and its sequence number. Timestamps
+are CLOCK_MONOTONIC in ns, the clock of the vpcd trace. In ESP32 mode the
+clock of the device is correlated at the start of each session with the
+vendor specific command f7, which also tells the sequence number the
+device gives to the following exchanges in its APDU log.
+"""
+
+import json
+import threading
+import time
+
+CLOCK_APDU = b'\x00\xF7\x00\x00\x0C'
+CLOCK_SAMPLES = 4   # Exchanges of f7 per session, the fastest one is used
+
+
+def _ctypesMonotonic():
+    import ctypes
+    import ctypes.util
+
+    class timespec(ctypes.Structure):
+        _fields_ = [("tv_sec", ctypes.c_long), ("tv_nsec", ctypes.c_long)]
+
+    lib = ctypes.CDLL(ctypes.util.find_library("rt") or
+                      ctypes.util.find_library("c"), use_errno=True)
+    ts = timespec()
+
+    def monotonic():
+        lib.clock_gettime(1, ctypes.byref(ts))  # CLOCK_MONOTONIC
+        return ts.tv_sec * 1000000000 + ts.tv_nsec
+    return monotonic
+
+
+try:
+    monotonicNs = time.monotonic_ns
+except AttributeError:
+    monotonicNs = _ctypesMonotonic()
+
+
+class BridgeTrace(object):
+
+    def __init__(self, path, port):
+        self.file = open(path, "a")
+        self.lock = threading.Lock()
+        self.port = port
+        self.conn = 0           # Connections from vpcd
+        self.seq = 0            # Messages received on the current connection
+        self.current = None     # Timestamps of the APDU being handled
+        self.samples = []
+        self.syncNeeded = True
+        self.deviceSeq = None   # APDU log sequence number of the next device exchange
+
+    def write(self, event):
+        with self.lock:
+            self.file.write(json.dumps(event, sort_keys=True) + "\n")
+            self.file.flush()
+
+    def connected(self):
+        """A new connection to vpcd"""
+        self.conn += 1
+        self.seq = 0
+        self.current = None
+
+    def received(self, msg):
+        """A message was received from vpcd"""
+        self.seq += 1
+        if msg is not None and len(msg) > 1:
+            msg = bytearray(msg)
+            self.current = {"event": "apdu", "port": self.port,
+                            "conn": self.conn, "seq": self.seq,
+                            "ins": msg[1], "length": len(msg),
+                            "t": {"recv": monotonicNs()}}
+        else:
+            self.current = None
+            if self.deviceSeq is not None:
+                self.syncNeeded = True  # Power up or reset, a new session
+
+    def mark(self, name):
+        current = self.current
+        if current is not None:
+            current["t"][name] = monotonicNs()
+
+    def forwarded(self):
+        """The command is being sent to the device"""
+        current = self.current
+        if self.deviceSeq is not None:
+            if current is not None:
+                current["device_seq"] = self.deviceSeq
+            self.deviceSeq += 1
+        self.mark("device_send")
+
+    def replied(self, response):
+        """The response is being sent to vpcd"""
+        current = self.current
+        if current is None:
+            return
+        current["t"]["reply"] = monotonicNs()
+        if response is not None and len(response) >= 2:
+            response = bytearray(response)
+            current["sw"] = "%02X%02X" % (response[-2], response[-1])
+        self.current = None
+        self.write(current)
+
+    def clockSample(self, sent, received, response):
+        """
+        Record the response to f7: the time of the device (8 bytes, us) and
+        the sequence number of the exchange in its APDU log (4 bytes)
+        """
+        response = bytearray(response)
+        if len(response) != 14 or response[-2:] != b'\x90\x00':
+            self.syncNeeded = False     # Older firmware, no correlation
+            return
+        deviceUs = sum(response[i] << (56 - 8 * i) for i in range(8))
+        head = sum(response[8 + i] << (24 - 8 * i) for i in range(4))
+        self.samples.append((received - sent, sent, received, deviceUs, head))
+        if len(self.samples) < CLOCK_SAMPLES:
+            return
+
+        # The exchange of the last f7 gets the highest sequence number
+        self.deviceSeq = max(s[4] for s in self.samples) + 1
+        rtt, sent, received, deviceUs, head = min(self.samples)
+        self.samples = []
+        self.syncNeeded = False
+        # The device time is taken halfway through the fastest exchange
+        self.write({"event": "clock", "port": self.port, "conn": self.conn,
+                    "t": received, "offset_us": deviceUs - (sent + received) // 2 // 1000,
+                    "rtt_us": rtt // 1000, "device_seq": self.deviceSeq})
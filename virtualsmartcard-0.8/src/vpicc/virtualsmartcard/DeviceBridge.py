@@ -0,0 +1,525 @@
+#
+# This file is part of virtualsmartcard.
+#
+# virtualsmartcard is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option) any
+# later version.
+#
+# virtualsmartcard is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Bridge between the vpcd slots of the vicc and the ESP32 devices connecting
+over WiFi.
+
+An ESP32 connects to port 5511 for each exchange, reads one command APDU,
+sends the response and closes the connection. All devices share the port;
+the registry identifies a device by the MAC address it reports with the
+vendor specific command f8 and binds it to a slot, i.e. a reader of vpcd.
+The handshake is repeated whenever an address has been quiet for longer
+than REBIND_GAP, so a device that rejoins the WiFi with a new address is
+found again with one exchange, and a new device that gets the address of
+an old one is not taken for it. Devices without f8 are identified by their
+address.
+
+The firmware keeps its parked connection until a command arrives on it. A
+device that connects again while its slot still holds its parked connection
+has restarted (or lost the socket with the WiFi) and may have lost its PIN
+status and changed its data, so the cache and the mirror of its slot are
+cleared, also within REBIND_GAP when the handshake is skipped.
+
+The bindings are kept in a JSON file if one is given, so every device gets
+the same reader after a restart of the vicc. Without one, a vicc with a
+single slot serves whichever device connected last.
+"""
+
+import collections
+import errno
+import json
+import logging
+import os
+import socket
+import threading
+import time
+
+try:
+    import SocketServer
+except ImportError:
+    import socketserver as SocketServer
+
+from socket import error as SocketError
+from virtualsmartcard.BridgeTrace import CLOCK_APDU, monotonicNs
+from virtualsmartcard.DeviceCache import ResponseCache
+from virtualsmartcard.DeviceMirror import CardMirror
+
+BRIDGE_PORT = 5511
+DEVICE_TIMEOUT = 30     # Seconds to wait for the response of the ESP32, the button waits 15
+REBIND_GAP = 10         # Seconds an address keeps its device without a connection
+SEEN_GAP = 2            # Seconds a device counts as connected after its last connection
+KEEPALIVE = (5, 2, 3)   # Idle seconds, interval and probes until a parked connection is dropped
+DEVICE_ID_APDU = b'\x00\xF8\x00\x00\x06'
+
+
+class DeviceRequest(object):
+    """
+    A command APDU handed over to the next connection of an ESP32. The vpcd
+    loop blocks in wait() until a connection handler delivers the response
+    or the deadline passes; a request given up while still queued is skipped
+    by the handlers and a late response is dropped.
+    """
+
+    QUEUED, SENT, DONE, ABANDONED = range(4)
+
+    def __init__(self, command, timeout, trace=None, metrics=None):
+        self.command = command
+        self.trace = trace      # BridgeTrace of the vpcd connection
+        self.metrics = metrics  # BridgeMetrics of the vpcd connection
+        self.deadline = time.time() + timeout
+        self.lock = threading.Lock()
+        self.done = threading.Event()
+        self.state = DeviceRequest.QUEUED
+        self.taken = False
+        self.response = None
+        self.error = None
+
+    def take(self):
+        """Claim the request for sending, False if the caller gave up on it"""
+        with self.lock:
+            if self.state != DeviceRequest.QUEUED:
+                return False
+            self.state = DeviceRequest.SENT
+            self.taken = True
+            return True
+
+    def release(self):
+        """Put a claimed request back, the connection died before sending it"""
+        with self.lock:
+            if self.state == DeviceRequest.SENT:
+                self.state = DeviceRequest.QUEUED
+
+    def finish(self, response=None, error=None):
+        with self.lock:
+            if self.state != DeviceRequest.SENT:
+                return
+            self.state = DeviceRequest.DONE
+            self.response = response
+            self.error = error
+        self.done.set()
+
+    def expire(self):
+        with self.lock:
+            if self.state == DeviceRequest.DONE:
+                return
+            self.state = DeviceRequest.ABANDONED
+        self.done.set()
+
+    def wait(self):
+        """
+        Return the response, or None if the deadline passed. Raises the
+        socket error if the exchange with the device failed.
+        """
+        # Event.wait() with a timeout polls in Python 2 and would delay the
+        # response by up to 50 ms; the deadline is enforced by a timer instead
+        timer = threading.Timer(self.remaining(), self.expire)
+        timer.daemon = True
+        timer.start()
+        self.done.wait()
+        timer.cancel()
+        if self.state != DeviceRequest.DONE:
+            return None
+        if self.error is not None:
+            raise self.error
+        return self.response
+
+    def remaining(self):
+        return max(0.001, self.deadline - time.time())
+
+
+class DeviceSlot(object):
+    """
+    The commands of one vpcd slot and the connection of its device that
+    waits for the next one. A newer connection of the device supersedes the
+    parked one, which the device has given up on.
+
+    The commands of vpcd and those the bridge sends itself (the prefetch of
+    the cache) do not interleave within a sequence, a command and its GET
+    RESPONSE commands or a command chain, as the device keeps the rest of a
+    response only until the next command.
+    """
+
+    VPCD, BRIDGE = range(2)
+
+    def __init__(self, index):
+        self.index = index
+        self.lock = threading.Lock()
+        self.sequence = threading.Condition(threading.Lock())
+        self.holder = None      # VPCD or BRIDGE while its sequence of commands is not done
+        self.pending = collections.deque()  # Requests waiting for a connection
+        self.parked = None      # Handler of the connection waiting for a request
+        self.trace = None       # BridgeTrace of the vpcd connection
+        self.metrics = None     # BridgeMetrics of the vpcd connection
+        self.busy = 0           # Exchanges in progress
+        self.busyTime = 0.0     # Seconds spent in exchanges
+        self.lastSeen = 0       # Time of the last connection or exchange
+        self.failed = False     # The last exchange failed, until the device reconnects
+        self.requeue = True     # Wait for the device to reconnect if its connection died
+        self.cache = ResponseCache()    # Data objects and public keys read from the device
+        self.mirror = CardMirror()      # Security state of the device
+
+    def transmit(self, command, timeout=DEVICE_TIMEOUT):
+        """
+        Hand a command APDU over to the device and block until its response.
+        Returns None if there is none within timeout, raises a socket error
+        if the exchange failed.
+        """
+        return self.exchange(DeviceSlot.VPCD, DeviceRequest(command, timeout, self.trace, self.metrics))
+
+    def fetch(self, command, timeout=DEVICE_TIMEOUT):
+        """Like transmit, for the commands of the bridge that vpcd did not send"""
+        return self.exchange(DeviceSlot.BRIDGE, DeviceRequest(command, timeout))
+
+    def exchange(self, owner, request):
+        """send() once the other owner has no sequence of commands running"""
+        if not self.hold(owner, request.remaining()):
+            return None
+        response = None
+        try:
+            response = self.send(request)
+        finally:
+            chained = len(request.command) > 0 and bytearray(request.command)[0] & 0x10
+            more = response is not None and len(response) >= 2 and bytearray(response)[-2] == 0x61
+            if not (chained or more):
+                self.unhold(owner)
+        return response
+
+    def hold(self, owner, timeout):
+        """
+        Wait until the sequence of the other owner is done and start one for
+        owner. Returns False if it is still running after timeout.
+        """
+        deadline = time.time() + timeout
+        with self.sequence:
+            while self.holder not in (None, owner):
+                remaining = deadline - time.time()
+                if remaining <= 0:
+                    return False
+                self.sequence.wait(remaining)   # Polls in Python 2, only while the other owner is in a sequence
+            self.holder = owner
+            return True
+
+    def unhold(self, owner):
+        with self.sequence:
+            if self.holder == owner:
+                self.holder = None
+                self.sequence.notify_all()
+
+    def send(self, request):
+        if request.metrics is not None:
+            request.metrics.waiting()
+        self.submit(request)
+        response = request.wait()
+        if response is None and not request.taken and request.metrics is not None:
+            request.metrics.abandoned()     # No device connected in time
+        return response
+
+    def submit(self, request, first=False):
+        with self.lock:
+            handler, self.parked = self.parked, None
+            if handler is None or not request.take():
+                self.parked = handler
+                if first:
+                    self.pending.appendleft(request)
+                else:
+                    self.pending.append(request)
+                return
+        handler.assign(request)
+
+    def park(self, handler):
+        """
+        Return the oldest pending request for a new connection of the device,
+        or park the connection until one is submitted. A parked connection
+        superseded by the new one means the device restarted.
+        """
+        with self.lock:
+            superseded, self.parked = self.parked, None
+            request = None
+            while self.pending and request is None:
+                request = self.pending.popleft()
+                if not request.take():  # Given up by the vpcd loop while queued
+                    request = None
+            if request is None:
+                self.parked = handler
+            self.lastSeen = time.time()
+            self.failed = False
+        if superseded is not None:
+            self.forget()
+            superseded.assign(None)
+        return request
+
+    def abort(self, error):
+        """Fail the requests waiting for the device, e.g. to send them to another one"""
+        with self.lock:
+            pending, self.pending = self.pending, collections.deque()
+        for request in pending:
+            if request.take():
+                request.finish(error=error)
+
+    def load(self):
+        """Requests waiting for the device or in progress"""
+        with self.lock:
+            return len(self.pending) + self.busy
+
+    def healthy(self):
+        """The device is connected and its last exchange did not fail"""
+        with self.lock:
+            if self.failed:
+                return False
+            if self.busy or time.time() - self.lastSeen < SEEN_GAP:
+                return True
+            parked = self.parked
+        return parked is not None and parked.alive()
+
+    def started(self):
+        with self.lock:
+            self.busy += 1
+
+    def ended(self, seconds, ok):
+        with self.lock:
+            self.busy -= 1
+            self.busyTime += seconds
+            self.lastSeen = time.time()
+            if not ok:
+                self.failed = True
+        if not ok:
+            self.forget()   # The device may have been reset
+
+    def forget(self):
+        """Drop what is known of the state of the device, it may have changed"""
+        self.cache.clear()
+        self.mirror.clear()
+
+
+class DeviceRegistry(object):
+    """Which device uses an address, and which slot a device is bound to"""
+
+    def __init__(self, slots, path=None):
+        self.lock = threading.Lock()
+        self.slots = slots
+        self.path = path
+        self.addresses = {}     # address: [device, last connection or exchange]
+        self.bindings = {}      # device: slot index
+        if path is not None and os.path.exists(path):
+            with open(path) as f:
+                self.bindings = dict((str(device), int(index))
+                                     for device, index in json.load(f).items())
+
+    def identify(self, address):
+        """The device at address, None if it has to be asked"""
+        now = time.time()
+        with self.lock:
+            entry = self.addresses.get(address)
+            if entry is None or now - entry[1] > REBIND_GAP:
+                return None
+            entry[1] = now
+            return entry[0]
+
+    def touch(self, address):
+        with self.lock:
+            if address in self.addresses:
+                self.addresses[address][1] = time.time()
+
+    def bind(self, address, device):
+        """Record the answer of the handshake, returns the slot index or None if all are taken"""
+        with self.lock:
+            for other in [a for a, entry in self.addresses.items() if entry[0] == device]:
+                del self.addresses[other]   # The device moved to a new address
+            self.addresses[address] = [device, time.time()]
+            if device not in self.bindings:
+                used = set(self.bindings.values())
+                free = [i for i in range(self.slots) if i not in used]
+                if not free and self.slots == 1 and self.path is None:
+                    self.bindings.clear()   # A single card, the latest device replaces it
+                    free = [0]
+                if not free:
+                    return None
+                self.bindings[device] = free[0]
+                self.save()
+                logging.info("Device %s bound to slot %d", device, free[0])
+            return self.bindings[device]
+
+    def slot(self, device):
+        with self.lock:
+            return self.bindings.get(device)
+
+    def devices(self):
+        """The bound devices by slot index"""
+        with self.lock:
+            return dict((index, device) for device, index in self.bindings.items())
+
+    def save(self):
+        if self.path is None:
+            return
+        tmp = self.path + ".tmp"
+        with open(tmp, "w") as f:
+            json.dump(self.bindings, f, indent=1, sort_keys=True)
+        os.rename(tmp, self.path)
+
+
+class DeviceHandler(SocketServer.BaseRequestHandler):
+    """
+    One connection of an ESP32: the identity handshake, the clock
+    correlation of the trace or one exchange of the slot of the device.
+    """
+
+    def setup(self):
+        self.assigned = None
+        self.event = threading.Event()
+        # A device that left the WiFi does not close its parked connection
+        idle, interval, count = KEEPALIVE
+        self.request.setsockopt(socket.SOL_SOCKET, socket.SO_KEEPALIVE, 1)
+        self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_KEEPIDLE, idle)
+        self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_KEEPINTVL, interval)
+        self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_KEEPCNT, count)
+
+    def assign(self, request):
+        """Called by the slot, None if the connection has been superseded"""
+        self.assigned = request
+        self.event.set()
+
+    def handle(self):
+        bridge = self.server.bridge
+        address = self.client_address[0]
+
+        device = bridge.registry.identify(address)
+        if device is None:
+            self.identify(address)
+            return
+        index = bridge.registry.slot(device)
+        if index is None:
+            self.hold()
+            return
+        slot = bridge.slots[index]
+
+        if slot.trace is not None and slot.trace.syncNeeded:
+            self.syncClock(slot.trace)  # Use this connection to read the clock of the ESP32
+            return
+
+        request = slot.park(self)
+        if request is None:
+            self.event.wait()
+            request = self.assigned
+            if request is None:
+                return
+        if not self.alive():
+            slot.forget()   # The device only closes a parked connection when it restarts
+            if slot.requeue:
+                request.release()   # Closed while parked, the device will reconnect
+                slot.submit(request, first=True)
+            else:
+                slot.failed = True
+                request.finish(error=SocketError(errno.ECONNRESET, "Connection closed while parked"))
+            return
+        self.exchange(slot, device, request)
+        bridge.registry.touch(address)
+
+    def identify(self, address):
+        """Ask the device for its MAC address and bind it to a slot"""
+        try:
+            self.request.settimeout(DEVICE_TIMEOUT)
+            self.request.sendall(DEVICE_ID_APDU)
+            answer = bytearray(self.recvAll())
+        except SocketError:
+            return
+        if len(answer) == 8 and answer[6:] == b'\x90\x00':
+            device = ":".join("%02x" % b for b in answer[:6])
+        else:
+            device = "ip:" + address    # Firmware without f8
+        index = self.server.bridge.registry.bind(address, device)
+        if index is None:
+            logging.warning("No free slot for device %s at %s", device, address)
+        else:
+            logging.info("Device %s connected from %s (slot %d)", device, address, index)
+            self.server.bridge.slots[index].forget()  # It may have changed while away
+
+    def hold(self):
+        """Keep a device without a slot waiting instead of letting it reconnect in a loop"""
+        try:
+            self.request.settimeout(None)
+            self.recvAll()
+        except SocketError:
+            pass
+
+    def alive(self):
+        try:
+            return self.request.recv(1, socket.MSG_PEEK | socket.MSG_DONTWAIT) != b""
+        except SocketError as e:
+            return e.errno in (errno.EAGAIN, errno.EWOULDBLOCK)    # Nothing to read, still connected
+
+    def exchange(self, slot, device, request):
+        trace, metrics = request.trace, request.metrics
+        start = time.time()
+        slot.started()
+        try:
+            if trace is not None:
+                trace.forwarded()
+            if metrics is not None:
+                forwarded = metrics.forwarded(device)
+            self.request.settimeout(request.remaining())
+            self.request.sendall(request.command)   # Send the command APDU to the ESP32
+            response = self.recvAll()               # Get the response APDU
+            if trace is not None:
+                trace.mark("device_recv")
+            if metrics is not None:
+                metrics.answered(device, forwarded)
+            slot.ended(time.time() - start, True)
+            request.finish(response)
+        except SocketError as e:    # ESP32 probably disconnected
+            if metrics is not None:
+                metrics.failed(device, e)
+            slot.ended(time.time() - start, False)
+            request.finish(error=e)
+
+    def recvAll(self):
+        """Read until the ESP32 closes the connection after the response"""
+        data = b""
+        while True:
+            chunk = self.request.recv(1024)
+            if not chunk:
+                return data
+            data += chunk
+
+    def syncClock(self, trace):
+        sent = monotonicNs()
+        try:
+            self.request.settimeout(DEVICE_TIMEOUT)
+            self.request.sendall(CLOCK_APDU)
+            answer = self.recvAll()
+        except SocketError:
+            return
+        trace.clockSample(sent, monotonicNs(), answer)
+
+
+class DeviceBridge(object):
+    """The port the ESP32 devices connect to, shared by the slots of the vicc"""
+
+    def __init__(self, localIP, slots=1, registry=None):
+        self.slots = [DeviceSlot(i) for i in range(slots)]
+        self.registry = DeviceRegistry(slots, registry)
+
+        class Server(SocketServer.ThreadingTCPServer):
+            allow_reuse_address = True
+            daemon_threads = True
+        self.server = Server((localIP, BRIDGE_PORT), DeviceHandler)
+        self.server.bridge = self
+        thread = threading.Thread(target=self.server.serve_forever)
+        thread.daemon = True
+        thread.start()
+
+    def slot(self, index):
+        return self.slots[index]
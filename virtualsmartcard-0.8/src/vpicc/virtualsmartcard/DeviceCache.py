@@ -0,0 +1,267 @@
+#
+# This file is part of virtualsmartcard.
+#
+# virtualsmartcard is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option) any
+# later version.
+#
+# virtualsmartcard is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Cache of the data objects and public keys read from an ESP32, so that the
+reads GnuPG repeats in every session are answered by the vicc instead of
+crossing the WiFi.
+
+A read is cached as the response APDUs the device sent for it, the first
+one and those of the GET RESPONSE commands that followed, and is replayed
+the same way. Only complete reads (ending in 9000) are kept. The data
+objects that depend on the PINs verified (Private Use DO 3 and 4), change
+on every signature (7A) or with every VERIFY (C4) are always sent to the
+device.
+
+The cache is dropped when a command that may change the card is sent
+(PUT DATA, key generation or import, TERMINATE DF, ACTIVATE FILE, ...),
+also inside a batch (F9), when the device is identified again after a
+reconnect, when it restarted (see DeviceBridge) and when an exchange with
+it fails. A VERIFY, CHANGE REFERENCE DATA or RESET RETRY COUNTER only
+drops the Application Related Data, which holds the remaining tries, as the
+device does with its own cache.
+
+After a SELECT the missing reads of PREFETCH can be sent to the device in
+the background, while the host is busy with the answer. A read and its GET
+RESPONSE commands are sent between the sequences of commands of the host
+(see DeviceSlot), so that neither cuts into what the device keeps for the
+other one.
+"""
+
+import logging
+import threading
+
+from socket import error as SocketError
+
+GET_DATA = 0xCA
+GET_RESPONSE = 0xC0
+SELECT = 0xA4
+GENERATE_KEY = 0x47
+READ_PUBLIC_KEY = 0x81
+BATCH = 0xF9
+
+# Data objects (P1P2 of GET DATA) that only change with PUT DATA or a reset
+CACHED_OBJECTS = (0x004F, 0x005E, 0x5F50, 0x5F52, 0x0065, 0x006E,
+                  0x0101, 0x0102, 0x7F21)
+APPLICATION_DATA = 0x006E
+
+# Commands that do not change the data objects or the keys
+READ_ONLY = (0x2A, 0x55, 0x84, 0x88, SELECT, GET_RESPONSE, GET_DATA,
+             0xF1, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8)
+# Commands that only change the PIN status in the Application Related Data
+PIN_COMMANDS = (0x20, 0x24, 0x2C)
+
+# The reads of gpg --card-status and of a signature
+PREFETCH = (
+    b'\x00\xCA\x00\x6E\x00',
+    b'\x00\xCA\x00\x65\x00',
+    b'\x00\xCA\x5F\x50\x00',
+    b'\x00\xCA\x5F\x52\x00',
+    b'\x00\x47\x81\x00\x02\xB6\x00\x00',
+    b'\x00\x47\x81\x00\x02\xB8\x00\x00',
+    b'\x00\x47\x81\x00\x02\xA4\x00\x00',
+)
+
+
+def readKey(command):
+    """
+    The key a command is cached under, CLA, INS, P1, P2 and the command data
+    (the device ignores Le), None if the command is not a cached read.
+    """
+    apdu = bytearray(command)
+    if len(apdu) < 4 or apdu[0] != 0x00:
+        return None
+    ins, p1, p2 = apdu[1:4]
+    if ins == GET_DATA and (p1 << 8 | p2) in CACHED_OBJECTS:
+        return bytes(apdu[:4])
+    if ins == GENERATE_KEY and p1 == READ_PUBLIC_KEY and len(apdu) > 5:
+        return bytes(apdu[:4] + apdu[5:5 + apdu[4]])
+    return None
+
+
+def _batched(apdu):
+    """The commands of a batch envelope, each preceded by its length, None if it is malformed"""
+    if len(apdu) < 5:
+        return None
+    data = apdu[5:5 + apdu[4]]
+    commands = []
+    while data:
+        if len(data) < 2 or len(data) < 2 + (data[0] << 8 | data[1]):
+            return None
+        n = data[0] << 8 | data[1]
+        commands.append(bytes(data[2:2 + n]))
+        data = data[2 + n:]
+    return commands
+
+
+def _more(response):
+    """Number of bytes the device has left for GET RESPONSE, None if the response is the last one"""
+    if response is None or len(response) < 2 or bytearray(response)[-2] != 0x61:
+        return None
+    return bytearray(response)[-1]
+
+
+def _complete(response):
+    return response is not None and len(response) >= 2 and response[-2:] == b'\x90\x00'
+
+
+class ResponseCache(object):
+    """The cached reads of one device, or of the devices of a pool"""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.entries = {}       # Key: response APDUs of the read
+        self.pending = {}       # Key: Event set once the prefetch of the read is done
+        self.generation = 0     # Incremented whenever entries are dropped
+        self.prefetching = False
+
+    def get(self, key, timeout):
+        """The response APDUs of a read, None if it has to be sent to the device"""
+        with self.lock:
+            event = self.pending.get(key)
+        if event is not None:
+            event.wait(timeout)     # Cheaper than sending the read a second time
+        with self.lock:
+            responses = self.entries.get(key)
+            return list(responses) if responses is not None else None
+
+    def put(self, key, responses, generation):
+        """Cache a read that was sent while the cache was at generation"""
+        with self.lock:
+            if generation == self.generation:
+                self.entries[key] = tuple(responses)
+
+    def clear(self, objects=None):
+        """Drop the cached reads, or those of the data objects (P1P2) given"""
+        with self.lock:
+            self.generation += 1
+            if objects is None:
+                self.entries.clear()
+                return
+            for key in list(self.entries):
+                key = bytearray(key)
+                if key[1] == GET_DATA and (key[2] << 8 | key[3]) in objects:
+                    del self.entries[bytes(key)]
+
+    def changed(self, command):
+        """Drop what a command forwarded to the device may change"""
+        apdu = bytearray(command)
+        if len(apdu) < 4:
+            return
+        ins, p1 = apdu[1], apdu[2]
+        if ins == BATCH:
+            commands = _batched(apdu)
+            if commands is None:
+                self.clear()
+            for command in commands or ():
+                self.changed(command)
+        elif ins in PIN_COMMANDS:
+            self.clear((APPLICATION_DATA,))
+        elif ins not in READ_ONLY and not (ins == GENERATE_KEY and p1 == READ_PUBLIC_KEY):
+            self.clear()
+
+    def prefetch(self, transmit, timeout):
+        """Read the missing entries of PREFETCH with transmit(command, timeout) in the background"""
+        with self.lock:
+            if self.prefetching:
+                return
+            missing = []
+            for command in PREFETCH:
+                key = readKey(command)
+                if key not in self.entries and key not in self.pending:
+                    self.pending[key] = threading.Event()
+                    missing.append((key, command))
+            if not missing:
+                return
+            self.prefetching = True
+        thread = threading.Thread(target=self.fetch, args=(transmit, timeout, missing))
+        thread.daemon = True
+        thread.start()
+
+    def fetch(self, transmit, timeout, reads):
+        try:
+            for key, command in reads:
+                generation = self.generation
+                responses = []
+                try:
+                    response = transmit(command, timeout)
+                    responses.append(response)
+                    while _more(response) is not None:
+                        response = transmit(b'\x00\xC0\x00\x00' + bytes(bytearray([_more(response)])), timeout)
+                        responses.append(response)
+                except SocketError as e:
+                    logging.debug("Prefetch stopped: %s", e)
+                    return
+                finally:
+                    with self.lock:
+                        self.pending.pop(key).set()
+                if response is None:
+                    return      # The device did not answer in time
+                if _complete(response):
+                    self.put(key, responses, generation)
+        finally:
+            with self.lock:
+                self.prefetching = False
+                for key, command in reads:
+                    event = self.pending.pop(key, None)
+                    if event is not None:
+                        event.set()
+
+
+class CacheSession(object):
+    """
+    The reads of one vpcd connection: answers them from the cache of its
+    device and caches those the device answered.
+    """
+
+    def __init__(self, cache, fetch=None, timeout=None):
+        self.cache = cache
+        self.fetch = fetch      # transmit(command, timeout) of the prefetch, None to disable it
+        self.timeout = timeout
+        self.replay = []        # Cached responses left for GET RESPONSE
+        self.reading = None     # (key, generation, responses) of the read the device is answering
+
+    def answer(self, command):
+        """The response from the cache, None if the command has to be sent to the device"""
+        apdu = bytearray(command)
+        if len(apdu) >= 4 and apdu[1] == GET_RESPONSE and self.replay:
+            return self.replay.pop(0)
+        self.replay = []
+        key = readKey(command)
+        if key is None:
+            return None
+        responses = self.cache.get(key, self.timeout)
+        if responses is None:
+            return None
+        self.replay = responses[1:]
+        return responses[0]
+
+    def forwarded(self, command, response):
+        """The device answered command with response"""
+        apdu = bytearray(command)
+        if len(apdu) >= 4 and apdu[1] == GET_RESPONSE and self.reading is not None:
+            self.reading[2].append(response)
+        else:
+            self.cache.changed(command)
+            key = readKey(command)
+            self.reading = (key, self.cache.generation, [response]) if key is not None else None
+        if self.reading is not None and _more(response) is None:
+            key, generation, responses = self.reading
+            self.reading = None
+            if _complete(response):
+                self.cache.put(key, responses, generation)
+        if self.fetch is not None and len(apdu) >= 4 and apdu[1] == SELECT and _complete(response):
+            self.cache.prefetch(self.fetch, self.timeout)
@@ -0,0 +1,188 @@
+#
+# This file is part of virtualsmartcard.
+#
+# virtualsmartcard is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option) any
+# later version.
+#
+# virtualsmartcard is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Mirror of the security state of an ESP32, kept from the commands the bridge
+relays and their responses, so that commands the device is certain to
+refuse are answered by the vicc with the status word the device would
+send. A PSO or INTERNAL AUTHENTICATE the device refuses still waits for its
+proceed button first.
+
+Every part of the state is True, False or None (not known); a command is
+only answered locally when the parts it depends on are known, and whatever
+a command may have changed in a way the response does not tell becomes
+unknown. The rules follow process() of libAPDU.h:
+
+- PW1 is verified (validated) and its modes 81 and 82 are set by VERIFY,
+  SELECT clears the modes, the reset command 55 and any failed check of
+  PW1 clear validated, and PSO:CDS clears mode 81 if the first PW status
+  byte (C4) is 00
+- TERMINATE DF (E6) makes the device refuse everything but ACTIVATE FILE
+  (44), any 9000 shows that it is not terminated
+- A key is known to be missing after the device answered 6A88 for it, and
+  to be there after it was used
+- Nothing is answered while a command chain, a key import (PUT DATA DB) or
+  a GET RESPONSE is in progress on the device, as the commands it refuses
+  also end those
+
+The mirror is cleared when the device is identified again, when an
+exchange fails, after a batch of commands (F9) and by the reset command,
+which also gives up the terminated state in case the card was wiped with
+the hard reset button.
+"""
+
+SW_SECURITY_STATUS_NOT_SATISFIED = b'\x69\x82'
+SW_AUTHENTICATION_BLOCKED = b'\x69\x83'
+SW_CONDITIONS_NOT_SATISFIED = b'\x69\x85'
+SW_REFERENCED_DATA_NOT_FOUND = b'\x6A\x88'
+SW_OK = b'\x90\x00'
+
+# Key (control reference template) used by the private key operations, and
+# the PW1 mode they need, by (INS, P1, P2)
+KEY_OPERATIONS = {
+    (0x2A, 0x9E, 0x9A): (0xB6, 0x81),  # PSO:COMPUTE DIGITAL SIGNATURE
+    (0x2A, 0x80, 0x86): (0xB8, 0x82),  # PSO:DECIPHER
+    (0x88, 0x00, 0x00): (0xA4, 0x82),  # INTERNAL AUTHENTICATE
+}
+KEYS = (0xB6, 0xB8, 0xA4)
+
+# Handled by the device before the chaining and the terminated state
+EARLY_COMMANDS = (0x00, 0x55, 0xA4, 0xDB, 0xF8)
+# Commands that do not change the mirrored state
+STATELESS = (0x84, 0xC0, 0xCA, 0xF1, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7)
+
+
+class CardMirror(object):
+    """The security state of one device, as far as the bridge has seen it"""
+
+    def __init__(self):
+        self.clear()
+
+    def clear(self):
+        self.validated = None   # PW1 verified
+        self.modes = {0x81: None, 0x82: None}  # PW1 modes
+        self.terminated = None
+        self.missing = dict((key, None) for key in KEYS)  # The key is not on the device
+        self.status = None      # First PW status byte, 00 if PW1 is valid for one signature
+        self.chain = None       # A command chain is in progress
+        self.importing = None   # A key import may be in progress
+        self.pending = None     # The device has data left for GET RESPONSE
+
+    def answer(self, command):
+        """The response of the device to command if it is certain, else None"""
+        apdu = bytearray(command)
+        if len(apdu) < 4 or apdu[0] != 0x00:
+            return None
+        if self.chain is not False or self.importing is not False or self.pending is not False:
+            return None
+        ins, p1, p2 = apdu[1:4]
+        if ins in EARLY_COMMANDS:
+            return None
+        if self.terminated:
+            return SW_CONDITIONS_NOT_SATISFIED if ins != 0x44 else None
+        if self.terminated is None or (ins, p1, p2) not in KEY_OPERATIONS:
+            return None
+
+        key, mode = KEY_OPERATIONS[(ins, p1, p2)]
+        if self.validated is False or self.modes[mode] is False:
+            return SW_SECURITY_STATUS_NOT_SATISFIED
+        if self.validated and self.modes[mode] and self.missing[key]:
+            # PSO:CDS clears mode 81 before it looks for the key if C4 is 00
+            if mode == 0x82 or self.status not in (None, 0):
+                return SW_REFERENCED_DATA_NOT_FOUND
+        return None
+
+    def forwarded(self, command, response):
+        """Follow the state of the device after it answered command with response"""
+        apdu = bytearray(command)
+        if response is None or len(response) < 2 or len(apdu) < 4:
+            self.clear()    # It may or may not have processed the command
+            return
+        cla, ins, p1, p2 = apdu[:4]
+        sw = bytes(bytearray(response)[-2:])
+
+        if ins == 0xF9:
+            self.clear()    # Its responses may be split by GET RESPONSE
+            return
+
+        if ins == 0x55:
+            self.validated = False
+            self.terminated = None
+            return
+        if ins == 0xF8:
+            return
+        if ins == 0xA4:
+            self.modes = {0x81: False, 0x82: False}
+            self.pending = False
+            return
+
+        self.importing = (ins == 0xDB)  # Any other command ends the import
+        self.pending = (sw[:1] == b'\x61')
+        if ins == 0xDB:
+            self.chain = False
+            self.missing = dict((key, None) for key in KEYS)
+            if sw == SW_OK:
+                self.terminated = False
+            return
+        if cla & 0x10:
+            self.chain = (sw == SW_OK)  # Stored for the last command of the chain
+            return
+        self.chain = False
+        if sw == SW_OK and ins != 0x44:
+            self.terminated = False
+
+        if ins == 0x20 and p2 in self.modes:
+            if sw == SW_OK:
+                self.validated = True
+                self.modes[p2] = True
+            elif sw == SW_SECURITY_STATUS_NOT_SATISFIED:
+                self.validated = False  # The wrong PIN cleared it
+        elif ins == 0x20 and p2 == 0x83:
+            pass    # PW3 is not mirrored
+        elif (ins, p1, p2) in KEY_OPERATIONS:
+            key, mode = KEY_OPERATIONS[(ins, p1, p2)]
+            if sw == SW_OK:
+                self.missing[key] = False
+            elif sw == SW_REFERENCED_DATA_NOT_FOUND:
+                self.missing[key] = True
+            if mode == 0x81 and sw not in (SW_SECURITY_STATUS_NOT_SATISFIED, SW_AUTHENTICATION_BLOCKED,
+                                           SW_CONDITIONS_NOT_SATISFIED):
+                if self.status == 0:
+                    self.modes[0x81] = False
+                elif self.status is None:
+                    self.modes[0x81] = None
+        elif ins == 0xCA and (p1 << 8 | p2) == 0x00C4:
+            if sw == SW_OK and len(response) > 2:
+                self.status = bytearray(response)[0]
+        elif ins == 0x47 and p1 == 0x81:
+            pass    # Reading a public key
+        elif ins == 0x44 and sw == SW_OK:
+            self.clear()    # Initialized, without keys and with the default PINs
+            self.validated = False
+            self.modes = {0x81: False, 0x82: False}
+            self.terminated = False
+            self.missing = dict((key, True) for key in KEYS)
+            self.status = 0
+            self.chain = self.importing = self.pending = False
+        elif ins == 0xE6 and sw == SW_OK:
+            self.terminated = True
+        elif ins not in STATELESS:
+            # CHANGE REFERENCE DATA, RESET RETRY COUNTER, PUT DATA, key
+            # generation, SET RETRIES or a command the mirror does not know
+            self.validated = None
+            self.modes = {0x81: None, 0x82: None}
+            self.missing = dict((key, None) for key in KEYS)
+            self.status = None
@@ -0,0 +1,376 @@
+#
+# This file is part of virtualsmartcard.
+#
+# virtualsmartcard is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option) any
+# later version.
+#
+# virtualsmartcard is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Several ESP32 devices holding the same keys and PINs, presented as one
+logical card on every reader of the vicc.
+
+Each reader (vpcd connection) is a session. The private key operations
+(PSO:CDS, PSO:DECIPHER, INTERNAL AUTHENTICATE) of all sessions go to the
+healthy device with the fewest requests, so as many operations run at once
+as there are devices. A session remembers the PINs it verified and the
+pool remembers which PIN each device has verified, so a VERIFY is replayed
+to a device before an operation that needs it. Access is decided by the
+session: an operation of a session that has not verified the PIN is
+refused without asking a device, whatever another session verified.
+
+A command that fails because its device dropped off the WiFi is sent once
+more to another device; a device that stops answering without closing its
+connection is only given up when the command times out. Commands that
+continue on the same device (command chaining, GET RESPONSE) stay with it,
+and the session holds the device until the response is complete and the
+chain has ended, so that no other session's command overwrites what the
+device keeps for them. A session that leaves the device waiting for longer
+than HOLD_IDLE loses it.
+Commands that change the card are refused, as they would make the devices
+differ; personalize each device on its own reader outside the pool. A batch
+of commands (F9) is refused too, as its commands could not be routed one by
+one; vpcd then sends them on their own.
+"""
+
+import errno
+import logging
+import threading
+import time
+
+from socket import error as SocketError
+from virtualsmartcard.DeviceBridge import DeviceRequest, DEVICE_TIMEOUT
+from virtualsmartcard.DeviceCache import ResponseCache
+
+SW_OK = b'\x90\x00'
+SW_SECURITY_STATUS_NOT_SATISFIED = b'\x69\x82'
+SW_CONDITIONS_NOT_SATISFIED = b'\x69\x85'
+
+# PIN reference needed by the private key operations, by (INS, P1, P2)
+KEY_OPERATIONS = {
+    (0x2A, 0x9E, 0x9A): 0x81,   # PSO:COMPUTE DIGITAL SIGNATURE
+    (0x2A, 0x80, 0x86): 0x82,   # PSO:DECIPHER
+    (0x88, 0x00, 0x00): 0x82,   # INTERNAL AUTHENTICATE
+}
+
+# Commands that change the keys, the PINs or the data objects
+WRITE_COMMANDS = (0x24, 0x2C, 0x44, 0xDA, 0xDB, 0xE6)
+BATCH = 0xF9
+GENERATE_KEY = 0x47
+READ_PUBLIC_KEY = 0x81
+
+GET_PW_STATUS = b'\x00\xCA\x00\xC4\x00'
+ATTEMPTS = 2            # Devices tried for one command
+WAIT_POLL = 0.1         # Seconds between looking for a device while none is connected
+HOLD_IDLE = 5           # Seconds a session holds its device between the commands of a sequence
+
+
+class PoolSession(object):
+    """One reader of the pool, used by the vicc like a DeviceSlot"""
+
+    def __init__(self, pool, index):
+        self.pool = pool
+        self.index = index
+        self.trace = None       # BridgeTrace of the vpcd connection
+        self.metrics = None     # BridgeMetrics of the vpcd connection
+        self.pins = {}          # PIN reference: PIN verified in this session
+        self.held = None        # Slot held for the GET RESPONSE or the rest of a chain
+        self.cache = pool.cache
+        self.mirror = None      # The PINs are checked by the session
+
+    def transmit(self, command, timeout=DEVICE_TIMEOUT):
+        """
+        Route a command APDU to a device of the pool and return its response,
+        None if no device answered within timeout.
+        """
+        apdu = bytearray(command)
+        if len(apdu) < 4:
+            return self.forward(command, timeout)
+        cla, ins, p1, p2 = apdu[:4]
+
+        if ins == 0x55:
+            self.pins.clear()   # Reset, the devices keep serving the other sessions
+            self.end()
+            return SW_OK
+        if ins in WRITE_COMMANDS or ins == BATCH or (ins == GENERATE_KEY and p1 != READ_PUBLIC_KEY):
+            logging.warning("INS %02X refused in pool mode", ins)
+            return SW_CONDITIONS_NOT_SATISFIED
+        if ins == 0x20 and len(apdu) > 5:
+            return self.verify(command, p2, bytes(apdu[5:5 + apdu[4]]), timeout)
+        reference = KEY_OPERATIONS.get((ins, p1, p2))
+        if reference is not None and reference not in self.pins:
+            return SW_SECURITY_STATUS_NOT_SATISFIED
+        if reference is not None and self.held is None:
+            return self.operation(command, reference, timeout)
+        return self.forward(command, timeout)
+
+    def fetch(self, command, timeout=DEVICE_TIMEOUT):
+        """Like transmit, for the commands of the bridge that vpcd did not send"""
+        return self.pool.fetcher.transmit(command, timeout)
+
+    def forward(self, command, timeout):
+        """Any device will do, unless a previous command has to be continued"""
+        if self.held is None:
+            return self.attempt(timeout, lambda slot, deadline:
+                                self.pool.send(slot, command, deadline - time.time(), self.trace, self.metrics),
+                                command)
+        slot = self.held
+        if not self.pool.resume(slot, self):
+            self.held = None    # Taken over by another session, what the device kept is gone
+            self.pool.release(slot)
+            return None
+        response = self.pool.send(slot, command, timeout, self.trace, self.metrics)
+        self.follow(slot, command, response)
+        return response
+
+    def verify(self, command, reference, pin, timeout):
+        """Check the PIN on one device and remember it for the others"""
+        def exchange(slot, deadline):
+            response = self.pool.send(slot, command, deadline - time.time(), self.trace, self.metrics)
+            if response is not None and response[-2:] == SW_OK:
+                self.pins[reference] = pin
+                self.pool.verified(slot, reference, pin)
+            else:
+                self.pins.pop(reference, None)
+                self.pool.verified(slot, reference, None)
+            return response
+        return self.attempt(timeout, exchange, command)
+
+    def operation(self, command, reference, timeout):
+        """A private key operation on the device with the PIN of the session"""
+        pin = self.pins[reference]
+
+        def exchange(slot, deadline):
+            # The device is held, so its PIN state does not change between
+            # the replayed VERIFY and the operation
+            if not self.pool.prepare(slot, reference, pin, deadline - time.time()):
+                return None
+            response = self.pool.send(slot, command, deadline - time.time(), self.trace, self.metrics)
+            if response is not None and reference == 0x81 and response[-2:] == SW_OK:
+                self.pool.signed(slot)
+                if self.pool.status == 0:
+                    self.pins.pop(reference, None)  # PW1 is valid for one signature
+            return response
+        return self.attempt(timeout, exchange, command)
+
+    def attempt(self, timeout, exchange, command):
+        """
+        Run exchange(slot, deadline) on the least loaded device, holding it,
+        and once more on another one if the device fails. Returns the
+        response, None if no device answered.
+        """
+        self.end()  # A new command, the device may drop what it kept
+        deadline = time.time() + timeout
+        tried = []
+        while len(tried) < ATTEMPTS:
+            slot = self.pool.acquire(deadline, exclude=tried)
+            if slot is None:
+                return None
+            tried.append(slot)
+            if not self.pool.hold(slot, self, deadline):
+                self.pool.release(slot)
+                return None     # Held by other sessions until the deadline
+            self.held = slot
+            response = None
+            try:
+                response = exchange(slot, deadline)
+            finally:
+                if response is None or len(response) < 2:
+                    self.end()
+            if response is not None and len(response) >= 2:
+                self.follow(slot, command, response)
+                return response
+            self.pool.failover(slot)
+        return None
+
+    def follow(self, slot, command, response):
+        """Keep holding the device for GET RESPONSE and the rest of a command chain"""
+        chained = len(command) > 0 and bytearray(command)[0] & 0x10
+        more = response is not None and len(response) >= 2 and bytearray(response)[-2] == 0x61
+        if response is not None and (chained or more):
+            self.pool.pause(slot, self)
+        else:
+            self.end()
+
+    def end(self):
+        """Let the other sessions use the device held"""
+        if self.held is not None:
+            slot, self.held = self.held, None
+            self.pool.unhold(slot, self)
+            self.pool.release(slot)
+
+
+class DevicePool(object):
+    """The devices of the bridge, shared by the sessions of the readers"""
+
+    def __init__(self, bridge):
+        self.bridge = bridge
+        for slot in bridge.slots:
+            slot.requeue = False    # Fail over instead of waiting for the device
+        self.lock = threading.Lock()
+        self.sessions = {}
+        self.pins = {}          # Slot index: {PIN reference: PIN verified on the device}
+        self.load = {}          # Slot index: Commands of the sessions routed to the device
+        self.holders = {}       # Slot index: [session holding the device, end of its hold or None while busy]
+        self.unheld = threading.Condition(self.lock)
+        self.status = None      # First PW status byte (C4), 0 if PW1 is valid for one signature
+        self.failovers = 0
+        self.replays = 0        # VERIFY commands replayed to a device
+        self.cache = ResponseCache()    # Shared, the devices hold the same data
+        self.fetcher = PoolSession(self, None)
+
+    def slot(self, index):
+        """The session of reader index, used by the vicc like bridge.slot()"""
+        with self.lock:
+            if index not in self.sessions:
+                self.sessions[index] = PoolSession(self, index)
+            return self.sessions[index]
+
+    def acquire(self, deadline, exclude=()):
+        """
+        Route a command to the healthy device with the fewest commands, the
+        least used one among equals, avoiding the devices in exclude if there
+        are others. Waits for a device to connect until deadline and returns
+        None if none did, else release() the device once the command is done.
+        """
+        while True:
+            with self.lock:
+                healthy = [self.bridge.slots[index] for index in sorted(self.bridge.registry.devices())]
+                healthy = [slot for slot in healthy if slot.healthy()]
+                candidates = [slot for slot in healthy if slot not in exclude] or healthy
+                if candidates:
+                    slot = min(candidates, key=lambda slot: (self.load.get(slot.index, 0), slot.busyTime))
+                    self.load[slot.index] = self.load.get(slot.index, 0) + 1
+                    return slot
+            if time.time() + WAIT_POLL > deadline:
+                return None
+            time.sleep(WAIT_POLL)   # Only while no device is connected
+
+    def release(self, slot):
+        with self.lock:
+            self.load[slot.index] -= 1
+
+    def hold(self, slot, session, deadline):
+        """
+        Wait until no other session holds the device and hold it for session.
+        Returns False if it is still held at deadline.
+        """
+        with self.unheld:
+            while True:
+                holder = self.holders.get(slot.index)
+                if holder is None or holder[0] is session or \
+                        (holder[1] is not None and holder[1] < time.time()):
+                    self.holders[slot.index] = [session, None]
+                    return True
+                remaining = deadline - time.time()
+                if remaining <= 0:
+                    return False
+                if holder[1] is not None:
+                    remaining = min(remaining, holder[1] - time.time())
+                self.unheld.wait(max(0.001, remaining))
+
+    def resume(self, slot, session):
+        """Continue the hold of session for the next command of a sequence, False if it was lost"""
+        with self.lock:
+            holder = self.holders.get(slot.index)
+            if holder is None or holder[0] is not session:
+                return False
+            holder[1] = None
+            return True
+
+    def pause(self, slot, session):
+        """session waits for the host between two commands of a sequence"""
+        with self.lock:
+            holder = self.holders.get(slot.index)
+            if holder is not None and holder[0] is session:
+                holder[1] = time.time() + HOLD_IDLE
+                self.unheld.notify_all()    # For the waiters to time the end of the hold
+
+    def unhold(self, slot, session):
+        with self.unheld:
+            holder = self.holders.get(slot.index)
+            if holder is not None and holder[0] is session:
+                del self.holders[slot.index]
+                self.unheld.notify_all()
+
+    def send(self, slot, command, timeout, trace=None, metrics=None):
+        if slot.failed:
+            return None     # Failed while the command waited for the device
+        try:
+            return slot.send(DeviceRequest(command, max(0.001, timeout), trace, metrics))
+        except SocketError:
+            return None
+
+    def prepare(self, slot, reference, pin, timeout):
+        """
+        Replay the VERIFY of the session if the device has not verified its
+        PIN. Returns False if the device failed.
+        """
+        with self.lock:
+            if self.pins.get(slot.index, {}).get(reference) == pin:
+                return True
+            self.replays += 1
+        command = b'\x00\x20\x00' + bytes(bytearray([reference, len(pin)])) + pin
+        response = self.send(slot, command, timeout)
+        if response is None or len(response) < 2:
+            return False
+        if response[-2:] == SW_OK:
+            self.verified(slot, reference, pin)
+        else:   # The operation will be refused by the device
+            logging.error("Device of slot %u rejected the PIN of the pool", slot.index)
+            self.verified(slot, reference, None)
+        return True
+
+    def verified(self, slot, reference, pin):
+        with self.lock:
+            pins = self.pins.setdefault(slot.index, {})
+            if pin is None:
+                pins.pop(reference, None)
+            else:
+                pins[reference] = pin
+
+    def signed(self, slot):
+        """The device may have reset PW1 for signing (first PW status byte 00)"""
+        if self.pw1Status(slot) == 0:
+            self.verified(slot, 0x81, None)
+
+    def pw1Status(self, slot):
+        """Read the first PW status byte once, the devices are configured alike"""
+        if self.status is None:
+            response = self.send(slot, GET_PW_STATUS, DEVICE_TIMEOUT)
+            if response is None or response[-2:] != SW_OK or len(response) < 3:
+                return 0
+            self.status = bytearray(response)[0]
+        return self.status
+
+    def failover(self, slot):
+        logging.warning("Device of slot %u failed, trying another one", slot.index)
+        slot.failed = True
+        slot.abort(SocketError(errno.EHOSTUNREACH, "Device failed"))
+        with self.lock:
+            self.failovers += 1
+            self.pins.pop(slot.index, None)     # It may have restarted
+
+    def samples(self):
+        """The metrics of the pool (see BridgeMetrics.FAMILIES)"""
+        out = {"vicc_pool_device_load": [], "vicc_pool_device_healthy": [],
+               "vicc_pool_device_busy_seconds_total": []}
+        for index, device in sorted(self.bridge.registry.devices().items()):
+            slot = self.bridge.slots[index]
+            labels = '{device="%s"}' % device
+            out["vicc_pool_device_load"].append("vicc_pool_device_load%s %d" % (labels, self.load.get(index, 0)))
+            out["vicc_pool_device_healthy"].append("vicc_pool_device_healthy%s %d" % (labels, slot.healthy()))
+            out["vicc_pool_device_busy_seconds_total"].append(
+                "vicc_pool_device_busy_seconds_total%s %.6f" % (labels, slot.busyTime))
+        with self.lock:
+            out["vicc_pool_failovers_total"] = ["vicc_pool_failovers_total %d" % self.failovers]
+            out["vicc_pool_pin_replays_total"] = ["vicc_pool_pin_replays_total %d" % self.replays]
+        return out
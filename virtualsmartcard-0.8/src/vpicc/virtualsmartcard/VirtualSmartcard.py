@@ -30,8 +30,11 @@ from virtualsmartcard.utils import C_APDU, R_APDU, hexdump, inttostring
 from virtualsmartcard.CardGenerator import CardGenerator
 
 # ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
-import SocketServer, time, threading
 from socket import error as SocketError
+from virtualsmartcard.BridgeTrace import BridgeTrace
+from virtualsmartcard.BridgeMetrics import BridgeMetrics, MetricsServer, CACHE_DEVICE, MIRROR_DEVICE
+from virtualsmartcard.DeviceCache import CacheSession
+from virtualsmartcard.DeviceBridge import DeviceBridge, DEVICE_TIMEOUT
 # ADDED CODE SECTION ENDS HERE
 
 
@@ -382,34 +385,6 @@ VPCD_CTRL_RESET = 2
 VPCD_CTRL_ATR = 4
 
 
-# ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
-class handleConnection(SocketServer.BaseRequestHandler):
-    def handle(self):
-        global command      # The command APDU
-        global response     # The response APDU
-        global condCommand  # Condition to wait until a new APDU command arrives
-        global condResponse # Condition to wait until a response is available
-        global newCommand   # Flag for the handler that there is a new command
-        global processing   # Flag for the run function that the processing has finished
-        global err          # Flag for the run function that an error happened
-
-        with condCommand:
-            while (newCommand == 0):
-                condCommand.wait()
-
-        with condResponse:
-            try:
-                self.request.sendall(command)   # Send the command APDU to the ESP32
-                response = self.request.recv(257).strip()   # Get the response APDU
-            except SocketError:     # ESP32 probably disconnected
-                err = 1             # Set the error flag
-
-            processing = 0          # Processing finished, got the response
-            newCommand = 0          # Reset the newCommand flag
-            condResponse.notify()
-# ADDED CODE SECTION ENDS HERE
-
-
 class VirtualICC(object):
     """
     This class is responsible for maintaining the communication of the virtual
@@ -424,7 +399,8 @@ class VirtualICC(object):
                  readernum=None, ef_cardsecurity=None, ef_cardaccess=None,
                  ca_key=None, cvca=None, disable_checks=False, esign_key=None,
                  esign_ca_cert=None, esign_cert=None,
-                 logginglevel=logging.INFO):
+                 logginglevel=logging.INFO, trace=None, metrics=None,
+                 slot=0, bridge=None, cache="on", mirror="on"):
         from os.path import exists
 
         logging.basicConfig(level=logginglevel,
@@ -469,6 +445,11 @@ class VirtualICC(object):
         self.type = card_type
 
         # Connect to the VPCD
+        # ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
+        if host and host.startswith("unix:") and slot:
+            # every reader of vpcd has its own socket, PATH, PATH.1, ...
+            host = "%s.%d" % (host, slot)
+        # ADDED CODE SECTION ENDS HERE
         self.host = host
         self.port = port
         if host:
@@ -509,12 +490,32 @@ class VirtualICC(object):
         logging.info("Connected to virtual PCD at %s:%u", host, port)
 
         # ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
+        self.trace = None       # Trace of the exchanges (--trace)
+        self.metrics = None     # Counters and histograms (--metrics)
+        self.device = None      # Slot of the ESP32 bridge served by this connection
+        self.shared = bridge is not None    # Other slots keep running if the device fails
+        self.reads = None       # Reads answered from the cache of the device (--cache)
+        self.mirror = None      # Security state of the device (--mirror)
+        if trace is not None:
+            self.trace = BridgeTrace(trace, port)
+            self.trace.syncNeeded = (mode == "esp")
+            self.trace.connected()
+        if metrics is not None:
+            if not isinstance(metrics, MetricsServer):
+                metrics = MetricsServer(metrics)
+            self.metrics = metrics.add(BridgeMetrics(port))
+            self.metrics.connected()
         if (mode == "esp"):
-            SocketServer.TCPServer.allow_reuse_address = True
-            server = SocketServer.TCPServer((localIP, 5511), handleConnection)
-            srvThrd = threading.Thread(target=server.serve_forever)
-            srvThrd.daemon = True
-            srvThrd.start()
+            if bridge is None:
+                bridge = DeviceBridge(localIP)
+            self.device = bridge.slot(slot)
+            self.device.trace = self.trace
+            self.device.metrics = self.metrics
+            if cache != "off":
+                fetch = self.device.fetch if cache == "prefetch" else None
+                self.reads = CacheSession(self.device.cache, fetch, DEVICE_TIMEOUT)
+            if mirror != "off":
+                self.mirror = self.device.mirror
         # ADDED CODE SECTION ENDS HERE
 
         atexit.register(self.stop)
@@ -524,6 +525,13 @@ class VirtualICC(object):
         """
         Open a connection to a given host on a given port.
         """
+        # ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
+        if host.startswith("unix:"):
+            # the Unix domain socket of vpcd, the port only names the reader
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            sock.connect(host[len("unix:"):])
+            return sock
+        # ADDED CODE SECTION ENDS HERE
         sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         sock.connect((host, port))
         return sock
@@ -574,6 +582,34 @@ class VirtualICC(object):
 
         return size, msg
 
+    # ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
+    def __sendToDevice(self, command):
+        """
+        Hand a command APDU over to the ESP32 of the slot and block until its
+        response. Returns None if there is none within DEVICE_TIMEOUT, raises
+        a socket error if the exchange failed. Repeated reads are answered
+        from the cache of the device, and commands it is certain to refuse by
+        its mirror.
+        """
+        for local, device in ((self.reads, CACHE_DEVICE), (self.mirror, MIRROR_DEVICE)):
+            answer = local.answer(command) if local is not None else None
+            if answer is not None:
+                if self.metrics is not None:
+                    self.metrics.local(device)
+                return answer
+        try:
+            answer = self.device.transmit(command, DEVICE_TIMEOUT)
+        except SocketError:
+            if self.mirror is not None:
+                self.mirror.clear()
+            raise
+        if self.reads is not None:
+            self.reads.forwarded(command, answer)
+        if self.mirror is not None:
+            self.mirror.forwarded(command, answer)
+        return answer
+    # ADDED CODE SECTION ENDS HERE
+
     def run(self, mode):    # MODIFIED ARGUMENTS
         """
         Main loop of the vpicc. Receives command APDUs via a socket from the
@@ -581,18 +617,6 @@ class VirtualICC(object):
         respsonse APDU back to the vpcd.
         """
 
-        # ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
-        global command      # The command APDU
-        global response     # The response APDU
-        global condCommand  # Condition to wait until a new APDU command arrives
-        global condResponse # Condition to wait until a response is available
-        global newCommand   # Flag for the handler that there is a new command
-        global processing   # Flag for the run function that the processing has finished
-        global err          # Flag for the run function that an error happened
-        condCommand = threading.Condition()
-        condResponse = threading.Condition()
-        # ADDED CODE SECTION ENDS HERE
-
         while True:
             try:
                 (size, msg) = self.__recvFromVPICC()
@@ -600,16 +624,21 @@ class VirtualICC(object):
                 if not self.host:
                     logging.info("Waiting for vpcd on port " + str(self.port))
                     (self.sock, address) = self.server_sock.accept()
+                    # ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
+                    if self.trace is not None:
+                        self.trace.connected()
+                    if self.metrics is not None:
+                        self.metrics.connected()
+                    # ADDED CODE SECTION ENDS HERE
                     continue
                 else:
                     sys.exit()
 
             # ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
-            newCommand = 0
-            processing = 0
-            command = ""
-            response = ""
-            err = 0
+            if self.trace is not None:
+                self.trace.received(msg)
+            if self.metrics is not None:
+                self.metrics.received(msg)
             # ADDED CODE SECTION ENDS HERE
 
             if not size:
@@ -626,15 +655,10 @@ class VirtualICC(object):
                     logging.info("Reset")
                     # ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
                     if (mode == "esp"):
-                        with condCommand:
-                            command = '\x00\x55\x00\x00\x00'    # Custom command INS to reset
-                            newCommand = 1
-                            processing = 1
-                            condCommand.notify()
-
-                        with condResponse:
-                            while (processing == 1):
-                                condResponse.wait()
+                        try:
+                            self.__sendToDevice('\x00\x55\x00\x00\x00')  # Custom command INS to reset
+                        except SocketError:
+                            logging.warning("Failed to reset the ESP32")
                     # ADDED CODE SECTION ENDS HERE
                     self.os.reset()
                 elif msg == chr(VPCD_CTRL_ATR):
@@ -648,26 +672,28 @@ class VirtualICC(object):
 
                 # ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
                 if (mode == "esp"):
-                    with condCommand:
-                        command = msg
-                        newCommand = 1
-                        processing = 1
-                        condCommand.notify()
-
-                    with condResponse:
-                        while (processing == 1):
-                            condResponse.wait(0)
-
-                        if (err == 0):
-                            self.__sendToVPICC(response)
-                        else:               # ESP32 was probably disconnected
+                    try:
+                        answer = self.__sendToDevice(msg)
+                    except SocketError:     # ESP32 was probably disconnected
+                        if not self.shared:
                             sys.exit()      # Terminate execution
+                        logging.error("Lost the ESP32 of slot %u", self.device.index)
+                        answer = inttostring(0x6F00, 2)
+                    if answer is None:
+                        logging.error("No response from the ESP32 within %u s", DEVICE_TIMEOUT)
+                        answer = inttostring(0x6F00, 2)
                 else:
                 # ADDED CODE SECTION ENDS HERE
                     answer = self.os.execute(msg)
                     logging.info("Response APDU (%d Bytes):\n%s\n", len(answer),
                                  hexdump(answer))
-                    self.__sendToVPICC(answer)
+                # ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
+                if self.trace is not None:
+                    self.trace.replied(answer)
+                if self.metrics is not None:
+                    self.metrics.replied(answer)
+                # ADDED CODE SECTION ENDS HERE
+                self.__sendToVPICC(answer)
 
     def stop(self):
         self.sock.close()
@@ -0,0 +1,106 @@
+#
+# This file is part of virtualsmartcard.
+#
+# virtualsmartcard is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option) any
+# later version.
+#
+# virtualsmartcard is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import hashlib
+import threading
+import time
+import unittest
+
+from virtualsmartcard.DeviceBridge import DeviceSlot
+from virtualsmartcard.DeviceCache import CacheSession, PREFETCH, readKey
+
+CHUNK = 200     # Bytes in the first response, the rest with GET RESPONSE
+SELECT = b'\x00\xA4\x04\x00\x06\xD2\x76\x00\x01\x24\x01'
+
+
+def content(command):
+    """The complete answer of the fake device to a read or a PSO:CDS"""
+    out = b''
+    while len(out) < 300:
+        out += hashlib.sha256(bytes(command) + bytes(bytearray([len(out) // 32]))).digest()
+    return out[:300]
+
+
+class FakeSlot(DeviceSlot):
+    """
+    A DeviceSlot whose device answers like the firmware: one buffer for the
+    data left for GET RESPONSE, which the next command replaces, and a delay
+    per exchange so that the commands of the threads interleave.
+    """
+
+    def __init__(self):
+        DeviceSlot.__init__(self, 0)
+        self.left = b''
+        self.device = threading.Lock()
+
+    def send(self, request):
+        time.sleep(0.002)
+        with self.device:
+            return self.answer(bytearray(request.command))
+
+    def answer(self, apdu):
+        if apdu[1] == 0xC0:
+            if not self.left:
+                return b'\x69\x85'
+            data, self.left = self.left[:apdu[4] or 256], self.left[apdu[4] or 256:]
+            return data + (b'\x90\x00' if not self.left else b'\x61' + bytes(bytearray([min(len(self.left), 255)])))
+        self.left = b''
+        if apdu[1] == 0xA4:
+            return b'\x90\x00'
+        data = content(apdu[:4] + apdu[5:5 + apdu[4]] if apdu[1] != 0xCA else apdu[:4])
+        self.left = data[CHUNK:]
+        return data[:CHUNK] + b'\x61' + bytes(bytearray([len(self.left)]))
+
+
+def exchange(slot, reads, command):
+    """A command and its GET RESPONSE commands through the cache, like the vicc sends them"""
+    data = b''
+    while True:
+        response = reads.answer(command)
+        if response is None:
+            response = slot.transmit(command, 5)
+            reads.forwarded(command, response)
+        data += response[:-2]
+        if response[-2:-1] != b'\x61':
+            return data, response[-2:]
+        command = b'\x00\xC0\x00\x00' + response[-1:]
+
+
+class TestResponseCache(unittest.TestCase):
+
+    def test_prefetch_during_signatures(self):
+        slot = FakeSlot()
+        reads = CacheSession(slot.cache, slot.fetch, 5)
+        for n in range(10):
+            exchange(slot, reads, SELECT)   # Starts the prefetch
+            for i in range(5):
+                digest = hashlib.sha256(b'%d/%d' % (n, i)).digest()
+                command = b'\x00\x2A\x9E\x9A' + bytes(bytearray([len(digest)])) + digest + b'\x00'
+                self.assertEqual(exchange(slot, reads, command), (content(command[:4] + digest), b'\x90\x00'))
+            while slot.cache.prefetching:
+                time.sleep(0.01)
+            for command in PREFETCH:
+                responses = slot.cache.entries.get(readKey(command))
+                self.assertIsNotNone(responses)
+                data = b''.join(response[:-2] for response in responses)
+                self.assertEqual(data, content(readKey(command)))
+            self.assertIsNone(slot.holder)
+            slot.cache.clear()
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,165 @@
+#
+# This file is part of virtualsmartcard.
+#
+# virtualsmartcard is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option) any
+# later version.
+#
+# virtualsmartcard is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import hashlib
+import threading
+import time
+import unittest
+
+from virtualsmartcard.DevicePool import DevicePool
+
+PIN = b'123456'
+SIGNATURE_LENGTH = 256
+CHUNK = 200     # Signature bytes in the response to PSO:CDS, the rest with GET RESPONSE
+
+
+def signature(digest):
+    """What the fake device signs, a function of the digest only"""
+    out = b''
+    while len(out) < SIGNATURE_LENGTH:
+        out += hashlib.sha256(digest + bytes(bytearray([len(out) // 32]))).digest()
+    return out[:SIGNATURE_LENGTH]
+
+
+class FakeDevice(object):
+    """
+    A DeviceSlot answering like the firmware: one buffer for the data left
+    for GET RESPONSE, which the next command replaces, and a delay per
+    exchange so that the commands of the sessions interleave.
+    """
+
+    def __init__(self, index):
+        self.index = index
+        self.failed = False
+        self.requeue = True
+        self.busyTime = 0.0
+        self.verified = False
+        self.left = b''
+        self.lock = threading.Lock()
+
+    def healthy(self):
+        return True
+
+    def abort(self, error):
+        pass
+
+    def send(self, request):
+        time.sleep(0.002)
+        with self.lock:
+            return self.answer(bytearray(request.command))
+
+    def answer(self, apdu):
+        ins, p2 = apdu[1], apdu[3]
+        if ins == 0xC0:
+            data, self.left = self.left[:apdu[4] or 256], self.left[apdu[4] or 256:]
+            return data + (b'\x90\x00' if not self.left else b'\x61' + bytes(bytearray([min(len(self.left), 255)])))
+        self.left = b''
+        if ins == 0x20 and p2 == 0x81:
+            self.verified = bytes(apdu[5:5 + apdu[4]]) == PIN
+            return b'\x90\x00' if self.verified else b'\x63\xC2'
+        if ins == 0xCA and p2 == 0xC4:
+            return b'\x01\x7F\x7F\x7F\x03\x00\x03\x90\x00'
+        if ins == 0x2A:
+            if not self.verified:
+                return b'\x69\x82'
+            sig = signature(bytes(apdu[5:5 + apdu[4]]))
+            self.left = sig[CHUNK:]
+            return sig[:CHUNK] + b'\x61' + bytes(bytearray([len(self.left)]))
+        return b'\x6D\x00'
+
+
+class FakeRegistry(object):
+    def __init__(self, slots):
+        self.slots = slots
+
+    def devices(self):
+        return dict((slot.index, "02:00:00:00:00:%02x" % slot.index) for slot in self.slots)
+
+
+class FakeBridge(object):
+    def __init__(self, devices):
+        self.slots = [FakeDevice(i) for i in range(devices)]
+        self.registry = FakeRegistry(self.slots)
+
+
+def sign(session, digest):
+    """PSO:CDS and the GET RESPONSE commands, like the host sends them"""
+    response = session.transmit(b'\x00\x2A\x9E\x9A' + bytes(bytearray([len(digest)])) + digest + b'\x00', 5)
+    data = response[:-2]
+    while response[-2:-1] == b'\x61':
+        response = session.transmit(b'\x00\xC0\x00\x00' + response[-1:], 5)
+        data += response[:-2]
+    return data, response[-2:]
+
+
+class TestDevicePool(unittest.TestCase):
+
+    def interleave(self, devices, sessions=2, signatures=25):
+        pool = DevicePool(FakeBridge(devices))
+        errors = []
+
+        def client(index):
+            session = pool.slot(index)
+            sw = session.transmit(b'\x00\x20\x00\x81' + bytes(bytearray([len(PIN)])) + PIN, 5)
+            if sw != b'\x90\x00':
+                errors.append((index, "VERIFY", sw))
+                return
+            for n in range(signatures):
+                digest = hashlib.sha256(b'%d/%d' % (index, n)).digest()
+                data, sw = sign(session, digest)
+                if sw != b'\x90\x00' or data != signature(digest):
+                    errors.append((index, n, sw, len(data)))
+
+        threads = [threading.Thread(target=client, args=(i,)) for i in range(sessions)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(errors, [])
+        self.assertEqual(sum(pool.load.values()), 0)
+        self.assertEqual(pool.holders, {})
+
+    def test_interleaved_signatures_one_device(self):
+        self.interleave(1)
+
+    def test_interleaved_signatures_two_devices(self):
+        self.interleave(2, sessions=4)
+
+    def test_abandoned_get_response(self):
+        pool = DevicePool(FakeBridge(1))
+        first, second = pool.slot(0), pool.slot(1)
+        for session in (first, second):
+            session.transmit(b'\x00\x20\x00\x81' + bytes(bytearray([len(PIN)])) + PIN, 5)
+        digest = hashlib.sha256(b'abandoned').digest()
+        response = first.transmit(b'\x00\x2A\x9E\x9A' + bytes(bytearray([len(digest)])) + digest + b'\x00', 5)
+        self.assertEqual(response[-2:-1], b'\x61')
+        # The first session never sends GET RESPONSE, the other one gets
+        # the device once the hold ends
+        import virtualsmartcard.DevicePool as DevicePoolModule
+        idle, DevicePoolModule.HOLD_IDLE = DevicePoolModule.HOLD_IDLE, 0.2
+        try:
+            pool.pause(first.held, first)
+            data, sw = sign(second, digest)
+        finally:
+            DevicePoolModule.HOLD_IDLE = idle
+        self.assertEqual((data, sw), (signature(digest), b'\x90\x00'))
+        # The GET RESPONSE of the first session finds its device taken over
+        self.assertIsNone(first.transmit(b'\x00\xC0\x00\x00' + response[-1:], 5))
+
+
+if __name__ == "__main__":
+    unittest.main()